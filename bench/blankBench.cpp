@@ -0,0 +1,245 @@
+// Blank page detection: the dark pixel kernels of every instruction set supported by the CPU.
+// The kernels are checked against the scalar one on generated pages first, then timed.
+// usage: blankBench [pages] [dpi]
+//   pages: how many times each page is measured, 20 by default
+//   dpi: resolution of the A4 pages, 300 by default
+// Exits with 1 if a kernel gives another count than the scalar one
+#include "stdafx.h"
+#include "rawImage.h"
+#include "inkCount.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const SimdLevel AllLevels[] = { SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::NEON };
+
+    // The back of a sheet: paper noise, a few specks and the shadow of the edges
+    RawImage CreateBlankPage(uint32_t width, uint32_t height, PixelFormat format, std::mt19937& random)
+    {
+        RawImage image = CreateRawImage(width, height, format, 0xf0);
+        for (auto& pixel : image.pixels)
+        {
+            pixel = uint8_t(225 + random() % 31);
+        }
+
+        size_t bytesPerPixel = GetBytesPerPixel(format);
+        for (int i = 0; i < 200; i++)
+        {
+            uint8_t* pixel = image.Row(random() % height) + (random() % width) * bytesPerPixel;
+            for (size_t c = 0; c < bytesPerPixel; c++)
+            {
+                pixel[c] = uint8_t(random() % 100);
+            }
+        }
+
+        for (uint32_t y = 0; y < height; y++)
+        {
+            uint8_t* row = image.Row(y);
+            for (uint32_t x = 0; x < width / 50; x++)
+            {
+                for (size_t c = 0; c < bytesPerPixel; c++)
+                {
+                    row[x * bytesPerPixel + c] = 40;
+                }
+            }
+        }
+        return image;
+    }
+
+    // Lines of text-like blocks
+    RawImage CreateTextPage(uint32_t width, uint32_t height, PixelFormat format, std::mt19937& random)
+    {
+        RawImage image = CreateBlankPage(width, height, format, random);
+        size_t bytesPerPixel = GetBytesPerPixel(format);
+        uint32_t lineHeight = height / 80;
+
+        for (uint32_t y = height / 10; y < height - height / 10; y++)
+        {
+            if ((y / lineHeight) % 3)
+            {
+                continue;
+            }
+            uint8_t* row = image.Row(y);
+            for (uint32_t x = width / 10; x < width - width / 10; x++)
+            {
+                if (random() % 3 == 0)
+                {
+                    for (size_t c = 0; c < bytesPerPixel; c++)
+                    {
+                        row[x * bytesPerPixel + c] = uint8_t(random() % 120);
+                    }
+                }
+            }
+        }
+        return image;
+    }
+
+    // the ratio computed pixel by pixel, as MeasureInkRatio did before the kernels
+    double ReferenceInkRatio(const RawImage& image, uint8_t darkThreshold, double marginRatio)
+    {
+        RawImage gray = ToGray8(image);
+        uint32_t marginX = uint32_t(gray.width * marginRatio);
+        uint32_t marginY = uint32_t(gray.height * marginRatio);
+
+        uint64_t inkCount = 0;
+        for (uint32_t y = marginY; y < gray.height - marginY; y++)
+        {
+            for (uint32_t x = marginX; x < gray.width - marginX; x++)
+            {
+                inkCount += gray.Row(y)[x] < darkThreshold;
+            }
+        }
+        return double(inkCount) / (uint64_t(gray.width - marginX * 2) * (gray.height - marginY * 2));
+    }
+
+    bool CheckKernels(std::mt19937& random)
+    {
+        bool passed = true;
+
+        // every length around the vector sizes and the block of 255 vectors, at every alignment
+        std::vector<uint8_t> data(255 * 32 * 3 + 100);
+        for (auto& value : data)
+        {
+            value = uint8_t(random());
+        }
+        const size_t lengths[] = { 0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 255 * 16 - 1, 255 * 16, 255 * 16 + 1,
+            255 * 32 - 1, 255 * 32, 255 * 32 + 1, 255 * 32 * 3 + 7 };
+        const int thresholds[] = { 0, 1, 2, 127, 128, 129, 160, 254, 255 };
+
+        for (auto level : AllLevels)
+        {
+            if (!IsSimdLevelSupported(level))
+            {
+                continue;
+            }
+            for (auto length : lengths)
+            {
+                for (size_t offset = 0; offset < 32 && offset + length <= data.size(); offset += 7)
+                {
+                    for (auto threshold : thresholds)
+                    {
+                        size_t expected = CountDarkPixels(data.data() + offset, length, uint8_t(threshold), SimdLevel::Scalar);
+                        size_t actual = CountDarkPixels(data.data() + offset, length, uint8_t(threshold), level);
+                        if (expected != actual)
+                        {
+                            std::printf("FAILED: %s, length %zu, offset %zu, threshold %d: %zu instead of %zu\n",
+                                SimdLevelToString(level), length, offset, threshold, actual, expected);
+                            passed = false;
+                        }
+                    }
+                }
+            }
+        }
+
+        // all pixels dark, the byte counters are filled up to the limit
+        std::vector<uint8_t> dark(255 * 32 * 2 + 5, 0);
+        for (auto level : AllLevels)
+        {
+            if (IsSimdLevelSupported(level) && CountDarkPixels(dark.data(), dark.size(), 1, level) != dark.size())
+            {
+                std::printf("FAILED: %s, all pixels dark\n", SimdLevelToString(level));
+                passed = false;
+            }
+        }
+
+        // whole pages with margins, odd sizes
+        for (auto format : { PixelFormat::Gray8, PixelFormat::BGR24 })
+        {
+            RawImage pages[] = { CreateBlankPage(1001, 1403, format, random), CreateTextPage(1001, 1403, format, random) };
+            for (const auto& page : pages)
+            {
+                for (double margin : { 0.0, 0.05, 0.2 })
+                {
+                    double expected = ReferenceInkRatio(page, 160, margin);
+                    double actual = MeasureInkRatio(page, 160, margin);
+                    if (expected != actual)
+                    {
+                        std::printf("FAILED: %s page, margin %.2f: ink ratio %f instead of %f\n",
+                            format == PixelFormat::Gray8 ? "gray" : "color", margin, actual, expected);
+                        passed = false;
+                    }
+                }
+            }
+        }
+
+        BlankPageOptions options;
+        if (!IsBlankPage(CreateBlankPage(1240, 1754, PixelFormat::Gray8, random), options) ||
+            IsBlankPage(CreateTextPage(1240, 1754, PixelFormat::Gray8, random), options))
+        {
+            std::printf("FAILED: blank and text pages not told apart\n");
+            passed = false;
+        }
+        return passed;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int pageCount = argc > 1 ? std::atoi(argv[1]) : 20;
+    int dpi = argc > 2 ? std::atoi(argv[2]) : 300;
+
+    uint32_t width = uint32_t(8.27 * dpi);
+    uint32_t height = uint32_t(11.69 * dpi);
+
+    std::mt19937 random(14);
+    std::printf("CPU: %s\n", SimdLevelToString(GetSimdLevel()));
+
+    if (!CheckKernels(random))
+    {
+        return 1;
+    }
+    std::printf("kernels match the scalar one\n");
+
+    RawImage page = CreateBlankPage(width, height, PixelFormat::Gray8, random);
+    std::printf("A4 grayscale page at %d dpi, %ux%u, measured %d times\n", dpi, width, height, pageCount);
+
+    double scalarMs = 0;
+    for (auto level : AllLevels)
+    {
+        if (!IsSimdLevelSupported(level))
+        {
+            continue;
+        }
+
+        size_t dark = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < pageCount; i++)
+        {
+            dark += CountDarkPixels(page.pixels.data(), page.pixels.size(), 160, level);
+        }
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / pageCount;
+        if (level == SimdLevel::Scalar)
+        {
+            scalarMs = ms;
+        }
+
+        double mbPerSecond = page.pixels.size() / (ms / 1000) / (1024 * 1024);
+        std::printf("%-7s %8.3f ms/page, %8.0f MB/s, %.1fx scalar (%zu)\n",
+            SimdLevelToString(level), ms, mbPerSecond, scalarMs / ms, dark / pageCount);
+    }
+
+    // the whole detection as run by the pipeline, color pages are converted to luma row by row
+    for (auto format : { PixelFormat::Gray8, PixelFormat::BGR24 })
+    {
+        RawImage testPage = CreateBlankPage(width, height, format, random);
+        BlankPageOptions options;
+        int blankCount = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < pageCount; i++)
+        {
+            blankCount += IsBlankPage(testPage, options);
+        }
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / pageCount;
+        std::printf("IsBlankPage %-5s %8.3f ms/page, %d/%d blank\n",
+            format == PixelFormat::Gray8 ? "gray" : "color", ms, blankCount, pageCount);
+    }
+    return 0;
+}
@@ -0,0 +1,212 @@
+// The memory buffer of the pages delivered in memory, without scanners or Windows.
+// A synthetic producer writes pages as the drivers do: the data in chunks of random sizes, the header completed at the
+// end by seeking back, and sometimes a write past the end of the data leaving a gap. Every write is mirrored into a
+// plain vector, and the buffer, then the block detached from it, must hold the same bytes. Then the time to write a
+// page in chunks is measured.
+// usage: bufferBench [pages] [pageSize]
+//   pages: pages written by the producer, 200 by default
+//   pageSize: bytes of the page timed, 25 MB by default
+// Exits with 1 if the bytes, the size or the position of the buffer don't match what has been written
+#include "stdafx.h"
+#include "memoryBuffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const size_t HeaderSize = 54;
+
+    bool Check(bool condition, const char* what)
+    {
+        if (!condition)
+        {
+            std::printf("FAILED: %s\n", what);
+        }
+        return condition;
+    }
+
+    // The writes of the producer, applied to the buffer and to the expected bytes
+    class CMirror
+    {
+    public:
+        explicit CMirror(CMemoryBuffer& buffer)
+            : m_buffer(buffer)
+            , m_position(0)
+        {
+        }
+
+        bool Write(const std::vector<char>& data)
+        {
+            if (m_expected.size() < m_position + data.size())
+            {
+                m_expected.resize(m_position + data.size(), 0);
+            }
+            std::copy(data.begin(), data.end(), m_expected.begin() + m_position);
+            m_position += data.size();
+            return m_buffer.Write(data.data(), data.size()) == data.size();
+        }
+
+        bool Seek(int64_t offset, SeekOrigin origin)
+        {
+            uint64_t position = 0;
+            if (!m_buffer.Seek(offset, origin, &position))
+            {
+                return false;
+            }
+            m_position = size_t(position);
+            return true;
+        }
+
+        bool Matches() const
+        {
+            return m_buffer.Size() == m_expected.size() && m_buffer.Position() == m_position &&
+                (m_expected.empty() || std::memcmp(m_buffer.Data(), m_expected.data(), m_expected.size()) == 0);
+        }
+
+        const std::vector<char>& Expected() const
+        {
+            return m_expected;
+        }
+
+    private:
+        CMemoryBuffer& m_buffer;
+        std::vector<char> m_expected;
+        size_t m_position;
+    };
+
+    std::vector<char> RandomBytes(size_t size, std::mt19937& random)
+    {
+        std::vector<char> data(size);
+        for (auto& byte : data)
+        {
+            byte = char(random());
+        }
+        return data;
+    }
+
+    // One page written by the producer, then detached as it is handed to JS
+    bool CheckPage(std::mt19937& random)
+    {
+        bool passed = true;
+        size_t initialCapacity = (random() % 2) ? 0 : random() % 4096;
+        CMemoryBuffer buffer(initialCapacity);
+        CMirror mirror(buffer);
+
+        // the header is left empty until the end
+        passed = Check(mirror.Write(std::vector<char>(HeaderSize, 0)), "the header has not been written") && passed;
+
+        size_t dataSize = 1 + random() % (512 * 1024);
+        size_t written = 0;
+        while (written < dataSize)
+        {
+            size_t chunkSize = std::min<size_t>(dataSize - written, 1 + random() % 65536);
+            passed = Check(mirror.Write(RandomBytes(chunkSize, random)), "a chunk has not been written") && passed;
+            written += chunkSize;
+            passed = Check(buffer.Capacity() >= buffer.Size(), "the capacity is below the size") && passed;
+        }
+        passed = Check(buffer.Capacity() >= HeaderSize + dataSize &&
+            (buffer.Capacity() > initialCapacity || initialCapacity >= HeaderSize + dataSize), "the buffer has not grown") && passed;
+
+        // a write past the end of the data, the gap reads as zeros
+        if (random() % 2)
+        {
+            passed = Check(mirror.Seek(int64_t(random() % 1000), SeekOrigin::End), "the seek past the end failed") && passed;
+            passed = Check(mirror.Write(RandomBytes(1 + random() % 100, random)), "the write past the end failed") && passed;
+        }
+
+        // the header completed once the size is known, then the trailer appended
+        passed = Check(mirror.Seek(0, SeekOrigin::Begin), "the seek to the header failed") && passed;
+        passed = Check(mirror.Write(RandomBytes(HeaderSize, random)), "the header has not been completed") && passed;
+        passed = Check(mirror.Seek(0, SeekOrigin::End), "the seek to the end failed") && passed;
+        passed = Check(mirror.Write(RandomBytes(1 + random() % 16, random)), "the trailer has not been written") && passed;
+        passed = Check(!buffer.Seek(-int64_t(buffer.Size()) - 1, SeekOrigin::End), "a seek before the start succeeded") && passed;
+        passed = Check(mirror.Matches(), "the buffer doesn't hold the bytes written") && passed;
+
+        // read back from the middle, as the pipeline reads a page
+        size_t offset = random() % buffer.Size();
+        std::vector<char> readBack(buffer.Size() - offset + 10);
+        passed = Check(buffer.Seek(int64_t(offset), SeekOrigin::Begin), "the seek to read failed") && passed;
+        passed = Check(buffer.Read(readBack.data(), readBack.size()) == buffer.Size() - offset &&
+            std::memcmp(readBack.data(), mirror.Expected().data() + offset, buffer.Size() - offset) == 0,
+            "the bytes read back differ") && passed;
+
+        size_t size = 0;
+        char* data = buffer.Detach(size);
+        passed = Check(size == mirror.Expected().size(), "the size detached differs") && passed;
+        passed = Check(data && std::memcmp(data, mirror.Expected().data(), size) == 0, "the block detached differs") && passed;
+        passed = Check(!buffer.Data() && !buffer.Size() && !buffer.Capacity() && !buffer.Position(),
+            "the buffer is not empty once detached") && passed;
+        CMemoryBuffer::Free(data);
+
+        // still usable afterwards
+        const char byte = 42;
+        passed = Check(buffer.Write(&byte, 1) == 1 && buffer.Size() == 1 && buffer.Data()[0] == byte,
+            "the buffer is not usable once detached") && passed;
+        return passed;
+    }
+
+    // Nothing to detach
+    bool CheckEmpty()
+    {
+        CMemoryBuffer buffer;
+        size_t size = 1;
+        char* data = buffer.Detach(size);
+        bool passed = Check(!data && size == 0, "an empty buffer detached a block");
+        CMemoryBuffer::Free(data);
+        return passed;
+    }
+
+    double WritePageMs(size_t pageSize, size_t chunkSize, const std::vector<char>& chunk)
+    {
+        auto start = Clock::now();
+        CMemoryBuffer buffer;
+        for (size_t written = 0; written < pageSize; written += chunkSize)
+        {
+            buffer.Write(chunk.data(), std::min(chunkSize, pageSize - written));
+        }
+        size_t size = 0;
+        CMemoryBuffer::Free(buffer.Detach(size));
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int pageCount = std::max(argc > 1 ? std::atoi(argv[1]) : 200, 1);
+    size_t pageSize = size_t(std::max(argc > 2 ? std::atoi(argv[2]) : 25 * 1024 * 1024, 1));
+
+    bool passed = CheckEmpty();
+    std::mt19937 random(1);
+    for (int i = 0; i < pageCount; i++)
+    {
+        passed = CheckPage(random) && passed;
+    }
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+        return 1;
+    }
+    std::printf("%d pages written, patched, detached and freed with the bytes expected\n", pageCount);
+
+    std::vector<char> chunk = RandomBytes(1024 * 1024, random);
+    std::printf("%-12s %10s %10s\n", "chunk", "ms/page", "MB/s");
+    for (size_t chunkSize : { size_t(4096), size_t(65536), size_t(1024 * 1024) })
+    {
+        double bestMs = 1e9;
+        for (int run = 0; run < 5; run++)
+        {
+            bestMs = std::min(bestMs, WritePageMs(pageSize, chunkSize, chunk));
+        }
+        std::printf("%-12zu %10.2f %10.0f\n", chunkSize, bestMs, pageSize / 1048576.0 / (bestMs / 1000));
+    }
+    return 0;
+}
@@ -0,0 +1,248 @@
+// Multi-page documents written page by page, as a feeder scan with the option "document" does.
+// JPEG, G4 and raw pages are appended in turn, the document is read back and its structure checked.
+// usage: documentBench [pages] [dpi] [outputDir]
+//   pages: pages of each document, 50 by default
+//   dpi: resolution of the A4 pages, 200 by default
+//   outputDir: if given, scan.pdf and scan.tif are written there to be checked with other tools
+// Exits with 1 if a document is not complete
+#include "stdafx.h"
+#include "documentWriter.h"
+#include "jpegEncoder.h"
+#include "tiffG4Encoder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // A document on the disk, the pages are not kept in memory
+    class CFileDocumentSink : public IDocumentSink
+    {
+    public:
+        explicit CFileDocumentSink(FILE* file)
+            : m_file(file)
+        {
+        }
+
+        bool Write(const void* data, size_t size) override
+        {
+            return std::fwrite(data, 1, size, m_file) == size;
+        }
+
+        bool Patch(uint64_t offset, const void* data, size_t size) override
+        {
+            long end = std::ftell(m_file);
+            return std::fseek(m_file, long(offset), SEEK_SET) == 0 &&
+                std::fwrite(data, 1, size, m_file) == size &&
+                std::fseek(m_file, end, SEEK_SET) == 0;
+        }
+
+    private:
+        FILE* m_file;
+    };
+
+    // Text-like lines on a white page
+    RawImage CreateTextPage(uint32_t width, uint32_t height, PixelFormat format, std::mt19937& random)
+    {
+        RawImage image = CreateRawImage(width, height, format, 0xff);
+        size_t bytesPerPixel = GetBytesPerPixel(format);
+        uint32_t lineHeight = height / 80;
+
+        for (uint32_t y = height / 10; y < height - height / 10; y++)
+        {
+            if ((y / lineHeight) % 2)
+            {
+                continue;
+            }
+            uint8_t* row = image.Row(y);
+            for (uint32_t x = width / 10; x < width - width / 10; x++)
+            {
+                if ((x / (lineHeight * 3)) % 4 != 3 && (random() & 3))
+                {
+                    for (size_t c = 0; c < bytesPerPixel; c++)
+                    {
+                        row[x * bytesPerPixel + c] = 0;
+                    }
+                }
+            }
+        }
+        return image;
+    }
+
+    std::vector<uint8_t> ReadFile(FILE* file)
+    {
+        std::vector<uint8_t> data;
+        std::fseek(file, 0, SEEK_END);
+        data.resize(size_t(std::ftell(file)));
+        std::fseek(file, 0, SEEK_SET);
+        if (std::fread(data.data(), 1, data.size(), file) != data.size())
+        {
+            data.clear();
+        }
+        return data;
+    }
+
+    uint32_t GetUInt32LE(const uint8_t* data)
+    {
+        return uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+    }
+
+    // pages found by following the IFD chain
+    size_t CountTiffPages(const std::vector<uint8_t>& data)
+    {
+        size_t pages = 0;
+        uint32_t offset = data.size() >= 8 ? GetUInt32LE(data.data() + 4) : 0;
+        while (offset && offset + 2 <= data.size() && pages < 100000)
+        {
+            uint32_t entryCount = data[offset] | (data[offset + 1] << 8);
+            if (offset + 2 + entryCount * 12 + 4 > data.size())
+            {
+                return 0;
+            }
+            pages++;
+            offset = GetUInt32LE(data.data() + offset + 2 + entryCount * 12);
+        }
+        return pages;
+    }
+
+    // pages found through the cross-reference table, every object must be where the table says
+    size_t CountPdfPages(const std::vector<uint8_t>& data)
+    {
+        std::string text(data.begin(), data.end());
+        size_t startxref = text.rfind("startxref\n");
+        if (startxref == std::string::npos)
+        {
+            return 0;
+        }
+        size_t xref = std::strtoul(text.c_str() + startxref + 10, nullptr, 10);
+        if (text.compare(xref, 5, "xref\n") != 0)
+        {
+            return 0;
+        }
+
+        size_t objectCount = std::strtoul(text.c_str() + xref + 7, nullptr, 10);
+        size_t entries = text.find('\n', xref + 5) + 1 + 20;
+        size_t pages = 0;
+        for (size_t i = 1; i < objectCount; i++)
+        {
+            size_t offset = std::strtoul(text.c_str() + entries + (i - 1) * 20, nullptr, 10);
+            std::string header = std::to_string(i) + " 0 obj\n";
+            if (text.compare(offset, header.size(), header) != 0)
+            {
+                return 0;
+            }
+            if (text.compare(offset + header.size(), 14, "<< /Type /Page") == 0 &&
+                text.compare(offset + header.size(), 15, "<< /Type /Pages") != 0)
+            {
+                pages++;
+            }
+        }
+        return pages;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int pageCount = argc > 1 ? std::atoi(argv[1]) : 50;
+    double dpi = argc > 2 ? std::atof(argv[2]) : 200;
+    std::string outputDir = argc > 3 ? argv[3] : "";
+
+    uint32_t width = uint32_t(8.27 * dpi);
+    uint32_t height = uint32_t(11.69 * dpi);
+    std::mt19937 random(15);
+
+    // the pages as the driver or the pipeline delivers them
+    RawImage colorPage = CreateTextPage(width, height, PixelFormat::BGR24, random);
+    colorPage.dpiX = colorPage.dpiY = dpi;
+    RawImage bilevelPage = CreateTextPage(width, height, PixelFormat::Gray8, random);
+    bilevelPage.dpiX = bilevelPage.dpiY = dpi;
+
+    CMemoryBuffer jpegPage;
+    CMemoryBuffer g4Page;
+    if (!EncodeJpeg(colorPage, 85, jpegPage) || !EncodeTiffG4(bilevelPage, 128, g4Page))
+    {
+        std::printf("the pages cannot be encoded\n");
+        return 1;
+    }
+
+    std::printf("%d pages of %ux%u: JPEG %zu bytes, G4 %zu bytes, raw pages compressed on the way\n",
+        pageCount, width, height, jpegPage.Size(), g4Page.Size());
+
+    const struct
+    {
+        DocumentFormat format;
+        const char* name;
+        const char* fileName;
+    } documents[] = { { DocumentFormat::Pdf, "pdf", "scan.pdf" }, { DocumentFormat::Tiff, "tiff", "scan.tif" } };
+
+    bool passed = true;
+    for (const auto& document : documents)
+    {
+        FILE* file = outputDir.empty() ? std::tmpfile() : std::fopen((outputDir + "/" + document.fileName).c_str(), "w+b");
+        if (!file)
+        {
+            std::printf("%s: the file cannot be created\n", document.name);
+            return 1;
+        }
+
+        CFileDocumentSink sink(file);
+        CDocumentWriter writer(document.format, sink);
+
+        double maxAppendMs = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < pageCount; i++)
+        {
+            auto pageStart = Clock::now();
+            bool ret = false;
+            switch (i % 3)
+            {
+            case 0:
+                ret = writer.AddEncodedPage(jpegPage.Data(), jpegPage.Size());
+                break;
+            case 1:
+                ret = writer.AddEncodedPage(g4Page.Data(), g4Page.Size());
+                break;
+            default:
+                ret = writer.AddImagePage(bilevelPage, 128, 85);
+                break;
+            }
+            if (!ret)
+            {
+                std::printf("%s: page %d cannot be appended\n", document.name, i);
+                return 1;
+            }
+            maxAppendMs = std::max(maxAppendMs, std::chrono::duration<double, std::milli>(Clock::now() - pageStart).count());
+        }
+
+        // what is left to do after the last page has come
+        auto finishStart = Clock::now();
+        bool finished = writer.Finish() && std::fflush(file) == 0;
+        auto end = Clock::now();
+
+        std::vector<uint8_t> data = ReadFile(file);
+        std::fclose(file);
+
+        size_t pagesFound = (document.format == DocumentFormat::Pdf) ? CountPdfPages(data) : CountTiffPages(data);
+        std::printf("%-5s %8.1f ms total, max %6.2f ms per page, %6.3f ms after the last page, %zu bytes, %zu pages found\n",
+            document.name,
+            std::chrono::duration<double, std::milli>(end - start).count(), maxAppendMs,
+            std::chrono::duration<double, std::milli>(end - finishStart).count(),
+            data.size(), pagesFound);
+
+        if (!finished || pagesFound != size_t(pageCount))
+        {
+            std::printf("FAILED: %s\n", document.name);
+            passed = false;
+        }
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,212 @@
+// Benchmark of the native encoding of raw scans, from the driver buffer to the file data.
+// usage: encoderBench [pages] [dpi] [outputDir]
+//   pages: how many times each page is encoded, 10 by default
+//   dpi: resolution of the A4 pages, 300 by default
+//   outputDir: if given, the encoded pages are written there to be checked with other tools
+#include "stdafx.h"
+#include "rawScan.h"
+#include "jpegEncoder.h"
+#include "tiffG4Encoder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+
+using namespace scanner::util;
+
+namespace
+{
+    void PutUInt16(std::vector<uint8_t>& data, uint16_t value)
+    {
+        data.push_back(uint8_t(value));
+        data.push_back(uint8_t(value >> 8));
+    }
+    void PutUInt32(std::vector<uint8_t>& data, uint32_t value)
+    {
+        PutUInt16(data, uint16_t(value));
+        PutUInt16(data, uint16_t(value >> 16));
+    }
+
+    // Text-like lines on a slightly tinted page, with a colored block in the color version
+    RawImage CreateSyntheticPage(uint32_t width, uint32_t height, PixelFormat format, std::mt19937& random)
+    {
+        RawImage image = CreateRawImage(width, height, format, 0xf0);
+        size_t bytesPerPixel = GetBytesPerPixel(format);
+        uint32_t lineHeight = height / 80;
+
+        for (uint32_t y = height / 10; y < height - height / 10; y++)
+        {
+            if ((y / lineHeight) % 2)
+            {
+                continue;
+            }
+            uint8_t* row = image.Row(y);
+            for (uint32_t x = width / 10; x < width - width / 10; x++)
+            {
+                if ((x / (lineHeight * 3)) % 4 != 3 && (random() & 3))
+                {
+                    for (size_t c = 0; c < bytesPerPixel; c++)
+                    {
+                        row[x * bytesPerPixel + c] = uint8_t(20 + (random() & 15));
+                    }
+                }
+            }
+        }
+
+        if (format == PixelFormat::BGR24)
+        {
+            for (uint32_t y = height / 20; y < height / 5; y++)
+            {
+                uint8_t* row = image.Row(y);
+                for (uint32_t x = width / 2; x < width - width / 10; x++)
+                {
+                    row[x * 3] = uint8_t(x);
+                    row[x * 3 + 1] = uint8_t(y);
+                    row[x * 3 + 2] = 200;
+                }
+            }
+        }
+        return image;
+    }
+
+    // The buffer a driver hands over for WiaImgFmt_MEMORYBMP: BITMAPINFOHEADER, the color table, bottom-up rows
+    std::vector<uint8_t> CreateMemoryBitmap(const RawImage& image, uint16_t bitsPerPixel, double dpi)
+    {
+        uint32_t paletteCount = bitsPerPixel <= 8 ? (1u << bitsPerPixel) : 0;
+        size_t stride = ((size_t(image.width) * bitsPerPixel + 31) / 32) * 4;
+
+        std::vector<uint8_t> data;
+        data.reserve(40 + paletteCount * 4 + stride * image.height);
+        PutUInt32(data, 40);
+        PutUInt32(data, image.width);
+        PutUInt32(data, image.height);
+        PutUInt16(data, 1);
+        PutUInt16(data, bitsPerPixel);
+        PutUInt32(data, 0);
+        PutUInt32(data, uint32_t(stride * image.height));
+        PutUInt32(data, uint32_t(dpi / 0.0254 + 0.5));
+        PutUInt32(data, uint32_t(dpi / 0.0254 + 0.5));
+        PutUInt32(data, paletteCount);
+        PutUInt32(data, 0);
+
+        for (uint32_t i = 0; i < paletteCount; i++)
+        {
+            uint8_t level = uint8_t(i * 255 / (paletteCount - 1));
+            PutUInt32(data, level | (level << 8) | (level << 16));
+        }
+
+        RawImage gray = ToGray8(image);
+        for (uint32_t y = image.height; y-- > 0;)
+        {
+            size_t rowStart = data.size();
+            data.resize(rowStart + stride, 0);
+            uint8_t* dst = data.data() + rowStart;
+
+            if (bitsPerPixel == 24)
+            {
+                std::copy(image.Row(y), image.Row(y) + size_t(image.width) * 3, dst);
+            }
+            else if (bitsPerPixel == 8)
+            {
+                std::copy(gray.Row(y), gray.Row(y) + image.width, dst);
+            }
+            else
+            {
+                for (uint32_t x = 0; x < image.width; x++)
+                {
+                    if (gray.Row(y)[x] >= 128)
+                    {
+                        dst[x >> 3] |= uint8_t(0x80 >> (x & 7));
+                    }
+                }
+            }
+        }
+        return data;
+    }
+
+    struct BenchCase
+    {
+        const char* name;
+        const char* fileName;
+        std::vector<uint8_t> raw;
+        std::function<bool(const RawImage&, CMemoryBuffer&)> encode;
+    };
+}
+
+int main(int argc, char* argv[])
+{
+    long pageCount = argc > 1 ? std::atol(argv[1]) : 10;
+    double dpi = argc > 2 ? std::atof(argv[2]) : 300;
+    std::string outputDir = argc > 3 ? argv[3] : "";
+
+    uint32_t width = uint32_t(8.27 * dpi);
+    uint32_t height = uint32_t(11.69 * dpi);
+
+    std::mt19937 random(1);
+    RawImage colorPage = CreateSyntheticPage(width, height, PixelFormat::BGR24, random);
+
+    std::vector<BenchCase> cases;
+    cases.push_back({ "jpeg color", "color.jpg", CreateMemoryBitmap(colorPage, 24, dpi),
+        [](const RawImage& image, CMemoryBuffer& data) { return EncodeJpeg(image, 85, data); } });
+    cases.push_back({ "jpeg gray", "gray.jpg", CreateMemoryBitmap(colorPage, 8, dpi),
+        [](const RawImage& image, CMemoryBuffer& data) { return EncodeJpeg(image, 85, data); } });
+    cases.push_back({ "tiff-g4 bilevel", "bilevel.tif", CreateMemoryBitmap(colorPage, 1, dpi),
+        [](const RawImage& image, CMemoryBuffer& data) { return EncodeTiffG4(image, 128, data); } });
+    cases.push_back({ "tiff-g4 gray", "gray.tif", CreateMemoryBitmap(colorPage, 8, dpi),
+        [](const RawImage& image, CMemoryBuffer& data) { return EncodeTiffG4(image, 128, data); } });
+
+    std::printf("%ld pages of %ux%u per case\n", pageCount, width, height);
+
+    for (BenchCase& benchCase : cases)
+    {
+        double decodeMs = 0;
+        double encodeMs = 0;
+        size_t encodedSize = 0;
+
+        for (long i = 0; i < pageCount; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+
+            RawImage image;
+            if (!DecodeRawScan(benchCase.raw.data(), benchCase.raw.size(), image))
+            {
+                std::printf("%s: the raw data cannot be decoded\n", benchCase.name);
+                return 1;
+            }
+            auto decoded = std::chrono::steady_clock::now();
+
+            CMemoryBuffer data;
+            if (!benchCase.encode(image, data))
+            {
+                std::printf("%s: encoding failed\n", benchCase.name);
+                return 1;
+            }
+            auto end = std::chrono::steady_clock::now();
+
+            decodeMs += std::chrono::duration<double, std::milli>(decoded - start).count();
+            encodeMs += std::chrono::duration<double, std::milli>(end - decoded).count();
+            encodedSize = data.Size();
+
+            if (i == 0 && !outputDir.empty())
+            {
+                std::string path = outputDir + "/" + benchCase.fileName;
+                FILE* file = std::fopen(path.c_str(), "wb");
+                if (file)
+                {
+                    std::fwrite(data.Data(), 1, data.Size(), file);
+                    std::fclose(file);
+                }
+            }
+        }
+
+        double rawMB = benchCase.raw.size() / (1024.0 * 1024.0);
+        std::printf("%-16s raw %6.1f MB -> %7.1f KB, decode %6.1f ms, encode %6.1f ms per page (%.0f MB/s)\n",
+            benchCase.name, rawMB, encodedSize / 1024.0, decodeMs / pageCount, encodeMs / pageCount,
+            rawMB * pageCount * 1000.0 / (decodeMs + encodeMs));
+    }
+
+    return 0;
+}
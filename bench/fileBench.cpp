@@ -0,0 +1,220 @@
+// Files of a scan written through the write-behind sink against plain write() calls on the transfer thread.
+// The "driver" writes every page in small chunks, as WIA drivers do, and a BMP-like header is completed at the end.
+// The files are read back and checked.
+// usage: fileBench [pages] [pageKB] [chunkKB] [durability] [dir]
+//   pages: pages written, 20 by default
+//   pageKB: size of a page, 8192 by default
+//   chunkKB: size of the writes of the driver, 32 by default
+//   durability: none, end or page, none by default
+//   dir: where the files are written, /tmp by default
+// Exits with 1 if a file is not as written
+#include "stdafx.h"
+#include "fileSink.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const size_t HeaderSize = 54;
+
+    double ElapsedMs(Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    // what the file of a page must hold: the header written last
+    void MakeHeader(uint8_t* header, size_t pageSize)
+    {
+        std::memset(header, 0, HeaderSize);
+        header[0] = 'B';
+        header[1] = 'M';
+        for (int i = 0; i < 4; i++)
+        {
+            header[2 + i] = uint8_t(pageSize >> (i * 8));
+        }
+    }
+
+    // write() on the transfer thread, as the stream of the shell does
+    bool WritePagePlain(const std::string& path, const std::vector<uint8_t>& page, size_t chunkSize, FileDurability durability)
+    {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        bool succeeded = ::write(fd, page.data(), HeaderSize) == ssize_t(HeaderSize);
+        for (size_t position = HeaderSize; position < page.size() && succeeded; position += chunkSize)
+        {
+            size_t size = std::min(chunkSize, page.size() - position);
+            succeeded = ::write(fd, page.data() + position, size) == ssize_t(size);
+        }
+
+        uint8_t header[HeaderSize];
+        MakeHeader(header, page.size());
+        succeeded = succeeded && ::pwrite(fd, header, HeaderSize, 0) == ssize_t(HeaderSize);
+        if (durability == FileDurability::FlushEachFile)
+        {
+            succeeded = succeeded && ::fsync(fd) == 0;
+        }
+        return ::close(fd) == 0 && succeeded;
+    }
+
+    // the same writes through the sink, the header is read back before it is completed as a driver might do
+    bool WritePageSink(CFileWriter& writer, const std::string& path, const std::vector<uint8_t>& page, size_t chunkSize)
+    {
+        auto file = writer.Create(path, page.size());
+        if (!file)
+        {
+            return false;
+        }
+
+        bool succeeded = file->Write(page.data(), HeaderSize);
+        for (size_t position = HeaderSize; position < page.size() && succeeded; position += chunkSize)
+        {
+            size_t size = std::min(chunkSize, page.size() - position);
+            succeeded = file->Write(page.data() + position, size);
+        }
+
+        uint8_t header[HeaderSize];
+        succeeded = succeeded && file->Seek(0, SeekOrigin::Begin) && file->Read(header, HeaderSize) == HeaderSize &&
+            std::memcmp(header, page.data(), HeaderSize) == 0;
+
+        MakeHeader(header, page.size());
+        succeeded = succeeded && file->Seek(0, SeekOrigin::Begin) && file->Write(header, HeaderSize) &&
+            file->Seek(0, SeekOrigin::End);
+        return file->Close() && succeeded;
+    }
+
+    bool CheckFile(const std::string& path, const std::vector<uint8_t>& page)
+    {
+        std::vector<uint8_t> expected = page;
+        MakeHeader(expected.data(), page.size());
+
+        FILE* file = std::fopen(path.c_str(), "rb");
+        if (!file)
+        {
+            return false;
+        }
+        std::vector<uint8_t> data(page.size() + 1);
+        size_t size = std::fread(data.data(), 1, data.size(), file);
+        std::fclose(file);
+        return size == page.size() && std::memcmp(data.data(), expected.data(), size) == 0;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int pageCount = argc > 1 ? std::atoi(argv[1]) : 20;
+    size_t pageSize = size_t(argc > 2 ? std::atoi(argv[2]) : 8192) * 1024;
+    size_t chunkSize = size_t(argc > 3 ? std::atoi(argv[3]) : 32) * 1024;
+    std::string durabilityName = argc > 4 ? argv[4] : "none";
+    std::string dir = argc > 5 ? argv[5] : "/tmp";
+
+    FileSinkOptions options;
+    if (durabilityName == "end")
+    {
+        options.durability = FileDurability::FlushAtEnd;
+    }
+    else if (durabilityName == "page")
+    {
+        options.durability = FileDurability::FlushEachFile;
+    }
+
+    std::vector<uint8_t> page(std::max(pageSize, HeaderSize));
+    std::mt19937 random(17);
+    for (auto& value : page)
+    {
+        value = uint8_t(random());
+    }
+
+    std::printf("%d pages of %zu KB written in chunks of %zu KB to %s, durability %s\n",
+        pageCount, page.size() / 1024, chunkSize / 1024, dir.c_str(), durabilityName.c_str());
+
+    bool passed = true;
+
+    // plain writes, the transfer waits for every one of them
+    {
+        double transferMs = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < pageCount; i++)
+        {
+            auto pageStart = Clock::now();
+            std::string path = dir + "/fileBench_plain_" + std::to_string(i) + ".bmp";
+            if (!WritePagePlain(path, page, chunkSize, options.durability))
+            {
+                std::printf("FAILED: %s cannot be written\n", path.c_str());
+                return 1;
+            }
+            transferMs += ElapsedMs(pageStart);
+        }
+        if (options.durability == FileDurability::FlushAtEnd)
+        {
+            ::sync();
+        }
+        double totalMs = ElapsedMs(start);
+
+        for (int i = 0; i < pageCount; i++)
+        {
+            std::string path = dir + "/fileBench_plain_" + std::to_string(i) + ".bmp";
+            passed = CheckFile(path, page) && passed;
+            std::remove(path.c_str());
+        }
+        std::printf("write() %9.2f ms on the transfer thread per page, %9.1f ms in total, %zu writes per page\n",
+            transferMs / pageCount, totalMs, (page.size() - HeaderSize + chunkSize - 1) / chunkSize + 2);
+    }
+
+    // the sink, the transfer only copies the data, the files are written behind
+    {
+        auto writer = std::make_shared<CFileWriter>(options);
+        double transferMs = 0;
+        auto start = Clock::now();
+        for (int i = 0; i < pageCount; i++)
+        {
+            auto pageStart = Clock::now();
+            std::string path = dir + "/fileBench_sink_" + std::to_string(i) + ".bmp";
+            if (!WritePageSink(*writer, path, page, chunkSize))
+            {
+                std::printf("FAILED: %s cannot be written\n", path.c_str());
+                passed = false;
+            }
+            transferMs += ElapsedMs(pageStart);
+        }
+        passed = writer->Finish() && passed;
+        double totalMs = ElapsedMs(start);
+        FileSinkStats stats = writer->GetStats();
+
+        for (int i = 0; i < pageCount; i++)
+        {
+            std::string path = dir + "/fileBench_sink_" + std::to_string(i) + ".bmp";
+            if (!CheckFile(path, page))
+            {
+                std::printf("FAILED: %s is not as written\n", path.c_str());
+                passed = false;
+            }
+            std::remove(path.c_str());
+        }
+        std::printf("sink    %9.2f ms on the transfer thread per page, %9.1f ms in total, %.1f writes per page, "
+            "%.1f ms waiting for buffers, %.1f ms flushing, %llu/%llu files preallocated\n",
+            transferMs / pageCount, totalMs, double(stats.writes) / pageCount, stats.waitMs, stats.flushMs,
+            (unsigned long long)stats.preallocated, (unsigned long long)stats.files);
+    }
+
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,219 @@
+// Digests of the scanned files: computed while the driver writes the data, as CHashingStream does,
+// against reading every file again once written.
+// The digests are checked against known values first.
+// usage: hashBench [pages] [dpi] [chunkKB]
+//   pages: pages written, 10 by default
+//   dpi: resolution of the A4 color pages, 300 by default
+//   chunkKB: size of the writes of the driver, 64 by default
+// Exits with 1 if a digest is wrong
+#include "stdafx.h"
+#include "contentHash.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    struct TestVector
+    {
+        std::string data;
+        const char* sha256;
+        const char* xxh64;
+    };
+
+    bool CheckDigests()
+    {
+        const TestVector vectors[] =
+        {
+            { "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", "ef46db3751d8e999" },
+            { "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", "44bc2cf5ad770999" },
+            { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+                "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", "f06103773e8585df" },
+            { std::string(1000000, 'a'), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", "dc483aaa9b4fdc40" },
+        };
+
+        HashOptions options;
+        options.sha256 = true;
+        options.xxh64 = true;
+
+        bool passed = true;
+        for (const auto& vector : vectors)
+        {
+            // at once and in writes of every size up to 100 bytes
+            ContentDigest digest = HashBuffer(options, vector.data.data(), vector.data.size());
+
+            CContentHasher hasher(options);
+            size_t position = 0;
+            for (size_t size = 1; position < vector.data.size(); size = size % 100 + 1)
+            {
+                size_t writeSize = std::min(size, vector.data.size() - position);
+                hasher.Update(position, vector.data.data() + position, writeSize);
+                position += writeSize;
+            }
+            ContentDigest writtenDigest;
+            hasher.Finish(writtenDigest);
+
+            if (digest.sha256 != vector.sha256 || digest.xxh64 != vector.xxh64 ||
+                writtenDigest.sha256 != vector.sha256 || writtenDigest.xxh64 != vector.xxh64)
+            {
+                std::printf("FAILED: %zu bytes: %s %s instead of %s %s\n", vector.data.size(),
+                    writtenDigest.sha256.c_str(), writtenDigest.xxh64.c_str(), vector.sha256, vector.xxh64);
+                passed = false;
+            }
+        }
+
+        // a header written again at the end can't be hashed on the way
+        CContentHasher hasher(options);
+        hasher.Update(0, "BM\0\0\0\0", 6);
+        hasher.Update(6, "pixels", 6);
+        hasher.Update(2, "\x0c\0\0\0", 4);
+        ContentDigest digest;
+        if (hasher.Finish(digest))
+        {
+            std::printf("FAILED: data written out of order not detected\n");
+            passed = false;
+        }
+        return passed;
+    }
+
+    // the page written by the driver chunk by chunk, hashed on the way if a hasher is given
+    bool WritePage(FILE* file, const std::vector<uint8_t>& page, size_t chunkSize, CContentHasher* hasher)
+    {
+        std::rewind(file);
+        for (size_t position = 0; position < page.size(); position += chunkSize)
+        {
+            size_t size = std::min(chunkSize, page.size() - position);
+            if (std::fwrite(page.data() + position, 1, size, file) != size)
+            {
+                return false;
+            }
+            if (hasher)
+            {
+                hasher->Update(position, page.data() + position, size);
+            }
+        }
+        return std::fflush(file) == 0;
+    }
+
+    // what the digest of a file written costs without the hasher
+    bool ReadAndHash(FILE* file, size_t chunkSize, const HashOptions& options, ContentDigest& digest)
+    {
+        std::rewind(file);
+        std::vector<uint8_t> chunk(chunkSize);
+        CContentHasher hasher(options);
+        uint64_t position = 0;
+        for (;;)
+        {
+            size_t size = std::fread(chunk.data(), 1, chunk.size(), file);
+            if (!size)
+            {
+                break;
+            }
+            hasher.Update(position, chunk.data(), size);
+            position += size;
+        }
+        return hasher.Finish(digest);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int pageCount = argc > 1 ? std::atoi(argv[1]) : 10;
+    int dpi = argc > 2 ? std::atoi(argv[2]) : 300;
+    size_t chunkSize = size_t(argc > 3 ? std::atoi(argv[3]) : 64) * 1024;
+
+    if (!CheckDigests())
+    {
+        return 1;
+    }
+    std::printf("digests match the known values\n");
+
+    // an uncompressed color page, the largest files a scanner writes
+    uint32_t width = uint32_t(8.27 * dpi);
+    uint32_t height = uint32_t(11.69 * dpi);
+    std::vector<uint8_t> page(size_t(width) * height * 3);
+    std::mt19937 random(16);
+    for (auto& value : page)
+    {
+        value = uint8_t(random());
+    }
+    double pageMB = page.size() / (1024.0 * 1024.0);
+    std::printf("%d color pages at %d dpi, %.1f MB each, written in chunks of %zu KB\n", pageCount, dpi, pageMB, chunkSize / 1024);
+
+    FILE* file = std::tmpfile();
+    if (!file)
+    {
+        std::printf("the file cannot be created\n");
+        return 1;
+    }
+
+    const struct
+    {
+        const char* name;
+        bool sha256;
+        bool xxh64;
+    } configurations[] = { { "none", false, false }, { "sha256", true, false }, { "xxh64", false, true }, { "both", true, true } };
+
+    bool passed = true;
+    for (const auto& configuration : configurations)
+    {
+        HashOptions options;
+        options.sha256 = configuration.sha256;
+        options.xxh64 = configuration.xxh64;
+
+        double inlineMs = 0;
+        double rereadMs = 0;
+        for (int i = 0; i < pageCount; i++)
+        {
+            CContentHasher hasher(options);
+            ContentDigest inlineDigest;
+
+            auto start = Clock::now();
+            if (!WritePage(file, page, chunkSize, options.IsEnabled() ? &hasher : nullptr))
+            {
+                std::printf("the file cannot be written\n");
+                return 1;
+            }
+            hasher.Finish(inlineDigest);
+            auto written = Clock::now();
+
+            ContentDigest rereadDigest;
+            if (options.IsEnabled())
+            {
+                ReadAndHash(file, chunkSize, options, rereadDigest);
+            }
+            auto end = Clock::now();
+
+            inlineMs += std::chrono::duration<double, std::milli>(written - start).count();
+            rereadMs += std::chrono::duration<double, std::milli>(end - written).count();
+
+            if (inlineDigest.sha256 != rereadDigest.sha256 || inlineDigest.xxh64 != rereadDigest.xxh64)
+            {
+                std::printf("FAILED: %s, page %d: the digests differ from those of the file\n", configuration.name, i);
+                passed = false;
+            }
+        }
+
+        inlineMs /= pageCount;
+        rereadMs /= pageCount;
+        if (!options.IsEnabled())
+        {
+            std::printf("%-7s write %8.2f ms/page\n", configuration.name, inlineMs);
+            continue;
+        }
+        // the file is read from the page cache here, from the disk if it has been written out
+        std::printf("%-7s write+hash %8.2f ms/page, %7.0f MB/s; read again afterwards %8.2f ms/page\n",
+            configuration.name, inlineMs, pageMB / (inlineMs / 1000), rereadMs);
+    }
+
+    std::fclose(file);
+    return passed ? 0 : 1;
+}
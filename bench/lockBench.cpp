@@ -0,0 +1,226 @@
+// Contention of the device lock: property calls made while a long scan is running.
+// The old scheme, one mutex held for the whole scan, is run next to CDeviceLock for comparison.
+// usage: lockBench [scanMs] [readers]
+//   scanMs: how long the simulated feeder batch transfers, 2000 by default
+//   readers: threads calling getProperties() in a loop, 4 by default
+// Exits with 1 if a property read waited for the transfer with CDeviceLock
+#include "stdafx.h"
+#include "deviceLock.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // time the driver takes for a cached property read, and to apply the settings before a scan
+    const auto PropertyReadTime = std::chrono::microseconds(50);
+    const auto ApplySettingsTime = std::chrono::milliseconds(5);
+
+    struct Settings
+    {
+        std::wstring imageFormat = L"tiff";
+        std::wstring documentHandling = L"front";
+        int pageCount = 0;
+    };
+
+    struct BenchResult
+    {
+        std::vector<double> readMs;
+        uint64_t writes = 0;
+        uint64_t refusedWrites = 0;
+    };
+
+    // A device with the locking calls only, the driver work is simulated by sleeping
+    class IDevice
+    {
+    public:
+        virtual ~IDevice() = default;
+        virtual void Scan(std::chrono::milliseconds transferTime) = 0;
+        virtual void GetProperties() = 0;
+        // Returns false if refused
+        virtual bool SetProperties() = 0;
+    };
+
+    // the scheme before: every call holds the same recursive mutex, the scan holds it until it finishes
+    class CSingleMutexDevice : public IDevice
+    {
+    public:
+        void Scan(std::chrono::milliseconds transferTime) override
+        {
+            std::lock_guard<std::recursive_mutex> g(m_lock);
+            std::this_thread::sleep_for(ApplySettingsTime);
+            std::this_thread::sleep_for(transferTime);
+        }
+        void GetProperties() override
+        {
+            std::lock_guard<std::recursive_mutex> g(m_lock);
+            Settings settings = m_settings;
+            std::this_thread::sleep_for(PropertyReadTime);
+        }
+        bool SetProperties() override
+        {
+            std::lock_guard<std::recursive_mutex> g(m_lock);
+            m_settings.pageCount++;
+            std::this_thread::sleep_for(PropertyReadTime);
+            return true;
+        }
+
+    private:
+        std::recursive_mutex m_lock;
+        Settings m_settings;
+    };
+
+    // the scheme of CWIADevice: settings snapshot, reader/writer lock, atomic scan state
+    class CDeviceLockDevice : public IDevice
+    {
+    public:
+        void Scan(std::chrono::milliseconds transferTime) override
+        {
+            CScanScope scanScope(m_lock);
+            if (!scanScope.IsStarted())
+            {
+                return;
+            }
+
+            Settings settings = m_settings.Get();
+            {
+                auto g = m_lock.LockWrite();
+                std::this_thread::sleep_for(ApplySettingsTime);
+            }
+
+            if (m_lock.BeginTransfer())
+            {
+                std::this_thread::sleep_for(transferTime);
+            }
+        }
+        void GetProperties() override
+        {
+            Settings settings = m_settings.Get();
+            auto g = m_lock.LockRead();
+            std::this_thread::sleep_for(PropertyReadTime);
+        }
+        bool SetProperties() override
+        {
+            m_settings.Update([](Settings& settings)
+            {
+                settings.pageCount++;
+            });
+
+            auto g = m_lock.LockWriteIfIdle();
+            if (!g.owns_lock())
+            {
+                return false;
+            }
+            std::this_thread::sleep_for(PropertyReadTime);
+            return true;
+        }
+
+    private:
+        CDeviceLock m_lock;
+        CSnapshotValue<Settings> m_settings;
+    };
+
+    BenchResult RunBench(IDevice& device, std::chrono::milliseconds transferTime, int readerCount)
+    {
+        BenchResult result;
+        std::atomic<bool> scanDone(false);
+        std::mutex lockResult;
+
+        std::thread scanThread([&]()
+        {
+            // the UI is already polling when the scan starts
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            device.Scan(transferTime);
+            scanDone = true;
+        });
+
+        std::vector<std::thread> readers;
+        for (int i = 0; i < readerCount; i++)
+        {
+            readers.emplace_back([&]()
+            {
+                std::vector<double> readMs;
+                while (!scanDone)
+                {
+                    auto start = Clock::now();
+                    device.GetProperties();
+                    readMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+
+                std::lock_guard<std::mutex> g(lockResult);
+                result.readMs.insert(result.readMs.end(), readMs.begin(), readMs.end());
+            });
+        }
+
+        std::thread writer([&]()
+        {
+            while (!scanDone)
+            {
+                result.writes++;
+                if (!device.SetProperties())
+                {
+                    result.refusedWrites++;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+        });
+
+        scanThread.join();
+        for (auto& reader : readers)
+        {
+            reader.join();
+        }
+        writer.join();
+
+        std::sort(result.readMs.begin(), result.readMs.end());
+        return result;
+    }
+
+    double Percentile(const std::vector<double>& sorted, double ratio)
+    {
+        if (sorted.empty())
+        {
+            return 0;
+        }
+        return sorted[std::min(sorted.size() - 1, size_t(sorted.size() * ratio))];
+    }
+
+    void PrintResult(const char* name, const BenchResult& result)
+    {
+        std::printf("%-14s reads: %6zu, p50 %8.3f ms, p99 %8.3f ms, max %8.1f ms; writes: %llu, refused during the scan: %llu\n",
+            name, result.readMs.size(), Percentile(result.readMs, 0.5), Percentile(result.readMs, 0.99),
+            result.readMs.empty() ? 0.0 : result.readMs.back(),
+            (unsigned long long)result.writes, (unsigned long long)result.refusedWrites);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    auto transferTime = std::chrono::milliseconds(argc > 1 ? std::atol(argv[1]) : 2000);
+    int readerCount = argc > 2 ? std::atoi(argv[2]) : 4;
+
+    std::printf("scan transferring for %lld ms, %d readers polling every 1 ms, a writer every 50 ms\n",
+        (long long)transferTime.count(), readerCount);
+
+    CSingleMutexDevice singleMutexDevice;
+    BenchResult before = RunBench(singleMutexDevice, transferTime, readerCount);
+    PrintResult("single mutex", before);
+
+    CDeviceLockDevice deviceLockDevice;
+    BenchResult after = RunBench(deviceLockDevice, transferTime, readerCount);
+    PrintResult("CDeviceLock", after);
+
+    // A read may wait for the settings being applied, never for the transfer
+    double maxReadMs = after.readMs.empty() ? 0.0 : after.readMs.back();
+    return maxReadMs < transferTime.count() / 2.0 ? 0 : 1;
+}
@@ -0,0 +1,258 @@
+// What recording a latency costs, from one and from several threads at once, against a histogram taking a lock.
+// The histograms and counters recorded by several threads, a snapshot taken meanwhile, are checked against the values recorded.
+// usage: metricsBench [values] [threads]
+//   values: values recorded by every thread, 1000000 by default
+//   threads: 4 by default
+// Exits with 1 if a histogram is not as recorded
+#include "stdafx.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // the latencies of the driver, from a few microseconds to minutes, evenly spread over the powers of ten
+    std::vector<uint64_t> MakeValues(int count, unsigned seed)
+    {
+        std::mt19937_64 random(seed);
+        std::uniform_real_distribution<double> exponent(0.0, 8.0);
+        std::vector<uint64_t> values(count);
+        for (auto& value : values)
+        {
+            value = uint64_t(std::pow(10.0, exponent(random)));
+        }
+        return values;
+    }
+
+    // a histogram as simple as it gets, for reference
+    class CLockedHistogram
+    {
+    public:
+        CLockedHistogram()
+            : m_buckets(CLatencyHistogram::BucketCount)
+            , m_count(0)
+            , m_sumUs(0)
+        {
+        }
+
+        void Record(uint64_t valueUs)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            m_buckets[CLatencyHistogram::BucketIndex(valueUs)]++;
+            m_count++;
+            m_sumUs += valueUs;
+        }
+
+        uint64_t GetCount() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_count;
+        }
+
+    private:
+        mutable std::mutex m_lock;
+        std::vector<uint64_t> m_buckets;
+        uint64_t m_count;
+        uint64_t m_sumUs;
+    };
+
+    // ns per value, each thread recording its values in a loop
+    template<class Histogram>
+    double RecordValues(Histogram& histogram, const std::vector<std::vector<uint64_t>>& values)
+    {
+        std::vector<std::thread> threads;
+        auto start = Clock::now();
+        for (const auto& threadValues : values)
+        {
+            threads.emplace_back([&histogram, &threadValues]()
+            {
+                for (uint64_t value : threadValues)
+                {
+                    histogram.Record(value);
+                }
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / values[0].size();
+    }
+
+    bool CheckBuckets()
+    {
+        // every value in the bucket of its index, the buckets following each other
+        for (size_t i = 0; i + 1 < CLatencyHistogram::BucketCount; i++)
+        {
+            uint64_t lower = CLatencyHistogram::BucketLowerBound(i);
+            uint64_t upper = CLatencyHistogram::BucketUpperBound(i);
+            if (upper < lower || CLatencyHistogram::BucketLowerBound(i + 1) != upper + 1 ||
+                CLatencyHistogram::BucketIndex(lower) != i || CLatencyHistogram::BucketIndex(upper) != i ||
+                (lower >= 64 && double(upper - lower + 1) > double(lower) / 32.0))
+            {
+                std::printf("FAILED: bucket %zu holds %llu to %llu\n", i, (unsigned long long)lower, (unsigned long long)upper);
+                return false;
+            }
+        }
+        if (CLatencyHistogram::BucketIndex(UINT64_MAX) != CLatencyHistogram::BucketCount - 1)
+        {
+            std::printf("FAILED: the largest values are not in the last bucket\n");
+            return false;
+        }
+        return true;
+    }
+
+    bool CheckHistogram(const HistogramSnapshot& snapshot, std::vector<uint64_t> values)
+    {
+        std::sort(values.begin(), values.end());
+        uint64_t sum = 0;
+        for (uint64_t value : values)
+        {
+            sum += value;
+        }
+        uint64_t bucketSum = 0;
+        for (uint64_t bucket : snapshot.buckets)
+        {
+            bucketSum += bucket;
+        }
+
+        bool passed = true;
+        if (snapshot.count != values.size() || bucketSum != values.size() || snapshot.sumUs != sum ||
+            snapshot.minUs != values.front() || snapshot.maxUs != values.back())
+        {
+            std::printf("FAILED: %llu values recorded, %llu counted, %llu in the buckets\n", (unsigned long long)values.size(),
+                (unsigned long long)snapshot.count, (unsigned long long)bucketSum);
+            passed = false;
+        }
+
+        const double percentiles[] = { 50, 90, 99, 99.9, 100 };
+        for (double percentile : percentiles)
+        {
+            size_t rank = std::max(size_t(std::ceil(percentile / 100.0 * values.size())), size_t(1));
+            uint64_t exact = values[rank - 1];
+            uint64_t reported = snapshot.PercentileUs(percentile);
+            bool accurate = reported >= exact && double(reported) <= double(exact) * (1.0 + 1.0 / 32.0) + 1.0;
+            std::printf("p%-6g %12llu us, %12llu us exactly%s\n", percentile, (unsigned long long)reported,
+                (unsigned long long)exact, accurate ? "" : " FAILED");
+            passed = passed && accurate;
+        }
+        return passed;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int valueCount = std::max(argc > 1 ? std::atoi(argv[1]) : 1000000, 1);
+    int threadCount = std::max(argc > 2 ? std::atoi(argv[2]) : 4, 1);
+    std::printf("%d values on each of %d threads\n", valueCount, threadCount);
+
+    bool passed = CheckBuckets();
+
+    std::vector<std::vector<uint64_t>> values;
+    std::vector<uint64_t> allValues;
+    for (int t = 0; t < threadCount; t++)
+    {
+        values.push_back(MakeValues(valueCount, unsigned(t + 1)));
+        allValues.insert(allValues.end(), values.back().begin(), values.back().end());
+    }
+
+    {
+        CLatencyHistogram histogram;
+        std::vector<std::vector<uint64_t>> oneThread(1, values[0]);
+        std::printf("lock-free      %7.2f ns per value, 1 thread\n", RecordValues(histogram, oneThread));
+        CLockedHistogram lockedHistogram;
+        std::printf("locked         %7.2f ns per value, 1 thread\n", RecordValues(lockedHistogram, oneThread));
+    }
+
+    {
+        CLatencyHistogram histogram;
+        std::printf("lock-free      %7.2f ns per value and thread, %d threads\n", RecordValues(histogram, values), threadCount);
+        CLockedHistogram lockedHistogram;
+        std::printf("locked         %7.2f ns per value and thread, %d threads\n", RecordValues(lockedHistogram, values), threadCount);
+    }
+
+    // recorded while snapshots are being taken, as getStats() does during a scan
+    CLatencyHistogram histogram;
+    std::atomic<bool> bRecording(true);
+    int snapshotCount = 0;
+    std::thread reader([&]()
+    {
+        uint64_t lastCount = 0;
+        while (bRecording)
+        {
+            uint64_t count = histogram.GetSnapshot().count;
+            if (count < lastCount)
+            {
+                std::printf("FAILED: the count went back from %llu to %llu\n", (unsigned long long)lastCount, (unsigned long long)count);
+                passed = false;
+            }
+            lastCount = count;
+            snapshotCount++;
+        }
+    });
+    RecordValues(histogram, values);
+    bRecording = false;
+    reader.join();
+    std::printf("%d snapshots taken while recording\n", snapshotCount);
+
+    passed = CheckHistogram(histogram.GetSnapshot(), allValues) && passed;
+
+    // the devices looked up by the threads at once, the calls counted for the device of the scope
+    const wchar_t* deviceUUIDs[] = { L"{6BDD1FC6-810F-11D0-BEC7-08002BE2092F}\\0000", L"{6BDD1FC6-810F-11D0-BEC7-08002BE2092F}\\0001" };
+    const int callCount = std::min(valueCount, 100000);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++)
+    {
+        threads.emplace_back([&deviceUUIDs, callCount, t]()
+        {
+            auto pMetrics = CMetricsRegistry::GetInstance().GetDeviceMetrics(deviceUUIDs[t % 2]);
+            CMetricsScope scope(pMetrics.get());
+            for (int i = 0; i < callCount; i++)
+            {
+                CScopedLatency latency(CMetricsScope::Current(), &DeviceMetrics::readMultiple);
+                CMetricsScope::Current()->bytes.Add(2);
+            }
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    if (CMetricsScope::Current())
+    {
+        std::printf("FAILED: the scope of a thread is seen by another one\n");
+        passed = false;
+    }
+
+    auto devices = CMetricsRegistry::GetInstance().GetSnapshot();
+    for (int d = 0; d < 2 && d < threadCount; d++)
+    {
+        uint64_t expected = uint64_t(callCount) * ((threadCount - d + 1) / 2);
+        const DeviceMetricsSnapshot& device = devices[deviceUUIDs[d]];
+        if (device.readMultiple.count != expected || device.bytes != 2 * expected)
+        {
+            std::printf("FAILED: %llu calls counted for device %d instead of %llu\n", (unsigned long long)device.readMultiple.count,
+                d, (unsigned long long)expected);
+            passed = false;
+        }
+    }
+    std::printf("registry       %zu devices, %d calls on each thread\n", devices.size(), callCount);
+
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+    }
+    return passed ? 0 : 1;
+}
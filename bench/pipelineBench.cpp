@@ -0,0 +1,193 @@
+// Benchmark of the page pipeline with synthetic raw pages, runs without a scanner or Windows.
+// The thread pool is checked first for tasks accepted while it is stopped.
+// usage: pipelineBench [pages] [threads] [ppm] [dpi]
+//   pages: how many pages are fed, 100 by default
+//   threads: threads of the pipeline, 0 for the number of hardware threads
+//   ppm: rated speed of the simulated scanner in pages per minute, 0 to feed the pages as fast as possible
+//   dpi: resolution of the A4 pages, 200 by default
+// Exits with 1 if a task accepted by the pool does not run or a page fails
+#include "stdafx.h"
+#include "imagePipeline.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    const double PI = 3.14159265358979323846;
+
+    bool Check(bool condition, const char* what)
+    {
+        if (!condition)
+        {
+            std::printf("FAILED: %s\n", what);
+        }
+        return condition;
+    }
+
+    // Threads submit to the pool while it is stopped, every task accepted must still run
+    bool CheckStopWhileSubmitting(int rounds)
+    {
+        bool passed = true;
+        for (int round = 0; round < rounds && passed; round++)
+        {
+            std::atomic<uint64_t> ran(0);
+            std::atomic<uint64_t> accepted(0);
+            ThreadPoolStats stats;
+            {
+                CThreadPool pool(2, 8);
+                std::vector<std::thread> submitters;
+                for (int t = 0; t < 3; t++)
+                {
+                    submitters.emplace_back([&]()
+                    {
+                        while (pool.Submit([&ran]() { ran++; }))
+                        {
+                            accepted++;
+                        }
+                    });
+                }
+                // let the submitters run for a while, longer every round
+                for (int i = 0; i < round % 50; i++)
+                {
+                    std::this_thread::yield();
+                }
+                pool.Stop();
+                for (auto& submitter : submitters)
+                {
+                    submitter.join();
+                }
+                stats = pool.GetStats();
+            }
+            passed = Check(ran == accepted && stats.submitted == accepted && stats.completed == stats.submitted,
+                "a task accepted before Stop() has not run") && passed;
+        }
+        return passed;
+    }
+
+    // A page of text-like lines skewed by the angle, or a blank page with some dust on it
+    RawImage CreateSyntheticPage(uint32_t width, uint32_t height, double angle, bool blank, std::mt19937& random)
+    {
+        RawImage image = CreateRawImage(width, height, PixelFormat::Gray8);
+        std::uniform_int_distribution<uint32_t> xDist(0, width - 1);
+        std::uniform_int_distribution<uint32_t> yDist(0, height - 1);
+
+        if (blank)
+        {
+            for (int i = 0; i < 200; i++)
+            {
+                image.Row(yDist(random))[xDist(random)] = 40;
+            }
+            return image;
+        }
+
+        double slope = std::tan(angle * PI / 180.0);
+        uint32_t lineHeight = height / 80;
+        uint32_t lineSpacing = lineHeight * 2;
+        uint32_t left = width / 10;
+        uint32_t right = width - width / 10;
+
+        for (uint32_t top = height / 10; top + lineSpacing < height - height / 10; top += lineSpacing)
+        {
+            for (uint32_t x = left; x < right; x++)
+            {
+                // gaps between the words
+                if ((x / (lineHeight * 3)) % 4 == 3)
+                {
+                    continue;
+                }
+
+                int32_t shift = int32_t(std::lround((x - width / 2.0) * slope));
+                for (uint32_t dy = 0; dy < lineHeight; dy++)
+                {
+                    int32_t y = int32_t(top + dy) + shift;
+                    if (y >= 0 && y < int32_t(height) && (random() & 3))
+                    {
+                        image.Row(uint32_t(y))[x] = 20;
+                    }
+                }
+            }
+        }
+        return image;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    long pageCount = argc > 1 ? std::atol(argv[1]) : 100;
+    size_t threadCount = argc > 2 ? size_t(std::atol(argv[2])) : 0;
+    double ppm = argc > 3 ? std::atof(argv[3]) : 0;
+    double dpi = argc > 4 ? std::atof(argv[4]) : 200;
+
+    if (!CheckStopWhileSubmitting(500))
+    {
+        std::printf("FAILED\n");
+        return 1;
+    }
+
+    uint32_t width = uint32_t(8.27 * dpi);
+    uint32_t height = uint32_t(11.69 * dpi);
+
+    // a few templates copied for every page, generating them is not what is measured
+    std::mt19937 random(1);
+    std::vector<RawImage> templates;
+    std::vector<double> angles = { 1.5, -2.0, 0.0, 3.0, -0.7 };
+    for (double angle : angles)
+    {
+        templates.push_back(CreateSyntheticPage(width, height, angle, false, random));
+    }
+    templates.push_back(CreateSyntheticPage(width, height, 0, true, random));
+
+    PipelineOptions options;
+    options.removeBlankPages = true;
+    options.deskew = true;
+    options.threadCount = threadCount;
+
+    // no codec on this platform, the pages are dropped once processed
+    CImagePipeline pipeline(options, nullptr, nullptr, [](ProcessedPage& page)
+    {
+        page.image = RawImage();
+    });
+
+    std::printf("%ld pages of %ux%u, %s, rated speed %s\n", pageCount, width, height,
+        threadCount ? (std::to_string(threadCount) + " threads").c_str() : "hardware threads",
+        ppm > 0 ? (std::to_string(int(ppm)) + " ppm").c_str() : "unlimited");
+
+    auto interval = std::chrono::duration<double>(ppm > 0 ? 60.0 / ppm : 0);
+    auto start = std::chrono::steady_clock::now();
+    auto transferEnd = start;
+
+    for (long i = 0; i < pageCount; i++)
+    {
+        // the next page arrives from the scanner
+        std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval * (i + 1)));
+        pipeline.SubmitRawPage(i, templates[i % templates.size()]);
+        transferEnd = std::chrono::steady_clock::now();
+    }
+
+    auto pages = pipeline.Finish();
+    auto end = std::chrono::steady_clock::now();
+
+    PipelineStats stats = pipeline.GetStats();
+    double totalMs = std::chrono::duration<double, std::milli>(end - start).count();
+    double transferMs = std::chrono::duration<double, std::milli>(transferEnd - start).count();
+
+    std::printf("pages processed: %llu, blank: %llu, deskewed: %llu, failed: %llu\n",
+        (unsigned long long)stats.pages, (unsigned long long)stats.blankPages,
+        (unsigned long long)stats.deskewedPages, (unsigned long long)stats.failedPages);
+    std::printf("process time per page: %.1f ms average, %.1f ms max\n",
+        stats.pages ? stats.totalProcessMs / stats.pages : 0.0, stats.maxProcessMs);
+    std::printf("tasks stolen: %llu, producer blocked: %llu times\n",
+        (unsigned long long)stats.pool.stolen, (unsigned long long)stats.pool.blocked);
+    std::printf("last page transferred after %.0f ms, all pages done after %.0f ms (%.1f pages/min)\n",
+        transferMs, totalMs, pages.size() * 60000.0 / totalMs);
+
+    return stats.failedPages ? 1 : 0;
+}
@@ -0,0 +1,214 @@
+// What the device pool saves a front end opening and closing a device for every job, with devices taking a while to open.
+// Several threads run jobs on a few devices at once; every device is checked to be handed to one job at a time,
+// and to be closed on the thread of the pool once idle for longer than the TTL, evicted, or over the capacity.
+// usage: poolBench [jobs] [threads] [openMs]
+//   jobs: jobs run by every thread, 200 by default
+//   threads: 4 by default
+//   openMs: time a device takes to open, 20 by default
+// Exits with 1 if a device is shared, leaked or kept against the options
+#include "stdafx.h"
+#include "warmPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    std::atomic<int> g_liveDevices(0);
+    std::atomic<int> g_closedOnCaller(0);
+
+    // stands in for CWIADevice, opening takes a while
+    class CFakeDevice
+    {
+    public:
+        CFakeDevice(int openMs, std::thread::id callerThread)
+            : m_users(0)
+            , m_callerThread(callerThread)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(openMs));
+            g_liveDevices++;
+        }
+
+        ~CFakeDevice()
+        {
+            g_liveDevices--;
+            if (std::this_thread::get_id() == m_callerThread)
+            {
+                g_closedOnCaller++;
+            }
+        }
+
+        // false if another job uses the device
+        bool BeginJob()
+        {
+            return m_users.fetch_add(1) == 0;
+        }
+
+        void EndJob()
+        {
+            m_users--;
+        }
+
+    private:
+        std::atomic<int> m_users;
+        std::thread::id m_callerThread;     // the devices of the pool are not closed there
+    };
+
+    typedef CWarmPool<CFakeDevice> CDevicePool;
+
+    std::wstring DeviceKey(int device)
+    {
+        return L"{6BDD1FC6-810F-11D0-BEC7-08002BE2092F}\\000" + std::to_wstring(device);
+    }
+
+    CDevicePool::Factory OpenDevice(int openMs, std::thread::id callerThread = std::thread::id())
+    {
+        return [openMs, callerThread]()
+        {
+            return std::make_shared<CFakeDevice>(openMs, callerThread);
+        };
+    }
+
+    bool Check(bool condition, const char* what)
+    {
+        if (!condition)
+        {
+            std::printf("FAILED: %s\n", what);
+        }
+        return condition;
+    }
+
+    // every thread runs its jobs on a random device of a few, ms per open
+    double RunJobs(CDevicePool& pool, int jobCount, int threadCount, int deviceCount, int openMs, bool& passed)
+    {
+        std::atomic<int> shared(0);
+        std::atomic<int64_t> openNs(0);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < threadCount; t++)
+        {
+            threads.emplace_back([&, t]()
+            {
+                std::mt19937 random(t + 1);
+                for (int i = 0; i < jobCount; i++)
+                {
+                    auto start = Clock::now();
+                    auto pDevice = pool.Acquire(DeviceKey(random() % deviceCount), OpenDevice(openMs));
+                    openNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+                    if (!pDevice->BeginJob())
+                    {
+                        shared++;
+                    }
+                    // a job running on the worker thread holds a copy of the handle
+                    auto pJobDevice = pDevice;
+                    pDevice.reset();
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                    pJobDevice->EndJob();
+                }
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        passed = Check(shared == 0, "a device has been handed to two jobs at once") && passed;
+        return double(openNs) / 1e6 / (double(jobCount) * threadCount);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int jobCount = std::max(argc > 1 ? std::atoi(argv[1]) : 200, 1);
+    int threadCount = std::max(argc > 2 ? std::atoi(argv[2]) : 4, 1);
+    int openMs = std::max(argc > 3 ? std::atoi(argv[3]) : 20, 0);
+    const int deviceCount = 2;
+    std::printf("%d jobs on each of %d threads, %d devices taking %d ms to open\n", jobCount, threadCount, deviceCount, openMs);
+
+    bool passed = true;
+    {
+        // disabled by default, a device is closed when released
+        CDevicePool pool;
+        double openTimeMs = RunJobs(pool, std::min(jobCount, 20), threadCount, deviceCount, openMs, passed);
+        WarmPoolStats stats = pool.GetStats();
+        std::printf("no pool        %7.2f ms per open, %llu opened\n", openTimeMs, (unsigned long long)stats.misses);
+        passed = Check(stats.hits == 0 && stats.idleCount == 0 && g_liveDevices == 0, "a device has been kept by the pool disabled") && passed;
+    }
+
+    {
+        CDevicePool pool;
+        WarmPoolOptions options;
+        options.idleTtl = std::chrono::milliseconds(200);
+        options.maxIdle = 4;
+        pool.SetOptions(options);
+
+        double openTimeMs = RunJobs(pool, jobCount, threadCount, deviceCount, openMs, passed);
+        WarmPoolStats stats = pool.GetStats();
+        double hitRate = double(stats.hits) / double(stats.hits + stats.misses);
+        std::printf("pool           %7.2f ms per open, %llu opened, %llu handed out again, hit rate %.3f\n", openTimeMs,
+            (unsigned long long)stats.misses, (unsigned long long)stats.hits, hitRate);
+        passed = Check(stats.hits + stats.misses == uint64_t(jobCount) * threadCount, "jobs missing in the stats") && passed;
+        passed = Check(stats.inUseCount == 0 && int(stats.idleCount) == g_liveDevices, "the devices counted are not the devices open") && passed;
+        passed = Check(stats.misses <= uint64_t(threadCount) * deviceCount + stats.overCapacity, "more devices opened than jobs ran at once") && passed;
+
+        // closed on the thread of the pool once idle for longer than the TTL
+        std::this_thread::sleep_for(options.idleTtl * 3);
+        stats = pool.GetStats();
+        std::printf("after the TTL  %llu closed, %d open\n", (unsigned long long)stats.expired, g_liveDevices.load());
+        passed = Check(stats.idleCount == 0 && g_liveDevices == 0 && stats.expired > 0, "idle devices kept after the TTL") && passed;
+
+        // a device disconnected while one of its handles is in use and one idle
+        auto caller = std::this_thread::get_id();
+        auto pIdle = pool.Acquire(DeviceKey(0), OpenDevice(0, caller));
+        auto pInUse = pool.Acquire(DeviceKey(0), OpenDevice(0, caller));
+        pIdle.reset();
+        pool.Evict(DeviceKey(0));
+        pInUse.reset();
+        bool reused = true;
+        auto pReopened = pool.Acquire(DeviceKey(0), OpenDevice(0, caller), &reused);
+        stats = pool.GetStats();
+        passed = Check(!reused && stats.evicted == 2, "a device evicted has been handed out again") && passed;
+        pReopened.reset();
+
+        // over the capacity, the devices idle the longest are closed first
+        options.maxIdle = 2;
+        pool.SetOptions(options);
+        auto overCapacity = pool.GetStats().overCapacity;
+        {
+            std::vector<std::shared_ptr<CFakeDevice>> devices;
+            for (int d = 0; d < 4; d++)
+            {
+                devices.push_back(pool.Acquire(DeviceKey(d), OpenDevice(0, caller)));
+            }
+        }
+        overCapacity = pool.GetStats().overCapacity - overCapacity;
+        reused = false;
+        auto pNewest = pool.Acquire(DeviceKey(3), OpenDevice(0, caller), &reused);
+        std::printf("over capacity  %llu closed\n", (unsigned long long)overCapacity);
+        passed = Check(overCapacity == 2 && pool.GetStats().idleCount == 1 && reused, "the devices idle the longest have been kept") && passed;
+
+        // the pool shut down while a device is in use, it is closed when released.
+        // The devices evicted and over the capacity have been closed by the thread of the pool meanwhile
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        pool.Shutdown();
+        passed = Check(g_liveDevices == 1, "idle devices kept after the shutdown") && passed;
+        pNewest.reset();
+        passed = Check(g_liveDevices == 0, "a device released after the shutdown has been kept") && passed;
+    }
+    std::printf("closed on the calling thread: %d (the shutdown and the release after it)\n", g_closedOnCaller.load());
+    passed = Check(g_closedOnCaller == 2, "devices closed on the calling thread instead of the thread of the pool") && passed;
+
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,454 @@
+// How soon the first row of a preview can be painted when the rows are decoded as the driver writes them,
+// against the page decoded once transferred, as a full scan is. The driver is simulated writing its buffers at the pace
+// of the scanner. The rows decoded as they come are checked against the pages decoded at once, for the formats
+// a driver hands over, in chunks of random sizes, with the header written again and a gap in the data.
+// usage: previewBench [pageMs] [chunkKB]
+//   pageMs: time the scanner takes for a page, whatever the resolution, 500 by default
+//   chunkKB: size of the buffers written by the driver, 64 by default
+// Exits with 1 if a row is missed, given twice or differs from the page decoded at once
+#include "stdafx.h"
+#include "rawScan.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    void PutUInt16(std::vector<uint8_t>& data, uint16_t value)
+    {
+        data.push_back(uint8_t(value));
+        data.push_back(uint8_t(value >> 8));
+    }
+    void PutUInt32(std::vector<uint8_t>& data, uint32_t value)
+    {
+        PutUInt16(data, uint16_t(value));
+        PutUInt16(data, uint16_t(value >> 16));
+    }
+
+    // Text-like lines on a gradient, every row different
+    RawImage CreateSyntheticPage(uint32_t width, uint32_t height, PixelFormat format, std::mt19937& random)
+    {
+        RawImage image = CreateRawImage(width, height, format, 0xf0);
+        size_t bytesPerPixel = GetBytesPerPixel(format);
+        uint32_t lineHeight = std::max(height / 80, 1u);
+
+        for (uint32_t y = 0; y < height; y++)
+        {
+            uint8_t* row = image.Row(y);
+            for (uint32_t x = 0; x < width; x++)
+            {
+                bool ink = (y / lineHeight) % 2 == 0 && (random() & 3) != 0;
+                for (size_t c = 0; c < bytesPerPixel; c++)
+                {
+                    row[x * bytesPerPixel + c] = ink ? uint8_t(20 + (random() & 15)) : uint8_t(x * (c + 1) + y);
+                }
+            }
+        }
+        return image;
+    }
+
+    // pixels of a row packed into bitsPerPixel, bilevel ones white if bright
+    void PackRow(const RawImage& image, const RawImage& gray, uint32_t y, uint32_t bitsPerPixel, bool rgbOrder, uint8_t* dst)
+    {
+        for (uint32_t x = 0; x < image.width; x++)
+        {
+            switch (bitsPerPixel)
+            {
+            case 1:
+                if (gray.Row(y)[x] >= 128)
+                {
+                    dst[x >> 3] |= uint8_t(0x80 >> (x & 7));
+                }
+                break;
+            case 4:
+                dst[x >> 1] |= uint8_t((gray.Row(y)[x] >> 4) << ((x & 1) ? 0 : 4));
+                break;
+            case 8:
+                dst[x] = gray.Row(y)[x];
+                break;
+            case 24:
+                for (int c = 0; c < 3; c++)
+                {
+                    dst[x * 3 + c] = image.Row(y)[x * 3 + (rgbOrder ? 2 - c : c)];
+                }
+                break;
+            case 32:
+                for (int c = 0; c < 3; c++)
+                {
+                    dst[x * 4 + c] = image.Row(y)[x * 3 + c];
+                }
+                dst[x * 4 + 3] = 0xff;
+                break;
+            }
+        }
+    }
+
+    // WiaImgFmt_RAW: WIA_RAW_HEADER and the rows. knownHeight false writes the height as 0, as for a feeder page
+    std::vector<uint8_t> CreateWiaRaw(const RawImage& image, uint32_t bitsPerPixel, bool bottomUp, bool knownHeight, double dpi)
+    {
+        size_t stride = (size_t(image.width) * bitsPerPixel + 7) / 8;
+
+        std::vector<uint8_t> data{ 'W', 'R', 'A', 'W' };
+        PutUInt32(data, 0x00010000);                    // version
+        PutUInt32(data, 76);                            // header size
+        PutUInt32(data, uint32_t(dpi));
+        PutUInt32(data, uint32_t(dpi));
+        PutUInt32(data, image.width);
+        PutUInt32(data, knownHeight ? image.height : 0);
+        PutUInt32(data, uint32_t(stride));
+        PutUInt32(data, bitsPerPixel);
+        PutUInt32(data, bitsPerPixel == 24 ? 3 : 1);    // channels
+        PutUInt32(data, bitsPerPixel == 24 ? 3 : (bitsPerPixel == 1 ? 0 : 2));     // WIA_DATA_COLOR/THRESHOLD/GRAYSCALE
+        for (int i = 0; i < 8; i++)
+        {
+            data.push_back(uint8_t(i < 3 && bitsPerPixel == 24 ? 8 : (i == 0 ? bitsPerPixel : 0)));
+        }
+        PutUInt32(data, 0);                             // compression
+        PutUInt32(data, 0);                             // WIA_PHOTO_WHITE_1
+        PutUInt32(data, bottomUp ? 2 : 1);              // line order
+        PutUInt32(data, 76);                            // data offset
+        PutUInt32(data, uint32_t(stride * image.height));
+        PutUInt32(data, 0);                             // palette
+
+        RawImage gray = ToGray8(image);
+        for (uint32_t r = 0; r < image.height; r++)
+        {
+            size_t rowStart = data.size();
+            data.resize(rowStart + stride, 0);
+            PackRow(image, gray, bottomUp ? image.height - 1 - r : r, bitsPerPixel, true, data.data() + rowStart);
+        }
+        return data;
+    }
+
+    // WiaImgFmt_MEMORYBMP, or a BMP file: the color table, bottom-up rows
+    std::vector<uint8_t> CreateBitmap(const RawImage& image, uint16_t bitsPerPixel, bool fileHeader, double dpi)
+    {
+        uint32_t paletteCount = bitsPerPixel <= 8 ? (1u << bitsPerPixel) : 0;
+        size_t stride = ((size_t(image.width) * bitsPerPixel + 31) / 32) * 4;
+
+        std::vector<uint8_t> data;
+        if (fileHeader)
+        {
+            uint32_t pixelOffset = 14 + 40 + paletteCount * 4;
+            data.push_back('B');
+            data.push_back('M');
+            PutUInt32(data, uint32_t(pixelOffset + stride * image.height));
+            PutUInt32(data, 0);
+            PutUInt32(data, pixelOffset);
+        }
+        PutUInt32(data, 40);
+        PutUInt32(data, image.width);
+        PutUInt32(data, image.height);
+        PutUInt16(data, 1);
+        PutUInt16(data, bitsPerPixel);
+        PutUInt32(data, 0);
+        PutUInt32(data, uint32_t(stride * image.height));
+        PutUInt32(data, uint32_t(dpi / 0.0254 + 0.5));
+        PutUInt32(data, uint32_t(dpi / 0.0254 + 0.5));
+        PutUInt32(data, paletteCount);
+        PutUInt32(data, 0);
+        for (uint32_t i = 0; i < paletteCount; i++)
+        {
+            uint8_t level = uint8_t(i * 255 / (paletteCount - 1));
+            PutUInt32(data, level | (level << 8) | (level << 16));
+        }
+
+        RawImage gray = ToGray8(image);
+        for (uint32_t y = image.height; y-- > 0;)
+        {
+            size_t rowStart = data.size();
+            data.resize(rowStart + stride, 0);
+            PackRow(image, gray, y, bitsPerPixel, false, data.data() + rowStart);
+        }
+        return data;
+    }
+
+    bool Check(bool condition, const char* name, const char* what)
+    {
+        if (!condition)
+        {
+            std::printf("FAILED: %s: %s\n", name, what);
+        }
+        return condition;
+    }
+
+    // the rows given by the decoder, checked against the page decoded at once
+    class CRowChecker
+    {
+    public:
+        CRowChecker(const char* name, const RawImage& expected)
+            : m_name(name)
+            , m_expected(expected)
+            , m_given(expected.height, 0)
+            , m_passed(true)
+        {
+        }
+
+        RawScanRowCallback Callback()
+        {
+            return [this](uint32_t y, const uint8_t* row, uint32_t width)
+            {
+                bool valid = y < m_expected.height && width == m_expected.width && m_given[y]++ == 0;
+                m_passed = Check(valid, m_name, "a row out of the page or given twice") && m_passed;
+                if (valid)
+                {
+                    m_passed = Check(std::equal(row, row + width, m_expected.Row(y)), m_name, "a row differs") && m_passed;
+                }
+            };
+        }
+
+        uint32_t GetGivenCount() const
+        {
+            return uint32_t(std::count(m_given.begin(), m_given.end(), 1));
+        }
+
+        bool Finish(const CRawScanRowDecoder& decoder)
+        {
+            const RawImage& image = decoder.GetImage();
+            m_passed = Check(GetGivenCount() == m_expected.height, m_name, "rows missing") && m_passed;
+            m_passed = Check(image.width == m_expected.width && image.height == m_expected.height &&
+                image.pixels == m_expected.pixels, m_name, "the image differs from the page decoded at once") && m_passed;
+            return m_passed;
+        }
+
+    private:
+        const char* m_name;
+        const RawImage& m_expected;
+        std::vector<int> m_given;
+        bool m_passed;
+    };
+
+    // written in chunks of random sizes, the rows given once complete
+    bool CheckFormat(const char* name, const std::vector<uint8_t>& data, std::mt19937& random)
+    {
+        RawImage decoded;
+        if (!Check(DecodeRawScan(data.data(), data.size(), decoded), name, "not decoded at once"))
+        {
+            return false;
+        }
+        RawImage expected = ToGray8(decoded);
+
+        CRowChecker checker(name, expected);
+        CRawScanRowDecoder decoder(checker.Callback());
+        bool passed = true;
+        size_t offset = 0;
+        while (offset < data.size())
+        {
+            size_t size = std::min(size_t(1 + random() % 5000), data.size() - offset);
+            decoder.Write(offset, data.data() + offset, size);
+            offset += size;
+
+            // every row complete has been given
+            if (decoder.IsHeaderKnown())
+            {
+                RawScanLayout layout;
+                ParseRawScanHeader(data.data(), data.size(), layout);
+                size_t complete = offset > layout.pixelOffset ? (offset - layout.pixelOffset) / layout.stride : 0;
+                complete = std::min(complete, size_t(expected.height));
+                passed = Check(checker.GetGivenCount() == complete, name, "a row complete has not been given") && passed;
+            }
+        }
+        decoder.Finish();
+        return checker.Finish(decoder) && passed;
+    }
+
+    // The height written as 0 first, the header written again with it at the end
+    bool CheckHeaderRewrite(const RawImage& page, std::mt19937& random)
+    {
+        const char* name = "raw header written again";
+        std::vector<uint8_t> unknownHeight = CreateWiaRaw(page, 8, false, false, 75);
+        std::vector<uint8_t> data = CreateWiaRaw(page, 8, false, true, 75);
+        RawImage expected = ToGray8(page);
+
+        CRowChecker checker(name, expected);
+        CRawScanRowDecoder decoder(checker.Callback());
+        size_t offset = 0;
+        while (offset < unknownHeight.size())
+        {
+            size_t size = std::min(size_t(1 + random() % 5000), unknownHeight.size() - offset);
+            decoder.Write(offset, unknownHeight.data() + offset, size);
+            offset += size;
+        }
+        decoder.Write(0, data.data(), 76);
+        decoder.Finish();
+        return checker.Finish(decoder);
+    }
+
+    // A chunk written late, the rows after it wait for it. Finish() gives them if it never comes
+    bool CheckGap(const RawImage& page, bool filled)
+    {
+        const char* name = filled ? "gap filled" : "gap left";
+        std::vector<uint8_t> data = CreateWiaRaw(page, 8, false, true, 75);
+        const size_t chunkSize = 4096;
+        const size_t gapOffset = chunkSize * 2;
+
+        RawImage expected = ToGray8(page);
+        if (!filled)
+        {
+            // zeros where the data is missing
+            for (size_t i = gapOffset; i < gapOffset + chunkSize; i++)
+            {
+                size_t pixel = i - 76;
+                expected.pixels[pixel] = 0;
+            }
+        }
+
+        CRowChecker checker(name, expected);
+        CRawScanRowDecoder decoder(checker.Callback());
+        for (size_t offset = 0; offset < data.size(); offset += chunkSize)
+        {
+            if (offset != gapOffset)
+            {
+                decoder.Write(offset, data.data() + offset, std::min(chunkSize, data.size() - offset));
+            }
+        }
+        uint32_t beforeGap = uint32_t((gapOffset - 76) / page.width);
+        bool passed = Check(checker.GetGivenCount() == beforeGap, name, "rows after the gap given before it was filled");
+        if (filled)
+        {
+            decoder.Write(gapOffset, data.data() + gapOffset, chunkSize);
+        }
+        decoder.Finish();
+        return checker.Finish(decoder) && passed;
+    }
+
+    struct Timing
+    {
+        double firstRowMs = 0;
+        double totalMs = 0;
+    };
+
+    // the driver writing its buffers at the pace of the scanner on its own thread, as the transfer does
+    template <typename OnChunk>
+    void Transfer(const std::vector<uint8_t>& data, size_t chunkSize, int pageMs, OnChunk onChunk)
+    {
+        std::thread transfer([&]()
+        {
+            auto start = Clock::now();
+            for (size_t offset = 0; offset < data.size(); offset += chunkSize)
+            {
+                size_t size = std::min(chunkSize, data.size() - offset);
+                std::this_thread::sleep_until(start + std::chrono::microseconds(int64_t(pageMs) * 1000 * (offset + size) / data.size()));
+                onChunk(offset, data.data() + offset, size);
+            }
+        });
+        transfer.join();
+    }
+
+    // the page decoded once transferred, as a full scan is
+    Timing DecodeAfterTransfer(const std::vector<uint8_t>& data, size_t chunkSize, int pageMs)
+    {
+        Timing timing;
+        auto start = Clock::now();
+        std::vector<uint8_t> buffer;
+        Transfer(data, chunkSize, pageMs, [&buffer](size_t offset, const uint8_t* chunk, size_t size)
+        {
+            buffer.resize(offset + size);
+            std::copy(chunk, chunk + size, buffer.data() + offset);
+        });
+        RawImage image;
+        DecodeRawScan(buffer.data(), buffer.size(), image);
+        timing.firstRowMs = timing.totalMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        return timing;
+    }
+
+    Timing DecodeProgressively(const std::vector<uint8_t>& data, size_t chunkSize, int pageMs)
+    {
+        Timing timing;
+        auto start = Clock::now();
+        bool firstRow = true;
+        CRawScanRowDecoder decoder([&](uint32_t, const uint8_t*, uint32_t)
+        {
+            if (firstRow)
+            {
+                firstRow = false;
+                timing.firstRowMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            }
+        });
+        Transfer(data, chunkSize, pageMs, [&decoder](size_t offset, const uint8_t* chunk, size_t size)
+        {
+            decoder.Write(offset, chunk, size);
+        });
+        decoder.Finish();
+        timing.totalMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        return timing;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int pageMs = std::max(argc > 1 ? std::atoi(argv[1]) : 500, 1);
+    size_t chunkSize = size_t(std::max(argc > 2 ? std::atoi(argv[2]) : 64, 1)) * 1024;
+    std::printf("A4 pages scanned in %d ms, written in %zu KB buffers\n", pageMs, chunkSize / 1024);
+
+    bool passed = true;
+    std::mt19937 random(1);
+
+    {
+        RawImage color = CreateSyntheticPage(301, 157, PixelFormat::BGR24, random);
+        passed = CheckFormat("raw 1 bit", CreateWiaRaw(color, 1, false, true, 75), random) && passed;
+        passed = CheckFormat("raw 8 bit bottom-up", CreateWiaRaw(color, 8, true, true, 75), random) && passed;
+        passed = CheckFormat("raw 8 bit unknown height", CreateWiaRaw(color, 8, false, false, 75), random) && passed;
+        passed = CheckFormat("raw 24 bit", CreateWiaRaw(color, 24, false, true, 75), random) && passed;
+        passed = CheckFormat("bmp 1 bit", CreateBitmap(color, 1, false, 75), random) && passed;
+        passed = CheckFormat("bmp 4 bit", CreateBitmap(color, 4, false, 75), random) && passed;
+        passed = CheckFormat("bmp 8 bit", CreateBitmap(color, 8, false, 75), random) && passed;
+        passed = CheckFormat("bmp 24 bit", CreateBitmap(color, 24, false, 75), random) && passed;
+        passed = CheckFormat("bmp 32 bit", CreateBitmap(color, 32, false, 75), random) && passed;
+        passed = CheckFormat("bmp file", CreateBitmap(color, 24, true, 75), random) && passed;
+
+        RawImage gray = CreateSyntheticPage(301, 157, PixelFormat::Gray8, random);
+        passed = CheckHeaderRewrite(gray, random) && passed;
+        passed = CheckGap(gray, true) && passed;
+        passed = CheckGap(gray, false) && passed;
+        std::printf("rows decoded as they come checked against the pages decoded at once: %s\n", passed ? "ok" : "FAILED");
+    }
+
+    // A4 at 300 DPI in color as scanned today, against the preview at 75 DPI in greyscale
+    RawImage fullPage = CreateSyntheticPage(2480, 3508, PixelFormat::BGR24, random);
+    RawImage previewPage = CreateSyntheticPage(620, 877, PixelFormat::Gray8, random);
+    std::vector<uint8_t> fullScan = CreateWiaRaw(fullPage, 24, false, true, 300);
+    std::vector<uint8_t> previewRaw = CreateWiaRaw(previewPage, 8, false, true, 75);
+    std::vector<uint8_t> previewBitmap = CreateBitmap(previewPage, 8, false, 75);
+
+    struct BenchCase
+    {
+        const char* name;
+        const std::vector<uint8_t>& data;
+        bool progressive;
+    };
+    const BenchCase benchCases[] = {
+        { "300 dpi color, decoded after the transfer", fullScan, false },
+        { "75 dpi grey raw, decoded after the transfer", previewRaw, false },
+        { "75 dpi grey raw, rows as they come", previewRaw, true },
+        { "75 dpi grey bmp, rows as they come", previewBitmap, true },
+    };
+
+    std::printf("%-46s %12s %10s\n", "", "first row ms", "total ms");
+    double firstRowMs[4] = { 0 };
+    for (size_t i = 0; i < sizeof(benchCases) / sizeof(benchCases[0]); i++)
+    {
+        const BenchCase& benchCase = benchCases[i];
+        Timing timing = benchCase.progressive ?
+            DecodeProgressively(benchCase.data, chunkSize, pageMs) :
+            DecodeAfterTransfer(benchCase.data, chunkSize, pageMs);
+        firstRowMs[i] = timing.firstRowMs;
+        std::printf("%-46s %12.1f %10.1f\n", benchCase.name, timing.firstRowMs, timing.totalMs);
+    }
+    std::printf("first row %.1fx sooner than the full scan\n", firstRowMs[0] / std::max(firstRowMs[2], 0.001));
+    passed = Check(firstRowMs[2] < firstRowMs[1], "preview", "the first row has not come sooner than the page decoded at once") && passed;
+
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+    }
+    return passed ? 0 : 1;
+}
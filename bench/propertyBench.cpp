@@ -0,0 +1,369 @@
+// The batched property writes of the scan settings, without scanners or Windows.
+// The specs and the values of a batch are packed into stand-ins of PROPSPEC and PROPVARIANT and written to a simulated
+// property storage, which rejects a batch as a whole when one of its properties is out of range, as the drivers do.
+// The settings reported as written are checked against the properties the storage accepts one by one, for random
+// settings and rejections. Then the calls and the time of a settings write are compared with one write per property,
+// with a simulated round trip to the driver.
+// usage: propertyBench [writes] [roundTripUs]
+//   writes: random settings writes checked, 20000 by default
+//   roundTripUs: simulated time of a call to the driver, 1000 us by default
+// Exits with 1 if a spec or value is packed wrong, or if a setting is reported written while one of its properties
+// has been rejected, or the other way round
+#include "stdafx.h"
+#include "propertyBatch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // the values of objidl.h and wtypes.h
+    const unsigned long PropIdKind = 1;     // PRSPEC_PROPID
+    const unsigned short LongType = 3;      // VT_I4
+
+    // PROPSPEC and PROPVARIANT, the members used
+    struct PropSpec
+    {
+        unsigned long ulKind;
+        union
+        {
+            unsigned long propid;
+            wchar_t* lpwstr;
+        };
+    };
+
+    struct PropVariant
+    {
+        unsigned short vt;
+        unsigned short reserved[3];
+        union
+        {
+            int32_t lVal;
+            double dblVal;
+        };
+    };
+
+    bool Check(bool condition, const char* what)
+    {
+        if (!condition)
+        {
+            std::printf("FAILED: %s\n", what);
+        }
+        return condition;
+    }
+
+    // The properties of an item, each with its accepted range.
+    // A batch with one property out of range or of an unexpected kind is rejected as a whole
+    class CPropertyStorage
+    {
+    public:
+        explicit CPropertyStorage(std::chrono::microseconds roundTrip = std::chrono::microseconds(0))
+            : m_roundTrip(roundTrip)
+            , m_callCount(0)
+        {
+        }
+
+        void AddProperty(unsigned long id, int32_t minValue, int32_t maxValue)
+        {
+            m_ranges[id] = std::make_pair(minValue, maxValue);
+        }
+
+        bool Accepts(unsigned long id, int32_t value) const
+        {
+            auto it = m_ranges.find(id);
+            return it != m_ranges.end() && value >= it->second.first && value <= it->second.second;
+        }
+
+        bool WriteMultiple(size_t count, const PropSpec* specs, const PropVariant* values)
+        {
+            m_callCount++;
+            if (m_roundTrip.count())
+            {
+                std::this_thread::sleep_for(m_roundTrip);
+            }
+            for (size_t i = 0; i < count; i++)
+            {
+                if (specs[i].ulKind != PropIdKind || values[i].vt != LongType || !Accepts(specs[i].propid, values[i].lVal))
+                {
+                    return false;
+                }
+            }
+            for (size_t i = 0; i < count; i++)
+            {
+                m_values[specs[i].propid] = values[i].lVal;
+            }
+            return true;
+        }
+
+        // what a single property write does in the module
+        bool WriteOne(unsigned long id, int32_t value)
+        {
+            std::vector<unsigned long> ids(1, id);
+            std::vector<int32_t> values(1, value);
+            auto specs = PackPropertySpecs<PropSpec>(ids, PropIdKind);
+            PropVariant variant = PropVariant();
+            PackLongValues(values, &variant, LongType);
+            return WriteMultiple(1, specs.get(), &variant);
+        }
+
+        const std::map<unsigned long, int32_t>& Values() const
+        {
+            return m_values;
+        }
+
+        size_t GetCallCount() const
+        {
+            return m_callCount;
+        }
+
+    private:
+        std::chrono::microseconds m_roundTrip;
+        std::map<unsigned long, std::pair<int32_t, int32_t>> m_ranges;
+        std::map<unsigned long, int32_t> m_values;
+        size_t m_callCount;
+    };
+
+    // The settings of a scan as SetScanSettings() collects them, the DPI owns two properties
+    struct SettingsWrite
+    {
+        std::vector<unsigned long> ids;
+        std::vector<int32_t> values;
+        std::vector<unsigned int> owners;
+
+        void Add(unsigned long id, int32_t value, unsigned int owner)
+        {
+            ids.push_back(id);
+            values.push_back(value);
+            owners.push_back(owner);
+        }
+    };
+
+    struct WriteResult
+    {
+        unsigned int written = 0;
+        size_t batchCalls = 0;
+        size_t oneCalls = 0;
+    };
+
+    WriteResult Write(CPropertyStorage& storage, const SettingsWrite& settings)
+    {
+        WriteResult result;
+        std::unique_ptr<PropVariant[]> variants(new PropVariant[settings.values.size()]());
+        PackLongValues(settings.values, variants.get(), LongType);
+        result.written = WritePropertyBatch(settings.owners, [&]()
+        {
+            result.batchCalls++;
+            auto specs = PackPropertySpecs<PropSpec>(settings.ids, PropIdKind);
+            return storage.WriteMultiple(settings.ids.size(), specs.get(), variants.get());
+        }, [&](size_t i)
+        {
+            result.oneCalls++;
+            return storage.WriteOne(settings.ids[i], settings.values[i]);
+        });
+        return result;
+    }
+
+    const unsigned long DataTypeId = 4103;
+    const unsigned long PageSizeId = 3097;
+    const unsigned long XResId = 6147;
+    const unsigned long YResId = 6148;
+    const unsigned long BrightnessId = 6154;
+    const unsigned long ContrastId = 6155;
+
+    void AddScannerProperties(CPropertyStorage& storage)
+    {
+        storage.AddProperty(DataTypeId, 0, 3);
+        storage.AddProperty(PageSizeId, 0, 10);
+        storage.AddProperty(XResId, 75, 600);
+        storage.AddProperty(YResId, 75, 1200);
+        storage.AddProperty(BrightnessId, -1000, 1000);
+        storage.AddProperty(ContrastId, -1000, 1000);
+    }
+
+    // Random settings, a property out of range now and then
+    SettingsWrite RandomSettings(std::mt19937& random)
+    {
+        SettingsWrite settings;
+        auto pick = [&random](int32_t inRange, int32_t outOfRange)
+        {
+            return random() % 5 ? inRange : outOfRange;
+        };
+        if (random() % 2)
+        {
+            settings.Add(DataTypeId, pick(int32_t(random() % 4), 7), 1);
+        }
+        if (random() % 2)
+        {
+            settings.Add(PageSizeId, pick(int32_t(random() % 11), 42), 2);
+        }
+        if (random() % 2)
+        {
+            // 1200 is accepted vertically only
+            int32_t dpi = pick(int32_t(75 + random() % 526), random() % 2 ? 1200 : 50);
+            settings.Add(XResId, dpi, 4);
+            settings.Add(YResId, dpi, 4);
+        }
+        if (random() % 2)
+        {
+            settings.Add(BrightnessId, pick(int32_t(random() % 2001) - 1000, 5000), 8);
+        }
+        if (random() % 2)
+        {
+            settings.Add(ContrastId, pick(int32_t(random() % 2001) - 1000, -5000), 16);
+        }
+        // a property the item doesn't have
+        if (random() % 20 == 0)
+        {
+            settings.Add(9999, 1, 32);
+        }
+        return settings;
+    }
+
+    bool CheckPacking(std::mt19937& random)
+    {
+        bool passed = true;
+        for (size_t count : { size_t(0), size_t(1), size_t(2), size_t(7), size_t(64) })
+        {
+            std::vector<unsigned long> ids(count);
+            std::vector<int32_t> values(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                ids[i] = random();
+                values[i] = int32_t(random());
+            }
+
+            auto specs = PackPropertySpecs<PropSpec>(ids, PropIdKind);
+            std::unique_ptr<PropVariant[]> variants(new PropVariant[count + 1]());
+            variants[count].vt = 0xffff;
+            PackLongValues(values, variants.get(), LongType);
+            for (size_t i = 0; i < count; i++)
+            {
+                passed = Check(specs[i].ulKind == PropIdKind && specs[i].propid == ids[i], "a spec is packed wrong") && passed;
+                passed = Check(variants[i].vt == LongType && variants[i].lVal == values[i], "a value is packed wrong") && passed;
+            }
+            passed = Check(variants[count].vt == 0xffff, "a value is packed past the end") && passed;
+        }
+        return passed;
+    }
+
+    bool CheckMapping(int writeCount, std::mt19937& random)
+    {
+        bool passed = true;
+
+        // nothing to write, nothing called
+        CPropertyStorage empty;
+        WriteResult none = Write(empty, SettingsWrite());
+        passed = Check(none.written == 0 && none.batchCalls == 0 && none.oneCalls == 0, "an empty write called the storage") && passed;
+
+        for (int i = 0; i < writeCount && passed; i++)
+        {
+            CPropertyStorage storage;
+            AddScannerProperties(storage);
+            SettingsWrite settings = RandomSettings(random);
+
+            // a setting is written if the storage accepts all its properties
+            unsigned int expected = 0;
+            unsigned int rejected = 0;
+            bool batchAccepted = true;
+            for (size_t p = 0; p < settings.ids.size(); p++)
+            {
+                expected |= settings.owners[p];
+                if (!storage.Accepts(settings.ids[p], settings.values[p]))
+                {
+                    rejected |= settings.owners[p];
+                    batchAccepted = false;
+                }
+            }
+            expected &= ~rejected;
+
+            WriteResult result = Write(storage, settings);
+            passed = Check(result.written == expected, "the settings written don't match the properties accepted") && passed;
+            passed = Check(result.batchCalls == (settings.ids.empty() ? 0u : 1u), "the batch has not been written once") && passed;
+            passed = Check(result.oneCalls == (batchAccepted ? 0 : settings.ids.size()),
+                "the properties have not been written one by one exactly when the batch is rejected") && passed;
+
+            // the storage holds the properties accepted and nothing else
+            size_t acceptedCount = 0;
+            for (size_t p = 0; p < settings.ids.size(); p++)
+            {
+                auto it = storage.Values().find(settings.ids[p]);
+                if (storage.Accepts(settings.ids[p], settings.values[p]))
+                {
+                    acceptedCount++;
+                    passed = Check(it != storage.Values().end() && it->second == settings.values[p],
+                        "a property accepted has not been written") && passed;
+                }
+                else
+                {
+                    passed = Check(it == storage.Values().end(), "a property rejected has been written") && passed;
+                }
+            }
+            passed = Check(storage.Values().size() == acceptedCount, "properties not asked for have been written") && passed;
+        }
+        return passed;
+    }
+
+    void MeasureWrite(const char* name, const SettingsWrite& settings, std::chrono::microseconds roundTrip)
+    {
+        CPropertyStorage storage(roundTrip);
+        AddScannerProperties(storage);
+        auto start = Clock::now();
+        Write(storage, settings);
+        double batchMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        size_t batchCalls = storage.GetCallCount();
+
+        CPropertyStorage oneByOne(roundTrip);
+        AddScannerProperties(oneByOne);
+        start = Clock::now();
+        for (size_t i = 0; i < settings.ids.size(); i++)
+        {
+            oneByOne.WriteOne(settings.ids[i], settings.values[i]);
+        }
+        double oneMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        std::printf("%-24s %8zu %10.2f %8zu %10.2f\n", name, batchCalls, batchMs, oneByOne.GetCallCount(), oneMs);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int writeCount = std::max(argc > 1 ? std::atoi(argv[1]) : 20000, 1);
+    std::chrono::microseconds roundTrip(std::max(argc > 2 ? std::atoi(argv[2]) : 1000, 0));
+
+    bool passed = true;
+    std::mt19937 random(4);
+    passed = CheckPacking(random) && passed;
+    passed = CheckMapping(writeCount, random) && passed;
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+        return 1;
+    }
+    std::printf("%d settings writes report the settings whose properties are all accepted\n", writeCount);
+
+    SettingsWrite accepted;
+    accepted.Add(DataTypeId, 2, 1);
+    accepted.Add(PageSizeId, 0, 2);
+    accepted.Add(XResId, 300, 4);
+    accepted.Add(YResId, 300, 4);
+    accepted.Add(BrightnessId, 100, 8);
+    accepted.Add(ContrastId, -100, 16);
+    SettingsWrite rejected = accepted;
+    rejected.values[2] = rejected.values[3] = 1200;
+
+    std::printf("%lld us per call to the driver\n", (long long)roundTrip.count());
+    std::printf("%-24s %8s %10s %8s %10s\n", "settings", "calls", "ms", "1 by 1", "ms");
+    MeasureWrite("all accepted", accepted, roundTrip);
+    MeasureWrite("dpi rejected", rejected, roundTrip);
+    return 0;
+}
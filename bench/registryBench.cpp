@@ -0,0 +1,288 @@
+// What listing the devices costs when polled, reading the properties of every device every time, against the registry
+// kept up to date by the connect and disconnect events. Several threads plug devices in and out of a fake bus and
+// fire the events on their own thread, as the COM runtime does; the changes reported and the devices listed at the end
+// are checked against the bus.
+// usage: registryBench [events] [threads] [readMs]
+//   events: devices plugged in or out by every thread, 200 by default
+//   threads: 4 by default
+//   readMs: time the properties of a device take to be read, 2 by default
+// Exits with 1 if a change is missed, reported twice, or the devices listed are not the ones plugged in
+#include "stdafx.h"
+#include "deviceRegistry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    struct FakeDevice
+    {
+        std::wstring deviceUUID;
+        int plugCount;      // the devices plugged in again are read again
+    };
+
+    typedef CDeviceRegistry<FakeDevice> CRegistry;
+
+    std::wstring DeviceKey(int device)
+    {
+        return L"{6BDD1FC6-810F-11D0-BEC7-08002BE2092F}\\000" + std::to_wstring(device);
+    }
+
+    // stands in for EnumDeviceInfo and the property storage of the devices
+    class CFakeBus
+    {
+    public:
+        CFakeBus(int deviceCount, int readMs)
+            : m_plugCounts(deviceCount, 0)
+            , m_readMs(readMs)
+            , m_reads(0)
+        {
+        }
+
+        // the device plugged in or out, false if it already was
+        bool SetPlugged(int device, bool bPlugged)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            if ((m_plugCounts[device] > 0) == bPlugged)
+            {
+                return false;
+            }
+            m_plugCounts[device] = bPlugged ? std::abs(m_plugCounts[device]) + 1 : -m_plugCounts[device];
+            return true;
+        }
+
+        std::vector<std::wstring> GetPlugged() const
+        {
+            std::vector<std::wstring> deviceIds;
+            std::lock_guard<std::mutex> g(m_lock);
+            for (size_t d = 0; d < m_plugCounts.size(); d++)
+            {
+                if (m_plugCounts[d] > 0)
+                {
+                    deviceIds.push_back(DeviceKey(int(d)));
+                }
+            }
+            return deviceIds;
+        }
+
+        CRegistry::Enumerator Enumerator()
+        {
+            return [this](std::vector<std::wstring>& deviceIds)
+            {
+                deviceIds = GetPlugged();
+                return true;
+            };
+        }
+
+        // nullptr if unplugged meanwhile
+        CRegistry::Reader Reader()
+        {
+            return [this](const std::wstring& deviceId) -> std::shared_ptr<FakeDevice>
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(m_readMs));
+                m_reads++;
+                std::lock_guard<std::mutex> g(m_lock);
+                for (size_t d = 0; d < m_plugCounts.size(); d++)
+                {
+                    if (DeviceKey(int(d)) == deviceId && m_plugCounts[d] > 0)
+                    {
+                        return std::make_shared<FakeDevice>(FakeDevice{ deviceId, m_plugCounts[d] });
+                    }
+                }
+                return nullptr;
+            };
+        }
+
+        // the devices as listAllDevices() read them before, every property of every device
+        std::vector<std::shared_ptr<FakeDevice>> Poll()
+        {
+            std::vector<std::shared_ptr<FakeDevice>> devices;
+            auto read = Reader();
+            for (const auto& deviceId : GetPlugged())
+            {
+                auto device = read(deviceId);
+                if (device)
+                {
+                    devices.push_back(device);
+                }
+            }
+            return devices;
+        }
+
+        int GetReads() const
+        {
+            return m_reads;
+        }
+
+    private:
+        mutable std::mutex m_lock;
+        std::vector<int> m_plugCounts;      // > 0 plugged in, the times it has been
+        int m_readMs;
+        std::atomic<int> m_reads;
+    };
+
+    bool Check(bool condition, const char* what)
+    {
+        if (!condition)
+        {
+            std::printf("FAILED: %s\n", what);
+        }
+        return condition;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int eventCount = std::max(argc > 1 ? std::atoi(argv[1]) : 200, 1);
+    int threadCount = std::max(argc > 2 ? std::atoi(argv[2]) : 4, 1);
+    int readMs = std::max(argc > 3 ? std::atoi(argv[3]) : 2, 0);
+    const int deviceCount = 8;
+    std::printf("%d events on each of %d threads, %d devices taking %d ms to read\n", eventCount, threadCount, deviceCount, readMs);
+
+    bool passed = true;
+    CFakeBus bus(deviceCount, readMs);
+    for (int d = 0; d < deviceCount / 2; d++)
+    {
+        bus.SetPlugged(d, true);
+    }
+
+    CRegistry registry;
+    std::mutex lockChanges;
+    std::map<std::wstring, std::vector<DeviceChange<FakeDevice>>> changes;
+    registry.SetListener([&](const DeviceChange<FakeDevice>& change)
+    {
+        std::lock_guard<std::mutex> g(lockChanges);
+        changes[change.deviceId].push_back(change);
+    });
+
+    // listed once, not reported as added
+    passed = Check(registry.Rescan(bus.Enumerator(), bus.Reader()) && registry.IsPopulated(), "the devices have not been listed") && passed;
+    auto initialDevices = registry.GetDevices();
+    passed = Check(initialDevices.size() == size_t(deviceCount / 2) && changes.empty(), "the devices listed first have been reported as added") && passed;
+
+    {
+        // a front end polling for the devices
+        const int pollCount = 10;
+        auto start = Clock::now();
+        size_t found = 0;
+        for (int i = 0; i < pollCount; i++)
+        {
+            found += bus.Poll().size();
+        }
+        double pollMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / pollCount;
+
+        const int readCount = 100000;
+        start = Clock::now();
+        for (int i = 0; i < readCount; i++)
+        {
+            found += registry.GetDevices().size();
+        }
+        double readUs = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / readCount;
+        std::printf("polled       %9.3f ms per list\n", pollMs);
+        std::printf("registry     %9.3f us per list\n", readUs);
+        passed = Check(found == size_t(pollCount + readCount) * (deviceCount / 2), "the devices polled are not the ones listed") && passed;
+    }
+
+    // devices plugged in and out at random, every thread firing the event of its change
+    int readsBefore = bus.GetReads();
+    std::atomic<int> plugged(0);
+    std::atomic<int> unplugged(0);
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++)
+    {
+        threads.emplace_back([&, t]()
+        {
+            std::mt19937 random(t + 1);
+            for (int i = 0; i < eventCount; i++)
+            {
+                int device = int(random() % deviceCount);
+                bool bPlugged = random() % 2 == 0;
+                if (bus.SetPlugged(device, bPlugged))
+                {
+                    (bPlugged ? plugged : unplugged)++;
+                    registry.Rescan(bus.Enumerator(), bus.Reader());
+                }
+            }
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    double eventsMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    // every device reported added and removed in turn, its state in the end the one of the bus
+    size_t added = 0;
+    size_t removed = 0;
+    bool alternating = true;
+    auto finalDevices = registry.GetDevices();
+    for (int d = 0; d < deviceCount; d++)
+    {
+        std::wstring deviceId = DeviceKey(d);
+        bool bListed = std::any_of(initialDevices.begin(), initialDevices.end(), [&deviceId](const std::shared_ptr<FakeDevice>& device)
+        {
+            return device->deviceUUID == deviceId;
+        });
+        int lastPlugCount = bListed ? 1 : 0;
+        for (const auto& change : changes[deviceId])
+        {
+            bool bAdded = change.type == DeviceChangeType::Added;
+            alternating = alternating && bAdded != bListed && change.device->deviceUUID == deviceId;
+            if (bAdded)
+            {
+                // plugged in again, not the properties of an earlier time
+                alternating = alternating && change.device->plugCount > lastPlugCount;
+                lastPlugCount = change.device->plugCount;
+            }
+            bListed = bAdded;
+            (bAdded ? added : removed)++;
+        }
+        bool bFinal = std::any_of(finalDevices.begin(), finalDevices.end(), [&deviceId](const std::shared_ptr<FakeDevice>& device)
+        {
+            return device->deviceUUID == deviceId;
+        });
+        passed = Check(bListed == bFinal, "the changes reported don't lead to the devices listed") && passed;
+    }
+    auto pluggedIds = bus.GetPlugged();
+    passed = Check(alternating, "a device has been reported added or removed twice in a row") && passed;
+    passed = Check(finalDevices.size() == pluggedIds.size(), "the devices listed are not the ones plugged in") && passed;
+
+    int reads = bus.GetReads() - readsBefore;
+    std::printf("%d plugged in, %d out in %.0f ms: %zu added, %zu removed, %d devices read\n", plugged.load(), unplugged.load(),
+        eventsMs, added, removed, reads);
+    passed = Check(added <= size_t(plugged) && removed <= size_t(unplugged), "more changes reported than made") && passed;
+    passed = Check(size_t(reads) <= size_t(plugged), "devices already listed read again") && passed;
+
+    // stopped listening, the rescans go on
+    registry.SetListener(nullptr);
+    size_t changeCount = added + removed;
+    if (!bus.SetPlugged(0, true))
+    {
+        bus.SetPlugged(0, false);
+    }
+    registry.Rescan(bus.Enumerator(), bus.Reader());
+    size_t reported = 0;
+    for (const auto& device : changes)
+    {
+        reported += device.second.size();
+    }
+    passed = Check(reported == changeCount, "a change has been reported to the listener removed") && passed;
+
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,542 @@
+// Replays a transfer trace recorded with the scan option "trace" through a stand-in of the transfer callback
+// and of the bridge to JavaScript, without a scanner.
+// Without a trace a driver is simulated first: its pages are recorded into a trace with their data,
+// the trace is read back and the replayed pages are checked against the pages written.
+// usage: replayBench [trace] [speed] [pages] [pageKB] [MBps]
+//   trace: the trace file, "-" to simulate the driver, "-" by default
+//   speed: 1 replays at the recorded speed, 4 four times faster, 0 as fast as possible. Both 1 and 0 by default
+//   pages, pageKB, MBps: the simulated driver, 5 pages of 4096 KB at 50 MB/s by default
+// Exits with 1 if the replayed pages are not as recorded
+#include "stdafx.h"
+#include "transferTrace.h"
+#include "chunkQueue.h"
+#include "spscRing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const size_t HeaderSize = 54;
+    const size_t DriverChunkSize = 64 * 1024;
+
+    double ElapsedMs(Clock::time_point start, Clock::time_point end)
+    {
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    // the content of a simulated page, the header is completed at the end
+    std::vector<uint8_t> MakePage(int index, size_t size)
+    {
+        std::vector<uint8_t> page(size);
+        for (size_t i = 0; i < size; i++)
+        {
+            page[i] = uint8_t((i * 131 + index * 17) >> 3);
+        }
+        return page;
+    }
+
+    // What a WIA driver does: a stream per page written in chunks with status messages, the header written again at the end
+    bool SimulateDriver(const FilePath& path, int pageCount, size_t pageSize, double mbps)
+    {
+        CTransferTraceRecorder recorder;
+        if (!recorder.Open(path, true))
+        {
+            return false;
+        }
+
+        auto start = Clock::now();
+        uint64_t transferred = 0;
+        for (int i = 0; i < pageCount; i++)
+        {
+            std::vector<uint8_t> page = MakePage(i, pageSize);
+
+            recorder.RecordNextStream();
+            TransferParams params;
+            params.message = TransferMessage::Status;
+            recorder.RecordMessage(params);
+
+            std::vector<uint8_t> header(HeaderSize, 0);
+            recorder.RecordWrite(0, header.data(), header.size());
+            for (size_t position = HeaderSize; position < page.size(); position += DriverChunkSize)
+            {
+                size_t size = std::min(DriverChunkSize, page.size() - position);
+                transferred += size;
+                std::this_thread::sleep_until(start + std::chrono::microseconds(uint64_t(transferred / mbps)));
+
+                recorder.RecordWrite(position, page.data() + position, size);
+                params.percentComplete = int32_t((position + size) * 100 / page.size());
+                params.transferredBytes = position + size;
+                recorder.RecordMessage(params);
+            }
+            recorder.RecordWrite(0, page.data(), HeaderSize);
+
+            params.message = TransferMessage::EndOfStream;
+            recorder.RecordMessage(params);
+        }
+
+        TransferParams params;
+        params.message = TransferMessage::EndOfTransfer;
+        recorder.RecordMessage(params);
+        return recorder.Close();
+    }
+
+    struct ReplayedPage
+    {
+        std::shared_ptr<CMemoryBuffer> buffer;
+        Clock::time_point startTime;        // GetNextStream()
+        Clock::time_point endTime;          // END_OF_STREAM
+        Clock::time_point deliveredTime;    // the page event reached the "JavaScript" thread
+    };
+
+    struct ProgressRecord
+    {
+        int32_t percentComplete = 0;
+        uint64_t transferredBytes = 0;
+    };
+
+    // Stand-in of ScanWorker: the progress goes through a ring, the data through a chunk queue and the pages
+    // through a list, the thread standing for JavaScript is woken up like uv_async_send() does, wakeups merged
+    class CBridge
+    {
+    public:
+        CBridge()
+            : m_progressRing(4096)
+            , m_dataQueue(4 * 1024 * 1024)
+            , m_bNotified(false)
+            , m_bStop(false)
+            , m_progressCount(0)
+            , m_dataBytes(0)
+            , m_wakeups(0)
+        {
+            m_thread = std::thread(&CBridge::ThreadProc, this);
+        }
+
+        ~CBridge()
+        {
+            Stop();
+        }
+
+        // producer side, the transfer thread
+        void PushProgress(const ProgressRecord& record)
+        {
+            m_progressRing.Push(record);
+            Notify();
+        }
+
+        bool PushData(long page, uint64_t offset, const void* data, size_t size)
+        {
+            bool ret = m_dataQueue.Push(page, offset, data, size);
+            Notify();
+            return ret;
+        }
+
+        void PushPage(ReplayedPage* page)
+        {
+            {
+                std::lock_guard<std::mutex> g(m_lockPages);
+                m_pages.push_back(page);
+            }
+            Notify();
+        }
+
+        // deliver what is left and stop the thread
+        void Stop()
+        {
+            if (!m_thread.joinable())
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                m_bStop = true;
+            }
+            m_condition.notify_one();
+            m_thread.join();
+        }
+
+        uint64_t GetProgressCount() const { return m_progressCount; }
+        uint64_t GetDataBytes() const { return m_dataBytes; }
+        uint64_t GetWakeups() const { return m_wakeups; }
+        uint64_t GetBlockedCount() const { return m_dataQueue.GetBlockedCount(); }
+
+    private:
+        void Notify()
+        {
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                m_bNotified = true;
+            }
+            m_condition.notify_one();
+        }
+
+        void ThreadProc()
+        {
+            for (;;)
+            {
+                bool stop = false;
+                {
+                    std::unique_lock<std::mutex> g(m_lock);
+                    m_condition.wait(g, [this]() { return m_bNotified || m_bStop; });
+                    m_bNotified = false;
+                    stop = m_bStop;
+                }
+                m_wakeups++;
+
+                // what the handlers of the events do before calling JavaScript
+                m_progressCount += m_progressRing.PopAll([](const ProgressRecord&) {});
+
+                std::deque<DataChunk> chunks;
+                m_dataQueue.PopAll(chunks);
+                for (const auto& chunk : chunks)
+                {
+                    m_scratch.assign(chunk.data->Data(), chunk.data->Data() + chunk.data->Size());
+                    m_dataBytes += chunk.data->Size();
+                }
+
+                std::vector<ReplayedPage*> pages;
+                {
+                    std::lock_guard<std::mutex> g(m_lockPages);
+                    pages.swap(m_pages);
+                }
+                auto now = Clock::now();
+                for (auto page : pages)
+                {
+                    page->deliveredTime = now;
+                }
+
+                if (stop)
+                {
+                    m_dataQueue.Close();
+                    return;
+                }
+            }
+        }
+
+        CSPSCRing<ProgressRecord> m_progressRing;
+        CChunkQueue m_dataQueue;
+        std::mutex m_lockPages;
+        std::vector<ReplayedPage*> m_pages;
+
+        std::mutex m_lock;
+        std::condition_variable m_condition;
+        bool m_bNotified;
+        bool m_bStop;
+
+        uint64_t m_progressCount;
+        uint64_t m_dataBytes;
+        uint64_t m_wakeups;
+        std::vector<char> m_scratch;
+
+        std::thread m_thread;
+    };
+
+    // Stand-in of CScanTransferCallback for the output "buffer" with the events "progress", "data" and "page"
+    class CReplayCallback
+    {
+    public:
+        explicit CReplayCallback(CBridge& bridge)
+            : m_bridge(bridge)
+        {
+        }
+
+        bool TransferCallback(const TransferParams& params)
+        {
+            switch (params.message)
+            {
+            case TransferMessage::Status:
+            {
+                ProgressRecord record;
+                record.percentComplete = params.percentComplete;
+                record.transferredBytes = params.transferredBytes;
+                m_bridge.PushProgress(record);
+            }
+            break;
+            case TransferMessage::EndOfStream:
+                EndPage();
+                break;
+            default:
+                break;
+            }
+            return true;
+        }
+
+        bool GetNextStream()
+        {
+            std::unique_ptr<ReplayedPage> page(new ReplayedPage());
+            page->buffer = std::make_shared<CMemoryBuffer>();
+            page->startTime = Clock::now();
+            m_pages.push_back(std::move(page));
+            m_bPageOpen = true;
+            return true;
+        }
+
+        // IStream::Write() after a seek, the data goes to the buffer and to the bridge
+        bool Write(uint64_t offset, const void* data, size_t size)
+        {
+            if (!m_bPageOpen)
+            {
+                return false;
+            }
+            CMemoryBuffer& buffer = *m_pages.back()->buffer;
+            if (!buffer.Seek(int64_t(offset), SeekOrigin::Begin) || buffer.Write(data, size) != size)
+            {
+                return false;
+            }
+            return m_bridge.PushData(long(m_pages.size()) - 1, offset, data, size);
+        }
+
+        const std::vector<std::unique_ptr<ReplayedPage>>& GetPages() const
+        {
+            return m_pages;
+        }
+
+    private:
+        void EndPage()
+        {
+            if (!m_bPageOpen)
+            {
+                return;
+            }
+            m_bPageOpen = false;
+            m_pages.back()->endTime = Clock::now();
+            m_bridge.PushPage(m_pages.back().get());
+        }
+
+        CBridge& m_bridge;
+        std::vector<std::unique_ptr<ReplayedPage>> m_pages;
+        bool m_bPageOpen = false;
+    };
+
+    // time spent in the callback per call
+    struct CallStats
+    {
+        std::vector<double> us;
+
+        void Print(const char* name) const
+        {
+            if (us.empty())
+            {
+                return;
+            }
+            std::vector<double> sorted = us;
+            std::sort(sorted.begin(), sorted.end());
+            double total = 0;
+            for (double value : sorted)
+            {
+                total += value;
+            }
+            std::printf("  %-16s %6zu calls, mean %7.2f us, p99 %7.2f us, max %8.1f us, %8.1f ms in total\n", name, sorted.size(),
+                total / sorted.size(), sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)], sorted.back(), total / 1000);
+        }
+    };
+
+    // Feed the events to the callback at the recorded times divided by speed, at once if speed is 0
+    bool Replay(const std::vector<TraceEvent>& events, double speed, const std::vector<std::vector<uint8_t>>* expectedPages)
+    {
+        // a trace without the data is replayed with zeros
+        size_t maxWriteSize = 0;
+        for (const auto& event : events)
+        {
+            maxWriteSize = std::max<size_t>(maxWriteSize, event.size);
+        }
+        std::vector<uint8_t> zeros(maxWriteSize);
+
+        CBridge bridge;
+        CReplayCallback callback(bridge);
+        CallStats messageStats;
+        CallStats streamStats;
+        CallStats writeStats;
+        uint64_t writtenBytes = 0;
+        bool succeeded = true;
+
+        auto start = Clock::now();
+        for (const auto& event : events)
+        {
+            if (speed > 0)
+            {
+                std::this_thread::sleep_until(start + std::chrono::microseconds(uint64_t(event.timeUs / speed)));
+            }
+
+            auto callStart = Clock::now();
+            switch (event.type)
+            {
+            case TraceEventType::Message:
+                succeeded = callback.TransferCallback(event.params) && succeeded;
+                messageStats.us.push_back(ElapsedMs(callStart, Clock::now()) * 1000);
+                break;
+            case TraceEventType::NextStream:
+                succeeded = callback.GetNextStream() && succeeded;
+                streamStats.us.push_back(ElapsedMs(callStart, Clock::now()) * 1000);
+                break;
+            case TraceEventType::Write:
+                succeeded = callback.Write(event.offset, event.data.empty() ? zeros.data() : event.data.data(), event.size) && succeeded;
+                writeStats.us.push_back(ElapsedMs(callStart, Clock::now()) * 1000);
+                writtenBytes += event.size;
+                break;
+            default:
+                break;
+            }
+        }
+        auto end = Clock::now();
+        bridge.Stop();
+
+        double wallMs = ElapsedMs(start, end);
+        double recordedMs = events.empty() ? 0 : events.back().timeUs / 1000.0;
+        const auto& pages = callback.GetPages();
+        std::printf("speed %s: %zu events, %zu pages, %.1f MB replayed in %.1f ms (recorded %.1f ms), %.1f MB/s\n",
+            speed > 0 ? std::to_string(speed).substr(0, 4).c_str() : "max", events.size(), pages.size(),
+            writtenBytes / (1024.0 * 1024.0), wallMs, recordedMs, writtenBytes / (1024.0 * 1024.0) / (wallMs / 1000));
+        std::printf("callback overhead:\n");
+        messageStats.Print("TransferCallback");
+        streamStats.Print("GetNextStream");
+        writeStats.Print("Write");
+
+        double maxTransferMs = 0;
+        double totalTransferMs = 0;
+        double maxDeliveryMs = 0;
+        double totalDeliveryMs = 0;
+        for (const auto& page : pages)
+        {
+            double transferMs = ElapsedMs(page->startTime, page->endTime);
+            double deliveryMs = ElapsedMs(page->endTime, page->deliveredTime);
+            maxTransferMs = std::max(maxTransferMs, transferMs);
+            totalTransferMs += transferMs;
+            maxDeliveryMs = std::max(maxDeliveryMs, deliveryMs);
+            totalDeliveryMs += deliveryMs;
+        }
+        if (!pages.empty())
+        {
+            std::printf("per page: transfer mean %.1f ms max %.1f ms, end of stream to the 'page' event mean %.3f ms max %.3f ms\n",
+                totalTransferMs / pages.size(), maxTransferMs, totalDeliveryMs / pages.size(), maxDeliveryMs);
+        }
+        std::printf("bridge: %llu progress records, %.1f MB of data, %llu wakeups, the transfer blocked %llu times by the data queue\n",
+            (unsigned long long)bridge.GetProgressCount(), bridge.GetDataBytes() / (1024.0 * 1024.0),
+            (unsigned long long)bridge.GetWakeups(), (unsigned long long)bridge.GetBlockedCount());
+
+        if (bridge.GetDataBytes() != writtenBytes)
+        {
+            std::printf("FAILED: %llu bytes reached the bridge instead of %llu\n",
+                (unsigned long long)bridge.GetDataBytes(), (unsigned long long)writtenBytes);
+            succeeded = false;
+        }
+        if (expectedPages)
+        {
+            if (pages.size() != expectedPages->size())
+            {
+                std::printf("FAILED: %zu pages replayed instead of %zu\n", pages.size(), expectedPages->size());
+                return false;
+            }
+            for (size_t i = 0; i < pages.size(); i++)
+            {
+                const CMemoryBuffer& buffer = *pages[i]->buffer;
+                const auto& expected = (*expectedPages)[i];
+                if (buffer.Size() != expected.size() || std::memcmp(buffer.Data(), expected.data(), expected.size()) != 0)
+                {
+                    std::printf("FAILED: page %zu is not as written by the driver\n", i);
+                    succeeded = false;
+                }
+            }
+        }
+        return succeeded;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    std::string tracePath = argc > 1 ? argv[1] : "-";
+    double speedArg = argc > 2 ? std::atof(argv[2]) : -1;
+    int pageCount = argc > 3 ? std::atoi(argv[3]) : 5;
+    size_t pageSize = std::max(size_t(argc > 4 ? std::atoi(argv[4]) : 4096) * 1024, HeaderSize + 1);
+    double mbps = argc > 5 ? std::atof(argv[5]) : 50;
+
+    std::vector<std::vector<uint8_t>> expectedPages;
+    bool simulated = tracePath == "-";
+    if (simulated)
+    {
+        tracePath = "/tmp/replayBench.wiatrace";
+        std::printf("simulating a driver: %d pages of %zu KB at %.0f MB/s\n", pageCount, pageSize / 1024, mbps);
+        if (!SimulateDriver(tracePath, pageCount, pageSize, mbps))
+        {
+            std::printf("FAILED: the trace cannot be recorded to %s\n", tracePath.c_str());
+            return 1;
+        }
+        for (int i = 0; i < pageCount; i++)
+        {
+            expectedPages.push_back(MakePage(i, pageSize));
+        }
+    }
+
+    CTransferTraceReader reader;
+    if (!reader.Open(tracePath))
+    {
+        std::printf("FAILED: %s is not a trace\n", tracePath.c_str());
+        return 1;
+    }
+
+    std::vector<TraceEvent> events;
+    TraceEvent event;
+    uint64_t dataBytes = 0;
+    while (reader.Next(event))
+    {
+        dataBytes += event.data.size();
+        events.push_back(std::move(event));
+    }
+    if (!reader.IsComplete())
+    {
+        // the events read are replayed all the same
+        std::printf("the trace is incomplete or damaged after %zu events\n", events.size());
+    }
+
+    FILE* file = std::fopen(tracePath.c_str(), "rb");
+    long traceSize = 0;
+    if (file)
+    {
+        std::fseek(file, 0, SEEK_END);
+        traceSize = std::ftell(file);
+        std::fclose(file);
+    }
+    std::printf("%s: %zu events, %.1f KB, %s\n", tracePath.c_str(), events.size(), traceSize / 1024.0,
+        reader.HasData() ? "with the data" : "sizes only");
+    std::printf("  %.1f bytes per event besides the data\n",
+        events.empty() ? 0.0 : double(uint64_t(traceSize) - dataBytes) / events.size());
+
+    bool passed = !simulated || reader.IsComplete();
+    std::vector<double> speeds;
+    if (speedArg >= 0)
+    {
+        speeds.push_back(speedArg);
+    }
+    else
+    {
+        speeds.push_back(1);
+        speeds.push_back(0);
+    }
+    for (double speed : speeds)
+    {
+        std::printf("\n");
+        passed = Replay(events, speed, simulated ? &expectedPages : nullptr) && passed;
+    }
+
+    if (simulated)
+    {
+        std::remove(tracePath.c_str());
+    }
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+    }
+    return passed ? 0 : 1;
+}
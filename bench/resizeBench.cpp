@@ -0,0 +1,327 @@
+// Thumbnails of the pages: the area filter of every instruction set supported by the CPU.
+// The golden checks come first: the result against an area filter computed in double, the kernels against the scalar one,
+// and the hash of the thumbnails of a generated page against the one recorded. Then the levels are timed on A4 pages
+// and the thumbnails encoded in JPEG, against the size of the page.
+// usage: resizeBench [pages] [dpi]
+//   pages: how many times each page is measured, 5 by default
+//   dpi: resolution of the A4 pages, 600 by default
+// Exits with 1 if a check fails
+#include "stdafx.h"
+#include "rawImage.h"
+#include "inkCount.h"
+#include "imageResize.h"
+#include "jpegEncoder.h"
+#include "memoryBuffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const SimdLevel AllLevels[] = { SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::NEON };
+
+    // FNV-1a 64 of the thumbnails of the golden page, the same on every platform and at every level
+    const uint64_t GoldenHash = 0x888a21dbb0c86be8ull;
+
+    // Paper noise, lines of text-like blocks and a gradient, so that every weight of the filter counts
+    RawImage CreatePage(uint32_t width, uint32_t height, PixelFormat format, std::mt19937& random)
+    {
+        RawImage image = CreateRawImage(width, height, format);
+        size_t bytesPerPixel = GetBytesPerPixel(format);
+        uint32_t lineHeight = std::max<uint32_t>(height / 80, 1);
+        for (uint32_t y = 0; y < height; y++)
+        {
+            uint8_t* row = image.Row(y);
+            bool bTextLine = y > height / 10 && y < height - height / 10 && (y / lineHeight) % 3 == 0;
+            for (uint32_t x = 0; x < width; x++)
+            {
+                for (size_t c = 0; c < bytesPerPixel; c++)
+                {
+                    uint8_t value = uint8_t(190 + (x * 50) / width - random() % 16 + c * 5);
+                    if (bTextLine && random() % 3 == 0)
+                    {
+                        value = uint8_t(random() % 120);
+                    }
+                    row[x * bytesPerPixel + c] = value;
+                }
+            }
+        }
+        return image;
+    }
+
+    // every pixel of the result the average of the area it covers, in double
+    RawImage ReferenceResizeArea(const RawImage& image, uint32_t width, uint32_t height)
+    {
+        RawImage result = CreateRawImage(width, height, image.format);
+        size_t bytesPerPixel = GetBytesPerPixel(image.format);
+        double scaleX = double(image.width) / width;
+        double scaleY = double(image.height) / height;
+        for (uint32_t y = 0; y < height; y++)
+        {
+            for (uint32_t x = 0; x < width; x++)
+            {
+                for (size_t c = 0; c < bytesPerPixel; c++)
+                {
+                    double sum = 0;
+                    for (uint32_t sy = uint32_t(y * scaleY); sy < image.height && sy < (y + 1) * scaleY; sy++)
+                    {
+                        double coverY = std::min<double>(sy + 1, (y + 1) * scaleY) - std::max<double>(sy, y * scaleY);
+                        for (uint32_t sx = uint32_t(x * scaleX); sx < image.width && sx < (x + 1) * scaleX; sx++)
+                        {
+                            double coverX = std::min<double>(sx + 1, (x + 1) * scaleX) - std::max<double>(sx, x * scaleX);
+                            sum += image.Row(sy)[sx * bytesPerPixel + c] * coverX * coverY;
+                        }
+                    }
+                    result.Row(y)[x * bytesPerPixel + c] = uint8_t(std::lround(sum / (scaleX * scaleY)));
+                }
+            }
+        }
+        return result;
+    }
+
+    void HashImage(const RawImage& image, uint64_t& hash)
+    {
+        size_t rowSize = image.width * GetBytesPerPixel(image.format);
+        for (uint32_t y = 0; y < image.height; y++)
+        {
+            const uint8_t* row = image.Row(y);
+            for (size_t i = 0; i < rowSize; i++)
+            {
+                hash = (hash ^ row[i]) * 1099511628211ull;
+            }
+        }
+    }
+
+    bool SameImage(const RawImage& a, const RawImage& b)
+    {
+        if (a.width != b.width || a.height != b.height || a.format != b.format)
+        {
+            return false;
+        }
+        size_t rowSize = a.width * GetBytesPerPixel(a.format);
+        for (uint32_t y = 0; y < a.height; y++)
+        {
+            if (!std::equal(a.Row(y), a.Row(y) + rowSize, b.Row(y)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int MaxDifference(const RawImage& a, const RawImage& b)
+    {
+        int difference = 0;
+        size_t rowSize = a.width * GetBytesPerPixel(a.format);
+        for (uint32_t y = 0; y < a.height; y++)
+        {
+            for (size_t i = 0; i < rowSize; i++)
+            {
+                difference = std::max(difference, std::abs(int(a.Row(y)[i]) - int(b.Row(y)[i])));
+            }
+        }
+        return difference;
+    }
+
+    bool CheckSizes()
+    {
+        const struct
+        {
+            uint32_t width, height, maxSide, thumbWidth, thumbHeight;
+        } cases[] =
+        {
+            { 4960, 7016, 1024, 724, 1024 },    // A4 at 600 dpi
+            { 4960, 7016, 256, 181, 256 },
+            { 7016, 4960, 256, 256, 181 },
+            { 1000, 1000, 256, 256, 256 },
+            { 200, 100, 256, 200, 100 },        // not enlarged
+            { 10000, 3, 256, 256, 1 },          // at least a pixel
+        };
+        bool passed = true;
+        for (const auto& c : cases)
+        {
+            uint32_t width = 0;
+            uint32_t height = 0;
+            GetThumbnailSize(c.width, c.height, c.maxSide, width, height);
+            if (width != c.thumbWidth || height != c.thumbHeight)
+            {
+                std::printf("FAILED: thumbnail of %ux%u at %u is %ux%u instead of %ux%u\n",
+                    c.width, c.height, c.maxSide, width, height, c.thumbWidth, c.thumbHeight);
+                passed = false;
+            }
+        }
+        return passed;
+    }
+
+    bool CheckKernels(std::mt19937& random)
+    {
+        bool passed = CheckSizes();
+
+        // odd sizes around the vector widths, integer and fractional ratios, the size kept
+        const struct
+        {
+            uint32_t width, height, thumbWidth, thumbHeight;
+        } cases[] =
+        {
+            { 1, 1, 1, 1 },
+            { 17, 33, 17, 33 },
+            { 64, 64, 16, 16 },
+            { 65, 97, 7, 11 },
+            { 333, 251, 100, 75 },
+            { 1001, 1403, 256, 359 },
+            { 1001, 1403, 1000, 1402 },
+            { 1240, 1754, 3, 1 },
+        };
+        for (auto format : { PixelFormat::Gray8, PixelFormat::BGR24 })
+        {
+            for (const auto& c : cases)
+            {
+                RawImage page = CreatePage(c.width, c.height, format, random);
+                RawImage expected = ReferenceResizeArea(page, c.thumbWidth, c.thumbHeight);
+                for (auto level : AllLevels)
+                {
+                    if (!IsSimdLevelSupported(level))
+                    {
+                        continue;
+                    }
+                    RawImage actual = ResizeArea(page, c.thumbWidth, c.thumbHeight, level);
+                    if (actual.width != c.thumbWidth || actual.height != c.thumbHeight)
+                    {
+                        std::printf("FAILED: %s, %ux%u to %ux%u gives %ux%u\n", SimdLevelToString(level),
+                            c.width, c.height, c.thumbWidth, c.thumbHeight, actual.width, actual.height);
+                        passed = false;
+                        continue;
+                    }
+                    int difference = MaxDifference(expected, actual);
+                    if (difference > 1)
+                    {
+                        std::printf("FAILED: %s, %ux%u to %ux%u differs by %d from the area filter\n", SimdLevelToString(level),
+                            c.width, c.height, c.thumbWidth, c.thumbHeight, difference);
+                        passed = false;
+                    }
+                    if (!SameImage(actual, ResizeArea(page, c.thumbWidth, c.thumbHeight, SimdLevel::Scalar)))
+                    {
+                        std::printf("FAILED: %s, %ux%u to %ux%u differs from the scalar kernel\n", SimdLevelToString(level),
+                            c.width, c.height, c.thumbWidth, c.thumbHeight);
+                        passed = false;
+                    }
+                }
+            }
+        }
+
+        // a flat page stays flat, whatever the weights
+        RawImage flat = CreateRawImage(997, 1301, PixelFormat::BGR24, 0x7b);
+        RawImage flatThumbnail = ResizeArea(flat, 255, 333);
+        if (MaxDifference(flatThumbnail, CreateRawImage(255, 333, PixelFormat::BGR24, 0x7b)) != 0)
+        {
+            std::printf("FAILED: a flat page is not flat once resized\n");
+            passed = false;
+        }
+
+        // the golden page, generated the same everywhere
+        std::mt19937 goldenRandom(24);
+        for (auto level : AllLevels)
+        {
+            if (!IsSimdLevelSupported(level))
+            {
+                continue;
+            }
+            uint64_t hash = 14695981039346656037ull;
+            for (auto format : { PixelFormat::Gray8, PixelFormat::BGR24 })
+            {
+                goldenRandom.seed(24);
+                RawImage page = CreatePage(1240, 1754, format, goldenRandom);
+                for (uint32_t maxSide : { 1024u, 256u })
+                {
+                    uint32_t width = 0;
+                    uint32_t height = 0;
+                    GetThumbnailSize(page.width, page.height, maxSide, width, height);
+                    HashImage(ResizeArea(page, width, height, level), hash);
+                }
+            }
+            if (hash != GoldenHash)
+            {
+                std::printf("FAILED: %s, golden hash %016llx instead of %016llx\n", SimdLevelToString(level),
+                    (unsigned long long)hash, (unsigned long long)GoldenHash);
+                passed = false;
+            }
+        }
+        return passed;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int pageCount = std::max(argc > 1 ? std::atoi(argv[1]) : 5, 1);
+    int dpi = argc > 2 ? std::atoi(argv[2]) : 600;
+
+    uint32_t width = uint32_t(8.27 * dpi);
+    uint32_t height = uint32_t(11.69 * dpi);
+
+    std::mt19937 random(24);
+    std::printf("CPU: %s\n", SimdLevelToString(GetSimdLevel()));
+
+    if (!CheckKernels(random))
+    {
+        std::printf("FAILED\n");
+        return 1;
+    }
+    std::printf("kernels match the area filter, the scalar kernel and the golden hash\n");
+
+    for (auto format : { PixelFormat::Gray8, PixelFormat::BGR24 })
+    {
+        RawImage page = CreatePage(width, height, format, random);
+        CMemoryBuffer pageData;
+        EncodeJpeg(page, 85, pageData);
+        std::printf("A4 %s page at %d dpi, %ux%u, %zu KB in JPEG, measured %d times\n",
+            format == PixelFormat::Gray8 ? "grayscale" : "color", dpi, width, height, pageData.Size() / 1024, pageCount);
+
+        for (uint32_t maxSide : { 1024u, 256u })
+        {
+            uint32_t thumbWidth = 0;
+            uint32_t thumbHeight = 0;
+            GetThumbnailSize(width, height, maxSide, thumbWidth, thumbHeight);
+
+            double scalarMs = 0;
+            RawImage thumbnail;
+            for (auto level : AllLevels)
+            {
+                if (!IsSimdLevelSupported(level))
+                {
+                    continue;
+                }
+
+                auto start = Clock::now();
+                for (int i = 0; i < pageCount; i++)
+                {
+                    thumbnail = ResizeArea(page, thumbWidth, thumbHeight, level);
+                }
+                double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / pageCount;
+                if (level == SimdLevel::Scalar)
+                {
+                    scalarMs = ms;
+                }
+
+                double mbPerSecond = page.pixels.size() / (ms / 1000) / (1024 * 1024);
+                std::printf("  %4u %-7s %8.3f ms/page, %8.0f MB/s, %.1fx scalar\n",
+                    maxSide, SimdLevelToString(level), ms, mbPerSecond, scalarMs / ms);
+            }
+
+            CMemoryBuffer thumbnailData;
+            auto start = Clock::now();
+            EncodeJpeg(thumbnail, 85, thumbnailData);
+            double encodeMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            std::printf("  %4u %ux%u, %zu KB in JPEG(%.1f%% of the page), encoded in %.3f ms\n", maxSide, thumbWidth, thumbHeight,
+                thumbnailData.Size() / 1024, 100.0 * thumbnailData.Size() / std::max<size_t>(pageData.Size(), 1), encodeMs);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,242 @@
+// The ring carrying the progress of the transfers to the JS thread, without scanners or Windows.
+// One producer thread pushes records numbered in sequence, many times the capacity of the ring, while the consumer
+// drains them in batches with PopAll() and sometimes one by one with TryPop(). The consumer pauses now and then so that
+// the ring fills up and the producer has to wait. Every record must arrive once, in order, with the payload written.
+// usage: ringBench [records] [capacity]
+//   records: records pushed per run, 4000000 by default
+//   capacity: capacity of the ring, 4096 by default
+// Exits with 1 if a record is missing, out of order, duplicated or torn
+#include "stdafx.h"
+#include "spscRing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    bool Check(bool condition, const char* what)
+    {
+        if (!condition)
+        {
+            std::printf("FAILED: %s\n", what);
+        }
+        return condition;
+    }
+
+    // About the size of the progress info of a transfer
+    struct Record
+    {
+        uint64_t sequence;
+        uint64_t payload[3];
+    };
+
+    uint64_t Payload(uint64_t sequence, int i)
+    {
+        return (sequence + 1) * 0x9E3779B97F4A7C15ull ^ uint64_t(i);
+    }
+
+    Record MakeRecord(uint64_t sequence)
+    {
+        Record record;
+        record.sequence = sequence;
+        for (int i = 0; i < 3; i++)
+        {
+            record.payload[i] = Payload(sequence, i);
+        }
+        return record;
+    }
+
+    struct RunResult
+    {
+        bool passed = true;
+        double ms = 0;
+        uint64_t fullCount = 0;     // pushes which found the ring full
+        uint64_t batchCount = 0;
+        size_t maxBatch = 0;
+    };
+
+    // The consumer checks every record as it is popped and stops at the first error
+    class CSequenceChecker
+    {
+    public:
+        CSequenceChecker()
+            : m_expected(0)
+            , m_passed(true)
+        {
+        }
+
+        void operator()(const Record& record)
+        {
+            if (!m_passed)
+            {
+                return;
+            }
+            if (record.sequence != m_expected)
+            {
+                if (record.sequence < m_expected)
+                {
+                    std::printf("FAILED: record %llu is duplicated or out of order, %llu expected\n",
+                        (unsigned long long)record.sequence, (unsigned long long)m_expected);
+                }
+                else
+                {
+                    std::printf("FAILED: records %llu to %llu are missing\n",
+                        (unsigned long long)m_expected, (unsigned long long)record.sequence - 1);
+                }
+                m_passed = false;
+                return;
+            }
+            for (int i = 0; i < 3; i++)
+            {
+                if (record.payload[i] != Payload(record.sequence, i))
+                {
+                    std::printf("FAILED: record %llu is torn\n", (unsigned long long)record.sequence);
+                    m_passed = false;
+                    return;
+                }
+            }
+            m_expected++;
+        }
+
+        uint64_t Expected() const
+        {
+            return m_expected;
+        }
+
+        bool Passed() const
+        {
+            return m_passed;
+        }
+
+    private:
+        uint64_t m_expected;
+        bool m_passed;
+    };
+
+    // pauseEvery: the consumer sleeps after this many batches so that the ring fills up, 0 to drain as fast as possible
+    RunResult Run(uint64_t recordCount, size_t capacity, int pauseEvery)
+    {
+        RunResult result;
+        CSPSCRing<Record> ring(capacity);
+        std::atomic<bool> produced(false);
+        std::atomic<uint64_t> fullCount(0);
+
+        auto start = Clock::now();
+        std::thread producer([&]()
+        {
+            uint64_t full = 0;
+            for (uint64_t sequence = 0; sequence < recordCount; sequence++)
+            {
+                Record record = MakeRecord(sequence);
+                if (!ring.TryPush(record))
+                {
+                    full++;
+                    ring.Push(record);
+                }
+            }
+            fullCount = full;
+            produced = true;
+        });
+
+        CSequenceChecker checker;
+        uint64_t batch = 0;
+        while (checker.Passed())
+        {
+            // read before popping, the records pushed before the producer is done are all in the ring
+            bool done = produced.load();
+            size_t count = 0;
+            if (batch % 7 == 6)
+            {
+                Record record;
+                while (count < 16 && ring.TryPop(record))
+                {
+                    checker(record);
+                    count++;
+                }
+            }
+            else
+            {
+                count = ring.PopAll([&checker](const Record& record)
+                {
+                    checker(record);
+                });
+            }
+
+            if (count)
+            {
+                batch++;
+                result.maxBatch = std::max(result.maxBatch, count);
+                if (pauseEvery && batch % pauseEvery == 0)
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                }
+            }
+            else if (done)
+            {
+                break;
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+        producer.join();
+        result.ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        result.passed = checker.Passed();
+        result.passed = Check(!result.passed || checker.Expected() == recordCount, "records are missing at the end") && result.passed;
+        result.passed = Check(ring.Size() == 0, "records are left in the ring") && result.passed;
+        result.passed = Check(result.maxBatch <= ring.Capacity(), "a batch is larger than the ring") && result.passed;
+        result.fullCount = fullCount;
+        result.batchCount = batch;
+        return result;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t recordCount = uint64_t(std::max(argc > 1 ? std::atoll(argv[1]) : 4000000ll, 1ll));
+    size_t capacity = size_t(std::max(argc > 2 ? std::atoi(argv[2]) : 4096, 1));
+
+    bool passed = true;
+    std::printf("%llu records per run, ring of %zu\n", (unsigned long long)recordCount, capacity);
+    std::printf("%-16s %10s %12s %12s %10s %12s\n", "consumer", "ms", "Mrecords/s", "ring full", "batches", "max batch");
+    const struct
+    {
+        const char* name;
+        int pauseEvery;
+    } runs[] =
+    {
+        { "drain", 0 },
+        { "paused", 64 },
+        { "slow", 4 },
+    };
+    for (const auto& run : runs)
+    {
+        // the slower consumers get fewer records, the producer waits for them most of the time
+        uint64_t count = run.pauseEvery ? std::max<uint64_t>(recordCount / run.pauseEvery * 4, capacity * 8) : recordCount;
+        RunResult result = Run(count, capacity, run.pauseEvery);
+        std::printf("%-16s %10.1f %12.2f %12llu %10llu %12zu\n", run.name, result.ms, count / result.ms / 1000,
+            (unsigned long long)result.fullCount, (unsigned long long)result.batchCount, result.maxBatch);
+        passed = result.passed && passed;
+    }
+
+    // the smallest ring wraps on every record
+    passed = Run(std::min<uint64_t>(recordCount, 200000), 1, 0).passed && passed;
+
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+        return 1;
+    }
+    std::printf("every record arrived once and in order\n");
+    return 0;
+}
@@ -0,0 +1,502 @@
+// The scan scheduler with simulated jobs, without scanners or Windows.
+// The order the jobs start in, the limits and the cancels are checked first. Then several devices run jobs made of
+// page transfers, which wait for the device and do some CPU work per chunk as the driver callbacks do, while the pages
+// transferred are deskewed by the pipeline of the job. The transfers are timed without limits, with the processing
+// limited, and with the scans limited as well.
+// usage: schedulerBench [devices] [jobs] [pages] [dpi]
+//   devices: 4 by default
+//   jobs: jobs of every device, 3 by default. The jobs of the first device have a higher priority
+//   pages: pages of every job, 6 by default
+//   dpi: resolution of the A4 pages processed, 150 by default
+// Exits with 1 if a job starts out of order, a limit is exceeded or the stats don't add up
+#include "stdafx.h"
+#include "jobScheduler.h"
+#include "imagePipeline.h"
+#include "taskQueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    const double PI = 3.14159265358979323846;
+
+    bool Check(bool condition, const char* what)
+    {
+        if (!condition)
+        {
+            std::printf("FAILED: %s\n", what);
+        }
+        return condition;
+    }
+
+    bool CheckStats(const CJobScheduler& scheduler, uint64_t submitted, uint64_t cancelled)
+    {
+        JobSchedulerStats stats = scheduler.GetStats();
+        return Check(stats.submitted == submitted && stats.cancelled == cancelled &&
+            stats.started == submitted - cancelled && stats.finished == stats.started &&
+            stats.queuedCount == 0 && stats.activeCount == 0, "the stats don't add up");
+    }
+
+    // The jobs run one at a time on the thread calling Finish(), in the order of their priority, then submitted
+    bool CheckOrder()
+    {
+        bool passed = true;
+        JobSchedulerOptions options;
+        options.maxActiveJobs = 1;
+        CJobScheduler scheduler(options);
+
+        std::vector<JobMetrics> started;
+        auto handler = [&started](const JobMetrics& job)
+        {
+            started.push_back(job);
+        };
+
+        // running while the others are queued
+        uint64_t first = scheduler.Submit(L"A", 0, handler);
+        passed = Check(started.size() == 1 && started[0].id == first && started[0].state == JobState::Running,
+            "the first job has not started at once") && passed;
+
+        const struct
+        {
+            const wchar_t* deviceId;
+            int priority;
+        } jobs[] =
+        {
+            { L"A", 0 }, { L"B", 1 }, { L"C", 0 }, { L"A", 5 }, { L"B", -1 }, { L"C", 1 }, { L"A", 0 }, { L"B", 5 },
+        };
+        std::vector<std::pair<int, uint64_t>> expected;
+        for (const auto& job : jobs)
+        {
+            expected.push_back(std::make_pair(-job.priority, scheduler.Submit(job.deviceId, job.priority, handler)));
+        }
+        std::sort(expected.begin(), expected.end());
+
+        // every job finished starts the next one
+        for (size_t i = 0; i < started.size(); i++)
+        {
+            JobMetrics finished = scheduler.Finish(started[i].id);
+            passed = Check(finished.state == JobState::Finished && finished.id == started[i].id, "the job finished is not the one running") && passed;
+        }
+        passed = Check(started.size() == expected.size() + 1, "not every job has run") && passed;
+        for (size_t i = 0; i < expected.size() && i + 1 < started.size(); i++)
+        {
+            if (started[i + 1].id != expected[i].second)
+            {
+                std::printf("FAILED: job %llu started as #%zu instead of job %llu\n",
+                    (unsigned long long)started[i + 1].id, i + 1, (unsigned long long)expected[i].second);
+                passed = false;
+            }
+        }
+        passed = CheckStats(scheduler, expected.size() + 1, 0) && passed;
+
+        // without a limit, one job per device at a time, the others wait for it
+        scheduler.SetOptions(JobSchedulerOptions());
+        started.clear();
+        uint64_t a1 = scheduler.Submit(L"A", 0, handler);
+        uint64_t a2 = scheduler.Submit(L"A", 0, handler);
+        uint64_t a3 = scheduler.Submit(L"A", 1, handler);
+        uint64_t b1 = scheduler.Submit(L"B", 0, handler);
+        passed = Check(started.size() == 2 && started[0].id == a1 && started[1].id == b1, "a device runs two jobs at once") && passed;
+        scheduler.Finish(a1);
+        passed = Check(started.size() == 3 && started[2].id == a3, "the job of the higher priority of the device has not started next") && passed;
+        scheduler.Finish(a3);
+        passed = Check(started.size() == 4 && started[3].id == a2, "the device is not running its last job") && passed;
+        scheduler.Finish(a2);
+        scheduler.Finish(b1);
+        passed = CheckStats(scheduler, expected.size() + 5, 0) && passed;
+        return passed;
+    }
+
+    bool CheckCancel()
+    {
+        bool passed = true;
+        JobSchedulerOptions options;
+        options.maxActiveJobs = 1;
+        CJobScheduler scheduler(options);
+
+        std::vector<JobMetrics> notified;
+        auto handler = [&notified](const JobMetrics& job)
+        {
+            notified.push_back(job);
+        };
+
+        uint64_t running = scheduler.Submit(L"A", 0, handler);
+        uint64_t a1 = scheduler.Submit(L"A", 0, handler);
+        uint64_t a2 = scheduler.Submit(L"A", 0, handler);
+        scheduler.Submit(L"B", 0, handler);
+        scheduler.Submit(L"B", 3, handler);
+
+        passed = Check(scheduler.Cancel(a1), "a job queued has not been cancelled") && passed;
+        passed = Check(notified.size() == 2 && notified[1].id == a1 && notified[1].state == JobState::Cancelled,
+            "the handler of the job cancelled has not been told") && passed;
+        passed = Check(!scheduler.Cancel(a1) && !scheduler.Cancel(running), "a job not queued has been cancelled") && passed;
+        passed = Check(scheduler.CancelDevice(L"B") == 2 && scheduler.CancelDevice(L"B") == 0, "the jobs of the device have not been cancelled") && passed;
+
+        scheduler.Finish(running);
+        passed = Check(notified.back().id == a2 && notified.back().state == JobState::Running, "the job left has not started") && passed;
+        scheduler.Finish(a2);
+        size_t cancelledCount = 0;
+        for (const auto& job : notified)
+        {
+            cancelledCount += job.state == JobState::Cancelled;
+        }
+        passed = Check(notified.size() == 5 && cancelledCount == 3, "a job has been notified twice") && passed;
+        passed = CheckStats(scheduler, 5, 3) && passed;
+        return passed;
+    }
+
+    // Jobs submitted from several threads, run on the threads of their devices
+    bool CheckConcurrency(std::mt19937& random)
+    {
+        bool passed = true;
+        const size_t deviceCount = 4;
+        const int jobCount = 200;
+        JobSchedulerOptions options;
+        options.maxActiveJobs = 2;
+        CJobScheduler scheduler(options);
+
+        std::vector<std::unique_ptr<CTaskQueue>> devices;
+        for (size_t d = 0; d < deviceCount; d++)
+        {
+            devices.emplace_back(new CTaskQueue());
+        }
+
+        std::atomic<int> active(0);
+        std::atomic<int> maxActive(0);
+        std::vector<std::atomic<int>> deviceActive(deviceCount);
+        std::atomic<int> finished(0);
+        std::mutex lockStarted;
+        std::map<std::pair<std::wstring, int>, std::vector<uint64_t>> started;     // by device and priority, the IDs in the order started
+        std::atomic<bool> overlapping(false);
+
+        auto submit = [&](unsigned seed)
+        {
+            std::mt19937 jobRandom(seed);
+            for (int i = 0; i < jobCount / 2; i++)
+            {
+                size_t d = jobRandom() % deviceCount;
+                int priority = int(jobRandom() % 3);
+                std::wstring deviceId = L"device" + std::to_wstring(d);
+                scheduler.Submit(deviceId, priority, [&, d](const JobMetrics& job)
+                {
+                    {
+                        std::lock_guard<std::mutex> g(lockStarted);
+                        started[std::make_pair(job.deviceId, job.priority)].push_back(job.id);
+                    }
+                    devices[d]->Post([&, d, job]()
+                    {
+                        int count = ++active;
+                        int expected = maxActive;
+                        while (count > expected && !maxActive.compare_exchange_weak(expected, count))
+                        {
+                        }
+                        if (++deviceActive[d] > 1)
+                        {
+                            overlapping = true;
+                        }
+                        std::this_thread::sleep_for(std::chrono::microseconds(200 + job.id % 5 * 100));
+                        deviceActive[d]--;
+                        active--;
+                        scheduler.Finish(job.id);
+                        finished++;
+                    });
+                });
+            }
+        };
+        std::thread first(submit, unsigned(random()));
+        std::thread second(submit, unsigned(random()));
+        first.join();
+        second.join();
+
+        while (finished < jobCount)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        devices.clear();
+
+        passed = Check(maxActive <= 2 && scheduler.GetStats().maxActiveCount <= 2, "more jobs than maxActiveJobs have run at once") && passed;
+        passed = Check(!overlapping, "a device has run two jobs at once") && passed;
+        for (const auto& ids : started)
+        {
+            passed = Check(std::is_sorted(ids.second.begin(), ids.second.end()), "the jobs of a device and a priority have not started in order") && passed;
+        }
+        passed = CheckStats(scheduler, jobCount, 0) && passed;
+        return passed;
+    }
+
+    bool CheckProcessingLimit()
+    {
+        bool passed = true;
+        CConcurrencyLimit limit(2);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; t++)
+        {
+            threads.emplace_back([&limit]()
+            {
+                for (int i = 0; i < 20; i++)
+                {
+                    limit.Acquire();
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                    limit.Release();
+                }
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        ConcurrencyLimitStats stats = limit.GetStats();
+        passed = Check(stats.maxActiveCount == 2 && stats.acquired == 160 && stats.activeCount == 0, "the processing limit has been exceeded") && passed;
+
+        // raising the limit lets the thread waiting through
+        limit.SetLimit(1);
+        limit.Acquire();
+        std::atomic<bool> acquired(false);
+        std::thread waiting([&]()
+        {
+            limit.Acquire();
+            acquired = true;
+            limit.Release();
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        bool waited = !acquired;
+        limit.SetLimit(0);
+        waiting.join();
+        limit.Release();
+        passed = Check(waited && acquired, "the limit raised has not let the thread waiting through") && passed;
+        return passed;
+    }
+
+    // A page of text-like lines skewed by the angle
+    RawImage CreateSkewedPage(uint32_t width, uint32_t height, double angle, std::mt19937& random)
+    {
+        RawImage image = CreateRawImage(width, height, PixelFormat::Gray8);
+        double slope = std::tan(angle * PI / 180.0);
+        uint32_t lineHeight = std::max<uint32_t>(height / 80, 1);
+        for (uint32_t top = height / 10; top + lineHeight * 2 < height - height / 10; top += lineHeight * 2)
+        {
+            for (uint32_t x = width / 10; x < width - width / 10; x++)
+            {
+                int32_t shift = int32_t(std::lround((x - width / 2.0) * slope));
+                for (uint32_t dy = 0; dy < lineHeight; dy++)
+                {
+                    int32_t y = int32_t(top + dy) + shift;
+                    if (y >= 0 && y < int32_t(height) && (random() & 3))
+                    {
+                        image.Row(uint32_t(y))[x] = 20;
+                    }
+                }
+            }
+        }
+        return image;
+    }
+
+    // CPU work of a fixed amount, not of a fixed time: it takes longer when the CPU is shared
+    std::atomic<uint32_t> g_sink(0);
+    void BurnCpu(uint64_t iterations)
+    {
+        uint32_t x = 2463534242u;
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+        }
+        g_sink += x;
+    }
+
+    uint64_t CalibrateCpu(double ms)
+    {
+        uint64_t iterations = 100000;
+        auto start = Clock::now();
+        BurnCpu(iterations);
+        double elapsedMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        return std::max<uint64_t>(1, uint64_t(iterations * ms / std::max(elapsedMs, 0.001)));
+    }
+
+    struct Workload
+    {
+        size_t deviceCount;
+        int jobCount;               // of every device
+        int pageCount;              // of every job
+        int chunkCount;             // of every page
+        double chunkWaitMs;         // for the device
+        uint64_t chunkIterations;   // of CPU work, as the driver callbacks do
+        std::vector<RawImage> pages;
+    };
+
+    struct ScenarioResult
+    {
+        double totalMs = 0;
+        double avgTransferMs = 0;   // per page
+        double maxTransferMs = 0;
+        bool passed = true;
+    };
+
+    ScenarioResult RunScenario(const char* name, const Workload& workload, const JobSchedulerOptions& options)
+    {
+        ScenarioResult result;
+        CJobScheduler scheduler(options);
+        std::vector<std::unique_ptr<CTaskQueue>> devices;
+        for (size_t d = 0; d < workload.deviceCount; d++)
+        {
+            devices.emplace_back(new CTaskQueue());
+        }
+
+        std::mutex lockResults;
+        std::vector<double> transferMs;
+        std::vector<JobMetrics> jobs;
+        std::atomic<int> finished(0);
+        std::atomic<int> missingPages(0);
+        int totalJobs = int(workload.deviceCount) * workload.jobCount;
+
+        auto start = Clock::now();
+        for (int j = 0; j < workload.jobCount; j++)
+        {
+            for (size_t d = 0; d < workload.deviceCount; d++)
+            {
+                // the first device scans the urgent batches
+                int priority = d == 0 ? 1 : 0;
+                scheduler.Submit(L"device" + std::to_wstring(d), priority, [&, d](const JobMetrics& job)
+                {
+                    devices[d]->Post([&, job]()
+                    {
+                        PipelineOptions pipelineOptions;
+                        pipelineOptions.deskew = true;
+                        pipelineOptions.processingLimit = scheduler.GetProcessingLimit();
+                        CImagePipeline pipeline(pipelineOptions, nullptr, nullptr);
+
+                        std::vector<double> pageMs;
+                        for (int p = 0; p < workload.pageCount; p++)
+                        {
+                            auto pageStart = Clock::now();
+                            for (int c = 0; c < workload.chunkCount; c++)
+                            {
+                                std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(workload.chunkWaitMs));
+                                BurnCpu(workload.chunkIterations);
+                            }
+                            pageMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - pageStart).count());
+                            pipeline.SubmitRawPage(p, workload.pages[p % workload.pages.size()]);
+                        }
+                        if (pipeline.Finish().size() != size_t(workload.pageCount))
+                        {
+                            missingPages++;
+                        }
+
+                        JobMetrics metrics = scheduler.Finish(job.id);
+                        {
+                            std::lock_guard<std::mutex> g(lockResults);
+                            transferMs.insert(transferMs.end(), pageMs.begin(), pageMs.end());
+                            jobs.push_back(metrics);
+                        }
+                        finished++;
+                    });
+                });
+            }
+        }
+        while (finished < totalJobs)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        result.totalMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        devices.clear();
+
+        for (double ms : transferMs)
+        {
+            result.avgTransferMs += ms / transferMs.size();
+            result.maxTransferMs = std::max(result.maxTransferMs, ms);
+        }
+        double urgentQueueMs = 0;
+        double otherQueueMs = 0;
+        double runMs = 0;
+        for (const auto& job : jobs)
+        {
+            (job.priority > 0 ? urgentQueueMs : otherQueueMs) += job.queueMs;
+            runMs += job.runMs / jobs.size();
+        }
+        int otherJobs = totalJobs - workload.jobCount;
+
+        JobSchedulerStats stats = scheduler.GetStats();
+        std::printf("%-20s %8.0f ms, transfer %6.1f ms/page avg, %6.1f max, job run %7.1f ms avg, queued %7.1f ms urgent, %7.1f ms others,"
+            " %llu pages waited %.0f ms to be processed\n",
+            name, result.totalMs, result.avgTransferMs, result.maxTransferMs, runMs,
+            urgentQueueMs / workload.jobCount, otherJobs ? otherQueueMs / otherJobs : 0.0,
+            (unsigned long long)stats.processing.waited, stats.processing.totalWaitMs);
+
+        result.passed = Check(missingPages == 0, "pages of a job have not been processed") && result.passed;
+        result.passed = Check(!options.maxActiveJobs || stats.maxActiveCount <= options.maxActiveJobs, "more scans than the limit have run at once") && result.passed;
+        result.passed = Check(!options.maxProcessingThreads || stats.processing.maxActiveCount <= options.maxProcessingThreads,
+            "more pages than the limit have been processed at once") && result.passed;
+        result.passed = CheckStats(scheduler, totalJobs, 0) && result.passed;
+        return result;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t deviceCount = size_t(std::max(argc > 1 ? std::atoi(argv[1]) : 4, 1));
+    int jobCount = std::max(argc > 2 ? std::atoi(argv[2]) : 3, 1);
+    int pageCount = std::max(argc > 3 ? std::atoi(argv[3]) : 6, 1);
+    int dpi = std::max(argc > 4 ? std::atoi(argv[4]) : 150, 10);
+
+    bool passed = true;
+    std::mt19937 random(25);
+    passed = CheckOrder() && passed;
+    passed = CheckCancel() && passed;
+    passed = CheckConcurrency(random) && passed;
+    passed = CheckProcessingLimit() && passed;
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+        return 1;
+    }
+    std::printf("the jobs start in order, the limits hold and the cancels are reported\n");
+
+    size_t hardwareThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    Workload workload;
+    workload.deviceCount = deviceCount;
+    workload.jobCount = jobCount;
+    workload.pageCount = pageCount;
+    workload.chunkCount = 20;
+    workload.chunkWaitMs = 2;
+    workload.chunkIterations = CalibrateCpu(0.5);
+    for (double angle : { 2.0, -1.5, 3.0 })
+    {
+        workload.pages.push_back(CreateSkewedPage(uint32_t(8.27 * dpi), uint32_t(11.69 * dpi), angle, random));
+    }
+
+    double idealMs = workload.chunkCount * (workload.chunkWaitMs + 0.5);
+    std::printf("%zu devices, %d jobs each of %d pages deskewed at %d dpi, %zu hardware threads, %.1f ms per page transferred alone\n",
+        deviceCount, jobCount, pageCount, dpi, hardwareThreads, idealMs);
+
+    JobSchedulerOptions unlimited;
+    JobSchedulerOptions processingLimited;
+    processingLimited.maxProcessingThreads = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+    JobSchedulerOptions scansLimited = processingLimited;
+    scansLimited.maxActiveJobs = std::max<size_t>(deviceCount / 2, 1);
+
+    passed = RunScenario("no limit", workload, unlimited).passed && passed;
+    char name[64];
+    std::snprintf(name, sizeof(name), "%zu processing", processingLimited.maxProcessingThreads);
+    passed = RunScenario(name, workload, processingLimited).passed && passed;
+    std::snprintf(name, sizeof(name), "%zu scans, %zu proc.", scansLimited.maxActiveJobs, scansLimited.maxProcessingThreads);
+    passed = RunScenario(name, workload, scansLimited).passed && passed;
+
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+    }
+    return passed ? 0 : 1;
+}
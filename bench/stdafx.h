@@ -0,0 +1,11 @@
+// Replaces src/stdafx.h for the portable sources built by the benchmark,
+// they need the standard headers only
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <utility>
+#include <stdexcept>
+
+#include <cassert>
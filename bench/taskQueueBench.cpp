@@ -0,0 +1,341 @@
+// The queue running the calls of a device on its own thread, without scanners or Windows.
+// The order of the tasks, the hooks entering and leaving the thread, Stop() and the counts are checked first, with
+// tasks posted from one thread and from several. Then the time from Post() until the task runs is measured with the
+// queue idle, and the rate of the tasks posted by several threads at once.
+// usage: taskQueueBench [tasks] [threads]
+//   tasks: tasks posted by every thread, 100000 by default
+//   threads: threads posting at once, 4 by default
+// Exits with 1 if a task runs out of order, twice, not at all or off the thread of the queue, if a hook runs at the
+// wrong time, or if a task is accepted once the queue is stopped
+#include "stdafx.h"
+#include "taskQueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    bool Check(bool condition, const char* what)
+    {
+        if (!condition)
+        {
+            std::printf("FAILED: %s\n", what);
+        }
+        return condition;
+    }
+
+    enum class EventType
+    {
+        ThreadStart,
+        Task,
+        ThreadExit,
+    };
+
+    struct Event
+    {
+        EventType type;
+        int poster;
+        int sequence;
+        std::thread::id threadId;
+    };
+
+    // Written by the thread of the queue only, read once it has been joined
+    struct EventLog
+    {
+        std::vector<Event> events;
+
+        void Add(EventType type, int poster = -1, int sequence = -1)
+        {
+            Event event;
+            event.type = type;
+            event.poster = poster;
+            event.sequence = sequence;
+            event.threadId = std::this_thread::get_id();
+            events.push_back(event);
+        }
+    };
+
+    // The hooks run on the thread of the queue, before the first task and after the last one, which run in order
+    bool CheckOrder(int taskCount)
+    {
+        bool passed = true;
+        EventLog log;
+        std::thread::id queueThread;
+        {
+            CTaskQueue queue([&log]() { log.Add(EventType::ThreadStart); }, [&log]() { log.Add(EventType::ThreadExit); });
+
+            // held up by the first task so that the others are queued when Stop() is called
+            std::atomic<bool> release(false);
+            passed = Check(queue.Post([&]()
+            {
+                queueThread = std::this_thread::get_id();
+                log.Add(EventType::Task, 0, 0);
+                while (!release)
+                {
+                    std::this_thread::yield();
+                }
+            }), "a task has been rejected") && passed;
+            for (int i = 1; i < taskCount; i++)
+            {
+                passed = Check(queue.Post([&log, i]() { log.Add(EventType::Task, 0, i); }), "a task has been rejected") && passed;
+            }
+
+            passed = Check(!queue.IsWorkerThread(), "the thread posting is the thread of the queue") && passed;
+            passed = Check(queue.GetPendingCount() == size_t(taskCount), "the pending count is wrong") && passed;
+
+            std::thread stopper([&queue]() { queue.Stop(); });
+            // Stop() has rejected further tasks once Post() fails, the tasks queued are still to run
+            while (queue.Post([&log]() { log.Add(EventType::Task, 1, 0); }))
+            {
+                std::this_thread::yield();
+            }
+            passed = Check(queue.GetCompletedCount() == 0, "tasks ran while the first one was held") && passed;
+            release = true;
+            stopper.join();
+
+            passed = Check(!queue.Post([]() {}), "a task has been accepted after Stop()") && passed;
+            passed = Check(queue.GetPendingCount() == 0, "tasks are pending after Stop()") && passed;
+
+            // the tasks accepted while Stop() was still to reject them ran as well
+            size_t accepted = std::count_if(log.events.begin(), log.events.end(), [](const Event& event)
+            {
+                return event.type == EventType::Task && event.poster == 1;
+            });
+            passed = Check(queue.GetCompletedCount() == uint64_t(taskCount) + accepted, "the completed count is wrong") && passed;
+            queue.Stop();
+        }
+
+        passed = Check(log.events.size() >= size_t(taskCount) + 2, "tasks are missing") && passed;
+        if (!passed)
+        {
+            return false;
+        }
+        passed = Check(log.events.front().type == EventType::ThreadStart, "the start hook did not run first") && passed;
+        passed = Check(log.events.back().type == EventType::ThreadExit, "the exit hook did not run last") && passed;
+        int next = 0;
+        bool otherPoster = false;
+        for (size_t i = 1; i + 1 < log.events.size(); i++)
+        {
+            const Event& event = log.events[i];
+            if (event.type != EventType::Task)
+            {
+                passed = Check(false, "a hook ran between the tasks");
+                break;
+            }
+            if (event.poster == 1)
+            {
+                otherPoster = true;
+                continue;
+            }
+            if (otherPoster || event.sequence != next)
+            {
+                passed = Check(false, "a task ran out of order");
+                break;
+            }
+            next++;
+        }
+        passed = Check(next == taskCount, "tasks did not run") && passed;
+        for (const auto& event : log.events)
+        {
+            if (event.threadId != queueThread)
+            {
+                passed = Check(false, "a task or hook ran off the thread of the queue");
+                break;
+            }
+        }
+        return passed;
+    }
+
+    // Tasks posted from several threads run in the order of every poster
+    bool CheckPosters(int taskCount, int threadCount)
+    {
+        bool passed = true;
+        EventLog log;
+        {
+            CTaskQueue queue;
+            std::atomic<int> ready(0);
+            std::vector<std::thread> threads;
+            for (int t = 0; t < threadCount; t++)
+            {
+                threads.emplace_back([&, t]()
+                {
+                    ready++;
+                    while (ready < threadCount)
+                    {
+                        std::this_thread::yield();
+                    }
+                    for (int i = 0; i < taskCount; i++)
+                    {
+                        queue.Post([&log, t, i]() { log.Add(EventType::Task, t, i); });
+                    }
+                });
+            }
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+            queue.Stop();
+            passed = Check(queue.GetCompletedCount() == uint64_t(taskCount) * threadCount, "the completed count is wrong") && passed;
+        }
+
+        std::vector<int> next(threadCount, 0);
+        for (const auto& event : log.events)
+        {
+            if (event.poster < 0 || event.poster >= threadCount || event.sequence != next[event.poster])
+            {
+                passed = Check(false, "the tasks of a thread ran out of order or twice");
+                break;
+            }
+            next[event.poster]++;
+        }
+        passed = Check(std::all_of(next.begin(), next.end(), [taskCount](int count) { return count == taskCount; }),
+            "tasks of a thread did not run") && passed;
+        return passed;
+    }
+
+    // Tasks posted by a task run after the tasks queued, and still run when posted before Stop() rejects them
+    bool CheckReentrantPost()
+    {
+        bool passed = true;
+        std::vector<int> order;
+        bool acceptedInside = false;
+        int accepted = 0;
+        int ran = 0;
+        {
+            CTaskQueue queue;
+            std::atomic<bool> stopping(false);
+            std::atomic<bool> posted(false);
+            std::atomic<bool> firstRan(false);
+            queue.Post([&]()
+            {
+                // the tasks below are queued first
+                while (!posted)
+                {
+                    std::this_thread::yield();
+                }
+                order.push_back(0);
+                acceptedInside = queue.Post([&order]() { order.push_back(2); });
+                firstRan = true;
+            });
+            queue.Post([&order]() { order.push_back(1); });
+
+            // posts from the thread of the queue until Stop() rejects them
+            queue.Post([&]()
+            {
+                while (!stopping)
+                {
+                    std::this_thread::yield();
+                }
+                while (queue.Post([&ran]() { ran++; }))
+                {
+                    accepted++;
+                    std::this_thread::yield();
+                }
+            });
+            posted = true;
+            std::thread stopper([&]()
+            {
+                // not before the first task has posted
+                while (!firstRan)
+                {
+                    std::this_thread::yield();
+                }
+                stopping = true;
+                queue.Stop();
+            });
+            stopper.join();
+        }
+        passed = Check(acceptedInside, "a task posted by a task has been rejected") && passed;
+        passed = Check(order.size() == 3 && order[0] == 0 && order[1] == 1 && order[2] == 2,
+            "a task posted by a task did not run after the tasks queued") && passed;
+        passed = Check(ran == accepted, "a task accepted before Stop() rejected the others did not run") && passed;
+        return passed;
+    }
+
+    double Percentile(std::vector<double>& values, double p)
+    {
+        std::sort(values.begin(), values.end());
+        return values[std::min(values.size() - 1, size_t(p * values.size()))];
+    }
+
+    // From Post() until the task starts, waiting for every task before posting the next one
+    void MeasureIdleLatency(int taskCount)
+    {
+        CTaskQueue queue;
+        std::vector<double> latencies;
+        latencies.reserve(taskCount);
+        for (int i = 0; i < taskCount; i++)
+        {
+            std::atomic<bool> done(false);
+            auto posted = Clock::now();
+            queue.Post([&]()
+            {
+                latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - posted).count());
+                done = true;
+            });
+            while (!done)
+            {
+                std::this_thread::yield();
+            }
+        }
+        std::printf("%-24s p50 %8.2f us   p99 %8.2f us\n", "idle queue", Percentile(latencies, 0.5), Percentile(latencies, 0.99));
+    }
+
+    // Tasks posted as fast as possible by several threads
+    void MeasureThroughput(int taskCount, int threadCount)
+    {
+        auto start = Clock::now();
+        uint64_t completed = 0;
+        {
+            CTaskQueue queue;
+            std::vector<std::thread> threads;
+            for (int t = 0; t < threadCount; t++)
+            {
+                threads.emplace_back([&queue, taskCount]()
+                {
+                    for (int i = 0; i < taskCount; i++)
+                    {
+                        queue.Post([]() {});
+                    }
+                });
+            }
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+            queue.Stop();
+            completed = queue.GetCompletedCount();
+        }
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        std::printf("%-24s %8.2f Mtasks/s from %d threads\n", "posted and run", completed / ms / 1000, threadCount);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int taskCount = std::max(argc > 1 ? std::atoi(argv[1]) : 100000, 1);
+    int threadCount = std::max(argc > 2 ? std::atoi(argv[2]) : 4, 1);
+
+    bool passed = true;
+    passed = CheckOrder(std::min(taskCount, 10000)) && passed;
+    passed = CheckPosters(taskCount, threadCount) && passed;
+    passed = CheckReentrantPost() && passed;
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+        return 1;
+    }
+    std::printf("the tasks run in order between the hooks, Stop() runs the tasks queued and rejects the others\n");
+
+    MeasureIdleLatency(std::min(taskCount, 20000));
+    MeasureThroughput(taskCount, threadCount);
+    return 0;
+}
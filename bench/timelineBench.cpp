@@ -0,0 +1,135 @@
+// What a span of the scan timeline costs, disabled and enabled, from several threads at once as the pipeline records them.
+// The exported trace is checked to hold every span with its thread.
+// usage: timelineBench [spans] [threads]
+//   spans: spans recorded by every thread, 1000000 by default
+//   threads: 4 by default
+// Exits with 1 if the trace is not as recorded
+#include "stdafx.h"
+#include "timeline.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <thread>
+
+using namespace scanner::util;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // keeps the loop from being optimized away
+    std::atomic<uint64_t> g_sink(0);
+
+    // ns per span, each thread recording spans in a loop
+    double RecordSpans(CTimeline& timeline, int spanCount, int threadCount)
+    {
+        std::vector<std::thread> threads;
+        auto start = Clock::now();
+        for (int t = 0; t < threadCount; t++)
+        {
+            threads.emplace_back([&timeline, spanCount]()
+            {
+                uint64_t sum = 0;
+                for (int i = 0; i < spanCount; i++)
+                {
+                    CTimelineSpan span(timeline, "TransferPage", "transfer", "page", i);
+                    sum += i;
+                }
+                g_sink += sum;
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / spanCount;
+    }
+
+    size_t CountOccurrences(const std::string& text, const std::string& pattern)
+    {
+        size_t count = 0;
+        for (size_t position = text.find(pattern); position != std::string::npos; position = text.find(pattern, position + 1))
+        {
+            count++;
+        }
+        return count;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int spanCount = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    int threadCount = std::max(argc > 2 ? std::atoi(argv[2]) : 4, 1);
+    std::printf("%d spans on each of %d threads\n", spanCount, threadCount);
+
+    bool passed = true;
+
+    // an empty loop for reference
+    {
+        auto start = Clock::now();
+        uint64_t sum = 0;
+        for (int i = 0; i < spanCount; i++)
+        {
+            sum += i;
+            g_sink.store(sum, std::memory_order_relaxed);
+        }
+        std::printf("loop only      %7.2f ns per iteration\n", std::chrono::duration<double, std::nano>(Clock::now() - start).count() / spanCount);
+    }
+
+    CTimeline timeline;
+    double disabledNs = RecordSpans(timeline, spanCount, threadCount);
+    if (!timeline.GetSpans().empty())
+    {
+        std::printf("FAILED: spans recorded while disabled\n");
+        passed = false;
+    }
+    std::printf("disabled       %7.2f ns per span and thread\n", disabledNs);
+
+    timeline.Enable(true);
+    double enabledNs = RecordSpans(timeline, spanCount, threadCount);
+    uint64_t recorded = uint64_t(spanCount) * threadCount;
+    std::printf("enabled        %7.2f ns per span and thread, %llu spans kept, %llu dropped\n", enabledNs,
+        (unsigned long long)timeline.GetSpans().size(), (unsigned long long)timeline.GetDroppedCount());
+    if (timeline.GetSpans().size() + timeline.GetDroppedCount() != recorded)
+    {
+        std::printf("FAILED: %llu spans recorded instead of %llu\n",
+            (unsigned long long)(timeline.GetSpans().size() + timeline.GetDroppedCount()), (unsigned long long)recorded);
+        passed = false;
+    }
+
+    // a timeline as small as a scan makes, every span exported
+    timeline.Enable(false);
+    timeline.Enable(true);
+    int exportCount = std::min(spanCount, 1000);
+    RecordSpans(timeline, exportCount, threadCount);
+    timeline.Enable(false);
+
+    auto start = Clock::now();
+    std::string trace = timeline.ToChromeTrace();
+    double exportMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    std::set<uint32_t> threadIds;
+    for (const auto& span : timeline.GetSpans())
+    {
+        threadIds.insert(span.threadId);
+    }
+    size_t exported = CountOccurrences(trace, "\"ph\":\"X\"");
+    std::printf("export         %zu spans of %zu threads, %zu KB of JSON in %.2f ms\n",
+        exported, threadIds.size(), trace.size() / 1024, exportMs);
+    if (exported != size_t(exportCount) * threadCount || threadIds.size() != size_t(threadCount) ||
+        trace.compare(0, 16, "{\"traceEvents\":[") != 0 || trace.back() != '}')
+    {
+        std::printf("FAILED: the trace doesn't hold the spans recorded\n");
+        passed = false;
+    }
+
+    if (!passed)
+    {
+        std::printf("FAILED\n");
+    }
+    return passed ? 0 : 1;
+}
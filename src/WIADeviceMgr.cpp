@@ -1,36 +1,152 @@
 ﻿#include "stdafx.h"
 #include "WIADeviceMgr.h"
+#include "memoryStream.h"
+#include "forwardingStream.h"
+#include "fileSinkStream.h"
+#include "transferTrace.h"
+#include "callTimings.h"
+#include "wicCodec.h"
+#include "rawScan.h"
+#include "jpegEncoder.h"
+#include "tiffG4Encoder.h"
+#include "documentWriter.h"
+#include "watchdog.h"
+#include "propertyBatch.h"
 
 #include <experimental/filesystem>
+#include <chrono>
 
 namespace scanner
 {
+    // COM environment of the helper threads: the page pipeline and the scan watchdog
+    static thread_local std::unique_ptr<util::COMEnvironment> t_workerComEnvironment;
+
+    // pixels darker than this are black in G4 compressed pages
+    static const uint8_t G4Threshold = 128;
+
+    // raw scanlines are taken directly, everything else goes through WIC
+    static bool DecodePage(const util::CMemoryBuffer& data, util::RawImage& image)
+    {
+        return util::DecodeRawScan(data.Data(), data.Size(), image) ||
+            SUCCEEDED(util::DecodeImage(data.Data(), data.Size(), image));
+    }
+
+    static_assert(int(util::TransferMessage::Status) == WIA_TRANSFER_MSG_STATUS &&
+        int(util::TransferMessage::EndOfStream) == WIA_TRANSFER_MSG_END_OF_STREAM &&
+        int(util::TransferMessage::EndOfTransfer) == WIA_TRANSFER_MSG_END_OF_TRANSFER &&
+        int(util::TransferMessage::DeviceStatus) == WIA_TRANSFER_MSG_DEVICE_STATUS &&
+        int(util::TransferMessage::NewPage) == WIA_TRANSFER_MSG_NEW_PAGE, "the messages of a trace are those of WIA");
+
+    static util::TransferParams TransferParamsFromWIA(const WiaTransferParams& params)
+    {
+        util::TransferParams transferParams;
+        transferParams.message = util::TransferMessage(params.lMessage);
+        transferParams.percentComplete = params.lPercentComplete;
+        transferParams.transferredBytes = params.ulTransferredBytes;
+        transferParams.errorStatus = params.hrErrorStatus;
+        return transferParams;
+    }
+
+    // A document written to a file
+    class CStreamDocumentSink : public util::IDocumentSink
+    {
+    public:
+        explicit CStreamDocumentSink(ATL::CComPtr<IStream> pStream)
+            : m_pStream(pStream)
+        {
+        }
+
+        bool Write(const void* data, size_t size) override
+        {
+            ULONG writtenSize = 0;
+            return SUCCEEDED(m_pStream->Write(data, ULONG(size), &writtenSize)) && writtenSize == size;
+        }
+
+        bool Patch(uint64_t offset, const void* data, size_t size) override
+        {
+            LARGE_INTEGER position;
+            position.QuadPart = LONGLONG(offset);
+            LARGE_INTEGER end = {};
+
+            // back to the end for the next write
+            ULONG writtenSize = 0;
+            return SUCCEEDED(m_pStream->Seek(position, STREAM_SEEK_SET, NULL)) &&
+                SUCCEEDED(m_pStream->Write(data, ULONG(size), &writtenSize)) && writtenSize == size &&
+                SUCCEEDED(m_pStream->Seek(end, STREAM_SEEK_END, NULL));
+        }
+
+    private:
+        ATL::CComPtr<IStream> m_pStream;
+    };
+
     // The callback used to write data fetched from WIA interface to file
     class CScanTransferCallback : public IWiaTransferCallback
     {
     public:
         CScanTransferCallback(CWIADevice& device,
             ATL::CComPtr<IWiaTransfer> transferInterface,
-            const std::wstring& saveDirectory,
-            const std::wstring& saveFilename,
+            const ScanOptions& options,
             const std::wstring& fileExtension,
             bool isFeeder,
-            ScanProgressCallback progressCallback = nullptr)
+            bool isDuplex,
+            ScanProgressCallback progressCallback = nullptr,
+            ScanDataCallback dataCallback = nullptr,
+            ScanPageCallback pageCallback = nullptr)
             : m_device(device)
             , m_pTransferInterface(transferInterface)
             , m_cRef(1)
             , m_fileIndex(0)
             , m_pageCount(0)
             , m_bFeeder(isFeeder)
-            , m_saveDirectoryName(saveDirectory)
-            , m_saveFilename(saveFilename)
+            , m_bDuplex(isDuplex)
+            , m_output(options.output)
+            , m_saveDirectoryName(options.saveDirectory)
+            , m_saveFilename(options.saveFilename)
             , m_fileExtension(fileExtension)
             , m_progressCallback(progressCallback)
+            , m_dataCallback(dataCallback)
+            , m_pageCallback(pageCallback)
+            , m_bTransferCancelled(false)
+            , m_hashOptions(options.hash)
+            , m_documentFormat(options.document)
+            , m_documentQuality(options.pipeline.quality)
+            , m_nextDocumentPage(0)
+            , m_hrDocument(S_OK)
+            , m_expectedPageSize(0)
+            , m_timeline(device.GetTimeline())
+            , m_metrics(device.GetMetrics())
+            , m_transferStartTime(std::chrono::steady_clock::now())
+            , m_bFirstByte(false)
+            , m_submittedPages(0)
         {
             assert(m_pTransferInterface);
-            assert(!m_saveDirectoryName.empty());
-            assert(!m_saveFilename.empty());
+            assert(m_output != ScanOutput::File || !m_saveDirectoryName.empty());
+            assert(m_output != ScanOutput::File || !m_saveFilename.empty());
             assert(!m_fileExtension.empty());
+
+            if (m_documentFormat != util::DocumentFormat::None && m_output == ScanOutput::File)
+            {
+                m_document.filePath = m_saveDirectoryName + L"\\" + m_saveFilename + L"." + m_fileExtension;
+            }
+
+            if (m_output == ScanOutput::File)
+            {
+                m_pFileWriter = std::make_shared<util::CFileWriter>(options.fileSink);
+            }
+
+            if (options.pipeline.IsEnabled())
+            {
+                CreatePipeline(options.pipeline);
+            }
+
+            if (!options.traceFile.empty())
+            {
+                m_pTraceRecorder.reset(new util::CTransferTraceRecorder());
+                if (!m_pTraceRecorder->Open(options.traceFile, options.traceData))
+                {
+                    m_pTraceRecorder.reset();
+                }
+            }
         }
         virtual ~CScanTransferCallback()
         {
@@ -85,32 +201,35 @@ namespace scanner
                 return E_INVALIDARG;
             }
 
+            if (m_pTraceRecorder)
+            {
+                m_pTraceRecorder->RecordMessage(TransferParamsFromWIA(*pWiaTransferParams));
+            }
+
+            // checked on every message, some drivers report the status rarely
+            if (CheckCancelled())
+            {
+                return E_ABORT;
+            }
+
             switch (pWiaTransferParams->lMessage)
             {
             case WIA_TRANSFER_MSG_STATUS:
             {
-                if (!pWiaTransferParams->lPercentComplete)
+                // from the start of the transfer until the driver delivers data, the scanner warming up
+                if (!m_bFirstByte && pWiaTransferParams->ulTransferredBytes && m_timeline.IsEnabled())
                 {
-                    m_pageCount++;
+                    m_bFirstByte = true;
+                    m_timeline.AddSpan("WaitForFirstByte", "transfer", m_transferStartTime, std::chrono::steady_clock::now());
                 }
 
-                ScanProgressInfo progressInfo;
-
-                progressInfo.pageCount = m_pageCount;
-                progressInfo.percentComplete = pWiaTransferParams->lPercentComplete;
-                progressInfo.bytesTransferred = pWiaTransferParams->ulTransferredBytes;
-                progressInfo.error = pWiaTransferParams->hrErrorStatus;
-
-                if (m_progressCallback)
+                if (!pWiaTransferParams->lPercentComplete)
                 {
-                    m_progressCallback(progressInfo);
+                    m_pageCount++;
+                    ReportProgress(ScanProgressType::PageStart, pWiaTransferParams);
                 }
 
-                if (!m_device.IsScanRunning())
-                {
-                    HRESULT cancelResult = m_pTransferInterface->Cancel();
-                    return E_ABORT;
-                }
+                ReportProgress(ScanProgressType::Status, pWiaTransferParams);
             }
             break;
             case WIA_TRANSFER_MSG_NEW_PAGE:
@@ -123,6 +242,12 @@ namespace scanner
             break;
             case WIA_TRANSFER_MSG_END_OF_STREAM:
             {
+                ReportProgress(ScanProgressType::PageEnd, pWiaTransferParams);
+                m_metrics.bytes.Add(pWiaTransferParams->ulTransferredBytes);
+                EndPage();
+
+                // the page is processed while the next one is being transferred
+                SubmitPagesToPipeline();
             }
             break;
             case WIA_TRANSFER_MSG_END_OF_TRANSFER:
@@ -137,224 +262,1008 @@ namespace scanner
         }
         HRESULT STDMETHODCALLTYPE GetNextStream(LONG lFlags, BSTR bstrItemName, BSTR bstrFullItemName, IStream** ppDestination) override
         {
-            HRESULT hr = S_OK;
-
-            if ((!ppDestination) || (!bstrItemName) || (m_saveDirectoryName.empty()))
+            if ((!ppDestination) || (!bstrItemName))
             {
                 return E_INVALIDARG;
             }
             *ppDestination = NULL;
 
-            const int pathMaxSize = 1000;
-            std::unique_ptr<wchar_t[]> savePathBuf(new wchar_t[pathMaxSize]());
-
-            if (!m_fileExtension.empty())
+            if (m_pTraceRecorder)
             {
-                // Add page index after filename if the scanner is a feeder
-                if (m_bFeeder)
-                {
-                    m_fileIndex++;
-                    swprintf_s(savePathBuf.get(), pathMaxSize, L"%s\\%s_%d.%s", m_saveDirectoryName.c_str(), m_saveFilename.c_str(), m_fileIndex, m_fileExtension.c_str());
-                }
-                else
-                {
-                    swprintf_s(savePathBuf.get(), pathMaxSize, L"%s\\%s.%s", m_saveDirectoryName.c_str(), m_saveFilename.c_str(), m_fileExtension.c_str());
-                }
+                m_pTraceRecorder->RecordNextStream();
             }
-            else
+
+            // don't start another page
+            if (CheckCancelled())
             {
-                swprintf_s(savePathBuf.get(), pathMaxSize, L"%s\\%s", m_saveDirectoryName.c_str(), m_saveFilename.c_str());
+                return S_FALSE;
             }
 
-            hr = SHCreateStreamOnFileW(savePathBuf.get(), STGM_CREATE | STGM_READWRITE, ppDestination);
-            if (SUCCEEDED(hr))
+            ATL::CComPtr<IStream> pStream;
+            HRESULT hr = S_OK;
+            if (m_pPipeline)
+            {
+                hr = CreatePipelineStream(pStream);
+            }
+            else if (m_output == ScanOutput::Buffer || m_documentFormat != util::DocumentFormat::None)
             {
-                m_saveFilePaths.push_back(savePathBuf.get());
+                // the pages of a document are kept in memory until appended
+                hr = CreateMemoryStream(pStream);
             }
             else
             {
-                *ppDestination = NULL;
+                hr = CreateFileStream(pStream);
             }
-            return hr;
-        }
 
-        std::vector<std::wstring> GetSaveFilePaths() const
-        {
-            return m_saveFilePaths;
-        }
+            if (FAILED(hr))
+            {
+                return hr;
+            }
 
-    private:
-        CWIADevice& m_device;
-        ATL::CComPtr<IWiaTransfer> m_pTransferInterface;
+            // hashed while the driver writes it,
+            // the pages processed by the pipeline are hashed once encoded and those of a document with the document
+            if (m_hashOptions.IsEnabled() && !m_pPipeline && m_documentFormat == util::DocumentFormat::None)
+            {
+                m_pHashingStream.Attach(new util::CHashingStream(pStream, m_hashOptions));
+                pStream = m_pHashingStream.p;
+            }
 
-        ULONG m_cRef;
-        long m_fileIndex;
-        bool m_bFeeder;                     // is the scanner a Feeder
+            // kept until the end of the page to report it
+            m_pPageStream = pStream;
+            m_pageStartTime = std::chrono::steady_clock::now();
 
-        long m_pageCount;
+            // pass the data to the callback while the driver is writing the page
+            if (m_dataCallback)
+            {
+                long page = long(m_scannedPages.size());
+                ScanDataCallback dataCallback = m_dataCallback;
 
-        std::wstring m_saveDirectoryName;   // save directory
-        std::wstring m_saveFilename;        // file name
-        std::wstring m_fileExtension;       // file extension
+                ATL::CComPtr<IStream> pTeeStream;
+                pTeeStream.Attach(new util::CTeeStream(pStream,
+                    [page, dataCallback](ULONGLONG position, const void* data, ULONG size) -> bool
+                {
+                    return dataCallback(page, position, data, size);
+                }));
+                pStream = pTeeStream;
+            }
 
-        std::vector<std::wstring> m_saveFilePaths;
+            // the outermost stream, the writes are recorded when the driver makes them
+            if (m_pTraceRecorder)
+            {
+                util::CTransferTraceRecorder* pTraceRecorder = m_pTraceRecorder.get();
 
-        ScanProgressCallback m_progressCallback;
-    };
+                ATL::CComPtr<IStream> pTraceStream;
+                pTraceStream.Attach(new util::CTeeStream(pStream,
+                    [pTraceRecorder](ULONGLONG position, const void* data, ULONG size) -> bool
+                {
+                    pTraceRecorder->RecordWrite(position, data, size);
+                    return true;
+                }));
+                pStream = pTraceStream;
+            }
 
-    CWIADeviceMgr::CWIADeviceMgr()
-    {
-        if (FAILED(CreateWIADeviveManager()) || FAILED(CreateWIADeviceInterfaceTable()))
-        {
-            throw std::runtime_error("Unable to create instance of IWiaDevMgr!");
+            *ppDestination = pStream.Detach();
+            return S_OK;
         }
-    }
-
-
-    CWIADeviceMgr::~CWIADeviceMgr()
-    {
-    }
-
-    ATL::CComPtr<IWiaDevMgr2> CWIADeviceMgr::get() const
-    {
-        return m_pWiaDevMgr;
-    }
-
-    std::unique_ptr<CWIADeviceMgr>& CWIADeviceMgr::GetInstance()
-    {
-        static std::unique_ptr<CWIADeviceMgr> instance(new CWIADeviceMgr());
-        return instance;
-    }
-
-    ATL::CComPtr<IGlobalInterfaceTable> CWIADeviceMgr::GetInterfaceTable()
-    {
-        return m_pWiaDeviceTable;
-    }
-
-    std::shared_ptr<CWIADevice> CWIADeviceMgr::OpenWIADevice(const std::wstring& deviceId)
-    {
-        try
-        {
-            auto pDevice = std::make_shared<CWIADevice>(deviceId, *this);
 
-            return pDevice;
-        }
-        catch (const std::exception&)
+        std::vector<ScannedPage> GetScannedPages() const
         {
-            return nullptr;
+            return m_scannedPages;
         }
 
-    }
-    static void AssignDevicePropertyValue(WIADeviceProperties& props, const PROPSPEC& key, const PROPVARIANT& value)
-    {
-        if (key.ulKind == PRSPEC_PROPID)
+        // Wait for the pipeline to complete the pages, the blank pages are removed from the scanned pages
+        void FinishPipeline(util::PipelineStats* pipelineStats)
         {
-            if (key.propid == WIA_DIP_DEV_ID && value.vt == VT_BSTR)
+            if (!m_pPipeline)
             {
-                props.deviceUUID = value.bstrVal;
+                return;
             }
-            if (key.propid == WIA_DIP_VEND_DESC && value.vt == VT_BSTR)
+
+            // A page not ended has not been submitted, e.g. the transfer has been cancelled.
+            // It is delivered as it is, left out of a document
+            auto processedPages = m_pPipeline->Finish();
+            if (pipelineStats)
             {
-                props.manufacturer = value.bstrVal;
+                *pipelineStats = m_pPipeline->GetStats();
             }
-            if (key.propid == WIA_DIP_DEV_DESC && value.vt == VT_BSTR)
+
+            // the pages processed have been appended
+            if (m_documentFormat != util::DocumentFormat::None)
             {
-                props.description = value.bstrVal;
+                return;
             }
-            if (key.propid == WIA_DIP_DEV_TYPE && value.vt == VT_I4)
+
+            std::map<long, util::ProcessedPage*> processedPageMap;
+            for (auto& page : processedPages)
             {
-                props.type = value.intVal;
+                processedPageMap[page.index] = &page;
             }
-            if (key.propid == WIA_DIP_PORT_NAME && value.vt == VT_BSTR)
+
+            std::vector<ScannedPage> scannedPages;
+            for (long i = 0; i < long(m_scannedPages.size()); i++)
             {
-                props.port = value.bstrVal;
+                ScannedPage page = m_scannedPages[i];
+
+                auto it = processedPageMap.find(i);
+                if (it == processedPageMap.end())
+                {
+                    if (!page.buffer)
+                    {
+                        continue;
+                    }
+                    if (m_hashOptions.IsEnabled())
+                    {
+                        page.digest = util::HashBuffer(m_hashOptions, page.buffer->Data(), page.buffer->Size());
+                    }
+                    if (m_output == ScanOutput::File)
+                    {
+                        WriteBufferToFile(page.filePath, *page.buffer);
+                        page.buffer.reset();
+                    }
+                    scannedPages.push_back(page);
+                    continue;
+                }
+
+                util::ProcessedPage& processedPage = *it->second;
+                if (processedPage.blank)
+                {
+                    continue;
+                }
+
+                // files have been written by the pipeline, the data is kept for buffers only
+                page.buffer = (m_output == ScanOutput::Buffer) ? processedPage.data : nullptr;
+                page.digest = m_processedDigests[i];
+                page.thumbnails = processedPage.thumbnails;
+                scannedPages.push_back(page);
             }
-            if (key.propid == WIA_DIP_DEV_NAME && value.vt == VT_BSTR)
+            m_scannedPages = scannedPages;
+        }
+
+        // Complete the document, it replaces the pages in the result.
+        // Returns an error if a page could not be appended
+        HRESULT FinishDocument()
+        {
+            if (m_documentFormat == util::DocumentFormat::None)
             {
-                props.deviceName = value.bstrVal;
+                return S_OK;
             }
-            if (key.propid == WIA_DIP_SERVER_NAME && value.vt == VT_BSTR)
+
+            std::lock_guard<std::mutex> g(m_lockDocument);
+            m_scannedPages.clear();
+
+            // no page
+            if (!m_pDocumentWriter)
             {
-                props.server = value.bstrVal;
+                return m_hrDocument;
             }
-            if (key.propid == WIA_DIP_REMOTE_DEV_ID && value.vt == VT_BSTR)
+
+            if (!m_pDocumentWriter->Finish() && SUCCEEDED(m_hrDocument))
             {
-                props.remoteDeviceId = value.bstrVal;
+                m_hrDocument = E_FAIL;
             }
-            if (key.propid == WIA_DIP_UI_CLSID && value.vt == VT_BSTR)
+
+            // the pages of a TIFF are linked afterwards, such a file is read again
+            if (SUCCEEDED(m_hrDocument) && m_hashOptions.IsEnabled())
             {
-                props.uiClassId = value.bstrVal;
+                if (m_pDocumentHashingStream)
+                {
+                    m_pDocumentHashingStream->GetDigest(m_document.digest);
+                }
+                else if (m_document.buffer)
+                {
+                    m_document.digest = util::HashBuffer(m_hashOptions, m_document.buffer->Data(), m_document.buffer->Size());
+                }
             }
-            if (key.propid == WIA_DIP_HW_CONFIG && value.vt == VT_I4)
+
+            // the file is closed
+            m_pDocumentWriter.reset();
+            m_pDocumentSink.reset();
+            m_pDocumentHashingStream.Release();
+
+            m_scannedPages.push_back(m_document);
+            return m_hrDocument;
+        }
+
+        // The size of the pages if known before the transfer, their files are reserved on the disk at once
+        void SetExpectedPageSize(uint64_t size)
+        {
+            m_expectedPageSize = size;
+        }
+
+        // Wait until every file is written and flushed as ScanOptions::fileSink asks.
+        // Returns an error if a file could not be written
+        HRESULT FinishFiles()
+        {
+            if (!m_pFileWriter)
             {
-                props.hardwareConfig = value.intVal;
+                return S_OK;
             }
-            if (key.propid == WIA_DIP_BAUDRATE && value.vt == VT_BSTR)
+
+            // a page not ended, e.g. the transfer has been cancelled
+            m_pPageStream.Release();
+            m_pHashingStream.Release();
+            if (m_pPageFile)
             {
-                props.baudrate = value.bstrVal;
+                m_pPageFile->Close();
+                m_pPageFile.reset();
             }
-            if (key.propid == WIA_DIP_STI_GEN_CAPABILITIES && value.vt == VT_I4)
+
+            bool succeeded = m_pFileWriter->Finish();
+
+            util::FileSinkStats stats = m_pFileWriter->GetStats();
+            if (stats.waitMs > 0)
             {
-                props.STIGenericCapabilities = value.intVal;
+                util::CCallTimings::GetInstance().Record("CFileWriter::WaitForDisk", stats.waitMs);
             }
-            if (key.propid == WIA_DIP_WIA_VERSION && value.vt == VT_BSTR)
+            if (stats.flushMs > 0)
             {
-                props.WIAVersion = value.bstrVal;
+                util::CCallTimings::GetInstance().Record("CFileWriter::Flush", stats.flushMs);
             }
-            if (key.propid == WIA_DIP_DRIVER_VERSION && value.vt == VT_BSTR)
+            return succeeded ? S_OK : STG_E_WRITEFAULT;
+        }
+
+        // Complete the trace of the transfer if it is recorded, a trace not written doesn't fail the scan
+        void FinishTrace()
+        {
+            if (m_pTraceRecorder)
             {
-                props.DriverVersion = value.bstrVal;
+                m_pTraceRecorder->Close();
             }
-            if (key.propid == WIA_DIP_PNP_ID && value.vt == VT_BSTR)
+        }
+
+    private:
+        // Returns true if the scan has been cancelled, the transfer is cancelled on the first call
+        bool CheckCancelled()
+        {
+            if (m_device.GetScanState() != util::ScanState::Cancelling)
             {
-                props.PnPIDString = value.bstrVal;
+                return false;
             }
-            if (key.propid == WIA_DIP_STI_DRIVER_VERSION && value.vt == VT_I4)
+
+            if (!m_bTransferCancelled.exchange(true))
             {
-                props.STIDriverVersion = value.intVal;
+                m_pTransferInterface->Cancel();
             }
+            return true;
         }
-    }
-    static std::shared_ptr<WIADeviceProperties> ReadDeviceProperties(ATL::CComPtr<IWiaPropertyStorage> deviceInfo)
-    {
-        HRESULT hr = S_OK;
-
-        ULONG propertyValueCount = 0;
-        hr = deviceInfo->GetCount(&propertyValueCount);
-
-        // properties value list
-        std::unique_ptr<PROPSPEC[]> propKeys(new PROPSPEC[propertyValueCount]());
-        std::unique_ptr<PROPVARIANT[]> propValues(new PROPVARIANT[propertyValueCount]());
 
-        // find what kind of property available for the current WIA device
+        void ReportProgress(ScanProgressType type, const WiaTransferParams* pWiaTransferParams)
         {
-            ATL::CComPtr<IEnumSTATPROPSTG> propEnumrator;
-            hr = deviceInfo->Enum(&propEnumrator);
-            if (FAILED(hr))
+            if (!m_progressCallback)
             {
-                return nullptr;
+                return;
             }
 
-            int propertyIndex = 0;
-            while (hr == S_OK)
-            {
-                STATPROPSTG propertyInfo = { 0 };
-                ULONG fetched = 0;
-                hr = propEnumrator->Next(1, &propertyInfo, &fetched);
+            ScanProgressInfo progressInfo;
 
-                propKeys[propertyIndex].ulKind = PRSPEC_PROPID;
-                propKeys[propertyIndex].propid = propertyInfo.propid;
+            progressInfo.type = type;
+            progressInfo.pageCount = m_pageCount;
+            progressInfo.percentComplete = pWiaTransferParams->lPercentComplete;
+            progressInfo.bytesTransferred = pWiaTransferParams->ulTransferredBytes;
+            progressInfo.error = pWiaTransferParams->hrErrorStatus;
 
-                if (propertyInfo.lpwstrName)
-                {
-                    CoTaskMemFree(propertyInfo.lpwstrName);
-                }
-                propertyIndex++;
-            }
+            m_progressCallback(progressInfo);
         }
 
-        // Read property value
-        // The last property value will be ignored. it is empty.
+        void CreatePipeline(const util::PipelineOptions& options)
+        {
+            util::PageDecoder decoder = DecodePage;
+
+            util::PageEncoder encoder = [](const util::RawImage& image, const util::PipelineOptions& options, std::shared_ptr<util::CMemoryBuffer> data) -> bool
+            {
+                if (options.imageFormat == L"jpeg")
+                {
+                    return util::EncodeJpeg(image, options.quality, *data);
+                }
+                if (options.imageFormat == L"tiff-g4")
+                {
+                    return util::EncodeTiffG4(image, G4Threshold, *data);
+                }
+                return SUCCEEDED(util::EncodeImage(image, options.imageFormat, options.quality, data));
+            };
+
+            m_pPipeline.reset(new util::CImagePipeline(options, decoder, encoder,
+                [this](util::ProcessedPage& page)
+            {
+                OnPageProcessed(page);
+            },
+                []()
+            {
+                t_workerComEnvironment.reset(new util::COMEnvironment(COINIT_MULTITHREADED));
+            },
+                []()
+            {
+                t_workerComEnvironment.reset();
+            }));
+        }
+
+        // The page is acquired in memory, the pipeline writes the file once the page is processed
+        HRESULT CreatePipelineStream(ATL::CComPtr<IStream>& pStream)
+        {
+            ScannedPage page;
+            page.buffer = std::make_shared<util::CMemoryBuffer>();
+
+            if (m_output == ScanOutput::File && m_documentFormat == util::DocumentFormat::None)
+            {
+                page.filePath = MakeFilePath();
+                if (page.filePath.empty())
+                {
+                    return E_INVALIDARG;
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> g(m_lockPendingPages);
+                ScanPageInfo& pendingPage = m_pendingPages[long(m_scannedPages.size())];
+                pendingPage.index = long(m_scannedPages.size());
+                pendingPage.filePath = page.filePath;
+            }
+
+            pStream.Attach(new util::CMemoryStream(page.buffer));
+            m_scannedPages.push_back(page);
+            return S_OK;
+        }
+
+        void SubmitPagesToPipeline()
+        {
+            if (!m_pPipeline)
+            {
+                return;
+            }
+
+            // blocks while the pipeline is full, the transfer is slowed down instead of piling up pages in memory
+            for (; m_submittedPages < long(m_scannedPages.size()); m_submittedPages++)
+            {
+                // the pipeline owns the data from now on and releases it once the file is written,
+                // the page keeps its path only
+                ScannedPage& page = m_scannedPages[m_submittedPages];
+                if (m_pPipeline->SubmitPage(m_submittedPages, page.buffer))
+                {
+                    page.buffer.reset();
+                }
+            }
+        }
+
+        // called on a thread of the pipeline
+        void OnPageProcessed(util::ProcessedPage& page)
+        {
+            ScanPageInfo pageInfo;
+            {
+                std::lock_guard<std::mutex> g(m_lockPendingPages);
+                pageInfo = m_pendingPages[page.index];
+                m_pendingPages.erase(page.index);
+            }
+            pageInfo.thumbnails = page.thumbnails;
+
+            if (m_documentFormat != util::DocumentFormat::None)
+            {
+                // a blank page lets the pages after it be appended
+                QueueDocumentPage(pageInfo, page.blank ? nullptr : page.data);
+                page.data.reset();
+                return;
+            }
+
+            if (page.blank || !page.data)
+            {
+                return;
+            }
+
+            pageInfo.size = page.data->Size();
+            if (m_hashOptions.IsEnabled())
+            {
+                // hashed in memory, before it is written
+                pageInfo.digest = util::HashBuffer(m_hashOptions, page.data->Data(), page.data->Size());
+
+                std::lock_guard<std::mutex> g(m_lockPendingPages);
+                m_processedDigests[page.index] = pageInfo.digest;
+            }
+
+            if (m_output == ScanOutput::File)
+            {
+                // reported once the file is written
+                ScanPageCallback pageCallback = m_pageCallback;
+                HRESULT hr = WriteBufferToFile(pageInfo.filePath, *page.data, [pageCallback, pageInfo](bool succeeded)
+                {
+                    if (succeeded && pageCallback)
+                    {
+                        pageCallback(pageInfo);
+                    }
+                });
+
+                // the page is copied to the buffers of the file, release the memory as early as possible
+                page.data.reset();
+
+                if (FAILED(hr))
+                {
+                    page.succeeded = false;
+                    page.errorMessage = "unable to write the file";
+                }
+                return;
+            }
+
+            pageInfo.buffer = page.data;
+            if (m_pageCallback)
+            {
+                m_pageCallback(pageInfo);
+            }
+        }
+
+        // The stream of the page has ended, reported at once unless the pipeline processes the page
+        void EndPage()
+        {
+            if (!m_pPageStream)
+            {
+                return;
+            }
+
+            ATL::CComPtr<IStream> pStream;
+            pStream.Attach(m_pPageStream.Detach());
+
+            ScanPageInfo pageInfo;
+            pageInfo.index = long(m_scannedPages.size()) - 1;
+            pageInfo.side = (m_bDuplex && (pageInfo.index % 2)) ? ScanPageSide::Back : ScanPageSide::Front;
+            auto pageEndTime = std::chrono::steady_clock::now();
+            pageInfo.transferMs = std::chrono::duration<double, std::milli>(pageEndTime - m_pageStartTime).count();
+            m_metrics.pageTransfer.Record(pageEndTime - m_pageStartTime);
+            m_metrics.pages.Add();
+            if (m_timeline.IsEnabled())
+            {
+                m_timeline.AddSpan("TransferPage", "transfer", m_pageStartTime, pageEndTime, "page", pageInfo.index);
+            }
+
+            if (m_pHashingStream)
+            {
+                ATL::CComPtr<util::CHashingStream> pHashingStream;
+                pHashingStream.Attach(m_pHashingStream.Detach());
+                if (SUCCEEDED(pHashingStream->GetDigest(pageInfo.digest)))
+                {
+                    m_scannedPages.back().digest = pageInfo.digest;
+                }
+            }
+
+            if (m_pPipeline)
+            {
+                std::lock_guard<std::mutex> g(m_lockPendingPages);
+                ScanPageInfo& pendingPage = m_pendingPages[pageInfo.index];
+                pendingPage.side = pageInfo.side;
+                pendingPage.transferMs = pageInfo.transferMs;
+                return;
+            }
+
+            if (m_documentFormat != util::DocumentFormat::None)
+            {
+                // the memory of the page is released once it is in the document
+                QueueDocumentPage(pageInfo, m_scannedPages.back().buffer);
+                m_scannedPages.back().buffer.reset();
+                return;
+            }
+
+            const ScannedPage& page = m_scannedPages.back();
+            if (m_output == ScanOutput::File)
+            {
+                pageInfo.filePath = page.filePath;
+                ClosePageFile(pageInfo);
+                return;
+            }
+
+            if (m_pageCallback)
+            {
+                pageInfo.size = page.buffer->Size();
+                pageInfo.buffer = page.buffer;
+                m_pageCallback(pageInfo);
+            }
+        }
+
+        // The file of the page is closed behind the transfer, the page is reported once it is written
+        void ClosePageFile(ScanPageInfo pageInfo)
+        {
+            std::shared_ptr<util::CFileSink> pFile;
+            pFile.swap(m_pPageFile);
+            if (!pFile)
+            {
+                return;
+            }
+
+            // the next pages are likely as large, their files are reserved on the disk at once
+            pageInfo.size = pFile->Size();
+            m_expectedPageSize = (std::max)(m_expectedPageSize, pageInfo.size);
+
+            ScanPageCallback pageCallback = m_pageCallback;
+            pFile->Close([pageCallback, pageInfo](bool succeeded)
+            {
+                if (succeeded && pageCallback)
+                {
+                    pageCallback(pageInfo);
+                }
+            });
+        }
+
+        // The whole file is written behind, onClosed is called once it is.
+        // Called on a thread of the pipeline if there is one
+        HRESULT WriteBufferToFile(const std::wstring& filePath, const util::CMemoryBuffer& buffer, util::FileClosedCallback onClosed = nullptr)
+        {
+            auto pFile = m_pFileWriter->Create(filePath, buffer.Size());
+            if (!pFile)
+            {
+                return LastErrorResult();
+            }
+            if (!pFile->Write(buffer.Data(), buffer.Size()))
+            {
+                return STG_E_WRITEFAULT;
+            }
+            return pFile->Close(onClosed) ? S_OK : STG_E_WRITEFAULT;
+        }
+
+        static HRESULT LastErrorResult()
+        {
+            DWORD error = GetLastError();
+            return error ? HRESULT_FROM_WIN32(error) : STG_E_CANTSAVE;
+        }
+
+        // Append the pages in order, a page coming early waits for the previous ones.
+        // data is null for a page left out, e.g. a blank one.
+        // Called on a thread of the pipeline if there is one
+        void QueueDocumentPage(const ScanPageInfo& pageInfo, std::shared_ptr<util::CMemoryBuffer> data)
+        {
+            std::vector<ScanPageInfo> appendedPages;
+            {
+                std::lock_guard<std::mutex> g(m_lockDocument);
+                m_documentPages[pageInfo.index] = std::make_pair(pageInfo, data);
+
+                for (auto it = m_documentPages.find(m_nextDocumentPage); it != m_documentPages.end(); it = m_documentPages.find(m_nextDocumentPage))
+                {
+                    if (it->second.second)
+                    {
+                        uint64_t documentSize = m_pDocumentWriter ? m_pDocumentWriter->GetSize() : 0;
+                        if (AppendToDocument(*it->second.second))
+                        {
+                            ScanPageInfo appendedPage = it->second.first;
+                            appendedPage.filePath = m_document.filePath;
+                            appendedPage.size = m_pDocumentWriter->GetSize() - documentSize;
+                            appendedPages.push_back(appendedPage);
+                        }
+                    }
+                    m_documentPages.erase(it);
+                    m_nextDocumentPage++;
+                }
+            }
+
+            if (m_pageCallback)
+            {
+                for (const auto& appendedPage : appendedPages)
+                {
+                    m_pageCallback(appendedPage);
+                }
+            }
+        }
+
+        // JPEG and G4 pages are appended as they are, the other ones are decoded and compressed again.
+        // Called with m_lockDocument held
+        bool AppendToDocument(const util::CMemoryBuffer& data)
+        {
+            if (FAILED(m_hrDocument))
+            {
+                return false;
+            }
+
+            // the document is created with its first page
+            if (!m_pDocumentWriter)
+            {
+                m_hrDocument = OpenDocument();
+                if (FAILED(m_hrDocument))
+                {
+                    return false;
+                }
+            }
+
+            if (m_pDocumentWriter->AddEncodedPage(data.Data(), data.Size()))
+            {
+                return true;
+            }
+
+            util::RawImage image;
+            if (!DecodePage(data, image))
+            {
+                m_hrDocument = WIA_ERROR_INVALID_DRIVER_RESPONSE;
+                return false;
+            }
+            if (!m_pDocumentWriter->AddImagePage(image, G4Threshold, m_documentQuality))
+            {
+                m_hrDocument = E_FAIL;
+                return false;
+            }
+            return true;
+        }
+
+        HRESULT OpenDocument()
+        {
+            if (m_output == ScanOutput::File)
+            {
+                // the size of the document is not known
+                auto pFile = m_pFileWriter->Create(m_document.filePath);
+                if (!pFile)
+                {
+                    return LastErrorResult();
+                }
+                ATL::CComPtr<IStream> pStream;
+                pStream.Attach(new util::CFileSinkStream(pFile));
+                if (m_hashOptions.IsEnabled())
+                {
+                    m_pDocumentHashingStream.Attach(new util::CHashingStream(pStream, m_hashOptions));
+                    pStream = m_pDocumentHashingStream.p;
+                }
+                m_pDocumentSink.reset(new CStreamDocumentSink(pStream));
+            }
+            else
+            {
+                m_document.buffer = std::make_shared<util::CMemoryBuffer>();
+                m_pDocumentSink.reset(new util::CMemoryDocumentSink(*m_document.buffer));
+            }
+
+            m_pDocumentWriter.reset(new util::CDocumentWriter(m_documentFormat, *m_pDocumentSink));
+            return S_OK;
+        }
+
+        std::wstring MakeFilePath()
+        {
+            if (m_saveDirectoryName.empty())
+            {
+                return std::wstring();
+            }
+
+            const int pathMaxSize = 1000;
+            std::unique_ptr<wchar_t[]> savePathBuf(new wchar_t[pathMaxSize]());
+
+            if (!m_fileExtension.empty())
+            {
+                // Add page index after filename if the scanner is a feeder
+                if (m_bFeeder)
+                {
+                    m_fileIndex++;
+                    swprintf_s(savePathBuf.get(), pathMaxSize, L"%s\\%s_%d.%s", m_saveDirectoryName.c_str(), m_saveFilename.c_str(), m_fileIndex, m_fileExtension.c_str());
+                }
+                else
+                {
+                    swprintf_s(savePathBuf.get(), pathMaxSize, L"%s\\%s.%s", m_saveDirectoryName.c_str(), m_saveFilename.c_str(), m_fileExtension.c_str());
+                }
+            }
+            else
+            {
+                swprintf_s(savePathBuf.get(), pathMaxSize, L"%s\\%s", m_saveDirectoryName.c_str(), m_saveFilename.c_str());
+            }
+
+            return savePathBuf.get();
+        }
+
+        HRESULT CreateFileStream(ATL::CComPtr<IStream>& pStream)
+        {
+            std::wstring filePath = MakeFilePath();
+            if (filePath.empty())
+            {
+                return E_INVALIDARG;
+            }
+
+            // the driver only copies the data, the file is written behind the transfer
+            std::shared_ptr<util::CFileSink> pFile;
+            {
+                util::CTimelineSpan span(m_timeline, "CreateFile", "files", "page", long(m_scannedPages.size()));
+                pFile = m_pFileWriter->Create(filePath, m_expectedPageSize);
+            }
+            if (!pFile)
+            {
+                return LastErrorResult();
+            }
+            pStream.Attach(new util::CFileSinkStream(pFile));
+
+            // closed at the end of the page
+            m_pPageFile = pFile;
+
+            ScannedPage page;
+            page.filePath = filePath;
+            m_scannedPages.push_back(page);
+            return S_OK;
+        }
+
+        HRESULT CreateMemoryStream(ATL::CComPtr<IStream>& pStream)
+        {
+            ScannedPage page;
+            page.buffer = std::make_shared<util::CMemoryBuffer>();
+
+            // the buffer is shared by the stream and the page, it outlives the stream released by WIA
+            // and is detached into a JS Buffer once the scan completes
+            pStream.Attach(new util::CMemoryStream(page.buffer));
+            m_scannedPages.push_back(page);
+            return S_OK;
+        }
+
+    private:
+        CWIADevice& m_device;
+        ATL::CComPtr<IWiaTransfer> m_pTransferInterface;
+
+        ULONG m_cRef;
+        long m_fileIndex;
+        bool m_bFeeder;                     // is the scanner a Feeder
+        bool m_bDuplex;                     // the pages are front and back sides in turn
+
+        long m_pageCount;
+
+        ScanOutput m_output;                // where the pages go
+        std::wstring m_saveDirectoryName;   // save directory
+        std::wstring m_saveFilename;        // file name
+        std::wstring m_fileExtension;       // file extension
+
+        std::vector<ScannedPage> m_scannedPages;
+
+        ScanProgressCallback m_progressCallback;
+        ScanDataCallback m_dataCallback;
+        ScanPageCallback m_pageCallback;
+
+        ATL::CComPtr<IStream> m_pPageStream;                    // the page being transferred
+        std::chrono::steady_clock::time_point m_pageStartTime;
+
+        std::atomic<bool> m_bTransferCancelled;     // IWiaTransfer::Cancel() has been called
+
+        util::HashOptions m_hashOptions;            // digests of the files or buffers, none by default
+        ATL::CComPtr<util::CHashingStream> m_pHashingStream;   // the page being transferred, if hashed as it is written
+
+        // writes the files behind the transfer if the output is ScanOutput::File
+        std::shared_ptr<util::CFileWriter> m_pFileWriter;
+        std::shared_ptr<util::CFileSink> m_pPageFile;           // the file of the page being transferred
+        uint64_t m_expectedPageSize;            // the files are reserved on the disk with it, 0 if unknown
+
+        // the phases of the scan, recorded if enabled
+        util::CTimeline& m_timeline;
+        util::DeviceMetrics& m_metrics;
+        std::chrono::steady_clock::time_point m_transferStartTime;
+        bool m_bFirstByte;                      // the driver has delivered data
+
+        // records the transfer if ScanOptions::traceFile is given
+        std::unique_ptr<util::CTransferTraceRecorder> m_pTraceRecorder;
+
+        // all pages go into one document unless the format is None
+        util::DocumentFormat m_documentFormat;
+        int m_documentQuality;                  // JPEG quality of the pages compressed again
+        ScannedPage m_document;                 // the file or the buffer of the document
+        std::mutex m_lockDocument;
+        std::unique_ptr<util::IDocumentSink> m_pDocumentSink;
+        std::unique_ptr<util::CDocumentWriter> m_pDocumentWriter;    // null until the first page
+        std::map<long, std::pair<ScanPageInfo, std::shared_ptr<util::CMemoryBuffer>>> m_documentPages;  // waiting for the previous pages
+        long m_nextDocumentPage;
+        HRESULT m_hrDocument;                   // the first page which could not be appended
+        ATL::CComPtr<util::CHashingStream> m_pDocumentHashingStream;   // the file of the document, if hashed
+
+        // post-processing of the pages, null if no stage is enabled
+        long m_submittedPages;              // pages handed to the pipeline
+        std::mutex m_lockPendingPages;
+        std::map<long, ScanPageInfo> m_pendingPages;        // pages in the pipeline, to be written to filePath and reported
+        std::map<long, util::ContentDigest> m_processedDigests;     // of the pages encoded by the pipeline, for the result
+        // the last member, the threads of the pipeline stop before the members above go away
+        std::unique_ptr<util::CImagePipeline> m_pPipeline;
+    };
+
+    CWIADeviceMgr::CWIADeviceMgr()
+        : m_managerCookie(0)
+        , m_bWatchingDevices(false)
+        , m_devicePool(
+            []()
+    {
+        // the devices are closed on the thread of the pool
+        t_workerComEnvironment.reset(new util::COMEnvironment(COINIT_MULTITHREADED));
+    },
+            []()
+    {
+        t_workerComEnvironment.reset();
+    })
+    {
+        if (FAILED(CreateWIADeviveManager()) || FAILED(CreateWIADeviceInterfaceTable()))
+        {
+            throw std::runtime_error("Unable to create instance of IWiaDevMgr!");
+        }
+
+        // The manager is used from the worker threads as well
+        HRESULT hr = m_pWiaDeviceTable->RegisterInterfaceInGlobal(m_pWiaDevMgr, IID_IWiaDevMgr2, &m_managerCookie);
+        assert(SUCCEEDED(hr));
+
+        RegisterDeviceEvents();
+    }
+
+
+    CWIADeviceMgr::~CWIADeviceMgr()
+    {
+        // Stop receiving WIA events before the registry goes away
+        if (m_pEventCallback)
+        {
+            m_pEventCallback->Disconnect();
+        }
+        m_eventRegistrations.clear();
+
+        m_devicePool.Shutdown();
+
+        if (m_managerCookie)
+        {
+            m_pWiaDeviceTable->RevokeInterfaceFromGlobal(m_managerCookie);
+        }
+    }
+
+    ATL::CComPtr<IWiaDevMgr2> CWIADeviceMgr::get() const
+    {
+        ATL::CComPtr<IWiaDevMgr2> manager;
+        if (m_managerCookie &&
+            SUCCEEDED(m_pWiaDeviceTable->GetInterfaceFromGlobal(m_managerCookie, IID_IWiaDevMgr2, (void**)&manager)))
+        {
+            return manager;
+        }
+        return m_pWiaDevMgr;
+    }
+
+    std::unique_ptr<CWIADeviceMgr>& CWIADeviceMgr::GetInstance()
+    {
+        static std::unique_ptr<CWIADeviceMgr> instance(new CWIADeviceMgr());
+        return instance;
+    }
+
+    ATL::CComPtr<IGlobalInterfaceTable> CWIADeviceMgr::GetInterfaceTable()
+    {
+        return m_pWiaDeviceTable;
+    }
+
+    std::shared_ptr<CWIADevice> CWIADeviceMgr::OpenWIADevice(const std::wstring& deviceId)
+    {
+        util::CScopedCallTimer timer("CWIADeviceMgr::OpenWIADevice");
+        bool reused = false;
+        auto pDevice = m_devicePool.Acquire(deviceId, [this, &deviceId]() -> std::shared_ptr<CWIADevice>
+        {
+            try
+            {
+                return std::make_shared<CWIADevice>(deviceId, *this);
+            }
+            catch (const std::exception&)
+            {
+                return nullptr;
+            }
+        }, &reused);
+
+        if (reused)
+        {
+            pDevice->ResetSession();
+        }
+        return pDevice;
+    }
+
+    void CWIADeviceMgr::SetDevicePoolOptions(const util::WarmPoolOptions& options)
+    {
+        m_devicePool.SetOptions(options);
+    }
+
+    util::WarmPoolOptions CWIADeviceMgr::GetDevicePoolOptions() const
+    {
+        return m_devicePool.GetOptions();
+    }
+
+    util::WarmPoolStats CWIADeviceMgr::GetDevicePoolStats() const
+    {
+        return m_devicePool.GetStats();
+    }
+
+    util::CJobScheduler& CWIADeviceMgr::GetScanScheduler()
+    {
+        return m_scanScheduler;
+    }
+
+    void CWIADeviceMgr::OnDeviceDisconnected(const std::wstring& deviceId)
+    {
+        m_devicePool.Evict(deviceId);
+    }
+    static void AssignDevicePropertyValue(WIADeviceProperties& props, const PROPSPEC& key, const PROPVARIANT& value)
+    {
+        if (key.ulKind == PRSPEC_PROPID)
+        {
+            if (key.propid == WIA_DIP_DEV_ID && value.vt == VT_BSTR)
+            {
+                props.deviceUUID = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_VEND_DESC && value.vt == VT_BSTR)
+            {
+                props.manufacturer = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_DEV_DESC && value.vt == VT_BSTR)
+            {
+                props.description = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_DEV_TYPE && value.vt == VT_I4)
+            {
+                props.type = value.intVal;
+            }
+            if (key.propid == WIA_DIP_PORT_NAME && value.vt == VT_BSTR)
+            {
+                props.port = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_DEV_NAME && value.vt == VT_BSTR)
+            {
+                props.deviceName = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_SERVER_NAME && value.vt == VT_BSTR)
+            {
+                props.server = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_REMOTE_DEV_ID && value.vt == VT_BSTR)
+            {
+                props.remoteDeviceId = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_UI_CLSID && value.vt == VT_BSTR)
+            {
+                props.uiClassId = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_HW_CONFIG && value.vt == VT_I4)
+            {
+                props.hardwareConfig = value.intVal;
+            }
+            if (key.propid == WIA_DIP_BAUDRATE && value.vt == VT_BSTR)
+            {
+                props.baudrate = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_STI_GEN_CAPABILITIES && value.vt == VT_I4)
+            {
+                props.STIGenericCapabilities = value.intVal;
+            }
+            if (key.propid == WIA_DIP_WIA_VERSION && value.vt == VT_BSTR)
+            {
+                props.WIAVersion = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_DRIVER_VERSION && value.vt == VT_BSTR)
+            {
+                props.DriverVersion = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_PNP_ID && value.vt == VT_BSTR)
+            {
+                props.PnPIDString = value.bstrVal;
+            }
+            if (key.propid == WIA_DIP_STI_DRIVER_VERSION && value.vt == VT_I4)
+            {
+                props.STIDriverVersion = value.intVal;
+            }
+        }
+    }
+    static std::shared_ptr<WIADeviceProperties> ReadDeviceProperties(ATL::CComPtr<IWiaPropertyStorage> deviceInfo)
+    {
+        HRESULT hr = S_OK;
+
+        ULONG propertyValueCount = 0;
+        hr = deviceInfo->GetCount(&propertyValueCount);
+
+        // properties value list
+        std::unique_ptr<PROPSPEC[]> propKeys(new PROPSPEC[propertyValueCount]());
+        std::unique_ptr<PROPVARIANT[]> propValues(new PROPVARIANT[propertyValueCount]());
+
+        // find what kind of property available for the current WIA device
+        {
+            ATL::CComPtr<IEnumSTATPROPSTG> propEnumrator;
+            hr = deviceInfo->Enum(&propEnumrator);
+            if (FAILED(hr))
+            {
+                return nullptr;
+            }
+
+            int propertyIndex = 0;
+            while (hr == S_OK)
+            {
+                STATPROPSTG propertyInfo = { 0 };
+                ULONG fetched = 0;
+                hr = propEnumrator->Next(1, &propertyInfo, &fetched);
+
+                propKeys[propertyIndex].ulKind = PRSPEC_PROPID;
+                propKeys[propertyIndex].propid = propertyInfo.propid;
+
+                if (propertyInfo.lpwstrName)
+                {
+                    CoTaskMemFree(propertyInfo.lpwstrName);
+                }
+                propertyIndex++;
+            }
+        }
+
+        // Read property value
+        // The last property value will be ignored. it is empty.
         hr = deviceInfo->ReadMultiple(propertyValueCount - 1, propKeys.get(), propValues.get());
         if (FAILED(hr))
         {
@@ -375,36 +1284,99 @@ namespace scanner
         return deviceProperties;
     }
 
-    std::vector<std::shared_ptr<WIADeviceProperties>> CWIADeviceMgr::ListAllDevices() const
+    std::vector<std::shared_ptr<WIADeviceProperties>> CWIADeviceMgr::ListAllDevices()
     {
-        std::vector<std::shared_ptr<WIADeviceProperties>> deviceInfo;
-        assert(m_pWiaDevMgr);
+        util::CScopedCallTimer timer("CWIADeviceMgr::ListAllDevices");
 
-        ATL::CComPtr<IEnumWIA_DEV_INFO> pWiaEnumDevInfo = NULL;
-        HRESULT hr = m_pWiaDevMgr->EnumDeviceInfo(WIA_DEVINFO_ENUM_LOCAL, &pWiaEnumDevInfo);
+        // read from memory once listed, the events keep the list up to date
+        if (!m_bWatchingDevices || !m_deviceRegistry.IsPopulated())
+        {
+            RescanDevices();
+        }
+        return m_deviceRegistry.GetDevices();
+    }
 
-        if (FAILED(hr))
+    void CWIADeviceMgr::SetDeviceChangeHandler(util::CDeviceRegistry<WIADeviceProperties>::Listener handler)
+    {
+        m_deviceRegistry.SetListener(handler);
+    }
+
+    void CWIADeviceMgr::RegisterDeviceEvents()
+    {
+        static const GUID* deviceEvents[] =
         {
-            return deviceInfo;
+            &WIA_EVENT_DEVICE_CONNECTED,
+            &WIA_EVENT_DEVICE_DISCONNECTED,
+        };
+
+        m_pEventCallback.Attach(new CWIAEventCallback(
+            [this](const GUID& eventId, const std::wstring& deviceId)
+        {
+            OnDeviceEvent(eventId, deviceId);
+        }));
+
+        // the events of every device, the list is polled if one is missing
+        size_t registered = 0;
+        for (auto eventId : deviceEvents)
+        {
+            ATL::CComPtr<IUnknown> pEventObject;
+            HRESULT hr = m_pWiaDevMgr->RegisterEventCallbackInterface(0, NULL, eventId, m_pEventCallback, &pEventObject);
+            if (SUCCEEDED(hr) && pEventObject)
+            {
+                m_eventRegistrations.push_back(pEventObject);
+                registered++;
+            }
         }
+        m_bWatchingDevices = registered == _countof(deviceEvents);
+    }
 
-        while (hr == S_OK)
+    void CWIADeviceMgr::OnDeviceEvent(const GUID& eventId, const std::wstring& deviceId)
+    {
+        // Called on a thread of the COM runtime. Until the devices are listed there is nothing to update.
+        // Listed again rather than removed by ID, the events of a device plugged in and out may come in any order.
+        // The properties are read for the device connected only
+        if (m_deviceRegistry.IsPopulated())
         {
-            ATL::CComPtr<IWiaPropertyStorage> pWiaPropertyStorage;
-            hr = pWiaEnumDevInfo->Next(1, &pWiaPropertyStorage, NULL);
+            RescanDevices();
+        }
+    }
 
-            if (hr == S_OK)
+    bool CWIADeviceMgr::RescanDevices()
+    {
+        auto manager = get();
+        assert(manager);
+
+        // the properties are read for the devices not listed before only
+        std::map<std::wstring, ATL::CComPtr<IWiaPropertyStorage>> deviceStorages;
+        return m_deviceRegistry.Rescan(
+            [&manager, &deviceStorages](std::vector<std::wstring>& deviceIds) -> bool
+        {
+            ATL::CComPtr<IEnumWIA_DEV_INFO> pWiaEnumDevInfo = NULL;
+            HRESULT hr = manager->EnumDeviceInfo(WIA_DEVINFO_ENUM_LOCAL, &pWiaEnumDevInfo);
+            while (hr == S_OK)
             {
-                auto deviceProperty = ReadDeviceProperties(pWiaPropertyStorage);
-                if (deviceProperty)
+                ATL::CComPtr<IWiaPropertyStorage> pWiaPropertyStorage;
+                hr = pWiaEnumDevInfo->Next(1, &pWiaPropertyStorage, NULL);
+                if (hr == S_OK)
                 {
-                    deviceInfo.emplace_back(deviceProperty);
+                    try
+                    {
+                        std::wstring deviceId = util::ReadPropertyString(pWiaPropertyStorage, WIA_DIP_DEV_ID);
+                        deviceIds.push_back(deviceId);
+                        deviceStorages[deviceId] = pWiaPropertyStorage;
+                    }
+                    catch (const util::PropertyStorageException&)
+                    {
+                    }
                 }
-
             }
-        }
-
-        return deviceInfo;
+            // a partial list would remove the devices not reached
+            return SUCCEEDED(hr);
+        },
+            [&deviceStorages](const std::wstring& deviceId)
+        {
+            return ReadDeviceProperties(deviceStorages[deviceId]);
+        });
     }
 
     HRESULT CWIADeviceMgr::CreateWIADeviveManager()
@@ -444,16 +1416,22 @@ namespace scanner
 
     CWIADevice::CWIADevice(const std::wstring& deviceUUID, CWIADeviceMgr& manager)
         : m_manager(manager)
-        , m_bScanRunning(false)
-        , m_documentHandling(L"front")
-        , m_imageFormat(L"tiff")
-        , m_pageCount(ALL_PAGES)
+        , m_deviceUUID(deviceUUID)
+        , m_bItemTreeDirty(true)
+        , m_pMetrics(util::CMetricsRegistry::GetInstance().GetDeviceMetrics(deviceUUID))
     {
+        util::CMetricsScope metricsScope(m_pMetrics.get());
+
+        ResetSession();
 
         ATL::CComPtr<IWiaItem2> pIWiaDevice;
         ATL::CComBSTR devId(deviceUUID.c_str());
 
-        HRESULT hr = m_manager.get()->CreateDevice(0, devId, &pIWiaDevice);
+        HRESULT hr = S_OK;
+        {
+            util::CScopedLatency latency(m_pMetrics.get(), &util::DeviceMetrics::createDevice);
+            hr = m_manager.get()->CreateDevice(0, devId, &pIWiaDevice);
+        }
 
         if (FAILED(hr))
         {
@@ -468,11 +1446,22 @@ namespace scanner
         hr = interfaceTable->RegisterInterfaceInGlobal(m_pDevice, IID_IWiaItem2, &m_deviceCookie);
         assert(SUCCEEDED(hr));
 
-        m_imageSources = FindImageSourcesFromDevice(m_pDevice);
+        GetItemTree();
+
+        RegisterDeviceEvents(deviceUUID);
     }
 
     CWIADevice::~CWIADevice()
     {
+        // Stop receiving WIA events before the device goes away
+        if (m_pEventCallback)
+        {
+            m_pEventCallback->Disconnect();
+        }
+        m_eventRegistrations.clear();
+
+        RevokeItemTree(m_imageSources);
+
         // Unregister the device from the IGlobalInterfaceTable
         auto interfaceTable = m_manager.GetInterfaceTable();
         HRESULT hr = interfaceTable->RevokeInterfaceFromGlobal(m_deviceCookie);
@@ -490,10 +1479,17 @@ namespace scanner
 
     std::vector<std::wstring> CWIADevice::GetImageSources()
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
+        util::CScopedCallTimer timer("CWIADevice::GetImageSources");
+        util::CMetricsScope metricsScope(m_pMetrics.get());
         std::vector<std::wstring> sources;
 
-        TraverseWIAItemTree(m_imageSources,
+        auto itemTree = GetItemTree();
+        if (!itemTree)
+        {
+            return sources;
+        }
+
+        TraverseWIAItemTree(itemTree,
             [&sources](const WIAItemTreeNodeInfo& info) -> bool
         {
             if (info.itemType & WiaItemTypeTransfer)
@@ -511,9 +1507,21 @@ namespace scanner
         return m_deviceCookie;
     }
 
+    const std::wstring& CWIADevice::GetDeviceUUID() const
+    {
+        return m_deviceUUID;
+    }
+
     HRESULT CWIADevice::ShowDeviceDlg(HWND hWndParent, const std::wstring& folderName, const std::wstring& saveFilename, std::vector<std::wstring>& outFilePaths)
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
+        // the dialog acquires images, it counts as a scan
+        util::CScanScope scanScope(m_deviceLock);
+        if (!scanScope.IsStarted())
+        {
+            return WIA_ERROR_BUSY;
+        }
+        m_deviceLock.BeginTransfer();
+
         ATL::CComBSTR folderNameBstr(folderName.c_str());
         ATL::CComBSTR filenameBstr(saveFilename.c_str());
 
@@ -536,113 +1544,12 @@ namespace scanner
         recvFileObject->Release();
         CoTaskMemFree(recvFilePaths);
 
-        return hr;
-    }
-
-    std::wstring CWIADevice::GetImageFormat()
-    {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-
-        return m_imageFormat;
-    }
-
-    bool CWIADevice::SetImageFormat(const std::wstring & format)
-    {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        if (!((format == L"tiff") ||
-            (format == L"bmp") ||
-            (format == L"jpeg") ||
-            (format == L"png")))
-        {
-            return false;
-        }
-
-        m_imageFormat = format;
-        return true;
-    }
-
-    std::wstring CWIADevice::GetColorFormat()
-    {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
-        if (!m_imageSources)
-        {
-            return std::wstring();
-        }
-
-        auto& imageSource = GetImageSource(m_imageSources, L"");
-
-        try
-        {
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+        // the settings might have been changed in the dialog
+        m_propertyCache.Invalidate();
 
-            LONG colorFormat = util::ReadPropertyLong(pIWiaPropertyStorage, WIA_IPA_DATATYPE);
-
-            if (colorFormat == WIA_DATA_COLOR)
-            {
-                return L"fullcolor";
-            }
-            else if (colorFormat == WIA_DATA_GRAYSCALE)
-            {
-                return L"greyscale";
-            }
-            else if (colorFormat == WIA_DATA_THRESHOLD)
-            {
-                return L"blackwhite";
-            }
-            else if (colorFormat == WIA_DATA_AUTO)
-            {
-                return L"auto";
-            }
-            else
-            {
-                return std::wstring();
-            }
-        }
-        catch (const util::PropertyStorageException&)
-        {
-            return std::wstring();
-        }
+        return hr;
     }
 
-    bool CWIADevice::SetColorFormat(const std::wstring & format)
-    {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
-        try
-        {
-            LONG colorFormat = WIA_DATA_THRESHOLD;
-            if (format == L"blackwhite")
-            {
-                colorFormat = WIA_DATA_THRESHOLD;
-            }
-            else if (format == L"greyscale")
-            {
-                colorFormat = WIA_DATA_GRAYSCALE;
-            }
-            else if (format == L"fullcolor")
-            {
-                colorFormat = WIA_DATA_COLOR;
-            }
-            else
-            {
-                return false;
-            }
-
-            auto& imageSource = GetImageSource(m_imageSources, L"");
-
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
-
-            util::WritePropertyLong(pIWiaPropertyStorage, WIA_IPA_DATATYPE, colorFormat);
-            return true;
-        }
-        catch (const util::PropertyStorageException&)
-        {
-            return false;
-        }
-    }
     struct PaperProfile
     {
         std::wstring paperProfileName;
@@ -679,155 +1586,348 @@ namespace scanner
         { L"b10", WIA_PAGE_ISO_B10 },
     };
 
-    std::wstring CWIADevice::GetPaperProfile()
+    static const std::vector<int> g_commonDPIs{ 75, 100, 150, 200, 240, 250, 300, 400, 500, 600, 1200, 2400 };
+
+    static std::wstring ColorFormatFromValue(LONG colorFormat)
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
-        if (!m_imageSources)
+        if (colorFormat == WIA_DATA_COLOR)
         {
-            return L"";
+            return L"fullcolor";
+        }
+        else if (colorFormat == WIA_DATA_GRAYSCALE)
+        {
+            return L"greyscale";
+        }
+        else if (colorFormat == WIA_DATA_THRESHOLD)
+        {
+            return L"blackwhite";
+        }
+        else if (colorFormat == WIA_DATA_AUTO)
+        {
+            return L"auto";
         }
+        return std::wstring();
+    }
 
-        auto& imageSource = GetImageSource(m_imageSources, L"");
+    static bool ColorFormatToValue(const std::wstring& format, LONG& colorFormat)
+    {
+        if (format == L"blackwhite")
+        {
+            colorFormat = WIA_DATA_THRESHOLD;
+        }
+        else if (format == L"greyscale")
+        {
+            colorFormat = WIA_DATA_GRAYSCALE;
+        }
+        else if (format == L"fullcolor")
+        {
+            colorFormat = WIA_DATA_COLOR;
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
 
-        try
+    static std::wstring PaperProfileFromValue(LONG paperProfile)
+    {
+        auto paperProfileIter = std::find_if(g_paperProfiles.cbegin(), g_paperProfiles.cend(),
+            [paperProfile](const PaperProfile& profile)
         {
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+            return profile.paperPropValue == paperProfile;
+        });
+
+        if (paperProfileIter == g_paperProfiles.cend())
+        {
+            return L"";
+        }
+        return paperProfileIter->paperProfileName;
+    }
 
-            LONG paperProfile = util::ReadPropertyLong(pIWiaPropertyStorage, WIA_IPS_PAGE_SIZE);
+    static bool PaperProfileToValue(const std::wstring& profile, LONG& paperProfile)
+    {
+        auto paperProfileIter = std::find_if(g_paperProfiles.cbegin(), g_paperProfiles.cend(),
+            [profile](const PaperProfile& profileData)
+        {
+            return profileData.paperProfileName == profile;
+        });
 
-            auto paperProfileIter = std::find_if(g_paperProfiles.cbegin(), g_paperProfiles.cend(),
-                [paperProfile](const PaperProfile& profile)
-            {
-                return profile.paperPropValue == paperProfile;
-            });
+        if (paperProfileIter == g_paperProfiles.cend())
+        {
+            return false;
+        }
+        paperProfile = paperProfileIter->paperPropValue;
+        return true;
+    }
 
-            if (paperProfileIter == g_paperProfiles.cend())
-            {
-                return L"";
-            }
+    static PropertyRange RangeFromAttribute(ULONG accessFlags, const PROPVARIANT& attribute)
+    {
+        PropertyRange range;
+        if ((accessFlags & WIA_PROP_RANGE) &&
+            attribute.vt == (VT_VECTOR | VT_I4) &&
+            attribute.cal.cElems >= WIA_RANGE_NUM_ELEMS)
+        {
+            range.min = attribute.cal.pElems[WIA_RANGE_MIN];
+            range.max = attribute.cal.pElems[WIA_RANGE_MAX];
+            range.normal = attribute.cal.pElems[WIA_RANGE_NOM];
+            range.step = attribute.cal.pElems[WIA_RANGE_STEP];
+        }
 
-            return paperProfileIter->paperProfileName;
+        // brightness and contrast are divided by the step
+        if (!range.step)
+        {
+            range.step = 1;
         }
-        catch (const util::PropertyStorageException&)
+        return range;
+    }
+
+    std::wstring CWIADevice::GetImageFormat()
+    {
+        return m_pendingSettings.Get().imageFormat;
+    }
+
+    bool CWIADevice::SetImageFormat(const std::wstring & format)
+    {
+        if (!((format == L"tiff") ||
+            (format == L"bmp") ||
+            (format == L"jpeg") ||
+            (format == L"png") ||
+            (format == L"raw")))
         {
-            return L"";
+            return false;
         }
+
+        m_pendingSettings.Update([&format](PendingScanSettings& settings)
+        {
+            settings.imageFormat = format;
+        });
+        return true;
     }
 
-    bool CWIADevice::SetPaperProfile(const std::wstring& profile)
+    std::wstring CWIADevice::GetColorFormat()
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
-        try
+        auto g = m_deviceLock.LockRead();
+
+        LONG colorFormat = 0;
+        if (!ReadCachedProperty(WIA_IPA_DATATYPE, colorFormat))
         {
-            auto paperProfileIter = std::find_if(g_paperProfiles.cbegin(), g_paperProfiles.cend(),
-                [profile](const PaperProfile& profileData)
-            {
-                return profileData.paperProfileName == profile;
-            });
+            return std::wstring();
+        }
+        return ColorFormatFromValue(colorFormat);
+    }
 
-            if (paperProfileIter == g_paperProfiles.cend())
-            {
-                return false;
-            }
+    bool CWIADevice::SetColorFormat(const std::wstring & format)
+    {
+        auto g = m_deviceLock.LockWriteIfIdle();
+        if (!g.owns_lock())
+        {
+            return false;
+        }
 
-            auto& imageSource = GetImageSource(m_imageSources, L"");
+        LONG colorFormat = WIA_DATA_THRESHOLD;
+        if (!ColorFormatToValue(format, colorFormat))
+        {
+            return false;
+        }
+        return WriteCachedProperty(WIA_IPA_DATATYPE, colorFormat);
+    }
+    std::wstring CWIADevice::GetPaperProfile()
+    {
+        auto g = m_deviceLock.LockRead();
 
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+        LONG paperProfile = 0;
+        if (!ReadCachedProperty(WIA_IPS_PAGE_SIZE, paperProfile))
+        {
+            return L"";
+        }
+        return PaperProfileFromValue(paperProfile);
+    }
 
-            util::WritePropertyLong(pIWiaPropertyStorage, WIA_IPS_PAGE_SIZE, paperProfileIter->paperPropValue);
-            return true;
+    bool CWIADevice::SetPaperProfile(const std::wstring& profile)
+    {
+        auto g = m_deviceLock.LockWriteIfIdle();
+        if (!g.owns_lock())
+        {
+            return false;
         }
-        catch (const util::PropertyStorageException& e)
+
+        LONG paperProfile = 0;
+        if (!PaperProfileToValue(profile, paperProfile))
         {
             return false;
         }
+        return WriteCachedProperty(WIA_IPS_PAGE_SIZE, paperProfile);
     }
 
     std::wstring CWIADevice::GetDocumentHandling()
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-
-        return m_documentHandling;
+        return m_pendingSettings.Get().documentHandling;
     }
 
     bool CWIADevice::SetDocumentHandling(const std::wstring & handling)
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
         if (!((handling == L"front") ||
             (handling == L"duplex")))
         {
             return false;
         }
 
-        m_documentHandling = handling;
+        m_pendingSettings.Update([&handling](PendingScanSettings& settings)
+        {
+            settings.documentHandling = handling;
+        });
         return true;
     }
 
     int CWIADevice::GetScanPageCount()
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        return m_pageCount;
+        return m_pendingSettings.Get().pageCount;
     }
 
     bool CWIADevice::SetScanPageCount(int pageCount)
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        m_pageCount = pageCount;
+        m_pendingSettings.Update([pageCount](PendingScanSettings& settings)
+        {
+            settings.pageCount = pageCount;
+        });
+        return true;
+    }
+
+    int CWIADevice::GetScanDPI()
+    {
+        auto g = m_deviceLock.LockRead();
+
+        LONG dpi = 0;
+        if (!ReadCachedProperty(WIA_IPS_XRES, dpi))
+        {
+            return 0;
+        }
+        return dpi;
+    }
+
+    bool CWIADevice::SetScanDPI(int newDPI)
+    {
+        auto g = m_deviceLock.LockWriteIfIdle();
+        if (!g.owns_lock())
+        {
+            return false;
+        }
+
+        if (std::find(g_commonDPIs.cbegin(), g_commonDPIs.cend(), newDPI) == g_commonDPIs.cend())
+        {
+            return false;
+        }
+        return WriteCachedProperty(WIA_IPS_XRES, newDPI) && WriteCachedProperty(WIA_IPS_YRES, newDPI);
+    }
+
+    bool CWIADevice::GetScanBrightnessRange(int& min, int& max, int& normal, int& step)
+    {
+        auto g = m_deviceLock.LockRead();
+
+        min = max = normal = step = 0;
+
+        std::vector<PropertyRange> ranges;
+        if (!ReadCachedRanges({ WIA_IPS_BRIGHTNESS }, ranges))
+        {
+            return false;
+        }
+
+        min = ranges[0].min;
+        max = ranges[0].max;
+        normal = ranges[0].normal;
+        step = ranges[0].step;
+        return true;
+    }
+
+    bool CWIADevice::GetScanContrastRange(int & min, int & max, int& normal, int& step)
+    {
+        auto g = m_deviceLock.LockRead();
+
+        min = max = normal = step = 0;
+
+        std::vector<PropertyRange> ranges;
+        if (!ReadCachedRanges({ WIA_IPS_CONTRAST }, ranges))
+        {
+            return false;
+        }
+
+        min = ranges[0].min;
+        max = ranges[0].max;
+        normal = ranges[0].normal;
+        step = ranges[0].step;
         return true;
     }
 
-    int CWIADevice::GetScanDPI()
+    int CWIADevice::GetScanBrightness()
+    {
+        auto g = m_deviceLock.LockRead();
+
+        std::vector<PropertyRange> ranges;
+        LONG brightness = 0;
+        if (!ReadCachedRanges({ WIA_IPS_BRIGHTNESS }, ranges) ||
+            !ReadCachedProperty(WIA_IPS_BRIGHTNESS, brightness))
+        {
+            return 0;
+        }
+        return brightness / ranges[0].step;
+    }
+
+    bool CWIADevice::SetScanBrightness(int brightness)
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
-        if (!m_imageSources)
+        auto g = m_deviceLock.LockWriteIfIdle();
+        if (!g.owns_lock())
         {
-            return 0;
+            return false;
         }
 
-        auto& imageSource = GetImageSource(m_imageSources, L"");
-
-        try
+        std::vector<PropertyRange> ranges;
+        if (!ReadCachedRanges({ WIA_IPS_BRIGHTNESS }, ranges))
         {
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+            return false;
+        }
+        return WriteCachedProperty(WIA_IPS_BRIGHTNESS, brightness * ranges[0].step);
+    }
 
-            LONG dpi = util::ReadPropertyLong(pIWiaPropertyStorage, WIA_IPS_XRES);
+    int CWIADevice::GetScanContrast()
+    {
+        auto g = m_deviceLock.LockRead();
 
-            return dpi;
-        }
-        catch (const util::PropertyStorageException&)
+        std::vector<PropertyRange> ranges;
+        LONG contrast = 0;
+        if (!ReadCachedRanges({ WIA_IPS_CONTRAST }, ranges) ||
+            !ReadCachedProperty(WIA_IPS_CONTRAST, contrast))
         {
             return 0;
         }
-
-        return 0;
+        return contrast / ranges[0].step;
     }
 
-    bool CWIADevice::SetScanDPI(int newDPI)
+    bool CWIADevice::SetScanContrast(int contrast)
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
-        try
+        auto g = m_deviceLock.LockWriteIfIdle();
+        if (!g.owns_lock())
         {
-            static const std::vector<int> commonDPIs{ 75, 100, 150, 200, 240, 250, 300, 400, 500, 600, 1200, 2400 };
-
-            if (std::find(commonDPIs.cbegin(), commonDPIs.cend(), newDPI) == commonDPIs.cend())
-            {
-                return false;
-            }
+            return false;
+        }
 
-            auto& imageSource = GetImageSource(m_imageSources, L"");
+        std::vector<PropertyRange> ranges;
+        if (!ReadCachedRanges({ WIA_IPS_CONTRAST }, ranges))
+        {
+            return false;
+        }
+        return WriteCachedProperty(WIA_IPS_CONTRAST, contrast * ranges[0].step);
+    }
 
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+    bool CWIADevice::ReadProperties(const std::vector<PROPID>& propids, util::CPropVariant& values)
+    {
+        auto g = m_deviceLock.LockRead();
 
-            util::WritePropertyLong(pIWiaPropertyStorage, WIA_IPS_XRES, newDPI);
-            util::WritePropertyLong(pIWiaPropertyStorage, WIA_IPS_YRES, newDPI);
+        try
+        {
+            util::CMetricsScope metricsScope(m_pMetrics.get());
+            auto pIWiaPropertyStorage = GetImageSourceStorage();
+            util::ReadProperties(pIWiaPropertyStorage, propids, values);
             return true;
         }
         catch (const util::PropertyStorageException&)
@@ -836,41 +1936,19 @@ namespace scanner
         }
     }
 
-    bool CWIADevice::GetScanBrightnessRange(int& min, int& max, int& normal, int& step)
+    bool CWIADevice::WriteProperties(const std::vector<PROPID>& propids, const util::CPropVariant& values)
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
-        if (!m_imageSources)
+        auto g = m_deviceLock.LockWriteIfIdle();
+        if (!g.owns_lock())
         {
-            return 0;
+            return false;
         }
 
-        min = max = normal = step = 0;
-
-        auto& imageSource = GetImageSource(m_imageSources, L"");
         try
         {
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
-
-            PROPSPEC brightnessSpec = { 0 };
-            ULONG accessFlags = 0;
-            util::CPropVariant props(1);
-
-            brightnessSpec.ulKind = PRSPEC_PROPID;
-            brightnessSpec.propid = WIA_IPS_BRIGHTNESS;
-
-            hr = pIWiaPropertyStorage->GetPropertyAttributes(1, &brightnessSpec, &accessFlags, props.get());
-            if (FAILED(hr))
-            {
-                throw util::PropertyStorageException("Error calling IWiaPropertyStorage::GetPropertyAttributes().", hr);
-            }
-
-            min = props[0].cal.pElems[WIA_RANGE_MIN];
-            max = props[0].cal.pElems[WIA_RANGE_MAX];
-            normal = props[0].cal.pElems[WIA_RANGE_NOM];
-            step = props[0].cal.pElems[WIA_RANGE_STEP];
-
+            util::CMetricsScope metricsScope(m_pMetrics.get());
+            auto pIWiaPropertyStorage = GetImageSourceStorage();
+            util::WriteProperties(pIWiaPropertyStorage, propids, values);
             return true;
         }
         catch (const util::PropertyStorageException&)
@@ -879,286 +1957,665 @@ namespace scanner
         }
     }
 
-    bool CWIADevice::GetScanContrastRange(int & min, int & max, int& normal, int& step)
+    ScanSettings CWIADevice::GetScanSettings()
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
-        if (!m_imageSources)
-        {
-            return 0;
-        }
+        util::CScopedCallTimer timer("CWIADevice::GetScanSettings");
+        util::CMetricsScope metricsScope(m_pMetrics.get());
 
-        min = max = normal = step = 0;
+        ScanSettings settings;
 
-        auto& imageSource = GetImageSource(m_imageSources, L"");
-        try
-        {
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+        // settings applied when the scan operation starts
+        PendingScanSettings pendingSettings = m_pendingSettings.Get();
+        settings.imageFormat = pendingSettings.imageFormat;
+        settings.documentHandling = pendingSettings.documentHandling;
+        settings.pageCount = pendingSettings.pageCount;
 
-            PROPSPEC brightnessSpec = { 0 };
-            ULONG accessFlags = 0;
-            util::CPropVariant props(1);
+        auto g = m_deviceLock.LockRead();
 
-            brightnessSpec.ulKind = PRSPEC_PROPID;
-            brightnessSpec.propid = WIA_IPS_CONTRAST;
+        std::vector<PropertyRange> ranges;
+        if (ReadCachedRanges({ WIA_IPS_BRIGHTNESS, WIA_IPS_CONTRAST }, ranges))
+        {
+            settings.brightnessRange = ranges[0];
+            settings.contrastRange = ranges[1];
+        }
 
-            hr = pIWiaPropertyStorage->GetPropertyAttributes(1, &brightnessSpec, &accessFlags, props.get());
-            if (FAILED(hr))
-            {
-                throw util::PropertyStorageException("Error calling IWiaPropertyStorage::GetPropertyAttributes().", hr);
-            }
+        static const std::vector<PROPID> propIds{ WIA_IPA_DATATYPE, WIA_IPS_PAGE_SIZE, WIA_IPS_XRES, WIA_IPS_BRIGHTNESS, WIA_IPS_CONTRAST };
 
-            min = props[0].cal.pElems[WIA_RANGE_MIN];
-            max = props[0].cal.pElems[WIA_RANGE_MAX];
-            normal = props[0].cal.pElems[WIA_RANGE_NOM];
-            step = props[0].cal.pElems[WIA_RANGE_STEP];
+        std::map<PROPID, LONG> values;
+        ReadCachedProperties(propIds, values);
 
-            return true;
+        auto iter = values.find(WIA_IPA_DATATYPE);
+        if (iter != values.end())
+        {
+            settings.colorFormat = ColorFormatFromValue(iter->second);
         }
-        catch (const util::PropertyStorageException&)
+        iter = values.find(WIA_IPS_PAGE_SIZE);
+        if (iter != values.end())
         {
-            return false;
+            settings.paperProfile = PaperProfileFromValue(iter->second);
         }
+        iter = values.find(WIA_IPS_XRES);
+        if (iter != values.end())
+        {
+            settings.dpi = iter->second;
+        }
+        iter = values.find(WIA_IPS_BRIGHTNESS);
+        if (iter != values.end())
+        {
+            settings.brightness = iter->second / settings.brightnessRange.step;
+        }
+        iter = values.find(WIA_IPS_CONTRAST);
+        if (iter != values.end())
+        {
+            settings.contrast = iter->second / settings.contrastRange.step;
+        }
+
+        return settings;
     }
 
-    int CWIADevice::GetScanBrightness()
+    unsigned int CWIADevice::SetScanSettings(const ScanSettings& settings, unsigned int flags)
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
-        if (!m_imageSources)
+        util::CScopedCallTimer timer("CWIADevice::SetScanSettings");
+        util::CMetricsScope metricsScope(m_pMetrics.get());
+
+        unsigned int succeeded = 0;
+
+        // settings applied when the scan operation starts
+        if ((flags & SCAN_SETTING_IMAGE_FORMAT) && SetImageFormat(settings.imageFormat))
         {
-            return 0;
+            succeeded |= SCAN_SETTING_IMAGE_FORMAT;
+        }
+        if ((flags & SCAN_SETTING_DOCUMENT_HANDLING) && SetDocumentHandling(settings.documentHandling))
+        {
+            succeeded |= SCAN_SETTING_DOCUMENT_HANDLING;
+        }
+        if ((flags & SCAN_SETTING_PAGE_COUNT) && SetScanPageCount(settings.pageCount))
+        {
+            succeeded |= SCAN_SETTING_PAGE_COUNT;
         }
 
-        auto& imageSource = GetImageSource(m_imageSources, L"");
+        auto g = m_deviceLock.LockWriteIfIdle();
+        if (!g.owns_lock())
+        {
+            return succeeded;
+        }
 
-        try
+        auto pIWiaPropertyStorage = GetImageSourceStorage();
+        if (!pIWiaPropertyStorage)
         {
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+            return succeeded;
+        }
 
-            int min, max, normal, step;
-            GetScanBrightnessRange(min, max, normal, step);
+        // settings written to the device, collected into a single WriteMultiple call
+        std::vector<PROPID> propIds;
+        std::vector<LONG> propValues;
+        std::vector<unsigned int> propOwners;   // which setting each property belongs to
 
-            LONG brightness = util::ReadPropertyLong(pIWiaPropertyStorage, WIA_IPS_BRIGHTNESS);
+        auto addProperty = [&](PROPID propId, LONG value, unsigned int owner)
+        {
+            propIds.push_back(propId);
+            propValues.push_back(value);
+            propOwners.push_back(owner);
+        };
 
-            return brightness / step;
+        LONG value = 0;
+        if ((flags & SCAN_SETTING_COLOR_FORMAT) && ColorFormatToValue(settings.colorFormat, value))
+        {
+            addProperty(WIA_IPA_DATATYPE, value, SCAN_SETTING_COLOR_FORMAT);
         }
-        catch (const util::PropertyStorageException&)
+        if ((flags & SCAN_SETTING_PAPER_PROFILE) && PaperProfileToValue(settings.paperProfile, value))
         {
-            return 0;
+            addProperty(WIA_IPS_PAGE_SIZE, value, SCAN_SETTING_PAPER_PROFILE);
+        }
+        if ((flags & SCAN_SETTING_DPI) &&
+            std::find(g_commonDPIs.cbegin(), g_commonDPIs.cend(), settings.dpi) != g_commonDPIs.cend())
+        {
+            addProperty(WIA_IPS_XRES, settings.dpi, SCAN_SETTING_DPI);
+            addProperty(WIA_IPS_YRES, settings.dpi, SCAN_SETTING_DPI);
+        }
+        if (flags & (SCAN_SETTING_BRIGHTNESS | SCAN_SETTING_CONTRAST))
+        {
+            // brightness and contrast are given in steps
+            std::vector<PropertyRange> ranges(2);
+            ReadCachedRanges({ WIA_IPS_BRIGHTNESS, WIA_IPS_CONTRAST }, ranges);
+
+            if (flags & SCAN_SETTING_BRIGHTNESS)
+            {
+                addProperty(WIA_IPS_BRIGHTNESS, settings.brightness * ranges[0].step, SCAN_SETTING_BRIGHTNESS);
+            }
+            if (flags & SCAN_SETTING_CONTRAST)
+            {
+                addProperty(WIA_IPS_CONTRAST, settings.contrast * ranges[1].step, SCAN_SETTING_CONTRAST);
+            }
+        }
+
+        if (propIds.empty())
+        {
+            return succeeded;
         }
 
-        return 0;
+        util::CPropVariant values((int)propIds.size());
+        util::PackLongValues(propValues, values.get(), VARTYPE(VT_I4));
+
+        succeeded |= util::WritePropertyBatch(propOwners, [&]()
+        {
+            try
+            {
+                util::WriteProperties(pIWiaPropertyStorage, propIds, values);
+            }
+            catch (const util::PropertyStorageException&)
+            {
+                return false;
+            }
+            for (size_t i = 0; i < propIds.size(); i++)
+            {
+                m_propertyCache.SetValue(propIds[i], propValues[i]);
+            }
+            return true;
+        }, [&](size_t i)
+        {
+            return WriteCachedProperty(propIds[i], propValues[i]);
+        });
+
+        return succeeded;
     }
 
-    bool CWIADevice::SetScanBrightness(int brightness)
+    void CWIADevice::RefreshProperties()
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
+        m_propertyCache.Invalidate();
+    }
 
-        try
-        {
-            auto& imageSource = GetImageSource(m_imageSources, L"");
+    util::PropertyCacheStats CWIADevice::GetPropertyCacheStats() const
+    {
+        return m_propertyCache.GetStats();
+    }
 
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+    bool CWIADevice::IsScanRunning() const
+    {
+        return m_deviceLock.IsScanRunning();
+    }
 
-            int min, max, normal, step;
-            GetScanBrightnessRange(min, max, normal, step);
+    util::ScanState CWIADevice::GetScanState() const
+    {
+        return m_deviceLock.GetScanState();
+    }
 
-            util::WritePropertyLong(pIWiaPropertyStorage, WIA_IPS_BRIGHTNESS, brightness * step);
-            return true;
-        }
-        catch (const util::PropertyStorageException&)
+    util::DeviceLockStats CWIADevice::GetLockStats() const
+    {
+        return m_deviceLock.GetStats();
+    }
+
+    util::CTimeline& CWIADevice::GetTimeline()
+    {
+        return m_timeline;
+    }
+
+    util::DeviceMetrics& CWIADevice::GetMetrics()
+    {
+        return *m_pMetrics;
+    }
+
+    void CWIADevice::ResetSession()
+    {
+        m_pendingSettings.Update([](PendingScanSettings& settings)
         {
-            return false;
-        }
+            settings.documentHandling = L"front";
+            settings.imageFormat = L"tiff";
+            settings.pageCount = ALL_PAGES;
+        });
+        m_timeline.Enable(false);
     }
 
-    int CWIADevice::GetScanContrast()
+    bool CWIADevice::CancelScan()
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
-        if (!m_imageSources)
+        if (!m_deviceLock.CancelScan())
         {
-            return 0;
+            return false;
         }
 
-        auto& imageSource = GetImageSource(m_imageSources, L"");
-
-        try
+        // arms the forced abort if the scan has asked for it
+        std::lock_guard<std::mutex> g(m_lockCancelHandler);
+        if (m_cancelHandler)
         {
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
-
-            int min, max, normal, step;
-            GetScanContrastRange(min, max, normal, step);
+            m_cancelHandler();
+        }
+        return true;
+    }
 
-            LONG contrast = util::ReadPropertyLong(pIWiaPropertyStorage, WIA_IPS_CONTRAST);
+    bool CWIADevice::IsFeeder()
+    {
+        util::CScopedCallTimer timer("CWIADevice::IsFeeder");
+        util::CMetricsScope metricsScope(m_pMetrics.get());
 
-            return contrast / step;
-        }
-        catch (const util::PropertyStorageException&)
+        // the category is recorded in the item tree, no need to ask the device
+        WIAItemTreeNodeInfo imgSourceInfo;
+        if (!FindImageSource(GetItemTree(), L"", imgSourceInfo))
         {
-            return 0;
+            return false;
         }
 
-        return 0;
+        return IsEqualGUID(imgSourceInfo.itemCategory, WIA_CATEGORY_FEEDER) != FALSE;
     }
 
-    bool CWIADevice::SetScanContrast(int contrast)
+    HRESULT CWIADevice::GetPreview(int dpi, util::RawScanRowCallback rowCallback, PreviewResult& result)
     {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
-        assert(m_imageSources);
+        util::CScopedCallTimer timer("CWIADevice::GetPreview");
 
-        try
+        result = PreviewResult();
+        if (std::find(g_commonDPIs.cbegin(), g_commonDPIs.cend(), dpi) == g_commonDPIs.cend())
         {
+            return E_INVALIDARG;
+        }
 
-            auto& imageSource = GetImageSource(m_imageSources, L"");
-
-            ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-            HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+        auto start = std::chrono::steady_clock::now();
+        auto onRow = [&result, &rowCallback, start](uint32_t y, const uint8_t* row, uint32_t width)
+        {
+            if (result.firstRowMs == 0)
+            {
+                result.firstRowMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                util::CCallTimings::GetInstance().Record("CWIADevice::PreviewFirstRow", result.firstRowMs);
+            }
+            if (rowCallback)
+            {
+                rowCallback(y, row, width);
+            }
+        };
 
-            int min, max, normal, step;
-            GetScanContrastRange(min, max, normal, step);
+        // the rows are decoded on the thread of the transfer as the driver writes them
+        util::CRawScanRowDecoder decoder(onRow);
+        ScanOptions options;
+        options.output = ScanOutput::Buffer;
+        options.previewDpi = dpi;
 
-            util::WritePropertyLong(pIWiaPropertyStorage, WIA_IPS_BRIGHTNESS, contrast * step);
+        std::vector<ScannedPage> scannedPages;
+        HRESULT hr = Scan(options, scannedPages, nullptr, [&decoder](long page, uint64_t offset, const void* data, size_t size)
+        {
+            if (page == 0)
+            {
+                decoder.Write(offset, data, size);
+            }
             return true;
+        });
+        if (FAILED(hr))
+        {
+            return hr;
         }
-        catch (const util::PropertyStorageException&)
+
+        decoder.Finish();
+        if (decoder.IsHeaderKnown())
         {
-            return false;
+            result.image = decoder.GetImage();
+        }
+        else if (!scannedPages.empty() && scannedPages[0].buffer)
+        {
+            // neither raw scanlines nor a bitmap, the rows are given once the page is decoded
+            util::RawImage image;
+            if (!DecodePage(*scannedPages[0].buffer, image))
+            {
+                return E_FAIL;
+            }
+            result.image = util::ToGray8(image);
+            for (uint32_t y = 0; y < result.image.height; y++)
+            {
+                onRow(y, result.image.Row(y), result.image.width);
+            }
         }
+        result.totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return hr;
     }
 
-    bool CWIADevice::IsScanRunning() const
+    HRESULT CWIADevice::Scan(
+        const ScanOptions& options,
+        std::vector<ScannedPage>& scannedPages,
+        ScanProgressCallback progressCallback,
+        ScanDataCallback dataCallback,
+        ScanPageCallback pageCallback,
+        util::PipelineStats* pipelineStats,
+        ScanCancelInfo* cancelInfo)
     {
-        return m_bScanRunning;
+        util::CMetricsScope metricsScope(m_pMetrics.get());
+        HRESULT hr = DoScan(options, scannedPages, progressCallback, dataCallback, pageCallback, pipelineStats, cancelInfo);
+        m_pMetrics->scans.Add();
+        if (FAILED(hr))
+        {
+            m_pMetrics->failedScans.Add();
+        }
+        return hr;
     }
 
-    void CWIADevice::CancelScan()
+    HRESULT CWIADevice::DoScan(
+        const ScanOptions& options,
+        std::vector<ScannedPage>& scannedPages,
+        ScanProgressCallback progressCallback,
+        ScanDataCallback dataCallback,
+        ScanPageCallback pageCallback,
+        util::PipelineStats* pipelineStats,
+        ScanCancelInfo* cancelInfo)
     {
+        util::CScopedCallTimer timer("CWIADevice::Scan");
+        util::CTimelineSpan scanSpan(m_timeline, "Scan", "scan");
 
-        m_bScanRunning = false;
-    }
+        scannedPages.clear();
 
-    bool CWIADevice::IsFeeder()
-    {
-        HRESULT hr = S_OK;
-        auto imgSource = GetImageSource(m_imageSources, L"");
+        // one scan at a time, a second one fails instead of waiting for the first to finish
+        util::CScanScope scanScope(m_deviceLock);
+        if (!scanScope.IsStarted())
+        {
+            return WIA_ERROR_BUSY;
+        }
+
+        // The settings are taken once, changes made during the scan are used by the next one
+        PendingScanSettings settings = m_pendingSettings.Get();
+        if (options.previewDpi > 0)
+        {
+            // one page of uncompressed scanlines, the rows can be decoded as they come
+            settings.imageFormat = L"raw";
+            settings.documentHandling = L"front";
+            settings.pageCount = 1;
+        }
+
+        // Get the first available image source pointer from the cached item tree.
+        // This method might be called from another thread apart from the thread where the object was created.
+        // The image source is acquired from the IGlobalInterfaceTable object, Windows will automatically marshal the pointer,
+        // then the error RPC_E_WRONG_THREAD will not occur.
+        ATL::CComPtr<IWiaItem2> imgSource;
+        {
+            util::CTimelineSpan span(m_timeline, "GetImageSource", "device");
+            imgSource = GetImageSource(L"");
+        }
         if (!imgSource)
         {
-            return false;
+            return E_FAIL;
         }
 
-        ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-        hr = imgSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+        // Query IWiaTransfer interface from the image source
+        ATL::CComPtr<IWiaTransfer> pWiaTransfer;
+        HRESULT hr = imgSource->QueryInterface(IID_IWiaTransfer, (void**)&pWiaTransfer);
 
         if (FAILED(hr))
         {
-            return false;
+            return hr;
         }
 
-        GUID itemCategory = util::ReadPropertyGuid(pIWiaPropertyStorage, WIA_IPA_ITEM_CATEGORY);
-        bool isFeeder = false;
+        // Get image source property
+        ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
+        hr = imgSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
 
-        if (IsEqualGUID(itemCategory, WIA_CATEGORY_FEEDER))
+        if (FAILED(hr))
         {
-            isFeeder = true;
+            return hr;
         }
+        try
+        {
+            // Check image source category here(is Feeder?)
+            GUID itemCategory = util::ReadPropertyGuid(pIWiaPropertyStorage, WIA_IPA_ITEM_CATEGORY);
+            bool isFeeder = IsEqualGUID(itemCategory, WIA_CATEGORY_FEEDER) != FALSE;
+            bool isDuplex = isFeeder && settings.documentHandling == L"duplex";
+            LONG dataType = WIA_DATA_COLOR;
+            LONG itemSize = 0;
+
+            // the resolution and the color mode of a preview, written back once the scan is done
+            struct previewSettingsContext
+            {
+                previewSettingsContext(CWIADevice& d, ATL::CComPtr<IWiaPropertyStorage> storage)
+                    : device(d)
+                    , pStorage(storage)
+                    , propIds{ WIA_IPS_XRES, WIA_IPS_YRES, WIA_IPA_DATATYPE }
+                    , savedValues(3)
+                    , applied(false)
+                {
+                }
+                ~previewSettingsContext()
+                {
+                    if (!applied)
+                    {
+                        return;
+                    }
 
-        return isFeeder;
-    }
+                    // the values the item supports, one write for all of them
+                    std::vector<PROPID> restoredIds;
+                    std::vector<LONG> restoredValues;
+                    for (int i = 0; i < savedValues.count(); i++)
+                    {
+                        device.m_propertyCache.RemoveValue(propIds[i]);
+                        if (savedValues[i].vt == VT_I4)
+                        {
+                            restoredIds.push_back(propIds[i]);
+                            restoredValues.push_back(savedValues[i].lVal);
+                        }
+                    }
+                    if (restoredIds.empty())
+                    {
+                        return;
+                    }
+
+                    util::CPropVariant values((int)restoredIds.size());
+                    util::PackLongValues(restoredValues, values.get(), VARTYPE(VT_I4));
+
+                    auto g = device.m_deviceLock.LockWrite();
+                    try
+                    {
+                        util::WriteProperties(pStorage, restoredIds, values);
+                        for (size_t i = 0; i < restoredIds.size(); i++)
+                        {
+                            device.m_propertyCache.SetValue(restoredIds[i], restoredValues[i]);
+                        }
+                    }
+                    catch (const util::PropertyStorageException&)
+                    {
+                        // the next reads go to the device
+                    }
+                }
+                // under the write lock, one read and one write
+                void Apply(int dpi)
+                {
+                    util::ReadProperties(pStorage, propIds, savedValues);
+                    applied = true;
+
+                    util::CPropVariant values((int)propIds.size());
+                    values[0].vt = VT_I4;
+                    values[0].lVal = dpi;
+                    values[1].vt = VT_I4;
+                    values[1].lVal = dpi;
+                    values[2].vt = VT_I4;
+                    values[2].lVal = WIA_DATA_GRAYSCALE;
+                    util::WriteProperties(pStorage, propIds, values);
+                }
+            private:
+                CWIADevice& device;
+                ATL::CComPtr<IWiaPropertyStorage> pStorage;
+                std::vector<PROPID> propIds;
+                util::CPropVariant savedValues;
+                bool applied;
+            };
+            previewSettingsContext previewSettings(*this, pIWiaPropertyStorage);
+
+            {
+                util::CTimelineSpan span(m_timeline, "WriteSettings", "device");
+
+                // no property writes while the settings are applied, the transfer runs without the lock
+                auto g = m_deviceLock.LockWrite();
+
+                // Set output file format
+                SetDeviceImageFormat(imgSource, settings.imageFormat);
+
+                if (options.previewDpi > 0)
+                {
+                    previewSettings.Apply(options.previewDpi);
+                }
+
+                if (isFeeder)
+                {
+                    // set feeder format
+                    SetDeviceDocumentHandling(imgSource, settings.documentHandling);
+                    SetDeviceScanPageCount(imgSource, settings.pageCount);
+                }
+
+                dataType = util::ReadPropertyLong(pIWiaPropertyStorage, WIA_IPA_DATATYPE);
+
+                // the size of an uncompressed page, not known by every driver
+                try
+                {
+                    itemSize = util::ReadPropertyLong(pIWiaPropertyStorage, WIA_IPA_ITEM_SIZE);
+                }
+                catch (const util::PropertyStorageException&)
+                {
+                }
+            }
 
-    HRESULT CWIADevice::Scan(
-        const std::wstring& saveDirectory,
-        const std::wstring& saveFilename,
-        std::vector<std::wstring>& saveFilePaths,
-        ScanProgressCallback progressCallback)
-    {
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
+            std::wstring fileExtension = settings.imageFormat;
 
-        struct runningContext
-        {
-            runningContext(CWIADevice& d)
-                : device(d)
+            // the pages changed by the pipeline are encoded in the acquired format unless another one is asked for
+            ScanOptions scanOptions = options;
+            if (settings.imageFormat == L"raw" && options.previewDpi <= 0)
             {
-                device.m_bScanRunning = true;
+                // Uncompressed scanlines are encoded by the pipeline, bilevel scans in G4, other ones in JPEG.
+                // The driver does not spend time compressing and the transfer is not blocked by the encoding
+                scanOptions.pipeline.recompress = true;
             }
-            ~runningContext()
+            if (scanOptions.pipeline.imageFormat.empty() &&
+                ((settings.imageFormat == L"raw" && options.previewDpi <= 0) || (scanOptions.document != util::DocumentFormat::None && scanOptions.pipeline.IsEnabled())))
             {
-                device.m_bScanRunning = false;
+                // the formats a document takes without decoding the pages again
+                scanOptions.pipeline.imageFormat = (dataType == WIA_DATA_THRESHOLD) ? L"tiff-g4" : L"jpeg";
+            }
+            if (scanOptions.pipeline.IsEnabled())
+            {
+                if (scanOptions.pipeline.imageFormat.empty())
+                {
+                    scanOptions.pipeline.imageFormat = settings.imageFormat;
+                }
+                fileExtension = scanOptions.pipeline.imageFormat;
+                if (fileExtension == L"tiff-g4")
+                {
+                    fileExtension = L"tiff";
+                }
+            }
+            if (scanOptions.document != util::DocumentFormat::None)
+            {
+                fileExtension = (scanOptions.document == util::DocumentFormat::Pdf) ? L"pdf" : L"tiff";
             }
-        private:
-            CWIADevice& device;
-        };
-        runningContext c(*this);
-
-        saveFilePaths.clear();
 
-        // Get the first available image source pointer from the opened device.
-        // We must acquire the device pointer from the IGlobalInterfaceTable object.
-        // This method might be called from another thread apart from the thread where the object was created.
-        // Windows will automatically marshal device pointer, then the error RPC_E_WRONG_THREAD will not occur.
-        auto device = GetDevice();
-        // Then rebuild the WIA item tree and find the first available device
-        auto deviceTree = FindImageSourcesFromDevice(device);
-        auto imgSource = GetImageSource(deviceTree, L"");
-        if (!imgSource)
-        {
-            return E_FAIL;
-        }
+            // init callback
+            ATL::CComPtr<IWiaTransferCallback> pCallback;
+            pCallback.Attach(new CScanTransferCallback(*this, pWiaTransfer, scanOptions, fileExtension, isFeeder, isDuplex,
+                progressCallback, dataCallback, pageCallback));
+            if (itemSize > 0)
+            {
+                ((CScanTransferCallback*)(&*pCallback))->SetExpectedPageSize(uint64_t(itemSize));
+            }
 
-        // Query IWiaTransfer interface from the image source
-        ATL::CComPtr<IWiaTransfer> pWiaTransfer;
-        HRESULT hr = imgSource->QueryInterface(IID_IWiaTransfer, (void**)&pWiaTransfer);
+            // The callbacks stop the transfer once cancelled. A driver might not call back for a long time,
+            // the watchdog aborts the transfer then, and cancels the scan running longer than the timeout
+            std::atomic<bool> timedOut(false);
+            std::atomic<bool> forced(false);
+            util::CWatchdog watchdog(
+                []()
+            {
+                t_workerComEnvironment.reset(new util::COMEnvironment(COINIT_MULTITHREADED));
+            },
+                []()
+            {
+                t_workerComEnvironment.reset();
+            });
 
-        if (FAILED(hr))
-        {
-            return hr;
-        }
+            int cancelTimeoutMs = options.cancelTimeoutMs;
+            auto onCancel = [&watchdog, &forced, pWiaTransfer, cancelTimeoutMs]()
+            {
+                if (cancelTimeoutMs <= 0)
+                {
+                    return;
+                }
 
-        // Get image source property
-        ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
-        hr = imgSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+                watchdog.Arm(std::chrono::steady_clock::now() + std::chrono::milliseconds(cancelTimeoutMs),
+                    [&forced, pWiaTransfer]()
+                {
+                    forced = true;
+                    pWiaTransfer->Cancel();
+                });
+            };
 
-        if (FAILED(hr))
-        {
-            return hr;
-        }
-        try
-        {
-            // Check image source category here(is Feeder?)
-            GUID itemCategory = util::ReadPropertyGuid(pIWiaPropertyStorage, WIA_IPA_ITEM_CATEGORY);
-            bool isFeeder = false;
+            if (options.timeoutMs > 0)
+            {
+                watchdog.Arm(std::chrono::steady_clock::now() + std::chrono::milliseconds(options.timeoutMs),
+                    [this, &timedOut]()
+                {
+                    timedOut = (GetScanState() != util::ScanState::Cancelling);
+                    CancelScan();
+                });
+            }
 
-            // Set output file format
-            SetDeviceImageFormat(imgSource, m_imageFormat);
+            // CancelScan() reaches the watchdog only while the transfer is running
+            struct cancelHandlerContext
+            {
+                cancelHandlerContext(CWIADevice& d, std::function<void()> handler)
+                    : device(d)
+                {
+                    std::lock_guard<std::mutex> g(device.m_lockCancelHandler);
+                    device.m_cancelHandler = handler;
+                }
+                ~cancelHandlerContext()
+                {
+                    std::lock_guard<std::mutex> g(device.m_lockCancelHandler);
+                    device.m_cancelHandler = nullptr;
+                }
+            private:
+                CWIADevice& device;
+            };
+            cancelHandlerContext c(*this, onCancel);
 
-            if (IsEqualGUID(itemCategory, WIA_CATEGORY_FEEDER))
+            if (m_deviceLock.BeginTransfer())
             {
-                // set feeder format
-                SetDeviceDocumentHandling(imgSource, m_documentHandling);
-                SetDeviceScanPageCount(imgSource, m_pageCount);
-                isFeeder = true;
+                util::CTimelineSpan span(m_timeline, "Download", "transfer");
+                util::CScopedLatency latency(m_pMetrics.get(), &util::DeviceMetrics::download);
+                hr = pWiaTransfer->Download(0, pCallback);
             }
-
-            std::wstring fileExtension = m_imageFormat;
-            if (!IsEqualIID(itemCategory, WIA_CATEGORY_FOLDER))
+            else
             {
-                fileExtension = m_imageFormat;
+                // cancelled while the settings were applied
+                hr = S_FALSE;
             }
+            watchdog.Disarm();
 
-            // init callback
-            ATL::CComPtr<IWiaTransferCallback> pCallback = new CScanTransferCallback(*this, pWiaTransfer, saveDirectory, saveFilename, fileExtension, isFeeder, progressCallback);
-
-            hr = pWiaTransfer->Download(0, pCallback);
-
-            saveFilePaths = ((CScanTransferCallback*)(&*pCallback))->GetSaveFilePaths();
-
+            {
+                util::CTimelineSpan span(m_timeline, "FinishPipeline", "pipeline");
+                ((CScanTransferCallback*)(&*pCallback))->FinishPipeline(pipelineStats);
+            }
+            HRESULT hrDocument = S_OK;
+            {
+                util::CTimelineSpan span(m_timeline, "FinishDocument", "files");
+                hrDocument = ((CScanTransferCallback*)(&*pCallback))->FinishDocument();
+            }
+            if (SUCCEEDED(hr) && FAILED(hrDocument))
+            {
+                hr = hrDocument;
+            }
+            HRESULT hrFiles = S_OK;
+            {
+                // the files written behind the transfer, flushed if asked for
+                util::CTimelineSpan span(m_timeline, "FinishFiles", "files");
+                hrFiles = ((CScanTransferCallback*)(&*pCallback))->FinishFiles();
+            }
+            if (SUCCEEDED(hr) && FAILED(hrFiles))
+            {
+                hr = hrFiles;
+            }
+            ((CScanTransferCallback*)(&*pCallback))->FinishTrace();
+            scannedPages = ((CScanTransferCallback*)(&*pCallback))->GetScannedPages();
 
+            ScanCancelInfo cancelResult;
+            cancelResult.cancelled = m_deviceLock.GetCancelTime(cancelResult.cancelTime);
+            if (cancelResult.cancelled)
+            {
+                cancelResult.timedOut = timedOut;
+                cancelResult.forced = forced;
+                cancelResult.cancelToIdleMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - cancelResult.cancelTime).count();
+                util::CCallTimings::GetInstance().Record("CWIADevice::CancelToIdle", cancelResult.cancelToIdleMs);
+            }
+            if (cancelInfo)
+            {
+                *cancelInfo = cancelResult;
+            }
         }
         catch (const util::PropertyStorageException& e)
         {
@@ -1170,6 +2627,8 @@ namespace scanner
 
     std::shared_ptr<WIAItemTreeNode> CWIADevice::FindImageSourcesFromDevice(ATL::CComPtr<IWiaItem2> pDevice)
     {
+        util::CTimelineSpan span(m_timeline, "FindImageSourcesFromDevice", "device");
+        util::CMetricsScope metricsScope(m_pMetrics.get());
         return DoFindImageSourcesFromDevice(pDevice);
     }
 
@@ -1192,7 +2651,10 @@ namespace scanner
         pDeviceTreeNode->info.deviceName = devName;
         pDeviceTreeNode->info.itemType = lItemType;
         pDeviceTreeNode->info.itemCategory = itemCategory;
-        pDeviceTreeNode->info.pWiaItem = pParentDevice;
+
+        // other apartments get the item through the cookie
+        hr = m_manager.GetInterfaceTable()->RegisterInterfaceInGlobal(pParentDevice, IID_IWiaItem2, &pDeviceTreeNode->info.itemCookie);
+        assert(SUCCEEDED(hr));
 
         // folder
         // If it is a folder, enumerate its children
@@ -1200,7 +2662,10 @@ namespace scanner
         {
             // Get the child item enumerator for this item
             ATL::CComPtr<IEnumWiaItem2> pIEnumWiaItem2;
-            hr = pParentDevice->EnumChildItems(0, &pIEnumWiaItem2);
+            {
+                util::CScopedLatency latency(m_pMetrics.get(), &util::DeviceMetrics::enumChildItems);
+                hr = pParentDevice->EnumChildItems(0, &pIEnumWiaItem2);
+            }
             if (SUCCEEDED(hr))
             {
                 // We will loop until we get an error or pEnumWiaItem->Next returns
@@ -1243,53 +2708,319 @@ namespace scanner
         return pDeviceTreeNode;
 
     }
-    ATL::CComPtr<IWiaItem2> CWIADevice::GetImageSource(std::shared_ptr<WIAItemTreeNode> itemTree, const std::wstring& imgSourceName)
+    void CWIADevice::RevokeItemTree(std::shared_ptr<WIAItemTreeNode> itemTree)
+    {
+        if (!itemTree)
+        {
+            return;
+        }
+
+        auto interfaceTable = m_manager.GetInterfaceTable();
+        TraverseWIAItemTree(itemTree,
+            [&interfaceTable](WIAItemTreeNodeInfo& info) -> bool
+        {
+            if (info.itemCookie)
+            {
+                interfaceTable->RevokeInterfaceFromGlobal(info.itemCookie);
+                info.itemCookie = 0;
+            }
+            return true;
+        });
+    }
+
+    std::shared_ptr<WIAItemTreeNode> CWIADevice::GetItemTree()
+    {
+        std::lock_guard<std::mutex> g(m_lockItemTree);
+
+        // An event arriving while the tree is being built marks the tree dirty again
+        if (m_imageSources && !m_bItemTreeDirty.exchange(false))
+        {
+            std::lock_guard<std::mutex> statsLock(m_lockStats);
+            m_itemTreeStats.cacheHits++;
+            return m_imageSources;
+        }
+        m_bItemTreeDirty = false;
+
+        auto startTime = std::chrono::steady_clock::now();
+
+        std::shared_ptr<WIAItemTreeNode> itemTree;
+        try
+        {
+            auto device = GetDevice();
+            if (device)
+            {
+                itemTree = FindImageSourcesFromDevice(device);
+            }
+        }
+        catch (const std::exception&)
+        {
+            itemTree = nullptr;
+        }
+
+        if (!itemTree)
+        {
+            // try again next time, the tree built last time is still used
+            m_bItemTreeDirty = true;
+            return m_imageSources;
+        }
+
+        RevokeItemTree(m_imageSources);
+        m_imageSources = itemTree;
+
+        double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+        util::CCallTimings::GetInstance().Record("CWIADevice::BuildItemTree", buildMs);
+        {
+            std::lock_guard<std::mutex> statsLock(m_lockStats);
+            m_itemTreeStats.builds++;
+            m_itemTreeStats.lastBuildMs = buildMs;
+            m_itemTreeStats.totalBuildMs += buildMs;
+        }
+
+        return m_imageSources;
+    }
+
+    void CWIADevice::InvalidateItemTree()
+    {
+        m_bItemTreeDirty = true;
+    }
+
+    WIAItemTreeStats CWIADevice::GetItemTreeStats() const
+    {
+        std::lock_guard<std::mutex> g(m_lockStats);
+        return m_itemTreeStats;
+    }
+
+    bool CWIADevice::FindImageSource(std::shared_ptr<WIAItemTreeNode> itemTree, const std::wstring& imgSourceName, WIAItemTreeNodeInfo& info)
     {
-        assert(itemTree);
         if (!itemTree)
+        {
+            return false;
+        }
+
+        bool found = false;
+        TraverseWIAItemTree(itemTree,
+            [&found, &info, &imgSourceName](const WIAItemTreeNodeInfo& nodeInfo) -> bool
+        {
+            bool matched = imgSourceName.empty() ?
+                ((nodeInfo.itemType & WiaItemTypeTransfer) != 0) :
+                (nodeInfo.deviceName == imgSourceName);
+            if (matched)
+            {
+                info = nodeInfo;
+                found = true;
+                return false;
+            }
+            return true;
+        });
+
+        return found;
+    }
+
+    ATL::CComPtr<IWiaItem2> CWIADevice::GetImageSource(const std::wstring& imgSourceName)
+    {
+        WIAItemTreeNodeInfo imgSourceInfo;
+        if (!FindImageSource(GetItemTree(), imgSourceName, imgSourceInfo))
+        {
+            return nullptr;
+        }
+
+        ATL::CComPtr<IWiaItem2> imgSource;
+        HRESULT hr = m_manager.GetInterfaceTable()->GetInterfaceFromGlobal(imgSourceInfo.itemCookie, IID_IWiaItem2, (void**)&imgSource);
+        if (FAILED(hr))
+        {
+            return nullptr;
+        }
+        return imgSource;
+    }
+    ATL::CComPtr<IWiaPropertyStorage> CWIADevice::GetImageSourceStorage()
+    {
+        auto imageSource = GetImageSource(L"");
+        if (!imageSource)
+        {
+            return nullptr;
+        }
+
+        ATL::CComPtr<IWiaPropertyStorage> pIWiaPropertyStorage;
+        HRESULT hr = imageSource->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
+        if (FAILED(hr))
         {
             return nullptr;
         }
-        if (!imgSourceName.empty())
+        return pIWiaPropertyStorage;
+    }
+
+    bool CWIADevice::ReadCachedProperties(const std::vector<PROPID>& propids, std::map<PROPID, LONG>& values)
+    {
+        util::CScopedCallTimer timer("CWIADevice::ReadCachedProperties");
+        util::CMetricsScope metricsScope(m_pMetrics.get());
+        std::vector<PROPID> missing;
+        if (m_propertyCache.GetValues(propids, values, missing))
+        {
+            return true;
+        }
+
+        auto pIWiaPropertyStorage = GetImageSourceStorage();
+        if (!pIWiaPropertyStorage)
+        {
+            return false;
+        }
+
+        // the properties not cached are read in one go
+        try
         {
-            ATL::CComPtr<IWiaItem2> ret;
+            util::CPropVariant missingValues((int)missing.size());
+            util::ReadProperties(pIWiaPropertyStorage, missing, missingValues);
 
-            TraverseWIAItemTree(itemTree,
-                [&ret, imgSourceName](const WIAItemTreeNodeInfo& info) -> bool
+            bool allRead = true;
+            for (size_t i = 0; i < missing.size(); i++)
             {
-                if (info.deviceName == imgSourceName)
+                const PROPVARIANT& value = missingValues[(int)i];
+                if (value.vt != VT_I4)
                 {
-                    ret = info.pWiaItem;
-                    return false;
+                    allRead = false;
+                    continue;
                 }
-                return true;
-            });
 
-            return ret;
+                values[missing[i]] = value.lVal;
+                m_propertyCache.SetValue(missing[i], value.lVal);
+            }
+            return allRead;
         }
-        else
+        catch (const util::PropertyStorageException&)
+        {
+            return false;
+        }
+    }
+
+    bool CWIADevice::ReadCachedProperty(PROPID propid, LONG& value)
+    {
+        std::map<PROPID, LONG> values;
+        if (!ReadCachedProperties({ propid }, values))
         {
-            ATL::CComPtr<IWiaItem2> ret;
+            return false;
+        }
+
+        value = values[propid];
+        return true;
+    }
+
+    bool CWIADevice::ReadCachedRanges(const std::vector<PROPID>& propids, std::vector<PropertyRange>& ranges)
+    {
+        ranges.resize(propids.size());
 
-            TraverseWIAItemTree(itemTree,
-                [&ret, imgSourceName](const WIAItemTreeNodeInfo& info) -> bool
+        std::vector<PROPID> missing;
+        for (size_t i = 0; i < propids.size(); i++)
+        {
+            if (!m_propertyCache.GetRange(propids[i], ranges[i]))
             {
-                if (info.itemType & WiaItemTypeTransfer)
-                {
-                    ret = info.pWiaItem;
-                    return false;
-                }
-                return true;
-            });
+                missing.push_back(propids[i]);
+            }
+        }
+        if (missing.empty())
+        {
+            return true;
+        }
+
+        auto pIWiaPropertyStorage = GetImageSourceStorage();
+        if (!pIWiaPropertyStorage)
+        {
+            return false;
+        }
+
+        try
+        {
+            std::vector<ULONG> accessFlags;
+            util::CPropVariant attributes((int)missing.size());
+            util::ReadPropertyAttributes(pIWiaPropertyStorage, missing, accessFlags, attributes);
+
+            for (size_t i = 0; i < missing.size(); i++)
+            {
+                PropertyRange range = RangeFromAttribute(accessFlags[i], attributes[(int)i]);
+                m_propertyCache.SetRange(missing[i], range);
+
+                auto iter = std::find(propids.cbegin(), propids.cend(), missing[i]);
+                ranges[iter - propids.cbegin()] = range;
+            }
+            return true;
+        }
+        catch (const util::PropertyStorageException&)
+        {
+            return false;
+        }
+    }
+
+    bool CWIADevice::WriteCachedProperty(PROPID propid, LONG value)
+    {
+        util::CScopedCallTimer timer("CWIADevice::WriteCachedProperty");
+        util::CMetricsScope metricsScope(m_pMetrics.get());
+        auto pIWiaPropertyStorage = GetImageSourceStorage();
+        if (!pIWiaPropertyStorage)
+        {
+            return false;
+        }
+
+        try
+        {
+            util::WritePropertyLong(pIWiaPropertyStorage, propid, value);
+            m_propertyCache.SetValue(propid, value);
+            return true;
+        }
+        catch (const util::PropertyStorageException&)
+        {
+            // the driver may have changed the value partly
+            m_propertyCache.RemoveValue(propid);
+            return false;
+        }
+    }
+
+    void CWIADevice::RegisterDeviceEvents(const std::wstring& deviceUUID)
+    {
+        static const GUID* deviceEvents[] =
+        {
+            &WIA_EVENT_DEVICE_CONNECTED,
+            &WIA_EVENT_DEVICE_DISCONNECTED,
+            &WIA_EVENT_TREE_UPDATED,
+            &WIA_EVENT_ITEM_CREATED,
+            &WIA_EVENT_ITEM_DELETED,
+        };
+
+        m_pEventCallback.Attach(new CWIAEventCallback(
+            [this](const GUID& eventId, const std::wstring& deviceId)
+        {
+            OnDeviceEvent(eventId);
+        }));
+
+        ATL::CComBSTR devId(deviceUUID.c_str());
+        for (auto eventId : deviceEvents)
+        {
+            // not every driver fires every event, the failures are ignored
+            ATL::CComPtr<IUnknown> pEventObject;
+            HRESULT hr = m_manager.get()->RegisterEventCallbackInterface(0, devId, eventId, m_pEventCallback, &pEventObject);
+            if (SUCCEEDED(hr) && pEventObject)
+            {
+                m_eventRegistrations.push_back(pEventObject);
+            }
+        }
+    }
 
-            return ret;
+    void CWIADevice::OnDeviceEvent(const GUID& eventId)
+    {
+        // Called on a thread of the COM runtime. Doesn't lock the device, a scan might be running
+        m_propertyCache.Invalidate();
+
+        if (!IsEqualGUID(eventId, WIA_EVENT_DEVICE_DISCONNECTED))
+        {
+            InvalidateItemTree();
+            return;
         }
 
+        // the handle is stale once the device is back, it is not handed out again
+        m_manager.OnDeviceDisconnected(m_deviceUUID);
     }
+
     bool CWIADevice::SetDeviceDocumentHandling(ATL::CComPtr<IWiaItem2> device, const std::wstring & handling)
     {
         assert(device);
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
 
         try
         {
@@ -1322,7 +3053,6 @@ namespace scanner
     bool CWIADevice::SetDeviceImageFormat(ATL::CComPtr<IWiaItem2> device, const std::wstring & imageFormat)
     {
         assert(device);
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
 
         try
         {
@@ -1346,6 +3076,10 @@ namespace scanner
                 imageFormatGuid = WiaImgFmt_PNG;
                 imageCompression = WIA_COMPRESSION_PNG;
             }
+            else if (imageFormat == L"raw")
+            {
+                imageFormatGuid = WiaImgFmt_RAW;
+            }
             else
             {
                 return false;
@@ -1355,7 +3089,19 @@ namespace scanner
             HRESULT hr = device->QueryInterface(IID_IWiaPropertyStorage, (void**)&pIWiaPropertyStorage);
 
             util::WritePropertyLong(pIWiaPropertyStorage, WIA_IPA_COMPRESSION, imageCompression);
-            util::WritePropertyGuid(pIWiaPropertyStorage, WIA_IPA_FORMAT, imageFormatGuid);
+            try
+            {
+                util::WritePropertyGuid(pIWiaPropertyStorage, WIA_IPA_FORMAT, imageFormatGuid);
+            }
+            catch (const util::PropertyStorageException&)
+            {
+                // WiaImgFmt_RAW is optional for drivers, every one supports WiaImgFmt_MEMORYBMP
+                if (!IsEqualGUID(imageFormatGuid, WiaImgFmt_RAW))
+                {
+                    throw;
+                }
+                util::WritePropertyGuid(pIWiaPropertyStorage, WIA_IPA_FORMAT, WiaImgFmt_MEMORYBMP);
+            }
 
 
             return true;
@@ -1368,7 +3114,6 @@ namespace scanner
     bool CWIADevice::SetDeviceScanPageCount(ATL::CComPtr<IWiaItem2> device, int pageCount)
     {
         assert(device);
-        std::lock_guard<std::recursive_mutex> g(m_lockWIADevice);
 
         try
         {
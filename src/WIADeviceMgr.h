@@ -5,9 +5,27 @@
 
 #include <wia.h>
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <mutex>
 #include <map>
 
+#include "memoryBuffer.h"
+#include "contentHash.h"
+#include "deviceLock.h"
+#include "deviceRegistry.h"
+#include "documentWriter.h"
+#include "fileSink.h"
+#include "imagePipeline.h"
+#include "jobScheduler.h"
+#include "metrics.h"
+#include "propertyCache.h"
+#include "rawScan.h"
+#include "timeline.h"
+#include "warmPool.h"
+#include "wiaEventCallback.h"
+
 namespace scanner
 {
     class CWIADevice;
@@ -43,46 +61,176 @@ namespace scanner
         CWIADeviceMgr();
     public:
         ~CWIADeviceMgr();
+        // The device manager valid in the current apartment
         ATL::CComPtr<IWiaDevMgr2> get() const;
 
         static std::unique_ptr<CWIADeviceMgr>& GetInstance();
 
         ATL::CComPtr<IGlobalInterfaceTable> GetInterfaceTable();
 
+        // Hands out a device of the pool if one is idle for the UUID
         std::shared_ptr<CWIADevice> OpenWIADevice(const std::wstring& deviceId);
-        std::vector<std::shared_ptr<WIADeviceProperties>> ListAllDevices() const;
+        // Listed once, then kept up to date by the WIA device events. Listed every time if the events cannot be registered
+        std::vector<std::shared_ptr<WIADeviceProperties>> ListAllDevices();
+        // Called for the devices connected and disconnected once listed, on a thread of the COM runtime
+        void SetDeviceChangeHandler(util::CDeviceRegistry<WIADeviceProperties>::Listener handler);
+
+        // The devices released are kept open for the idle TTL, with their item tree and property cache,
+        // and handed out again by OpenWIADevice(). Disabled by default
+        void SetDevicePoolOptions(const util::WarmPoolOptions& options);
+        util::WarmPoolOptions GetDevicePoolOptions() const;
+        util::WarmPoolStats GetDevicePoolStats() const;
+        // The devices of the UUID idle are closed, the ones in use are not pooled again
+        void OnDeviceDisconnected(const std::wstring& deviceId);
+
+        // The scans of all the devices, queued by device and priority under a global budget of the scans running
+        // and of the threads processing their pages. No limit by default
+        util::CJobScheduler& GetScanScheduler();
 
     private:
         HRESULT CreateWIADeviveManager();
         HRESULT CreateWIADeviceInterfaceTable();
+        void RegisterDeviceEvents();
+        void OnDeviceEvent(const GUID& eventId, const std::wstring& deviceId);
+        bool RescanDevices();
 
     private:
         ATL::CComPtr<IWiaDevMgr2> m_pWiaDevMgr;
         ATL::CComPtr<IGlobalInterfaceTable> m_pWiaDeviceTable;
+        DWORD m_managerCookie;      // m_pWiaDevMgr registered in the IGlobalInterfaceTable
+
+        util::CDeviceRegistry<WIADeviceProperties> m_deviceRegistry;
+        ATL::CComPtr<CWIAEventCallback> m_pEventCallback;
+        std::vector<ATL::CComPtr<IUnknown>> m_eventRegistrations;
+        bool m_bWatchingDevices;    // both the connect and the disconnect events registered
+
+        util::CJobScheduler m_scanScheduler;
+
+        // shut down first by the destructor, the devices need the manager to close
+        util::CWarmPool<CWIADevice> m_devicePool;
+    };
+
+    enum class ScanProgressType
+    {
+        Status,         // WIA_TRANSFER_MSG_STATUS
+        PageStart,      // a new page begins
+        PageEnd,        // WIA_TRANSFER_MSG_END_OF_STREAM
     };
 
     // information of the scan progress
     struct ScanProgressInfo
     {
+        ScanProgressType type;
         LONG pageCount;
         LONG percentComplete;
         ULONG64 bytesTransferred;
         HRESULT error;
+        ULONG coalesced;        // how many status updates of the same page have been merged into this one
 
         ScanProgressInfo()
-            : pageCount(0)
+            : type(ScanProgressType::Status)
+            , pageCount(0)
             , percentComplete(0)
             , bytesTransferred(0)
             , error(S_OK)
+            , coalesced(0)
         {
         }
     };
     typedef std::function<void(const ScanProgressInfo&)> ScanProgressCallback;
 
+    // Receives the data of a page while the driver is writing it.
+    // offset is where the data locates in the page, drivers might go back and rewrite the header at the end of the page.
+    // Returning false aborts the transfer.
+    typedef std::function<bool(long page, uint64_t offset, const void* data, size_t size)> ScanDataCallback;
+
+    enum class ScanPageSide
+    {
+        Front,
+        Back,       // the odd pages of a duplex scan
+    };
+
+    // a page completed while the scan goes on
+    struct ScanPageInfo
+    {
+        long index = 0;                                 // the page in the order of the transfer, the same as in ScanDataCallback
+        ScanPageSide side = ScanPageSide::Front;
+        std::wstring filePath;                          // path of the image file if the output is ScanOutput::File
+        std::shared_ptr<util::CMemoryBuffer> buffer;    // image data if the output is ScanOutput::Buffer, not to be changed
+        uint64_t size = 0;                              // bytes of the image
+        double transferMs = 0;                          // from the first byte of the page until its end
+        util::ContentDigest digest;                     // of the image if ScanOptions::hash is enabled, not of the pages of a document
+        std::vector<util::PageThumbnail> thumbnails;    // if ScanOptions::pipeline asks for them, the largest first
+    };
+
+    // Called as soon as a page is complete: on the scan thread when its stream ends,
+    // on a thread of the page pipeline once processed if ScanOptions::pipeline is enabled,
+    // on the thread writing the files once its file is written if the output is ScanOutput::File.
+    // Blank pages removed by the pipeline are not reported
+    typedef std::function<void(const ScanPageInfo&)> ScanPageCallback;
+
+    // where the acquired images go
+    enum class ScanOutput
+    {
+        File,       // write every page to a file in the save directory
+        Buffer,     // keep every page in memory
+    };
+
+    struct ScanOptions
+    {
+        ScanOutput output = ScanOutput::File;
+        std::wstring saveDirectory;     // available only if the output is ScanOutput::File
+        std::wstring saveFilename;      // available only if the output is ScanOutput::File
+        util::PipelineOptions pipeline; // stages run on the pages while the next ones are being acquired, none by default
+        // All pages are appended to one multi-page TIFF or PDF as they come, the result is a single file or buffer.
+        // Only one page is kept in memory, those processed by the pipeline out of order wait for the previous ones
+        util::DocumentFormat document = util::DocumentFormat::None;
+        // Digests of the files or buffers, computed while the data is written instead of reading the files again
+        util::HashOptions hash;
+        // The files are written behind the transfer, fileSink.durability tells when they are flushed to the disk
+        util::FileSinkOptions fileSink;
+        // The messages and the writes of the driver are recorded into this file, to be replayed by bench/replayBench.
+        // Nothing is recorded if empty, the scan doesn't fail if the trace cannot be written
+        std::wstring traceFile;
+        bool traceData = false;         // the trace keeps the data written by the driver, not only the sizes
+        int timeoutMs = 0;              // the scan is cancelled once it has run this long, 0 for no limit
+        int cancelTimeoutMs = 0;        // the transfer is aborted if the driver hasn't stopped this long after a cancel, 0 to wait
+        // A preview at this DPI if not 0: one page in greyscale, uncompressed.
+        // The resolution and the color mode are written for this scan only, the previous values are written back afterwards
+        int previewDpi = 0;
+    };
+
+    // how a scan has been cancelled
+    struct ScanCancelInfo
+    {
+        bool cancelled = false;
+        bool timedOut = false;          // cancelled because ScanOptions::timeoutMs passed
+        bool forced = false;            // the driver didn't stop within ScanOptions::cancelTimeoutMs, the transfer was aborted
+        std::chrono::steady_clock::time_point cancelTime;   // when the cancel was asked for
+        double cancelToIdleMs = 0;      // from the cancel until the scan returned
+    };
+
+    // the preview acquired by CWIADevice::GetPreview()
+    struct PreviewResult
+    {
+        util::RawImage image;           // PixelFormat::Gray8
+        double firstRowMs = 0;          // from the start until the first row was decoded
+        double totalMs = 0;
+    };
+
+    // an image acquired from the scanner
+    struct ScannedPage
+    {
+        std::wstring filePath;                          // path of the image file if the output is ScanOutput::File
+        std::shared_ptr<util::CMemoryBuffer> buffer;    // image data if the output is ScanOutput::Buffer
+        util::ContentDigest digest;                     // if ScanOptions::hash is enabled
+        std::vector<util::PageThumbnail> thumbnails;    // if ScanOptions::pipeline asks for them, not for a document
+    };
+
     struct WIAItemTreeNodeInfo
     {
         std::wstring deviceName;
-        ATL::CComPtr<IWiaItem2> pWiaItem;
+        DWORD itemCookie = 0;       // the item registered in the IGlobalInterfaceTable, usable from any apartment
         LONG itemType = 0;
         GUID itemCategory = { 0 };
     };
@@ -94,11 +242,47 @@ namespace scanner
         std::vector<std::shared_ptr<WIAItemTreeNode>> childItems;
     };
 
+    struct WIAItemTreeStats
+    {
+        uint64_t builds = 0;        // how many times the item tree has been built
+        uint64_t cacheHits = 0;     // how many times the cached item tree has been used instead
+        double lastBuildMs = 0;     // how long the last build took
+        double totalBuildMs = 0;
+    };
+
     // Traverse a WIA item tree
     typedef std::function<bool(WIAItemTreeNodeInfo&)> WIAItemIterateCallback;
     bool TraverseWIAItemTree(std::shared_ptr<WIAItemTreeNode> itemTree, WIAItemIterateCallback callback);
 
 
+    // Settings of the scan operation, read/written in one go
+    struct ScanSettings
+    {
+        std::wstring imageFormat;       // tiff/bmp/jpeg/png, or raw to have the pages encoded by the module
+        std::wstring colorFormat;       // blackwhite/greyscale/fullcolor
+        std::wstring paperProfile;
+        std::wstring documentHandling;  // front/duplex
+        int pageCount = 0;
+        int dpi = 0;
+        int brightness = 0;             // in steps of brightnessRange.step
+        int contrast = 0;               // in steps of contrastRange.step
+        PropertyRange brightnessRange;
+        PropertyRange contrastRange;
+    };
+
+    // which members of ScanSettings are taken
+    enum ScanSettingFlags : unsigned int
+    {
+        SCAN_SETTING_IMAGE_FORMAT       = 1 << 0,
+        SCAN_SETTING_COLOR_FORMAT       = 1 << 1,
+        SCAN_SETTING_PAPER_PROFILE      = 1 << 2,
+        SCAN_SETTING_DOCUMENT_HANDLING  = 1 << 3,
+        SCAN_SETTING_PAGE_COUNT         = 1 << 4,
+        SCAN_SETTING_DPI                = 1 << 5,
+        SCAN_SETTING_BRIGHTNESS         = 1 << 6,
+        SCAN_SETTING_CONTRAST           = 1 << 7,
+    };
+
     class CWIADevice
     {
     public:
@@ -114,10 +298,13 @@ namespace scanner
         std::vector<std::wstring> GetImageSources();
 
         DWORD GetInterfaceTableKey() const;
+        const std::wstring& GetDeviceUUID() const;
 
         HRESULT ShowDeviceDlg(HWND hWndParent, const std::wstring& folderName, const std::wstring& saveFilename, std::vector<std::wstring>& outFilePaths);
 
-        // Read/write properties of the WIA device
+        // Read/write properties of the WIA device.
+        // Reads don't wait for a running scan. Writes to the device are refused while a scan is running,
+        // the format, the document handling and the page count are taken by the next scan.
         // image output format(tiff/bmp/jpeg/png)
         std::wstring GetImageFormat();
         bool SetImageFormat(const std::wstring& format);
@@ -146,50 +333,137 @@ namespace scanner
         int GetScanContrast();
         bool SetScanContrast(int contrast);
 
+        // Read/write several properties of the image source with a single IWiaPropertyStorage call.
+        // values[i] corresponds to propids[i]
+        bool ReadProperties(const std::vector<PROPID>& propids, util::CPropVariant& values);
+        bool WriteProperties(const std::vector<PROPID>& propids, const util::CPropVariant& values);
+
+        // Read all the settings above with one ReadMultiple and one GetPropertyAttributes call
+        ScanSettings GetScanSettings();
+        // Write the settings selected by flags(ScanSettingFlags) with one WriteMultiple call.
+        // Returns the flags of the settings written successfully
+        unsigned int SetScanSettings(const ScanSettings& settings, unsigned int flags);
+
+        // Drop the property values cached, the next reads go to the device
+        void RefreshProperties();
+        util::PropertyCacheStats GetPropertyCacheStats() const;
+
+        // Rebuild the WIA item tree the next time it is used
+        void InvalidateItemTree();
+        WIAItemTreeStats GetItemTreeStats() const;
+
         bool IsScanRunning() const;
-        void CancelScan();
+        util::ScanState GetScanState() const;
+        util::DeviceLockStats GetLockStats() const;
+        // The phases of the scans on a timeline, recorded only while enabled
+        util::CTimeline& GetTimeline();
+        // Forget the settings pending and the tracing of the previous user, for a device handed out again by the pool.
+        // The properties written to the device stay, as they do while a device is open
+        void ResetSession();
+        // The calls to the driver and the transfers, kept by the registry for the UUID
+        util::DeviceMetrics& GetMetrics();
+        // Returns false if no scan is running, or it is being cancelled already.
+        // The transfer stops at the next callback of the driver
+        bool CancelScan();
 
         bool IsFeeder();
 
-        // get preview image
-        // 
-        void GetPreview();
+        // Scan a preview at a low DPI in greyscale. The rows are given to rowCallback as soon as they are transferred,
+        // on the thread of the transfer, for the preview to be painted as it comes. The settings are not changed
+        HRESULT GetPreview(int dpi, util::RawScanRowCallback rowCallback, PreviewResult& result);
 
         // do scan
         HRESULT Scan(
-            const std::wstring& saveDirectory, 
-            const std::wstring& saveFilename, 
-            std::vector<std::wstring>& saveFilenames,
-            ScanProgressCallback progressCallback = nullptr);
+            const ScanOptions& options,
+            std::vector<ScannedPage>& scannedPages,
+            ScanProgressCallback progressCallback = nullptr,
+            ScanDataCallback dataCallback = nullptr,
+            ScanPageCallback pageCallback = nullptr,
+            util::PipelineStats* pipelineStats = nullptr,
+            ScanCancelInfo* cancelInfo = nullptr);
 
     private:
-        // Build WIA item tree from a IWiaItem pointer
-        static std::shared_ptr<WIAItemTreeNode> FindImageSourcesFromDevice(ATL::CComPtr<IWiaItem2> pDevice);
-        static std::shared_ptr<WIAItemTreeNode> DoFindImageSourcesFromDevice(ATL::CComPtr<IWiaItem2> pParentDevice);
-        // Get the pointer of the image source with a specific name from the WIA item tree.
-        // If the name is empty, Get The first image source pointer from the WIA item tree which can be used for image transfer.
-        static ATL::CComPtr<IWiaItem2> GetImageSource(std::shared_ptr<WIAItemTreeNode> itemTree, const std::wstring& imgSourceName);
+        // the scan, counted by Scan()
+        HRESULT DoScan(
+            const ScanOptions& options,
+            std::vector<ScannedPage>& scannedPages,
+            ScanProgressCallback progressCallback,
+            ScanDataCallback dataCallback,
+            ScanPageCallback pageCallback,
+            util::PipelineStats* pipelineStats,
+            ScanCancelInfo* cancelInfo);
+
+        // Build WIA item tree from a IWiaItem pointer.
+        // Every item is registered in the IGlobalInterfaceTable, so that the tree can be used from any apartment.
+        std::shared_ptr<WIAItemTreeNode> FindImageSourcesFromDevice(ATL::CComPtr<IWiaItem2> pDevice);
+        std::shared_ptr<WIAItemTreeNode> DoFindImageSourcesFromDevice(ATL::CComPtr<IWiaItem2> pParentDevice);
+        // Revoke the items of a tree from the IGlobalInterfaceTable
+        void RevokeItemTree(std::shared_ptr<WIAItemTreeNode> itemTree);
+        // The cached WIA item tree. It is rebuilt only if a WIA event has changed the tree or InvalidateItemTree() is called
+        std::shared_ptr<WIAItemTreeNode> GetItemTree();
+        // Find the image source with a specific name from the WIA item tree.
+        // If the name is empty, find the first image source which can be used for image transfer.
+        static bool FindImageSource(std::shared_ptr<WIAItemTreeNode> itemTree, const std::wstring& imgSourceName, WIAItemTreeNodeInfo& info);
+        // Get the pointer of the image source valid in the current apartment
+        ATL::CComPtr<IWiaItem2> GetImageSource(const std::wstring& imgSourceName);
 
         bool SetDeviceDocumentHandling(ATL::CComPtr<IWiaItem2> device, const std::wstring& handling);
         bool SetDeviceImageFormat(ATL::CComPtr<IWiaItem2> device, const std::wstring& imageFormat);
         bool SetDeviceScanPageCount(ATL::CComPtr<IWiaItem2> device, int pageCount);
 
+        // property storage of the first available image source
+        ATL::CComPtr<IWiaPropertyStorage> GetImageSourceStorage();
+
+        // Read LONG properties of the image source through the property cache.
+        // values receives the properties read successfully, returns true if all of them are read
+        bool ReadCachedProperties(const std::vector<PROPID>& propids, std::map<PROPID, LONG>& values);
+        bool ReadCachedProperty(PROPID propid, LONG& value);
+        // Read the ranges of the properties through the property cache
+        bool ReadCachedRanges(const std::vector<PROPID>& propids, std::vector<PropertyRange>& ranges);
+        // Write a LONG property of the image source, and the cache as well if succeeded
+        bool WriteCachedProperty(PROPID propid, LONG value);
+
+        // WIA events which might change the properties of the device
+        void RegisterDeviceEvents(const std::wstring& deviceUUID);
+        void OnDeviceEvent(const GUID& eventId);
+
     private:
-        std::recursive_mutex m_lockWIADevice;
+        // Settings applied when the scan operation starts, a scan works on a snapshot of them
+        struct PendingScanSettings
+        {
+            std::wstring documentHandling;  // document handling
+            std::wstring imageFormat;       // output file format
+            int pageCount = 0;              // how many pages will be scanned
+        };
+
+    private:
+        util::CDeviceLock m_deviceLock;
+
+        // called by CancelScan() to arm the forced abort of the running scan
+        std::mutex m_lockCancelHandler;
+        std::function<void()> m_cancelHandler;
 
         CWIADeviceMgr& m_manager;
+        std::wstring m_deviceUUID;
         ATL::CComPtr<IWiaItem2> m_pDevice;
         DWORD m_deviceCookie;
 
 
+        std::mutex m_lockItemTree;
         std::shared_ptr<WIAItemTreeNode> m_imageSources;
+        std::atomic<bool> m_bItemTreeDirty;
+
+        mutable std::mutex m_lockStats;
+        WIAItemTreeStats m_itemTreeStats;
+
+        util::CTimeline m_timeline;
+        std::shared_ptr<util::DeviceMetrics> m_pMetrics;
 
-        bool m_bScanRunning;
+        util::CPropertyCache m_propertyCache;
+        ATL::CComPtr<CWIAEventCallback> m_pEventCallback;
+        std::vector<ATL::CComPtr<IUnknown>> m_eventRegistrations;
 
-        // Settings set when the scan operation is going to start
-        std::wstring m_documentHandling; // document handling
-        std::wstring m_imageFormat;   // output file format
-        int m_pageCount;           // how many pages will be scanned
+        util::CSnapshotValue<PendingScanSettings> m_pendingSettings;
     };
 }
 
@@ -23,4 +23,9 @@ namespace scanner
     {
         uv_async_send(m_pAsyncEvent.get());
     }
+
+    void uvAsyncEvent::Unref()
+    {
+        uv_unref((uv_handle_t*)m_pAsyncEvent.get());
+    }
 }
\ No newline at end of file
@@ -10,6 +10,8 @@ namespace scanner
         virtual ~uvAsyncEvent();
         void* GetContext() const;
         void NotifyComplete();
+        // the event doesn't keep the loop running, e.g. the events waited for may never come
+        void Unref();
 
     private:
         static void uvCloseCallback(uv_handle_t* handle)
@@ -0,0 +1,56 @@
+#include "stdafx.h"
+#include "callTimings.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        CCallTimings::CCallTimings()
+        {
+        }
+
+        CCallTimings& CCallTimings::GetInstance()
+        {
+            static CCallTimings instance;
+            return instance;
+        }
+
+        void CCallTimings::Record(const std::string& name, double elapsedMs)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+
+            CallTiming& timing = m_timings[name];
+            timing.count++;
+            timing.totalMs += elapsedMs;
+            timing.lastMs = elapsedMs;
+            if (elapsedMs > timing.maxMs)
+            {
+                timing.maxMs = elapsedMs;
+            }
+        }
+
+        std::map<std::string, CallTiming> CCallTimings::GetTimings() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_timings;
+        }
+
+        void CCallTimings::Reset()
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            m_timings.clear();
+        }
+
+        CScopedCallTimer::CScopedCallTimer(const char* name)
+            : m_name(name)
+            , m_startTime(std::chrono::steady_clock::now())
+        {
+        }
+
+        CScopedCallTimer::~CScopedCallTimer()
+        {
+            double elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_startTime).count();
+            CCallTimings::GetInstance().Record(m_name, elapsedMs);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace scanner
+{
+    namespace util
+    {
+        struct CallTiming
+        {
+            uint64_t count = 0;
+            double totalMs = 0;
+            double maxMs = 0;
+            double lastMs = 0;
+        };
+
+        // How long the calls into the WIA driver take, grouped by the name of the call
+        class CCallTimings
+        {
+        public:
+            static CCallTimings& GetInstance();
+
+            void Record(const std::string& name, double elapsedMs);
+            std::map<std::string, CallTiming> GetTimings() const;
+            void Reset();
+
+        private:
+            CCallTimings();
+
+            CCallTimings(const CCallTimings&) = delete;
+            CCallTimings& operator=(const CCallTimings&) = delete;
+
+        private:
+            mutable std::mutex m_lock;
+            std::map<std::string, CallTiming> m_timings;
+        };
+
+        // Records the time elapsed between construction and destruction to CCallTimings
+        class CScopedCallTimer
+        {
+        public:
+            explicit CScopedCallTimer(const char* name);
+            ~CScopedCallTimer();
+
+            CScopedCallTimer(const CScopedCallTimer&) = delete;
+            CScopedCallTimer& operator=(const CScopedCallTimer&) = delete;
+
+        private:
+            const char* m_name;
+            std::chrono::steady_clock::time_point m_startTime;
+        };
+    }
+}
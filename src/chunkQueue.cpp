@@ -0,0 +1,120 @@
+#include "stdafx.h"
+#include "chunkQueue.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        CChunkQueue::CChunkQueue(size_t capacity, size_t maxChunkSize)
+            : m_capacity(capacity)
+            , m_maxChunkSize(maxChunkSize)
+            , m_queuedBytes(0)
+            , m_blockedCount(0)
+            , m_bClosed(false)
+        {
+            assert(m_capacity);
+        }
+
+        CChunkQueue::~CChunkQueue()
+        {
+            Close();
+        }
+
+        bool CChunkQueue::Push(long page, uint64_t offset, const void* data, size_t size)
+        {
+            if (!size)
+            {
+                return true;
+            }
+
+            std::unique_lock<std::mutex> g(m_lock);
+
+            // A chunk larger than the capacity is still accepted once the queue is empty,
+            // otherwise the producer would never be woken up.
+            auto isFull = [this, size]()
+            {
+                return m_queuedBytes && (m_queuedBytes + size > m_capacity);
+            };
+
+            if (!m_bClosed && isFull())
+            {
+                m_blockedCount++;
+                m_cvNotFull.wait(g, [this, &isFull]() { return m_bClosed || !isFull(); });
+            }
+
+            if (m_bClosed)
+            {
+                return false;
+            }
+
+            // merge the data into the last chunk if it continues that chunk
+            if (!m_chunks.empty())
+            {
+                DataChunk& last = m_chunks.back();
+                if (last.page == page &&
+                    last.offset + last.data->Size() == offset &&
+                    last.data->Size() + size <= m_maxChunkSize)
+                {
+                    last.data->Write(data, size);
+                    m_queuedBytes += size;
+                    return true;
+                }
+            }
+
+            DataChunk chunk;
+            chunk.page = page;
+            chunk.offset = offset;
+            chunk.data = std::make_shared<CMemoryBuffer>(size);
+            chunk.data->Write(data, size);
+
+            m_chunks.push_back(chunk);
+            m_queuedBytes += size;
+            return true;
+        }
+
+        size_t CChunkQueue::PopAll(std::deque<DataChunk>& chunks)
+        {
+            size_t count = 0;
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                count = m_chunks.size();
+                for (auto& chunk : m_chunks)
+                {
+                    chunks.push_back(chunk);
+                }
+                m_chunks.clear();
+                m_queuedBytes = 0;
+            }
+            m_cvNotFull.notify_all();
+
+            return count;
+        }
+
+        void CChunkQueue::Close()
+        {
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                m_bClosed = true;
+            }
+            m_cvNotFull.notify_all();
+        }
+
+        bool CChunkQueue::IsClosed() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_bClosed;
+        }
+
+        size_t CChunkQueue::GetQueuedBytes() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_queuedBytes;
+        }
+
+        uint64_t CChunkQueue::GetBlockedCount() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_blockedCount;
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include "memoryBuffer.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        // a piece of a page written by the driver
+        struct DataChunk
+        {
+            long page = 0;              // index of the page the chunk belongs to
+            uint64_t offset = 0;        // where the chunk locates in the page
+            std::shared_ptr<CMemoryBuffer> data;
+        };
+
+        // A bounded queue of data chunks passed from the transfer thread to the JavaScript thread.
+        // Push() blocks the producer while the queued bytes exceed the capacity,
+        // so that a slow consumer slows the transfer down instead of growing the native memory without limit.
+        class CChunkQueue
+        {
+        public:
+            // capacity: how many bytes can be queued at most
+            // maxChunkSize: contiguous writes of the same page are merged into one chunk up to this size
+            CChunkQueue(size_t capacity, size_t maxChunkSize = 256 * 1024);
+            ~CChunkQueue();
+
+            CChunkQueue(const CChunkQueue&) = delete;
+            CChunkQueue& operator=(const CChunkQueue&) = delete;
+
+            // Copy data into the queue. Returns false if the queue has been closed
+            bool Push(long page, uint64_t offset, const void* data, size_t size);
+            // Take all queued chunks, wakes up the blocked producer
+            size_t PopAll(std::deque<DataChunk>& chunks);
+
+            // Wake up the producer and reject further data
+            void Close();
+            bool IsClosed() const;
+
+            size_t GetQueuedBytes() const;
+            // how many times the producer has been blocked because the queue was full
+            uint64_t GetBlockedCount() const;
+
+        private:
+            const size_t m_capacity;
+            const size_t m_maxChunkSize;
+
+            mutable std::mutex m_lock;
+            std::condition_variable m_cvNotFull;
+
+            std::deque<DataChunk> m_chunks;
+            size_t m_queuedBytes;
+            uint64_t m_blockedCount;
+            bool m_bClosed;
+        };
+    }
+}
@@ -0,0 +1,513 @@
+#include "stdafx.h"
+#include "contentHash.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CONTENT_HASH_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
+
+// as in inkCount.cpp, GCC and Clang need the instruction sets of the kernels enabled per function
+#if defined(__GNUC__)
+#define CONTENT_HASH_TARGET(name) __attribute__((target(name)))
+#else
+#define CONTENT_HASH_TARGET(name)
+#endif
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            const uint32_t Sha256Constants[64] =
+            {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+            };
+
+            const uint64_t XxPrime1 = 0x9E3779B185EBCA87ULL;
+            const uint64_t XxPrime2 = 0xC2B2AE3D27D4EB4FULL;
+            const uint64_t XxPrime3 = 0x165667B19E3779F9ULL;
+            const uint64_t XxPrime4 = 0x85EBCA77C2B2AE63ULL;
+            const uint64_t XxPrime5 = 0x27D4EB2F165667C5ULL;
+
+            inline uint32_t RotateRight32(uint32_t value, int bits)
+            {
+                return (value >> bits) | (value << (32 - bits));
+            }
+
+            inline uint64_t RotateLeft64(uint64_t value, int bits)
+            {
+                return (value << bits) | (value >> (64 - bits));
+            }
+
+            inline uint32_t GetUInt32BE(const uint8_t* data)
+            {
+                return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+            }
+
+            inline uint32_t GetUInt32LE(const uint8_t* data)
+            {
+                return uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+            }
+
+            inline uint64_t GetUInt64LE(const uint8_t* data)
+            {
+                return uint64_t(GetUInt32LE(data)) | (uint64_t(GetUInt32LE(data + 4)) << 32);
+            }
+
+            inline uint64_t XxRound(uint64_t accumulator, uint64_t input)
+            {
+                accumulator += input * XxPrime2;
+                accumulator = RotateLeft64(accumulator, 31);
+                return accumulator * XxPrime1;
+            }
+
+            inline uint64_t XxMergeRound(uint64_t hash, uint64_t accumulator)
+            {
+                hash ^= XxRound(0, accumulator);
+                return hash * XxPrime1 + XxPrime4;
+            }
+
+            typedef void(*Sha256BlocksFunction)(uint32_t state[8], const uint8_t* blocks, size_t count);
+
+            void Sha256BlocksScalar(uint32_t state[8], const uint8_t* blocks, size_t count)
+            {
+                for (; count; blocks += 64, count--)
+                {
+                    uint32_t w[64];
+                    for (int i = 0; i < 16; i++)
+                    {
+                        w[i] = GetUInt32BE(blocks + i * 4);
+                    }
+                    for (int i = 16; i < 64; i++)
+                    {
+                        uint32_t s0 = RotateRight32(w[i - 15], 7) ^ RotateRight32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                        uint32_t s1 = RotateRight32(w[i - 2], 17) ^ RotateRight32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+                    }
+
+                    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+                    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+                    for (int i = 0; i < 64; i++)
+                    {
+                        uint32_t s1 = RotateRight32(e, 6) ^ RotateRight32(e, 11) ^ RotateRight32(e, 25);
+                        uint32_t choice = (e & f) ^ (~e & g);
+                        uint32_t temp1 = h + s1 + choice + Sha256Constants[i] + w[i];
+                        uint32_t s0 = RotateRight32(a, 2) ^ RotateRight32(a, 13) ^ RotateRight32(a, 22);
+                        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+                        uint32_t temp2 = s0 + majority;
+
+                        h = g;
+                        g = f;
+                        f = e;
+                        e = d + temp1;
+                        d = c;
+                        c = b;
+                        b = a;
+                        a = temp1 + temp2;
+                    }
+
+                    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+                    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+                }
+            }
+
+#if defined(CONTENT_HASH_X86)
+            // The SHA extensions run 2 rounds per instruction on the state split in ABEF and CDGH
+            CONTENT_HASH_TARGET("sha,sse4.1")
+            void Sha256BlocksShaNi(uint32_t state[8], const uint8_t* blocks, size_t count)
+            {
+                // the words of the message are big endian
+                const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+                __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xb1);
+                __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1b);
+                __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+                __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+
+                for (; count; blocks += 64, count--)
+                {
+                    __m128i abefStart = abef;
+                    __m128i cdghStart = cdgh;
+
+                    // the last 16 words of the message schedule, 4 per vector
+                    __m128i w[4];
+                    for (int i = 0; i < 16; i++)
+                    {
+                        if (i < 4)
+                        {
+                            w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + i * 16)), byteSwap);
+                        }
+                        else
+                        {
+                            __m128i w7 = _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4);
+                            w[i % 4] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]), w7), w[(i + 3) % 4]);
+                        }
+
+                        __m128i message = _mm_add_epi32(w[i % 4], _mm_loadu_si128(reinterpret_cast<const __m128i*>(Sha256Constants + i * 4)));
+                        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+                        abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(message, 0x0e));
+                    }
+
+                    abef = _mm_add_epi32(abef, abefStart);
+                    cdgh = _mm_add_epi32(cdgh, cdghStart);
+                }
+
+                __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+                __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(feba, dchg, 0xf0));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+            }
+
+            bool CpuSupportsShaNi()
+            {
+                // leaf 1: SSSE3 in ecx bit 9, SSE4.1 in ecx bit 19, leaf 7: SHA in ebx bit 29
+#if defined(_MSC_VER)
+                int info[4] = {};
+                __cpuid(info, 0);
+                if (info[0] < 7)
+                {
+                    return false;
+                }
+                __cpuid(info, 1);
+                bool sse = (info[2] & (1 << 9)) && (info[2] & (1 << 19));
+                __cpuidex(info, 7, 0);
+                return sse && (info[1] & (1 << 29));
+#else
+                unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+                if (__get_cpuid_max(0, nullptr) < 7 || !__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+                {
+                    return false;
+                }
+                bool sse = (ecx & (1 << 9)) && (ecx & (1 << 19));
+                __cpuid_count(7, 0, eax, ebx, ecx, edx);
+                return sse && (ebx & (1 << 29));
+#endif
+            }
+#endif
+
+            Sha256BlocksFunction SelectSha256Blocks()
+            {
+#if defined(CONTENT_HASH_X86)
+                if (CpuSupportsShaNi())
+                {
+                    return Sha256BlocksShaNi;
+                }
+#endif
+                return Sha256BlocksScalar;
+            }
+
+            std::string ToHex(const uint8_t* data, size_t size)
+            {
+                static const char digits[] = "0123456789abcdef";
+                std::string hex(size * 2, '0');
+                for (size_t i = 0; i < size; i++)
+                {
+                    hex[i * 2] = digits[data[i] >> 4];
+                    hex[i * 2 + 1] = digits[data[i] & 0xf];
+                }
+                return hex;
+            }
+        }
+
+        CSha256::CSha256()
+        {
+            Reset();
+        }
+
+        void CSha256::Reset()
+        {
+            static const uint32_t initialState[8] =
+            {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+            };
+            std::memcpy(m_state, initialState, sizeof(m_state));
+            m_length = 0;
+            m_blockSize = 0;
+        }
+
+        void CSha256::Transform(const uint8_t* blocks, size_t count)
+        {
+            static const Sha256BlocksFunction transform = SelectSha256Blocks();
+            transform(m_state, blocks, count);
+        }
+
+        void CSha256::Update(const void* data, size_t size)
+        {
+            if (!size)
+            {
+                return;
+            }
+
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            m_length += size;
+
+            if (m_blockSize)
+            {
+                size_t copySize = std::min(size, sizeof(m_block) - m_blockSize);
+                std::memcpy(m_block + m_blockSize, bytes, copySize);
+                m_blockSize += copySize;
+                bytes += copySize;
+                size -= copySize;
+
+                if (m_blockSize < sizeof(m_block))
+                {
+                    return;
+                }
+                Transform(m_block, 1);
+                m_blockSize = 0;
+            }
+
+            // whole blocks straight from the data
+            size_t blockCount = size / sizeof(m_block);
+            if (blockCount)
+            {
+                Transform(bytes, blockCount);
+                bytes += blockCount * sizeof(m_block);
+                size -= blockCount * sizeof(m_block);
+            }
+
+            std::memcpy(m_block, bytes, size);
+            m_blockSize = size;
+        }
+
+        void CSha256::Final(uint8_t digest[32])
+        {
+            uint64_t bitLength = m_length * 8;
+
+            // 0x80, zeros up to 56 bytes in the block, then the length in bits
+            uint8_t padding[64 + 8] = { 0x80 };
+            size_t paddingSize = (m_blockSize < 56) ? (56 - m_blockSize) : (120 - m_blockSize);
+            for (int i = 0; i < 8; i++)
+            {
+                padding[paddingSize + i] = uint8_t(bitLength >> (56 - i * 8));
+            }
+            Update(padding, paddingSize + 8);
+
+            for (int i = 0; i < 8; i++)
+            {
+                digest[i * 4] = uint8_t(m_state[i] >> 24);
+                digest[i * 4 + 1] = uint8_t(m_state[i] >> 16);
+                digest[i * 4 + 2] = uint8_t(m_state[i] >> 8);
+                digest[i * 4 + 3] = uint8_t(m_state[i]);
+            }
+            Reset();
+        }
+
+        CXxHash64::CXxHash64()
+        {
+            Reset();
+        }
+
+        void CXxHash64::Reset()
+        {
+            m_accumulators[0] = XxPrime1 + XxPrime2;
+            m_accumulators[1] = XxPrime2;
+            m_accumulators[2] = 0;
+            m_accumulators[3] = 0 - XxPrime1;
+            m_length = 0;
+            m_blockSize = 0;
+        }
+
+        void CXxHash64::Update(const void* data, size_t size)
+        {
+            if (!size)
+            {
+                return;
+            }
+
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            m_length += size;
+
+            if (m_blockSize)
+            {
+                size_t copySize = std::min(size, sizeof(m_block) - m_blockSize);
+                std::memcpy(m_block + m_blockSize, bytes, copySize);
+                m_blockSize += copySize;
+                bytes += copySize;
+                size -= copySize;
+
+                if (m_blockSize < sizeof(m_block))
+                {
+                    return;
+                }
+                for (int i = 0; i < 4; i++)
+                {
+                    m_accumulators[i] = XxRound(m_accumulators[i], GetUInt64LE(m_block + i * 8));
+                }
+                m_blockSize = 0;
+            }
+
+            // the 4 lanes are independent, kept in registers over the whole data
+            uint64_t v1 = m_accumulators[0], v2 = m_accumulators[1], v3 = m_accumulators[2], v4 = m_accumulators[3];
+            for (; size >= sizeof(m_block); bytes += sizeof(m_block), size -= sizeof(m_block))
+            {
+                v1 = XxRound(v1, GetUInt64LE(bytes));
+                v2 = XxRound(v2, GetUInt64LE(bytes + 8));
+                v3 = XxRound(v3, GetUInt64LE(bytes + 16));
+                v4 = XxRound(v4, GetUInt64LE(bytes + 24));
+            }
+            m_accumulators[0] = v1; m_accumulators[1] = v2; m_accumulators[2] = v3; m_accumulators[3] = v4;
+
+            std::memcpy(m_block, bytes, size);
+            m_blockSize = size;
+        }
+
+        uint64_t CXxHash64::Final()
+        {
+            uint64_t hash;
+            if (m_length >= sizeof(m_block))
+            {
+                const uint64_t* v = m_accumulators;
+                hash = RotateLeft64(v[0], 1) + RotateLeft64(v[1], 7) + RotateLeft64(v[2], 12) + RotateLeft64(v[3], 18);
+                for (int i = 0; i < 4; i++)
+                {
+                    hash = XxMergeRound(hash, v[i]);
+                }
+            }
+            else
+            {
+                hash = XxPrime5;
+            }
+            hash += m_length;
+
+            // the bytes left in the block
+            const uint8_t* bytes = m_block;
+            size_t size = m_blockSize;
+            for (; size >= 8; bytes += 8, size -= 8)
+            {
+                hash ^= XxRound(0, GetUInt64LE(bytes));
+                hash = RotateLeft64(hash, 27) * XxPrime1 + XxPrime4;
+            }
+            if (size >= 4)
+            {
+                hash ^= uint64_t(GetUInt32LE(bytes)) * XxPrime1;
+                hash = RotateLeft64(hash, 23) * XxPrime2 + XxPrime3;
+                bytes += 4;
+                size -= 4;
+            }
+            for (; size; bytes++, size--)
+            {
+                hash ^= *bytes * XxPrime5;
+                hash = RotateLeft64(hash, 11) * XxPrime1;
+            }
+
+            hash ^= hash >> 33;
+            hash *= XxPrime2;
+            hash ^= hash >> 29;
+            hash *= XxPrime3;
+            hash ^= hash >> 32;
+
+            Reset();
+            return hash;
+        }
+
+        CContentHasher::CContentHasher(const HashOptions& options)
+            : m_options(options)
+            , m_size(0)
+            , m_bSequential(true)
+        {
+        }
+
+        void CContentHasher::Update(uint64_t position, const void* data, size_t size)
+        {
+            if (!m_bSequential)
+            {
+                return;
+            }
+            if (position != m_size)
+            {
+                m_bSequential = false;
+                return;
+            }
+
+            if (m_options.sha256)
+            {
+                m_sha256.Update(data, size);
+            }
+            if (m_options.xxh64)
+            {
+                m_xxh64.Update(data, size);
+            }
+            m_size += size;
+        }
+
+        void CContentHasher::Invalidate()
+        {
+            m_bSequential = false;
+        }
+
+        bool CContentHasher::IsSequential() const
+        {
+            return m_bSequential;
+        }
+
+        uint64_t CContentHasher::GetSize() const
+        {
+            return m_size;
+        }
+
+        bool CContentHasher::Finish(ContentDigest& digest)
+        {
+            if (!m_bSequential)
+            {
+                Reset();
+                return false;
+            }
+
+            digest = ContentDigest();
+            if (m_options.sha256)
+            {
+                uint8_t sha256[32];
+                m_sha256.Final(sha256);
+                digest.sha256 = ToHex(sha256, sizeof(sha256));
+            }
+            if (m_options.xxh64)
+            {
+                uint64_t xxh64 = m_xxh64.Final();
+                uint8_t bytes[8];
+                for (int i = 0; i < 8; i++)
+                {
+                    bytes[i] = uint8_t(xxh64 >> (56 - i * 8));
+                }
+                digest.xxh64 = ToHex(bytes, sizeof(bytes));
+            }
+
+            Reset();
+            return true;
+        }
+
+        void CContentHasher::Reset()
+        {
+            m_sha256 = CSha256();
+            m_xxh64 = CXxHash64();
+            m_size = 0;
+            m_bSequential = true;
+        }
+
+        ContentDigest HashBuffer(const HashOptions& options, const void* data, size_t size)
+        {
+            CContentHasher hasher(options);
+            hasher.Update(0, data, size);
+
+            ContentDigest digest;
+            hasher.Finish(digest);
+            return digest;
+        }
+    }
+}
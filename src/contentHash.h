@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace scanner
+{
+    namespace util
+    {
+        // which digests of the scanned files are computed, none by default
+        struct HashOptions
+        {
+            bool sha256 = false;        // for the chain of custody
+            bool xxh64 = false;         // fast, to find duplicates
+
+            bool IsEnabled() const { return sha256 || xxh64; }
+        };
+
+        // lower case hex digests, empty if not computed
+        struct ContentDigest
+        {
+            std::string sha256;
+            std::string xxh64;
+        };
+
+        // SHA-256, blocks are hashed with the SHA extensions on the x86 CPUs having them
+        class CSha256
+        {
+        public:
+            CSha256();
+
+            void Update(const void* data, size_t size);
+            // The hasher is reset afterwards
+            void Final(uint8_t digest[32]);
+
+        private:
+            void Reset();
+            void Transform(const uint8_t* blocks, size_t count);
+
+            uint32_t m_state[8];
+            uint64_t m_length;          // bytes hashed
+            uint8_t m_block[64];
+            size_t m_blockSize;
+        };
+
+        // XXH64 with the seed 0
+        class CXxHash64
+        {
+        public:
+            CXxHash64();
+
+            void Update(const void* data, size_t size);
+            // The hasher is reset afterwards
+            uint64_t Final();
+
+        private:
+            void Reset();
+
+            uint64_t m_accumulators[4];
+            uint64_t m_length;
+            uint8_t m_block[32];
+            size_t m_blockSize;
+        };
+
+        // Computes the digests of a file while it is written, without reading it again.
+        // The data must come in order: once a write starts elsewhere than at the end,
+        // e.g. a driver going back to complete a header, the digests are left to be computed from the whole file
+        class CContentHasher
+        {
+        public:
+            explicit CContentHasher(const HashOptions& options);
+
+            void Update(uint64_t position, const void* data, size_t size);
+
+            // The data has been changed some other way, the digests can't be computed from the writes
+            void Invalidate();
+
+            // false if the data hasn't come in order
+            bool IsSequential() const;
+            uint64_t GetSize() const;
+
+            // Returns false if the data hasn't come in order, the hasher is reset afterwards
+            bool Finish(ContentDigest& digest);
+            void Reset();
+
+        private:
+            HashOptions m_options;
+            CSha256 m_sha256;
+            CXxHash64 m_xxh64;
+            uint64_t m_size;
+            bool m_bSequential;
+        };
+
+        // the digests of data in memory
+        ContentDigest HashBuffer(const HashOptions& options, const void* data, size_t size);
+    }
+}
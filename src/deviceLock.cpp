@@ -0,0 +1,157 @@
+#include "stdafx.h"
+#include "deviceLock.h"
+
+#include <chrono>
+
+namespace scanner
+{
+    namespace util
+    {
+        const char* ScanStateToString(ScanState state)
+        {
+            switch (state)
+            {
+            case ScanState::Idle:
+                return "idle";
+            case ScanState::Starting:
+                return "starting";
+            case ScanState::Transferring:
+                return "transferring";
+            case ScanState::Cancelling:
+                return "cancelling";
+            }
+            return "unknown";
+        }
+
+        CDeviceLock::CDeviceLock()
+            : m_scanState(ScanState::Idle)
+            , m_cancelTime(0)
+            , m_reads(0)
+            , m_writes(0)
+            , m_refusedWrites(0)
+            , m_refusedScans(0)
+            , m_maxReadWaitMs(0)
+            , m_maxWriteWaitMs(0)
+        {
+        }
+
+        CDeviceLock::~CDeviceLock()
+        {
+        }
+
+        CDeviceLock::ReadLock CDeviceLock::LockRead()
+        {
+            auto startTime = std::chrono::steady_clock::now();
+            ReadLock g(m_lock);
+            UpdateMax(m_maxReadWaitMs, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+            m_reads++;
+            return g;
+        }
+
+        CDeviceLock::WriteLock CDeviceLock::LockWrite()
+        {
+            auto startTime = std::chrono::steady_clock::now();
+            WriteLock g(m_lock);
+            UpdateMax(m_maxWriteWaitMs, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+            m_writes++;
+            return g;
+        }
+
+        CDeviceLock::WriteLock CDeviceLock::LockWriteIfIdle()
+        {
+            if (IsScanRunning())
+            {
+                m_refusedWrites++;
+                return WriteLock();
+            }
+
+            WriteLock g = LockWrite();
+
+            // a scan might have started while waiting for the lock
+            if (IsScanRunning())
+            {
+                m_refusedWrites++;
+                return WriteLock();
+            }
+            return g;
+        }
+
+        bool CDeviceLock::BeginScan()
+        {
+            ScanState expected = ScanState::Idle;
+            if (!m_scanState.compare_exchange_strong(expected, ScanState::Starting))
+            {
+                m_refusedScans++;
+                return false;
+            }
+            m_cancelTime = 0;
+            return true;
+        }
+
+        bool CDeviceLock::BeginTransfer()
+        {
+            ScanState expected = ScanState::Starting;
+            return m_scanState.compare_exchange_strong(expected, ScanState::Transferring);
+        }
+
+        bool CDeviceLock::CancelScan()
+        {
+            ScanState state = m_scanState.load();
+            while (state == ScanState::Starting || state == ScanState::Transferring)
+            {
+                if (m_scanState.compare_exchange_weak(state, ScanState::Cancelling))
+                {
+                    m_cancelTime = std::chrono::steady_clock::now().time_since_epoch().count();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void CDeviceLock::EndScan()
+        {
+            m_scanState = ScanState::Idle;
+        }
+
+        ScanState CDeviceLock::GetScanState() const
+        {
+            return m_scanState.load();
+        }
+
+        bool CDeviceLock::IsScanRunning() const
+        {
+            return m_scanState.load() != ScanState::Idle;
+        }
+
+        bool CDeviceLock::GetCancelTime(std::chrono::steady_clock::time_point& cancelTime) const
+        {
+            auto ticks = m_cancelTime.load();
+            if (!ticks)
+            {
+                return false;
+            }
+            cancelTime = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(ticks));
+            return true;
+        }
+
+        DeviceLockStats CDeviceLock::GetStats() const
+        {
+            DeviceLockStats stats;
+            stats.reads = m_reads;
+            stats.writes = m_writes;
+            stats.refusedWrites = m_refusedWrites;
+            stats.refusedScans = m_refusedScans;
+            stats.maxReadWaitMs = m_maxReadWaitMs;
+            stats.maxWriteWaitMs = m_maxWriteWaitMs;
+            return stats;
+        }
+
+        void CDeviceLock::UpdateMax(std::atomic<double>& maxValue, double value)
+        {
+            double current = maxValue.load();
+            while (value > current && !maxValue.compare_exchange_weak(current, value))
+            {
+            }
+        }
+    }
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+
+namespace scanner
+{
+    namespace util
+    {
+        enum class ScanState
+        {
+            Idle,
+            Starting,       // the settings are being applied to the device
+            Transferring,
+            Cancelling,     // cancel has been asked for, the transfer stops at the next callback
+        };
+
+        const char* ScanStateToString(ScanState state);
+
+        struct DeviceLockStats
+        {
+            uint64_t reads = 0;
+            uint64_t writes = 0;
+            uint64_t refusedWrites = 0;     // writes refused because a scan was running
+            uint64_t refusedScans = 0;      // scans refused because another one was running
+            double maxReadWaitMs = 0;
+            double maxWriteWaitMs = 0;
+        };
+
+        // Locking of a device shared by a scan and the property calls.
+        // Property reads share the lock, property writes take it exclusively.
+        // A scan takes it exclusively only while it applies its settings, the transfer runs without the lock,
+        // so the property calls made during a long feeder batch don't wait for the batch.
+        // The state of the scan is atomic, asking for it never waits.
+        // No Windows dependency, so that the scheme can be exercised on its own
+        class CDeviceLock
+        {
+        public:
+            typedef std::shared_lock<std::shared_timed_mutex> ReadLock;
+            typedef std::unique_lock<std::shared_timed_mutex> WriteLock;
+
+            CDeviceLock();
+            ~CDeviceLock();
+
+            CDeviceLock(const CDeviceLock&) = delete;
+            CDeviceLock& operator=(const CDeviceLock&) = delete;
+
+            ReadLock LockRead();
+            WriteLock LockWrite();
+
+            // Writes are refused while a scan is running, the driver would apply them to the pages being transferred.
+            // The lock returned doesn't own the mutex if refused
+            WriteLock LockWriteIfIdle();
+
+            // Idle -> Starting. Returns false if a scan is running already
+            bool BeginScan();
+            // Starting -> Transferring. Returns false if the scan has been cancelled meanwhile
+            bool BeginTransfer();
+            // Starting/Transferring -> Cancelling. Returns false if no scan is running or it is being cancelled already
+            bool CancelScan();
+            // back to Idle
+            void EndScan();
+
+            ScanState GetScanState() const;
+            bool IsScanRunning() const;
+            // When the running scan has been cancelled, returns false if it hasn't
+            bool GetCancelTime(std::chrono::steady_clock::time_point& cancelTime) const;
+
+            DeviceLockStats GetStats() const;
+
+        private:
+            static void UpdateMax(std::atomic<double>& maxValue, double value);
+
+            mutable std::shared_timed_mutex m_lock;
+            std::atomic<ScanState> m_scanState;
+            std::atomic<std::chrono::steady_clock::rep> m_cancelTime;    // ticks of steady_clock, 0 if not cancelled
+
+            std::atomic<uint64_t> m_reads;
+            std::atomic<uint64_t> m_writes;
+            std::atomic<uint64_t> m_refusedWrites;
+            std::atomic<uint64_t> m_refusedScans;
+            std::atomic<double> m_maxReadWaitMs;
+            std::atomic<double> m_maxWriteWaitMs;
+        };
+
+        // Ends the scan started on the lock when going out of scope
+        class CScanScope
+        {
+        public:
+            explicit CScanScope(CDeviceLock& lock)
+                : m_lock(lock)
+                , m_started(lock.BeginScan())
+            {
+            }
+            ~CScanScope()
+            {
+                if (m_started)
+                {
+                    m_lock.EndScan();
+                }
+            }
+
+            CScanScope(const CScanScope&) = delete;
+            CScanScope& operator=(const CScanScope&) = delete;
+
+            bool IsStarted() const
+            {
+                return m_started;
+            }
+
+        private:
+            CDeviceLock& m_lock;
+            bool m_started;
+        };
+
+        // A value read and replaced as a whole under a short lock.
+        // Readers get a copy, e.g. a scan takes a snapshot of its settings and works on it without holding the lock
+        template <typename T>
+        class CSnapshotValue
+        {
+        public:
+            explicit CSnapshotValue(const T& value = T())
+                : m_value(value)
+            {
+            }
+
+            CSnapshotValue(const CSnapshotValue&) = delete;
+            CSnapshotValue& operator=(const CSnapshotValue&) = delete;
+
+            T Get() const
+            {
+                std::shared_lock<std::shared_timed_mutex> g(m_lock);
+                return m_value;
+            }
+
+            // Change the value in place, the function is called with the lock held
+            template <typename Function>
+            void Update(Function function)
+            {
+                std::unique_lock<std::shared_timed_mutex> g(m_lock);
+                function(m_value);
+            }
+
+        private:
+            mutable std::shared_timed_mutex m_lock;
+            T m_value;
+        };
+    }
+}
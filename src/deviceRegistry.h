@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace scanner
+{
+    namespace util
+    {
+        enum class DeviceChangeType
+        {
+            Added,
+            Removed,
+        };
+
+        template <typename T>
+        struct DeviceChange
+        {
+            DeviceChangeType type;
+            std::wstring deviceId;
+            std::shared_ptr<T> device;      // the properties read when added, the last ones known when removed
+        };
+
+        // The devices present, listed once and kept up to date by a rescan on the connect and disconnect events
+        // instead of being read again every time. The rescans are serialized and the last one sees the devices
+        // present at its time, the events may arrive in any order. The listener is called for every change
+        // in the order they happen, on the thread making them. Reading the devices takes a lock for the copy only
+        template <typename T>
+        class CDeviceRegistry
+        {
+        public:
+            // Lists the IDs of the devices present, false if they cannot be listed
+            typedef std::function<bool(std::vector<std::wstring>& deviceIds)> Enumerator;
+            // Reads the properties of a device listed by the enumerator, nullptr if it cannot be read
+            typedef std::function<std::shared_ptr<T>(const std::wstring& deviceId)> Reader;
+            typedef std::function<void(const DeviceChange<T>& change)> Listener;
+
+            CDeviceRegistry()
+                : m_bPopulated(false)
+            {
+            }
+
+            CDeviceRegistry(const CDeviceRegistry&) = delete;
+            CDeviceRegistry& operator=(const CDeviceRegistry&) = delete;
+
+            // Waits for the listener running at the moment, nullptr to stop listening
+            void SetListener(Listener listener)
+            {
+                std::lock_guard<std::mutex> g(m_lockListener);
+                m_listener = listener;
+            }
+
+            // Lists the devices and reads the ones not known yet, the ones not listed any more are removed.
+            // The first one populates the registry without reporting the devices as added.
+            // A device failing to be read is left out until the next rescan
+            bool Rescan(const Enumerator& enumerate, const Reader& read)
+            {
+                std::lock_guard<std::mutex> gUpdate(m_lockUpdate);
+                std::vector<std::wstring> deviceIds;
+                if (!enumerate(deviceIds))
+                {
+                    return false;
+                }
+
+                std::vector<DeviceChange<T>> changes;
+                std::vector<Entry> devices;
+                {
+                    std::lock_guard<std::mutex> g(m_lock);
+                    devices = m_devices;
+                }
+
+                // gone
+                for (auto it = devices.begin(); it != devices.end();)
+                {
+                    if (std::find(deviceIds.begin(), deviceIds.end(), it->deviceId) == deviceIds.end())
+                    {
+                        changes.push_back(DeviceChange<T>{ DeviceChangeType::Removed, it->deviceId, it->device });
+                        it = devices.erase(it);
+                    }
+                    else
+                    {
+                        ++it;
+                    }
+                }
+
+                // new, read outside of the lock, the readers of the list are not held up by the driver
+                for (const auto& deviceId : deviceIds)
+                {
+                    if (Find(devices, deviceId) != devices.end())
+                    {
+                        continue;
+                    }
+                    auto device = read(deviceId);
+                    if (device)
+                    {
+                        devices.push_back(Entry{ deviceId, device });
+                        changes.push_back(DeviceChange<T>{ DeviceChangeType::Added, deviceId, device });
+                    }
+                }
+
+                bool bPopulated = false;
+                {
+                    std::lock_guard<std::mutex> g(m_lock);
+                    m_devices.swap(devices);
+                    bPopulated = m_bPopulated;
+                    m_bPopulated = true;
+                }
+                if (bPopulated)
+                {
+                    Notify(changes);
+                }
+                return true;
+            }
+
+            // false until the first rescan succeeds
+            bool IsPopulated() const
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                return m_bPopulated;
+            }
+
+            // in the order they have been found, not to be changed
+            std::vector<std::shared_ptr<T>> GetDevices() const
+            {
+                std::vector<std::shared_ptr<T>> devices;
+                std::lock_guard<std::mutex> g(m_lock);
+                devices.reserve(m_devices.size());
+                for (const auto& entry : m_devices)
+                {
+                    devices.push_back(entry.device);
+                }
+                return devices;
+            }
+
+        private:
+            struct Entry
+            {
+                std::wstring deviceId;
+                std::shared_ptr<T> device;
+            };
+
+            static typename std::vector<Entry>::iterator Find(std::vector<Entry>& devices, const std::wstring& deviceId)
+            {
+                return std::find_if(devices.begin(), devices.end(), [&deviceId](const Entry& entry)
+                {
+                    return entry.deviceId == deviceId;
+                });
+            }
+
+            // under the update lock, the listener sees the changes in order
+            void Notify(const std::vector<DeviceChange<T>>& changes)
+            {
+                std::lock_guard<std::mutex> g(m_lockListener);
+                if (!m_listener)
+                {
+                    return;
+                }
+                for (const auto& change : changes)
+                {
+                    m_listener(change);
+                }
+            }
+
+        private:
+            std::mutex m_lockUpdate;                // held by the rescans from start to end
+
+            mutable std::mutex m_lock;
+            std::vector<Entry> m_devices;
+            bool m_bPopulated;
+
+            std::mutex m_lockListener;
+            Listener m_listener;
+        };
+    }
+}
@@ -0,0 +1,631 @@
+#include "stdafx.h"
+#include "documentWriter.h"
+#include "jpegEncoder.h"
+#include "tiffG4Encoder.h"
+
+#include <cstring>
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            const uint16_t TiffTypeShort = 3;
+            const uint16_t TiffTypeLong = 4;
+            const uint16_t TiffTypeRational = 5;
+
+            // the first PDF objects, written at the end
+            const uint32_t PdfCatalogObject = 1;
+            const uint32_t PdfPagesObject = 2;
+
+            uint16_t GetUInt16BE(const uint8_t* data)
+            {
+                return uint16_t((data[0] << 8) | data[1]);
+            }
+            uint16_t GetUInt16LE(const uint8_t* data)
+            {
+                return uint16_t(data[0] | (data[1] << 8));
+            }
+            uint32_t GetUInt32LE(const uint8_t* data)
+            {
+                return uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+            }
+
+            void PutUInt16(std::vector<uint8_t>& data, uint16_t value)
+            {
+                data.push_back(uint8_t(value));
+                data.push_back(uint8_t(value >> 8));
+            }
+            void PutUInt32(std::vector<uint8_t>& data, uint32_t value)
+            {
+                PutUInt16(data, uint16_t(value));
+                PutUInt16(data, uint16_t(value >> 16));
+            }
+
+            // values of 4 bytes at most are stored in the entry, the other ones at the offset given
+            void PutEntry(std::vector<uint8_t>& data, uint16_t tag, uint16_t type, uint32_t count, uint32_t value)
+            {
+                PutUInt16(data, tag);
+                PutUInt16(data, type);
+                PutUInt32(data, count);
+                PutUInt32(data, value);
+            }
+
+            // PDF numbers with two decimals, independent of the locale
+            std::string FormatPdfNumber(double value)
+            {
+                uint64_t hundredths = uint64_t(value * 100 + 0.5);
+                std::string text = std::to_string(hundredths / 100);
+                if (hundredths % 100)
+                {
+                    text += '.';
+                    text += char('0' + hundredths % 100 / 10);
+                    text += char('0' + hundredths % 10);
+                }
+                return text;
+            }
+
+            // points of a length in pixels, one pixel per point if the resolution is unknown
+            double PixelsToPoints(uint32_t pixels, double dpi)
+            {
+                return dpi > 0 ? pixels * 72.0 / dpi : double(pixels);
+            }
+
+            bool IsBilevel(const RawImage& image)
+            {
+                if (image.format != PixelFormat::Gray8)
+                {
+                    return false;
+                }
+                for (uint32_t y = 0; y < image.height; y++)
+                {
+                    const uint8_t* row = image.Row(y);
+                    for (uint32_t x = 0; x < image.width; x++)
+                    {
+                        if (row[x] != 0 && row[x] != 0xff)
+                        {
+                            return false;
+                        }
+                    }
+                }
+                return true;
+            }
+        }
+
+        CMemoryDocumentSink::CMemoryDocumentSink(CMemoryBuffer& buffer)
+            : m_buffer(buffer)
+        {
+        }
+
+        bool CMemoryDocumentSink::Write(const void* data, size_t size)
+        {
+            return m_buffer.Seek(0, SeekOrigin::End) && m_buffer.Write(data, size) == size;
+        }
+
+        bool CMemoryDocumentSink::Patch(uint64_t offset, const void* data, size_t size)
+        {
+            if (offset + size > m_buffer.Size())
+            {
+                return false;
+            }
+            std::memcpy(m_buffer.Data() + offset, data, size);
+            return true;
+        }
+
+        bool ParseJpegPage(const void* data, size_t size, DocumentPage& page)
+        {
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            if (size < 4 || bytes[0] != 0xff || bytes[1] != 0xd8)
+            {
+                return false;
+            }
+
+            DocumentPage result;
+            result.compression = DocumentPage::Compression::Jpeg;
+            result.data = bytes;
+            result.size = size;
+
+            // the segments up to the first scan
+            bool hasFrame = false;
+            size_t position = 2;
+            while (position + 4 <= size)
+            {
+                if (bytes[position] != 0xff)
+                {
+                    return false;
+                }
+                uint8_t marker = bytes[position + 1];
+                if (marker == 0xff)
+                {
+                    // fill byte
+                    position++;
+                    continue;
+                }
+                if (marker == 0xda)
+                {
+                    break;
+                }
+
+                size_t length = GetUInt16BE(bytes + position + 2);
+                if (length < 2 || position + 2 + length > size)
+                {
+                    return false;
+                }
+                const uint8_t* segment = bytes + position + 4;
+                size_t segmentSize = length - 2;
+
+                if (marker == 0xe0 && segmentSize >= 12 && std::memcmp(segment, "JFIF", 5) == 0)
+                {
+                    // density units: 1 for inch, 2 for cm
+                    uint8_t units = segment[7];
+                    double scale = (units == 1) ? 1.0 : (units == 2) ? 2.54 : 0.0;
+                    result.dpiX = GetUInt16BE(segment + 8) * scale;
+                    result.dpiY = GetUInt16BE(segment + 10) * scale;
+                }
+                else if (marker == 0xc0 || marker == 0xc1)
+                {
+                    if (segmentSize < 6 || segment[0] != 8)
+                    {
+                        return false;
+                    }
+                    result.height = GetUInt16BE(segment + 1);
+                    result.width = GetUInt16BE(segment + 3);
+                    result.components = segment[5];
+                    if ((result.components != 1 && result.components != 3) || segmentSize < 6 + 3 * result.components)
+                    {
+                        return false;
+                    }
+
+                    // the chroma must not be subsampled itself
+                    if (result.components == 3)
+                    {
+                        result.subsamplingX = segment[7] >> 4;
+                        result.subsamplingY = segment[7] & 0x0f;
+                        if (segment[10] != 0x11 || segment[13] != 0x11)
+                        {
+                            return false;
+                        }
+                    }
+                    hasFrame = true;
+                }
+                else if (marker >= 0xc2 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+                {
+                    // progressive, lossless or arithmetic coded
+                    return false;
+                }
+
+                position += 2 + length;
+            }
+
+            // the height might be defined by a DNL marker after the scan, not supported
+            if (!hasFrame || !result.width || !result.height)
+            {
+                return false;
+            }
+
+            page = result;
+            return true;
+        }
+
+        bool ParseTiffG4Page(const void* data, size_t size, DocumentPage& page)
+        {
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            if (size < 8 || bytes[0] != 'I' || bytes[1] != 'I' || GetUInt16LE(bytes + 2) != 42)
+            {
+                return false;
+            }
+
+            uint32_t ifdOffset = GetUInt32LE(bytes + 4);
+            if (ifdOffset + 2 > size)
+            {
+                return false;
+            }
+            uint16_t entryCount = GetUInt16LE(bytes + ifdOffset);
+            if (ifdOffset + 2 + entryCount * 12 + 4 > size)
+            {
+                return false;
+            }
+
+            // more pages are not taken
+            if (GetUInt32LE(bytes + ifdOffset + 2 + entryCount * 12))
+            {
+                return false;
+            }
+
+            DocumentPage result;
+            result.compression = DocumentPage::Compression::G4;
+            uint32_t compression = 1;
+            uint32_t photometric = 0;
+            uint32_t stripOffset = 0;
+            uint32_t stripSize = 0;
+            uint32_t resolutionUnit = 2;
+            double resolution[2] = {};
+
+            for (uint16_t i = 0; i < entryCount; i++)
+            {
+                const uint8_t* entry = bytes + ifdOffset + 2 + i * 12;
+                uint16_t tag = GetUInt16LE(entry);
+                uint16_t type = GetUInt16LE(entry + 2);
+                uint32_t count = GetUInt32LE(entry + 4);
+                uint32_t value = (type == TiffTypeShort) ? GetUInt16LE(entry + 8) : GetUInt32LE(entry + 8);
+
+                switch (tag)
+                {
+                case 256:   // ImageWidth
+                    result.width = value;
+                    break;
+                case 257:   // ImageLength
+                    result.height = value;
+                    break;
+                case 258:   // BitsPerSample
+                case 277:   // SamplesPerPixel
+                case 266:   // FillOrder
+                    if (value != 1)
+                    {
+                        return false;
+                    }
+                    break;
+                case 259:   // Compression
+                    compression = value;
+                    break;
+                case 262:   // PhotometricInterpretation
+                    photometric = value;
+                    break;
+                case 273:   // StripOffsets
+                    stripOffset = value;
+                    if (count != 1)
+                    {
+                        return false;
+                    }
+                    break;
+                case 279:   // StripByteCounts
+                    stripSize = value;
+                    if (count != 1)
+                    {
+                        return false;
+                    }
+                    break;
+                case 282:   // XResolution
+                case 283:   // YResolution
+                    if (type == TiffTypeRational && uint64_t(value) + 8 <= size && GetUInt32LE(bytes + value + 4))
+                    {
+                        resolution[tag - 282] = double(GetUInt32LE(bytes + value)) / GetUInt32LE(bytes + value + 4);
+                    }
+                    break;
+                case 296:   // ResolutionUnit
+                    resolutionUnit = value;
+                    break;
+                default:
+                    break;
+                }
+            }
+
+            // WhiteIsZero only, the same bits as in PDF
+            if (compression != 4 || photometric != 0 || !result.width || !result.height ||
+                !stripSize || uint64_t(stripOffset) + stripSize > size)
+            {
+                return false;
+            }
+
+            if (resolutionUnit == 2 || resolutionUnit == 3)
+            {
+                double scale = (resolutionUnit == 3) ? 2.54 : 1.0;
+                result.dpiX = resolution[0] * scale;
+                result.dpiY = resolution[1] * scale;
+            }
+            result.data = bytes + stripOffset;
+            result.size = stripSize;
+
+            page = result;
+            return true;
+        }
+
+        CDocumentWriter::CDocumentWriter(DocumentFormat format, IDocumentSink& sink)
+            : m_format(format)
+            , m_sink(sink)
+            , m_size(0)
+            , m_bFailed(format == DocumentFormat::None)
+            , m_bFinished(false)
+            , m_pageCount(0)
+            , m_nextIfdLink(0)
+        {
+        }
+
+        CDocumentWriter::~CDocumentWriter()
+        {
+        }
+
+        bool CDocumentWriter::AddPage(const DocumentPage& page)
+        {
+            if (m_bFailed || m_bFinished || !page.data || !page.size)
+            {
+                return false;
+            }
+
+            if (!m_pageCount && !BeginDocument())
+            {
+                return false;
+            }
+
+            bool ret = (m_format == DocumentFormat::Tiff) ? AddTiffPage(page) : AddPdfPage(page);
+            if (ret)
+            {
+                m_pageCount++;
+            }
+            return ret;
+        }
+
+        bool CDocumentWriter::AddEncodedPage(const void* data, size_t size)
+        {
+            DocumentPage page;
+            if (!ParseJpegPage(data, size, page) && !ParseTiffG4Page(data, size, page))
+            {
+                return false;
+            }
+            return AddPage(page);
+        }
+
+        bool CDocumentWriter::AddImagePage(const RawImage& image, uint8_t threshold, int quality)
+        {
+            if (image.Empty())
+            {
+                return false;
+            }
+
+            if (IsBilevel(image))
+            {
+                std::vector<uint8_t> strip;
+                EncodeG4(image, threshold, strip);
+
+                DocumentPage page;
+                page.compression = DocumentPage::Compression::G4;
+                page.width = image.width;
+                page.height = image.height;
+                page.dpiX = image.dpiX;
+                page.dpiY = image.dpiY;
+                page.data = strip.data();
+                page.size = strip.size();
+                return AddPage(page);
+            }
+
+            CMemoryBuffer jpeg;
+            DocumentPage page;
+            if (!EncodeJpeg(image, quality, jpeg) || !ParseJpegPage(jpeg.Data(), jpeg.Size(), page))
+            {
+                return false;
+            }
+            return AddPage(page);
+        }
+
+        bool CDocumentWriter::Finish()
+        {
+            if (m_bFailed || m_bFinished || !m_pageCount)
+            {
+                return false;
+            }
+            m_bFinished = true;
+
+            // the IFD of the last page ends the chain already
+            return (m_format == DocumentFormat::Tiff) ? true : FinishPdf();
+        }
+
+        size_t CDocumentWriter::GetPageCount() const
+        {
+            return m_pageCount;
+        }
+
+        uint64_t CDocumentWriter::GetSize() const
+        {
+            return m_size;
+        }
+
+        bool CDocumentWriter::Write(const void* data, size_t size)
+        {
+            if (m_bFailed || !m_sink.Write(data, size))
+            {
+                m_bFailed = true;
+                return false;
+            }
+            m_size += size;
+            return true;
+        }
+
+        bool CDocumentWriter::Write(const std::string& text)
+        {
+            return Write(text.data(), text.size());
+        }
+
+        bool CDocumentWriter::BeginDocument()
+        {
+            if (m_format == DocumentFormat::Tiff)
+            {
+                // the offset of the first IFD is filled in by the first page
+                static const uint8_t header[] = { 'I', 'I', 42, 0, 0, 0, 0, 0 };
+                m_nextIfdLink = 4;
+                return Write(header, sizeof(header));
+            }
+
+            // the comment of binary characters tells the transfer programs that the file is binary
+            m_objectOffsets.assign(2, 0);
+            return Write(std::string("%PDF-1.4\n%\xe2\xe3\xcf\xd3\n"));
+        }
+
+        bool CDocumentWriter::AddTiffPage(const DocumentPage& page)
+        {
+            // the offsets are 32 bits
+            uint64_t stripOffset = m_size;
+            if (stripOffset + page.size + 1024 > 0xffffffffull)
+            {
+                m_bFailed = true;
+                return false;
+            }
+
+            if (!Write(page.data, page.size))
+            {
+                return false;
+            }
+            static const uint8_t padding = 0;
+            if ((m_size & 1) && !Write(&padding, 1))
+            {
+                return false;
+            }
+
+            bool isJpeg = page.compression == DocumentPage::Compression::Jpeg;
+            bool isColor = isJpeg && page.components == 3;
+            bool hasDpi = page.dpiX > 0 && page.dpiY > 0;
+            uint16_t entryCount = 9 + (hasDpi ? 3 : 0) + (isColor ? 1 : 0);
+
+            uint32_t ifdOffset = uint32_t(m_size);
+            uint32_t extraOffset = ifdOffset + 2 + entryCount * 12 + 4;
+            uint32_t bitsOffset = extraOffset;
+            uint32_t resolutionOffset = extraOffset + (isColor ? 8 : 0);
+
+            uint16_t photometric = isJpeg ? (isColor ? 6 : 1) : 0;      // YCbCr, BlackIsZero or WhiteIsZero
+
+            // the entries are sorted by tag
+            std::vector<uint8_t> ifd;
+            PutUInt16(ifd, entryCount);
+            PutEntry(ifd, 256, TiffTypeLong, 1, page.width);                            // ImageWidth
+            PutEntry(ifd, 257, TiffTypeLong, 1, page.height);                           // ImageLength
+            if (isColor)
+            {
+                PutEntry(ifd, 258, TiffTypeShort, 3, bitsOffset);                       // BitsPerSample
+            }
+            else
+            {
+                PutEntry(ifd, 258, TiffTypeShort, 1, isJpeg ? 8 : 1);
+            }
+            PutEntry(ifd, 259, TiffTypeShort, 1, isJpeg ? 7 : 4);                       // Compression: JPEG or CCITT T.6
+            PutEntry(ifd, 262, TiffTypeShort, 1, photometric);                          // PhotometricInterpretation
+            PutEntry(ifd, 273, TiffTypeLong, 1, uint32_t(stripOffset));                 // StripOffsets
+            PutEntry(ifd, 277, TiffTypeShort, 1, isColor ? 3 : 1);                      // SamplesPerPixel
+            PutEntry(ifd, 278, TiffTypeLong, 1, page.height);                           // RowsPerStrip
+            PutEntry(ifd, 279, TiffTypeLong, 1, uint32_t(page.size));                   // StripByteCounts
+            if (hasDpi)
+            {
+                PutEntry(ifd, 282, TiffTypeRational, 1, resolutionOffset);              // XResolution
+                PutEntry(ifd, 283, TiffTypeRational, 1, resolutionOffset + 8);          // YResolution
+                PutEntry(ifd, 296, TiffTypeShort, 1, 2);                                // ResolutionUnit: inch
+            }
+            if (isColor)
+            {
+                PutEntry(ifd, 530, TiffTypeShort, 2, page.subsamplingX | (page.subsamplingY << 16));   // YCbCrSubSampling
+            }
+
+            // the next page links itself here
+            uint64_t nextIfdLink = ifdOffset + ifd.size();
+            PutUInt32(ifd, 0);
+
+            if (isColor)
+            {
+                PutUInt16(ifd, 8);
+                PutUInt16(ifd, 8);
+                PutUInt16(ifd, 8);
+                PutUInt16(ifd, 0);
+            }
+            if (hasDpi)
+            {
+                PutUInt32(ifd, uint32_t(page.dpiX * 100 + 0.5));
+                PutUInt32(ifd, 100);
+                PutUInt32(ifd, uint32_t(page.dpiY * 100 + 0.5));
+                PutUInt32(ifd, 100);
+            }
+
+            if (!Write(ifd.data(), ifd.size()))
+            {
+                return false;
+            }
+
+            uint8_t link[4] = { uint8_t(ifdOffset), uint8_t(ifdOffset >> 8), uint8_t(ifdOffset >> 16), uint8_t(ifdOffset >> 24) };
+            if (!m_sink.Patch(m_nextIfdLink, link, sizeof(link)))
+            {
+                m_bFailed = true;
+                return false;
+            }
+            m_nextIfdLink = nextIfdLink;
+            return true;
+        }
+
+        bool CDocumentWriter::AddPdfPage(const DocumentPage& page)
+        {
+            uint32_t imageObject = uint32_t(m_objectOffsets.size() + 1);
+            uint32_t contentObject = imageObject + 1;
+            uint32_t pageObject = imageObject + 2;
+
+            std::string image = std::to_string(imageObject) + " 0 obj\n<< /Type /XObject /Subtype /Image" +
+                " /Width " + std::to_string(page.width) + " /Height " + std::to_string(page.height);
+            if (page.compression == DocumentPage::Compression::Jpeg)
+            {
+                image += page.components == 3 ? " /ColorSpace /DeviceRGB" : " /ColorSpace /DeviceGray";
+                image += " /BitsPerComponent 8 /Filter /DCTDecode";
+            }
+            else
+            {
+                image += " /ColorSpace /DeviceGray /BitsPerComponent 1 /Filter /CCITTFaxDecode /DecodeParms << /K -1 /Columns " +
+                    std::to_string(page.width) + " /Rows " + std::to_string(page.height) + " >>";
+            }
+            image += " /Length " + std::to_string(page.size) + " >>\nstream\n";
+
+            m_objectOffsets.push_back(m_size);
+            if (!Write(image) || !Write(page.data, page.size) || !Write(std::string("\nendstream\nendobj\n")))
+            {
+                return false;
+            }
+
+            // the image fills the page
+            std::string width = FormatPdfNumber(PixelsToPoints(page.width, page.dpiX));
+            std::string height = FormatPdfNumber(PixelsToPoints(page.height, page.dpiY));
+            std::string content = "q " + width + " 0 0 " + height + " 0 0 cm /Im0 Do Q\n";
+
+            m_objectOffsets.push_back(m_size);
+            if (!Write(std::to_string(contentObject) + " 0 obj\n<< /Length " + std::to_string(content.size()) + " >>\nstream\n" +
+                content + "endstream\nendobj\n"))
+            {
+                return false;
+            }
+
+            m_objectOffsets.push_back(m_size);
+            m_pageObjects.push_back(pageObject);
+            return Write(std::to_string(pageObject) + " 0 obj\n<< /Type /Page /Parent " + std::to_string(PdfPagesObject) + " 0 R" +
+                " /MediaBox [0 0 " + width + " " + height + "]" +
+                " /Resources << /XObject << /Im0 " + std::to_string(imageObject) + " 0 R >> >>" +
+                " /Contents " + std::to_string(contentObject) + " 0 R >>\nendobj\n");
+        }
+
+        bool CDocumentWriter::FinishPdf()
+        {
+            std::string kids;
+            for (auto pageObject : m_pageObjects)
+            {
+                kids += std::to_string(pageObject) + " 0 R ";
+            }
+
+            m_objectOffsets[PdfPagesObject - 1] = m_size;
+            if (!Write(std::to_string(PdfPagesObject) + " 0 obj\n<< /Type /Pages /Kids [" + kids + "] /Count " +
+                std::to_string(m_pageObjects.size()) + " >>\nendobj\n"))
+            {
+                return false;
+            }
+
+            m_objectOffsets[PdfCatalogObject - 1] = m_size;
+            if (!Write(std::to_string(PdfCatalogObject) + " 0 obj\n<< /Type /Catalog /Pages " + std::to_string(PdfPagesObject) +
+                " 0 R >>\nendobj\n"))
+            {
+                return false;
+            }
+
+            // every entry is 20 bytes
+            uint64_t xrefOffset = m_size;
+            std::string xref = "xref\n0 " + std::to_string(m_objectOffsets.size() + 1) + "\n0000000000 65535 f \n";
+            for (auto offset : m_objectOffsets)
+            {
+                std::string number = std::to_string(offset);
+                xref += std::string(10 - number.size(), '0') + number + " 00000 n \n";
+            }
+            xref += "trailer\n<< /Size " + std::to_string(m_objectOffsets.size() + 1) + " /Root " + std::to_string(PdfCatalogObject) +
+                " 0 R >>\nstartxref\n" + std::to_string(xrefOffset) + "\n%%EOF\n";
+            return Write(xref);
+        }
+    }
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "memoryBuffer.h"
+#include "rawImage.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        enum class DocumentFormat
+        {
+            None,
+            Tiff,       // multi-page TIFF, JPEG(compression 7) or G4 strips
+            Pdf,
+        };
+
+        // Where a document is written to. Data is appended,
+        // the TIFF writer goes back only to link a page to the previous one
+        class IDocumentSink
+        {
+        public:
+            virtual ~IDocumentSink() = default;
+
+            virtual bool Write(const void* data, size_t size) = 0;
+            // Overwrite data written before, the next Write() still appends
+            virtual bool Patch(uint64_t offset, const void* data, size_t size) = 0;
+        };
+
+        class CMemoryDocumentSink : public IDocumentSink
+        {
+        public:
+            explicit CMemoryDocumentSink(CMemoryBuffer& buffer);
+
+            bool Write(const void* data, size_t size) override;
+            bool Patch(uint64_t offset, const void* data, size_t size) override;
+
+        private:
+            CMemoryBuffer& m_buffer;
+        };
+
+        // A page as it is stored in the document
+        struct DocumentPage
+        {
+            enum class Compression
+            {
+                Jpeg,       // a complete JPEG stream
+                G4,         // CCITT T.6 as written by EncodeG4
+            };
+
+            Compression compression = Compression::Jpeg;
+            uint32_t width = 0;
+            uint32_t height = 0;
+            uint32_t components = 1;        // 1 or 3, always 1 for G4
+            uint8_t subsamplingX = 1;       // of the JPEG chroma, needed by TIFF
+            uint8_t subsamplingY = 1;
+            double dpiX = 0;
+            double dpiY = 0;
+            const uint8_t* data = nullptr;
+            size_t size = 0;
+        };
+
+        // Take a JPEG as it is, the size and the resolution are read from its headers.
+        // Returns false if it is not a sequential JPEG of 1 or 3 components
+        bool ParseJpegPage(const void* data, size_t size, DocumentPage& page);
+        // Take the strip of a single strip G4 TIFF, e.g. written by EncodeTiffG4.
+        // The page points into the data
+        bool ParseTiffG4Page(const void* data, size_t size, DocumentPage& page);
+
+        // Writes a multi-page document page by page, only the page being added is kept in memory.
+        // TIFF: every page is followed by its IFD, the IFD of the previous page is linked to it.
+        // PDF: the objects of every page are written as it comes, the page tree and the cross-reference table at the end.
+        // The document is complete once Finish() returns
+        class CDocumentWriter
+        {
+        public:
+            CDocumentWriter(DocumentFormat format, IDocumentSink& sink);
+            ~CDocumentWriter();
+
+            CDocumentWriter(const CDocumentWriter&) = delete;
+            CDocumentWriter& operator=(const CDocumentWriter&) = delete;
+
+            bool AddPage(const DocumentPage& page);
+            // A JPEG or G4 TIFF page taken as it is, returns false if it is in another format
+            bool AddEncodedPage(const void* data, size_t size);
+            // Bilevel images(black and white pixels only) are compressed in G4, the other ones in JPEG
+            bool AddImagePage(const RawImage& image, uint8_t threshold, int quality);
+
+            // Write what is left, no page can be added afterwards
+            bool Finish();
+
+            size_t GetPageCount() const;
+            // bytes written so far
+            uint64_t GetSize() const;
+
+        private:
+            bool Write(const void* data, size_t size);
+            bool Write(const std::string& text);
+
+            bool BeginDocument();
+            bool AddTiffPage(const DocumentPage& page);
+            bool AddPdfPage(const DocumentPage& page);
+            bool FinishPdf();
+
+            DocumentFormat m_format;
+            IDocumentSink& m_sink;
+            uint64_t m_size;
+            bool m_bFailed;
+            bool m_bFinished;
+            size_t m_pageCount;
+
+            uint64_t m_nextIfdLink;                 // TIFF: where the offset of the next IFD goes
+            std::vector<uint64_t> m_objectOffsets;  // PDF: offset of every object, by number - 1
+            std::vector<uint32_t> m_pageObjects;    // PDF: the page objects
+        };
+    }
+}
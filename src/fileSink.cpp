@@ -0,0 +1,617 @@
+#include "stdafx.h"
+#include "fileSink.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace scanner
+{
+    namespace util
+    {
+        // The file itself, written on the I/O thread and read by the sink once its data is written
+        struct CFileWriter::FileState
+        {
+#if defined(_WIN32)
+            HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+            int fd = -1;
+#endif
+            std::atomic<bool> failed{ false };
+            bool preallocated = false;
+
+            ~FileState()
+            {
+                Close();
+            }
+
+            bool Open(const FilePath& path)
+            {
+#if defined(_WIN32)
+                // written from the start to the end, read again at most once
+                handle = ::CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+                return handle != INVALID_HANDLE_VALUE;
+#else
+                fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                return fd >= 0;
+#endif
+            }
+
+            bool WriteAt(uint64_t offset, const uint8_t* data, size_t size)
+            {
+                while (size)
+                {
+#if defined(_WIN32)
+                    OVERLAPPED overlapped = {};
+                    overlapped.Offset = DWORD(offset);
+                    overlapped.OffsetHigh = DWORD(offset >> 32);
+                    DWORD writtenSize = 0;
+                    if (!::WriteFile(handle, data, DWORD(std::min<size_t>(size, 0x40000000)), &writtenSize, &overlapped) || !writtenSize)
+                    {
+                        return false;
+                    }
+#else
+                    ssize_t writtenSize = ::pwrite(fd, data, size, off_t(offset));
+                    if (writtenSize < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (writtenSize <= 0)
+                    {
+                        return false;
+                    }
+#endif
+                    data += writtenSize;
+                    size -= size_t(writtenSize);
+                    offset += uint64_t(writtenSize);
+                }
+                return true;
+            }
+
+            size_t ReadAt(uint64_t offset, uint8_t* data, size_t size)
+            {
+                size_t readTotal = 0;
+                while (readTotal < size)
+                {
+#if defined(_WIN32)
+                    OVERLAPPED overlapped = {};
+                    overlapped.Offset = DWORD(offset);
+                    overlapped.OffsetHigh = DWORD(offset >> 32);
+                    DWORD readSize = 0;
+                    if (!::ReadFile(handle, data + readTotal, DWORD(std::min<size_t>(size - readTotal, 0x40000000)), &readSize, &overlapped) || !readSize)
+                    {
+                        break;
+                    }
+#else
+                    ssize_t readSize = ::pread(fd, data + readTotal, size - readTotal, off_t(offset));
+                    if (readSize < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (readSize <= 0)
+                    {
+                        break;
+                    }
+#endif
+                    readTotal += size_t(readSize);
+                    offset += uint64_t(readSize);
+                }
+                return readTotal;
+            }
+
+            bool Resize(uint64_t size)
+            {
+#if defined(_WIN32)
+                FILE_END_OF_FILE_INFO info = {};
+                info.EndOfFile.QuadPart = LONGLONG(size);
+                return ::SetFileInformationByHandle(handle, FileEndOfFileInfo, &info, sizeof(info)) != FALSE;
+#else
+                return ::ftruncate(fd, off_t(size)) == 0;
+#endif
+            }
+
+            // Reserve the space without changing the size, the file is not fragmented and the disk full is known at once
+            bool Preallocate(uint64_t size)
+            {
+#if defined(_WIN32)
+                FILE_ALLOCATION_INFO info = {};
+                info.AllocationSize.QuadPart = LONGLONG(size);
+                return ::SetFileInformationByHandle(handle, FileAllocationInfo, &info, sizeof(info)) != FALSE;
+#elif defined(__linux__)
+                return ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, off_t(size)) == 0;
+#else
+                return false;
+#endif
+            }
+
+            bool Sync()
+            {
+#if defined(_WIN32)
+                return ::FlushFileBuffers(handle) != FALSE;
+#else
+                return ::fsync(fd) == 0;
+#endif
+            }
+
+            bool Close()
+            {
+                bool closed = true;
+#if defined(_WIN32)
+                if (handle != INVALID_HANDLE_VALUE)
+                {
+                    closed = ::CloseHandle(handle) != FALSE;
+                    handle = INVALID_HANDLE_VALUE;
+                }
+#else
+                if (fd >= 0)
+                {
+                    closed = ::close(fd) == 0;
+                    fd = -1;
+                }
+#endif
+                return closed;
+            }
+        };
+
+        CFileWriter::CFileWriter(const FileSinkOptions& options)
+            : m_options(options)
+            , m_pendingBuffers(0)
+            , m_submitted(0)
+            , m_completed(0)
+            , m_bStop(false)
+        {
+            m_options.bufferSize = std::max<size_t>(m_options.bufferSize, 4096);
+            m_options.maxPendingBuffers = std::max<size_t>(m_options.maxPendingBuffers, 1);
+
+            m_thread = std::thread(&CFileWriter::ThreadProc, this);
+        }
+
+        CFileWriter::~CFileWriter()
+        {
+            Finish();
+
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                m_bStop = true;
+            }
+            m_requestCondition.notify_all();
+            m_thread.join();
+        }
+
+        std::shared_ptr<CFileSink> CFileWriter::Create(const FilePath& path, uint64_t expectedSize)
+        {
+            auto file = std::make_shared<FileState>();
+            if (!file->Open(path))
+            {
+                return nullptr;
+            }
+
+            // a short call, the file is empty
+            file->preallocated = expectedSize && file->Preallocate(expectedSize);
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                m_stats.files++;
+                m_stats.preallocated += file->preallocated ? 1 : 0;
+            }
+            return std::shared_ptr<CFileSink>(new CFileSink(shared_from_this(), file, path));
+        }
+
+        bool CFileWriter::Finish()
+        {
+            std::vector<std::shared_ptr<FileState>> unflushedFiles;
+            {
+                std::unique_lock<std::mutex> g(m_lock);
+                m_completeCondition.wait(g, [this]() { return m_completed == m_submitted; });
+                unflushedFiles.swap(m_unflushedFiles);
+            }
+
+            // the files closed are flushed together once all of them are written
+            auto start = std::chrono::steady_clock::now();
+            bool succeeded = true;
+            for (auto& file : unflushedFiles)
+            {
+                succeeded = file->Sync() && succeeded;
+                succeeded = file->Close() && succeeded;
+            }
+            double flushMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> g(m_lock);
+            m_stats.flushMs += flushMs;
+            m_stats.failed = m_stats.failed || !succeeded;
+            return !m_stats.failed;
+        }
+
+        const FileSinkOptions& CFileWriter::GetOptions() const
+        {
+            return m_options;
+        }
+
+        FileSinkStats CFileWriter::GetStats() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_stats;
+        }
+
+        uint64_t CFileWriter::Submit(Request request)
+        {
+            std::unique_lock<std::mutex> g(m_lock);
+            if (request.type == RequestType::Write)
+            {
+                // the writer is slowed down to the speed of the disk instead of filling the memory
+                if (m_pendingBuffers >= m_options.maxPendingBuffers)
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    m_completeCondition.wait(g, [this]() { return m_pendingBuffers < m_options.maxPendingBuffers; });
+                    m_stats.waitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                }
+                m_pendingBuffers++;
+            }
+
+            m_requests.push_back(std::move(request));
+            uint64_t sequence = ++m_submitted;
+            g.unlock();
+
+            m_requestCondition.notify_one();
+            return sequence;
+        }
+
+        void CFileWriter::Wait(uint64_t sequence)
+        {
+            std::unique_lock<std::mutex> g(m_lock);
+            m_completeCondition.wait(g, [this, sequence]() { return m_completed >= sequence; });
+        }
+
+        uint64_t CFileWriter::GetCompleted() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_completed;
+        }
+
+        std::vector<uint8_t> CFileWriter::GetBuffer()
+        {
+            std::vector<uint8_t> buffer;
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                if (!m_freeBuffers.empty())
+                {
+                    buffer.swap(m_freeBuffers.back());
+                    m_freeBuffers.pop_back();
+                }
+            }
+            buffer.reserve(m_options.bufferSize);
+            return buffer;
+        }
+
+        void CFileWriter::ThreadProc()
+        {
+            for (;;)
+            {
+                Request request;
+                {
+                    std::unique_lock<std::mutex> g(m_lock);
+                    m_requestCondition.wait(g, [this]() { return m_bStop || !m_requests.empty(); });
+                    if (m_requests.empty())
+                    {
+                        return;
+                    }
+                    request = std::move(m_requests.front());
+                    m_requests.pop_front();
+                }
+
+                Run(request);
+
+                {
+                    std::lock_guard<std::mutex> g(m_lock);
+                    if (request.type == RequestType::Write)
+                    {
+                        m_pendingBuffers--;
+                        request.data.clear();
+                        m_freeBuffers.push_back(std::move(request.data));
+                    }
+                    m_completed++;
+                }
+                m_completeCondition.notify_all();
+            }
+        }
+
+        void CFileWriter::Run(Request& request)
+        {
+            FileState& file = *request.file;
+            bool succeeded = true;
+            double flushMs = 0;
+
+            switch (request.type)
+            {
+            case RequestType::Write:
+                // nothing more is written to a file which has failed
+                succeeded = file.failed || file.WriteAt(request.offset, request.data.data(), request.data.size());
+                break;
+            case RequestType::SetSize:
+                succeeded = file.Resize(request.offset);
+                break;
+            case RequestType::Sync:
+            {
+                auto start = std::chrono::steady_clock::now();
+                succeeded = file.Sync();
+                flushMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            }
+            break;
+            case RequestType::Close:
+            {
+                // the space reserved beyond the data is given back
+                if (file.preallocated)
+                {
+                    succeeded = file.Resize(request.offset);
+                }
+
+                if (m_options.durability == FileDurability::FlushAtEnd)
+                {
+                    std::lock_guard<std::mutex> g(m_lock);
+                    m_unflushedFiles.push_back(request.file);
+                    break;
+                }
+                if (m_options.durability == FileDurability::FlushEachFile)
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    succeeded = file.Sync() && succeeded;
+                    flushMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                }
+                succeeded = file.Close() && succeeded;
+            }
+            break;
+            }
+
+            if (!succeeded)
+            {
+                file.failed = true;
+            }
+
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                if (request.type == RequestType::Write && !file.failed)
+                {
+                    m_stats.bytes += request.data.size();
+                    m_stats.writes++;
+                }
+                m_stats.flushMs += flushMs;
+                m_stats.failed = m_stats.failed || file.failed;
+            }
+
+            if (request.onClosed)
+            {
+                request.onClosed(!file.failed);
+            }
+        }
+
+        CFileSink::CFileSink(std::shared_ptr<CFileWriter> writer, std::shared_ptr<CFileWriter::FileState> file, const FilePath& path)
+            : m_pWriter(writer)
+            , m_file(file)
+            , m_path(path)
+            , m_position(0)
+            , m_size(0)
+            , m_bufferOffset(0)
+            , m_lastRequest(0)
+            , m_bClosed(false)
+        {
+        }
+
+        CFileSink::~CFileSink()
+        {
+            Close();
+        }
+
+        bool CFileSink::Write(const void* data, size_t size)
+        {
+            if (m_bClosed || m_file->failed)
+            {
+                return false;
+            }
+
+            // a write elsewhere, e.g. a header completed at the end, goes in a buffer of its own
+            if (!m_buffer.empty() && m_position != m_bufferOffset + m_buffer.size())
+            {
+                SubmitBuffer();
+            }
+
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            while (size)
+            {
+                if (m_buffer.capacity() == 0)
+                {
+                    m_buffer = m_pWriter->GetBuffer();
+                }
+                if (m_buffer.empty())
+                {
+                    m_bufferOffset = m_position;
+                }
+
+                size_t copySize = std::min(size, m_pWriter->GetOptions().bufferSize - m_buffer.size());
+                m_buffer.insert(m_buffer.end(), bytes, bytes + copySize);
+                bytes += copySize;
+                size -= copySize;
+                m_position += copySize;
+                m_size = std::max(m_size, m_position);
+
+                if (m_buffer.size() >= m_pWriter->GetOptions().bufferSize)
+                {
+                    SubmitBuffer();
+                }
+            }
+            return true;
+        }
+
+        size_t CFileSink::Read(void* data, size_t size)
+        {
+            if (m_bClosed || m_file->failed || m_position >= m_size)
+            {
+                return 0;
+            }
+            size = size_t(std::min<uint64_t>(size, m_size - m_position));
+            uint64_t end = m_position + size;
+
+            if (!m_buffer.empty() && m_bufferOffset < end && m_position < m_bufferOffset + m_buffer.size())
+            {
+                SubmitBuffer();
+            }
+
+            // e.g. a header read again at the end of a page waits for its own buffer, not for the whole page
+            uint64_t completed = m_pWriter->GetCompleted();
+            while (!m_pendingWrites.empty() && m_pendingWrites.front().sequence <= completed)
+            {
+                m_pendingWrites.pop_front();
+            }
+            uint64_t sequence = 0;
+            for (const auto& pendingWrite : m_pendingWrites)
+            {
+                if (pendingWrite.begin < end && m_position < pendingWrite.end)
+                {
+                    sequence = std::max(sequence, pendingWrite.sequence);
+                }
+            }
+            if (sequence)
+            {
+                m_pWriter->Wait(sequence);
+            }
+            if (m_file->failed)
+            {
+                return 0;
+            }
+
+            size_t readSize = m_file->ReadAt(m_position, static_cast<uint8_t*>(data), size);
+            m_position += readSize;
+            return readSize;
+        }
+
+        bool CFileSink::Seek(int64_t offset, SeekOrigin origin, uint64_t* newPosition)
+        {
+            int64_t base = 0;
+            switch (origin)
+            {
+            case SeekOrigin::Begin:
+                base = 0;
+                break;
+            case SeekOrigin::Current:
+                base = int64_t(m_position);
+                break;
+            case SeekOrigin::End:
+                base = int64_t(m_size);
+                break;
+            }
+            if (base + offset < 0)
+            {
+                return false;
+            }
+
+            m_position = uint64_t(base + offset);
+            if (newPosition)
+            {
+                *newPosition = m_position;
+            }
+            return true;
+        }
+
+        bool CFileSink::SetSize(uint64_t size)
+        {
+            if (m_bClosed || m_file->failed)
+            {
+                return false;
+            }
+
+            SubmitBuffer();
+
+            CFileWriter::Request request;
+            request.type = CFileWriter::RequestType::SetSize;
+            request.file = m_file;
+            request.offset = size;
+            m_lastRequest = m_pWriter->Submit(std::move(request));
+            m_pendingWrites.push_back({ 0, UINT64_MAX, m_lastRequest });
+            m_size = size;
+            return true;
+        }
+
+        uint64_t CFileSink::Size() const
+        {
+            return m_size;
+        }
+
+        uint64_t CFileSink::Position() const
+        {
+            return m_position;
+        }
+
+        const FilePath& CFileSink::GetPath() const
+        {
+            return m_path;
+        }
+
+        bool CFileSink::Flush(bool sync)
+        {
+            if (m_bClosed)
+            {
+                return !m_file->failed;
+            }
+
+            SubmitBuffer();
+            if (sync)
+            {
+                CFileWriter::Request request;
+                request.type = CFileWriter::RequestType::Sync;
+                request.file = m_file;
+                m_lastRequest = m_pWriter->Submit(std::move(request));
+            }
+
+            m_pWriter->Wait(m_lastRequest);
+            return !m_file->failed;
+        }
+
+        bool CFileSink::Close(FileClosedCallback onClosed)
+        {
+            if (m_bClosed)
+            {
+                return !m_file->failed;
+            }
+
+            SubmitBuffer();
+
+            CFileWriter::Request request;
+            request.type = CFileWriter::RequestType::Close;
+            request.file = m_file;
+            request.offset = m_size;
+            request.onClosed = onClosed;
+            m_lastRequest = m_pWriter->Submit(std::move(request));
+            m_bClosed = true;
+            return !m_file->failed;
+        }
+
+        bool CFileSink::Failed() const
+        {
+            return m_file->failed;
+        }
+
+        void CFileSink::SubmitBuffer()
+        {
+            if (m_buffer.empty())
+            {
+                return;
+            }
+
+            CFileWriter::Request request;
+            request.type = CFileWriter::RequestType::Write;
+            request.file = m_file;
+            request.offset = m_bufferOffset;
+            request.data.swap(m_buffer);
+            uint64_t end = m_bufferOffset + request.data.size();
+            m_lastRequest = m_pWriter->Submit(std::move(request));
+            m_pendingWrites.push_back({ m_bufferOffset, end, m_lastRequest });
+        }
+    }
+}
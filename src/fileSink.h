@@ -0,0 +1,183 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "memoryBuffer.h"
+
+namespace scanner
+{
+    namespace util
+    {
+#if defined(_WIN32)
+        typedef std::wstring FilePath;
+#else
+        typedef std::string FilePath;
+#endif
+
+        // when the data written reaches the disk
+        enum class FileDurability
+        {
+            None,           // left to the system
+            FlushAtEnd,     // every file is flushed once the scan ends, before it is reported complete
+            FlushEachFile,  // a file is flushed before it is closed, e.g. before its page is reported
+        };
+
+        struct FileSinkOptions
+        {
+            size_t bufferSize = 1024 * 1024;    // the writes are gathered into buffers of this size
+            size_t maxPendingBuffers = 32;      // buffers waiting for the I/O thread, a writer waits beyond
+            FileDurability durability = FileDurability::None;
+        };
+
+        struct FileSinkStats
+        {
+            uint64_t files = 0;
+            uint64_t bytes = 0;             // written to the files
+            uint64_t writes = 0;            // calls to the system
+            uint64_t preallocated = 0;      // files preallocated from their expected size
+            double waitMs = 0;              // writers waiting for a free buffer, i.e. the disk slowing the transfer down
+            double flushMs = 0;             // spent flushing the files to the disk
+            bool failed = false;            // a write, a flush or a close has failed
+        };
+
+        class CFileSink;
+
+        // Called on the I/O thread once a file is closed, succeeded is false if something written to it has failed.
+        // Must not release the last reference to the writer
+        typedef std::function<void(bool succeeded)> FileClosedCallback;
+
+        // Writes the files behind their writers on its own thread, the writers only copy the data into buffers.
+        // One writer serves all the files of a scan, the requests are run in order.
+        // Created with std::make_shared, the files keep it alive
+        class CFileWriter : public std::enable_shared_from_this<CFileWriter>
+        {
+        public:
+            explicit CFileWriter(const FileSinkOptions& options = FileSinkOptions());
+            // Finish()
+            ~CFileWriter();
+
+            CFileWriter(const CFileWriter&) = delete;
+            CFileWriter& operator=(const CFileWriter&) = delete;
+
+            // Create or truncate a file. expectedSize is reserved on the disk at once if given, 0 if unknown.
+            // Returns null if the file cannot be created
+            std::shared_ptr<CFileSink> Create(const FilePath& path, uint64_t expectedSize = 0);
+
+            // Wait until every file closed is written and flushed as asked by the durability.
+            // Returns false if something has failed
+            bool Finish();
+
+            const FileSinkOptions& GetOptions() const;
+            FileSinkStats GetStats() const;
+
+        private:
+            friend class CFileSink;
+            struct FileState;
+
+            enum class RequestType
+            {
+                Write,
+                SetSize,
+                Sync,
+                Close,
+            };
+
+            struct Request
+            {
+                RequestType type = RequestType::Write;
+                std::shared_ptr<FileState> file;
+                uint64_t offset = 0;                // Write: where the data goes, SetSize and Close: the size of the file
+                std::vector<uint8_t> data;
+                FileClosedCallback onClosed;
+            };
+
+            // Returns the sequence number of the request, to be waited for
+            uint64_t Submit(Request request);
+            void Wait(uint64_t sequence);
+            uint64_t GetCompleted() const;
+            std::vector<uint8_t> GetBuffer();
+
+            void ThreadProc();
+            void Run(Request& request);
+
+            FileSinkOptions m_options;
+
+            mutable std::mutex m_lock;
+            std::condition_variable m_requestCondition;     // a request has come
+            std::condition_variable m_completeCondition;    // a request has been run
+            std::deque<Request> m_requests;
+            std::vector<std::vector<uint8_t>> m_freeBuffers;
+            size_t m_pendingBuffers;
+            uint64_t m_submitted;
+            uint64_t m_completed;
+            bool m_bStop;
+            std::vector<std::shared_ptr<FileState>> m_unflushedFiles;   // closed, flushed once the scan ends
+            FileSinkStats m_stats;
+
+            std::thread m_thread;
+        };
+
+        // A file written through a CFileWriter, the data is gathered into buffers and written behind.
+        // Used by one thread at a time. A write elsewhere than at the end of the data buffered starts a new buffer,
+        // a read waits until the data it reads is written
+        class CFileSink
+        {
+        public:
+            ~CFileSink();
+
+            CFileSink(const CFileSink&) = delete;
+            CFileSink& operator=(const CFileSink&) = delete;
+
+            // false if the data cannot be written, e.g. an earlier write has failed
+            bool Write(const void* data, size_t size);
+            size_t Read(void* data, size_t size);
+            bool Seek(int64_t offset, SeekOrigin origin, uint64_t* newPosition = nullptr);
+            bool SetSize(uint64_t size);
+
+            uint64_t Size() const;
+            uint64_t Position() const;
+            const FilePath& GetPath() const;
+
+            // Wait until the data written so far is in the file, synced to the disk if sync
+            bool Flush(bool sync = false);
+            // The file is closed behind, onClosed is called once it is, e.g. to report the page.
+            // Returns false if a write has failed already
+            bool Close(FileClosedCallback onClosed = nullptr);
+            bool Failed() const;
+
+        private:
+            friend class CFileWriter;
+            CFileSink(std::shared_ptr<CFileWriter> writer, std::shared_ptr<CFileWriter::FileState> file, const FilePath& path);
+
+            // hand the buffer to the I/O thread
+            void SubmitBuffer();
+
+            struct PendingWrite
+            {
+                uint64_t begin;
+                uint64_t end;
+                uint64_t sequence;
+            };
+
+            std::shared_ptr<CFileWriter> m_pWriter;
+            std::shared_ptr<CFileWriter::FileState> m_file;
+            FilePath m_path;
+            uint64_t m_position;
+            uint64_t m_size;
+            std::vector<uint8_t> m_buffer;
+            uint64_t m_bufferOffset;            // where the buffer goes in the file
+            uint64_t m_lastRequest;             // sequence number of the last request submitted
+            std::deque<PendingWrite> m_pendingWrites;   // a read waits only for those of its range
+            bool m_bClosed;
+        };
+    }
+}
@@ -0,0 +1,231 @@
+#include "stdafx.h"
+#include "fileSinkStream.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        CFileSinkStream::CFileSinkStream(std::shared_ptr<CFileSink> file)
+            : m_cRef(1)
+            , m_pFile(file)
+        {
+            assert(m_pFile);
+        }
+
+        CFileSinkStream::~CFileSinkStream()
+        {
+            m_pFile->Close();
+        }
+
+        std::shared_ptr<CFileSink> CFileSinkStream::GetFile() const
+        {
+            return m_pFile;
+        }
+
+        // IUnknown
+        HRESULT CFileSinkStream::QueryInterface(REFIID riid, void **ppvObject)
+        {
+            if (NULL == ppvObject)
+            {
+                return E_INVALIDARG;
+            }
+
+            if (IsEqualIID(riid, IID_IUnknown))
+            {
+                *ppvObject = static_cast<IUnknown*>(this);
+            }
+            else if (IsEqualIID(riid, IID_ISequentialStream))
+            {
+                *ppvObject = static_cast<ISequentialStream*>(this);
+            }
+            else if (IsEqualIID(riid, IID_IStream))
+            {
+                *ppvObject = static_cast<IStream*>(this);
+            }
+            else
+            {
+                *ppvObject = NULL;
+                return (E_NOINTERFACE);
+            }
+
+            reinterpret_cast<IUnknown*>(*ppvObject)->AddRef();
+            return S_OK;
+        }
+
+        ULONG CFileSinkStream::AddRef()
+        {
+            return InterlockedIncrement((long*)&m_cRef);
+        }
+
+        ULONG CFileSinkStream::Release()
+        {
+            LONG cRef = InterlockedDecrement((long*)&m_cRef);
+            if (0 == cRef)
+            {
+                delete this;
+            }
+            return cRef;
+        }
+
+        // ISequentialStream
+        HRESULT CFileSinkStream::Read(void* pv, ULONG cb, ULONG* pcbRead)
+        {
+            if (!pv)
+            {
+                return STG_E_INVALIDPOINTER;
+            }
+            if (m_pFile->Failed())
+            {
+                return STG_E_READFAULT;
+            }
+
+            ULONG readSize = (ULONG)m_pFile->Read(pv, cb);
+            if (pcbRead)
+            {
+                *pcbRead = readSize;
+            }
+            return readSize < cb ? S_FALSE : S_OK;
+        }
+
+        HRESULT CFileSinkStream::Write(const void* pv, ULONG cb, ULONG* pcbWritten)
+        {
+            if (!pv)
+            {
+                return STG_E_INVALIDPOINTER;
+            }
+
+            // the data is copied only, a write failing behind fails the next one
+            bool written = m_pFile->Write(pv, cb);
+            if (pcbWritten)
+            {
+                *pcbWritten = written ? cb : 0;
+            }
+            return written ? S_OK : STG_E_WRITEFAULT;
+        }
+
+        // IStream
+        HRESULT CFileSinkStream::Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition)
+        {
+            SeekOrigin origin = SeekOrigin::Begin;
+            switch (dwOrigin)
+            {
+            case STREAM_SEEK_SET:
+                origin = SeekOrigin::Begin;
+                break;
+            case STREAM_SEEK_CUR:
+                origin = SeekOrigin::Current;
+                break;
+            case STREAM_SEEK_END:
+                origin = SeekOrigin::End;
+                break;
+            default:
+                return STG_E_INVALIDFUNCTION;
+            }
+
+            uint64_t newPosition = 0;
+            if (!m_pFile->Seek(dlibMove.QuadPart, origin, &newPosition))
+            {
+                return STG_E_INVALIDFUNCTION;
+            }
+
+            if (plibNewPosition)
+            {
+                plibNewPosition->QuadPart = newPosition;
+            }
+            return S_OK;
+        }
+
+        HRESULT CFileSinkStream::SetSize(ULARGE_INTEGER libNewSize)
+        {
+            return m_pFile->SetSize(libNewSize.QuadPart) ? S_OK : STG_E_MEDIUMFULL;
+        }
+
+        HRESULT CFileSinkStream::CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten)
+        {
+            if (!pstm)
+            {
+                return STG_E_INVALIDPOINTER;
+            }
+
+            std::vector<uint8_t> chunk((size_t)(std::min)(cb.QuadPart, (ULONGLONG)(64 * 1024)));
+            ULONGLONG read = 0;
+            ULONGLONG written = 0;
+            HRESULT hr = S_OK;
+            while (read < cb.QuadPart && SUCCEEDED(hr))
+            {
+                ULONG chunkSize = (ULONG)(std::min)(cb.QuadPart - read, (ULONGLONG)chunk.size());
+                ULONG readSize = (ULONG)m_pFile->Read(chunk.data(), chunkSize);
+                if (!readSize)
+                {
+                    break;
+                }
+                read += readSize;
+
+                ULONG writtenSize = 0;
+                hr = pstm->Write(chunk.data(), readSize, &writtenSize);
+                written += writtenSize;
+            }
+
+            if (pcbRead)
+            {
+                pcbRead->QuadPart = read;
+            }
+            if (pcbWritten)
+            {
+                pcbWritten->QuadPart = written;
+            }
+            return hr;
+        }
+
+        HRESULT CFileSinkStream::Commit(DWORD grfCommitFlags)
+        {
+            // waits for the data written so far, the file is synced when closed if the durability asks for it
+            return m_pFile->Flush() ? S_OK : STG_E_WRITEFAULT;
+        }
+
+        HRESULT CFileSinkStream::Revert()
+        {
+            return S_OK;
+        }
+
+        HRESULT CFileSinkStream::LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+        {
+            return STG_E_INVALIDFUNCTION;
+        }
+
+        HRESULT CFileSinkStream::UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+        {
+            return STG_E_INVALIDFUNCTION;
+        }
+
+        HRESULT CFileSinkStream::Stat(STATSTG* pstatstg, DWORD grfStatFlag)
+        {
+            if (!pstatstg)
+            {
+                return STG_E_INVALIDPOINTER;
+            }
+
+            memset(pstatstg, 0, sizeof(STATSTG));
+            pstatstg->type = STGTY_STREAM;
+            pstatstg->cbSize.QuadPart = m_pFile->Size();
+            pstatstg->grfMode = STGM_READWRITE;
+            if (!(grfStatFlag & STATFLAG_NONAME))
+            {
+                const std::wstring& path = m_pFile->GetPath();
+                size_t nameSize = (path.size() + 1) * sizeof(wchar_t);
+                pstatstg->pwcsName = (LPOLESTR)CoTaskMemAlloc(nameSize);
+                if (!pstatstg->pwcsName)
+                {
+                    return E_OUTOFMEMORY;
+                }
+                memcpy(pstatstg->pwcsName, path.c_str(), nameSize);
+            }
+            return S_OK;
+        }
+
+        HRESULT CFileSinkStream::Clone(IStream** ppstm)
+        {
+            return E_NOTIMPL;
+        }
+    }
+}
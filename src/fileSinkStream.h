@@ -0,0 +1,50 @@
+#pragma once
+
+#include <objidl.h>
+
+#include "fileSink.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        // IStream implementation writing a file through a CFileSink, the data is written behind the transfer.
+        // Used as the destination stream of a WIA transfer when images are delivered in files.
+        // The file is closed when the stream is released if it hasn't been before
+        class CFileSinkStream : public IStream
+        {
+        public:
+            explicit CFileSinkStream(std::shared_ptr<CFileSink> file);
+            virtual ~CFileSinkStream();
+
+            CFileSinkStream(const CFileSinkStream&) = delete;
+            CFileSinkStream& operator=(const CFileSinkStream&) = delete;
+
+            std::shared_ptr<CFileSink> GetFile() const;
+
+            // IUnknown
+            HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override;
+            ULONG STDMETHODCALLTYPE AddRef() override;
+            ULONG STDMETHODCALLTYPE Release() override;
+
+            // ISequentialStream
+            HRESULT STDMETHODCALLTYPE Read(void* pv, ULONG cb, ULONG* pcbRead) override;
+            HRESULT STDMETHODCALLTYPE Write(const void* pv, ULONG cb, ULONG* pcbWritten) override;
+
+            // IStream
+            HRESULT STDMETHODCALLTYPE Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition) override;
+            HRESULT STDMETHODCALLTYPE SetSize(ULARGE_INTEGER libNewSize) override;
+            HRESULT STDMETHODCALLTYPE CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten) override;
+            HRESULT STDMETHODCALLTYPE Commit(DWORD grfCommitFlags) override;
+            HRESULT STDMETHODCALLTYPE Revert() override;
+            HRESULT STDMETHODCALLTYPE LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+            HRESULT STDMETHODCALLTYPE UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+            HRESULT STDMETHODCALLTYPE Stat(STATSTG* pstatstg, DWORD grfStatFlag) override;
+            HRESULT STDMETHODCALLTYPE Clone(IStream** ppstm) override;
+
+        private:
+            ULONG m_cRef;
+            std::shared_ptr<CFileSink> m_pFile;
+        };
+    }
+}
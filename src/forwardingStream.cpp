@@ -0,0 +1,283 @@
+#include "stdafx.h"
+#include "forwardingStream.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        CForwardingStream::CForwardingStream(ATL::CComPtr<IStream> innerStream)
+            : m_cRef(1)
+            , m_pInner(innerStream)
+            , m_position(0)
+        {
+            assert(m_pInner);
+
+            // the inner stream might not start at the beginning
+            LARGE_INTEGER zero = { 0 };
+            ULARGE_INTEGER position = { 0 };
+            if (SUCCEEDED(m_pInner->Seek(zero, STREAM_SEEK_CUR, &position)))
+            {
+                m_position = position.QuadPart;
+            }
+        }
+
+        CForwardingStream::~CForwardingStream()
+        {
+        }
+
+        ATL::CComPtr<IStream> CForwardingStream::GetInnerStream() const
+        {
+            return m_pInner;
+        }
+
+        // IUnknown
+        HRESULT CForwardingStream::QueryInterface(REFIID riid, void **ppvObject)
+        {
+            if (NULL == ppvObject)
+            {
+                return E_INVALIDARG;
+            }
+
+            if (IsEqualIID(riid, IID_IUnknown))
+            {
+                *ppvObject = static_cast<IUnknown*>(this);
+            }
+            else if (IsEqualIID(riid, IID_ISequentialStream))
+            {
+                *ppvObject = static_cast<ISequentialStream*>(this);
+            }
+            else if (IsEqualIID(riid, IID_IStream))
+            {
+                *ppvObject = static_cast<IStream*>(this);
+            }
+            else
+            {
+                *ppvObject = NULL;
+                return (E_NOINTERFACE);
+            }
+
+            reinterpret_cast<IUnknown*>(*ppvObject)->AddRef();
+            return S_OK;
+        }
+
+        ULONG CForwardingStream::AddRef()
+        {
+            return InterlockedIncrement((long*)&m_cRef);
+        }
+
+        ULONG CForwardingStream::Release()
+        {
+            LONG cRef = InterlockedDecrement((long*)&m_cRef);
+            if (0 == cRef)
+            {
+                delete this;
+            }
+            return cRef;
+        }
+
+        // ISequentialStream
+        HRESULT CForwardingStream::Read(void* pv, ULONG cb, ULONG* pcbRead)
+        {
+            ULONG readSize = 0;
+            HRESULT hr = m_pInner->Read(pv, cb, &readSize);
+            m_position += readSize;
+
+            if (pcbRead)
+            {
+                *pcbRead = readSize;
+            }
+            return hr;
+        }
+
+        HRESULT CForwardingStream::Write(const void* pv, ULONG cb, ULONG* pcbWritten)
+        {
+            ULONG writtenSize = 0;
+            ULONGLONG position = m_position;
+
+            HRESULT hr = m_pInner->Write(pv, cb, &writtenSize);
+            m_position += writtenSize;
+
+            if (pcbWritten)
+            {
+                *pcbWritten = writtenSize;
+            }
+
+            if (SUCCEEDED(hr) && writtenSize)
+            {
+                hr = OnWrite(position, pv, writtenSize);
+            }
+            return hr;
+        }
+
+        // IStream
+        HRESULT CForwardingStream::Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition)
+        {
+            ULARGE_INTEGER newPosition = { 0 };
+            HRESULT hr = m_pInner->Seek(dlibMove, dwOrigin, &newPosition);
+            if (SUCCEEDED(hr))
+            {
+                m_position = newPosition.QuadPart;
+            }
+
+            if (plibNewPosition)
+            {
+                *plibNewPosition = newPosition;
+            }
+            return hr;
+        }
+
+        HRESULT CForwardingStream::SetSize(ULARGE_INTEGER libNewSize)
+        {
+            return m_pInner->SetSize(libNewSize);
+        }
+
+        HRESULT CForwardingStream::CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten)
+        {
+            ULARGE_INTEGER readSize = { 0 };
+            HRESULT hr = m_pInner->CopyTo(pstm, cb, &readSize, pcbWritten);
+            m_position += readSize.QuadPart;
+
+            if (pcbRead)
+            {
+                *pcbRead = readSize;
+            }
+            return hr;
+        }
+
+        HRESULT CForwardingStream::Commit(DWORD grfCommitFlags)
+        {
+            return m_pInner->Commit(grfCommitFlags);
+        }
+
+        HRESULT CForwardingStream::Revert()
+        {
+            return m_pInner->Revert();
+        }
+
+        HRESULT CForwardingStream::LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+        {
+            return m_pInner->LockRegion(libOffset, cb, dwLockType);
+        }
+
+        HRESULT CForwardingStream::UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+        {
+            return m_pInner->UnlockRegion(libOffset, cb, dwLockType);
+        }
+
+        HRESULT CForwardingStream::Stat(STATSTG* pstatstg, DWORD grfStatFlag)
+        {
+            return m_pInner->Stat(pstatstg, grfStatFlag);
+        }
+
+        HRESULT CForwardingStream::Clone(IStream** ppstm)
+        {
+            return E_NOTIMPL;
+        }
+
+        HRESULT CForwardingStream::OnWrite(ULONGLONG position, const void* pv, ULONG cb)
+        {
+            return S_OK;
+        }
+
+        CTeeStream::CTeeStream(ATL::CComPtr<IStream> innerStream, StreamWriteCallback callback)
+            : CForwardingStream(innerStream)
+            , m_callback(callback)
+        {
+        }
+
+        CTeeStream::~CTeeStream()
+        {
+        }
+
+        HRESULT CTeeStream::OnWrite(ULONGLONG position, const void* pv, ULONG cb)
+        {
+            if (m_callback && !m_callback(position, pv, cb))
+            {
+                return E_ABORT;
+            }
+            return S_OK;
+        }
+
+        CHashingStream::CHashingStream(ATL::CComPtr<IStream> innerStream, const HashOptions& options)
+            : CForwardingStream(innerStream)
+            , m_hasher(options)
+        {
+        }
+
+        CHashingStream::~CHashingStream()
+        {
+        }
+
+        HRESULT CHashingStream::GetDigest(ContentDigest& digest)
+        {
+            if (m_hasher.Finish(digest))
+            {
+                return S_OK;
+            }
+            return HashInnerStream(digest);
+        }
+
+        HRESULT CHashingStream::SetSize(ULARGE_INTEGER libNewSize)
+        {
+            HRESULT hr = CForwardingStream::SetSize(libNewSize);
+            if (SUCCEEDED(hr) && libNewSize.QuadPart != m_hasher.GetSize())
+            {
+                // data hashed might be cut off or zeros added
+                m_hasher.Invalidate();
+            }
+            return hr;
+        }
+
+        HRESULT CHashingStream::OnWrite(ULONGLONG position, const void* pv, ULONG cb)
+        {
+            m_hasher.Update(position, pv, cb);
+            return S_OK;
+        }
+
+        HRESULT CHashingStream::HashInnerStream(ContentDigest& digest)
+        {
+            ATL::CComPtr<IStream> pInner = GetInnerStream();
+
+            LARGE_INTEGER zero = { 0 };
+            ULARGE_INTEGER position = { 0 };
+            HRESULT hr = pInner->Seek(zero, STREAM_SEEK_CUR, &position);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+            hr = pInner->Seek(zero, STREAM_SEEK_SET, NULL);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+
+            const ULONG chunkSize = 256 * 1024;
+            std::unique_ptr<uint8_t[]> chunk(new uint8_t[chunkSize]);
+            uint64_t hashedSize = 0;
+            for (;;)
+            {
+                ULONG readSize = 0;
+                hr = pInner->Read(chunk.get(), chunkSize, &readSize);
+                if (FAILED(hr) || !readSize)
+                {
+                    break;
+                }
+                m_hasher.Update(hashedSize, chunk.get(), readSize);
+                hashedSize += readSize;
+            }
+
+            // the cursor is left where the driver put it
+            LARGE_INTEGER restore;
+            restore.QuadPart = LONGLONG(position.QuadPart);
+            pInner->Seek(restore, STREAM_SEEK_SET, NULL);
+
+            if (FAILED(hr))
+            {
+                m_hasher.Reset();
+                return hr;
+            }
+            m_hasher.Finish(digest);
+            return S_OK;
+        }
+    }
+}
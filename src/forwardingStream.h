@@ -0,0 +1,96 @@
+#pragma once
+
+#include <objidl.h>
+
+#include <functional>
+
+#include "contentHash.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        // IStream implementation forwarding every call to another stream.
+        // Derived classes override OnWrite() to observe the data written by the driver.
+        class CForwardingStream : public IStream
+        {
+        public:
+            explicit CForwardingStream(ATL::CComPtr<IStream> innerStream);
+            virtual ~CForwardingStream();
+
+            CForwardingStream(const CForwardingStream&) = delete;
+            CForwardingStream& operator=(const CForwardingStream&) = delete;
+
+            ATL::CComPtr<IStream> GetInnerStream() const;
+
+            // IUnknown
+            HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override;
+            ULONG STDMETHODCALLTYPE AddRef() override;
+            ULONG STDMETHODCALLTYPE Release() override;
+
+            // ISequentialStream
+            HRESULT STDMETHODCALLTYPE Read(void* pv, ULONG cb, ULONG* pcbRead) override;
+            HRESULT STDMETHODCALLTYPE Write(const void* pv, ULONG cb, ULONG* pcbWritten) override;
+
+            // IStream
+            HRESULT STDMETHODCALLTYPE Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition) override;
+            HRESULT STDMETHODCALLTYPE SetSize(ULARGE_INTEGER libNewSize) override;
+            HRESULT STDMETHODCALLTYPE CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten) override;
+            HRESULT STDMETHODCALLTYPE Commit(DWORD grfCommitFlags) override;
+            HRESULT STDMETHODCALLTYPE Revert() override;
+            HRESULT STDMETHODCALLTYPE LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+            HRESULT STDMETHODCALLTYPE UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) override;
+            HRESULT STDMETHODCALLTYPE Stat(STATSTG* pstatstg, DWORD grfStatFlag) override;
+            HRESULT STDMETHODCALLTYPE Clone(IStream** ppstm) override;
+
+        protected:
+            // Called after data has been written to the inner stream successfully.
+            // position is where the data starts in the stream.
+            // Returning a failure code makes the write fail.
+            virtual HRESULT OnWrite(ULONGLONG position, const void* pv, ULONG cb);
+
+        private:
+            ULONG m_cRef;
+            ATL::CComPtr<IStream> m_pInner;
+            ULONGLONG m_position;       // tracked cursor, avoids asking the inner stream on every write
+        };
+
+        // Forwards the data written by the driver to a callback as well
+        typedef std::function<bool(ULONGLONG position, const void* data, ULONG size)> StreamWriteCallback;
+
+        class CTeeStream : public CForwardingStream
+        {
+        public:
+            CTeeStream(ATL::CComPtr<IStream> innerStream, StreamWriteCallback callback);
+            virtual ~CTeeStream();
+
+        protected:
+            HRESULT OnWrite(ULONGLONG position, const void* pv, ULONG cb) override;
+
+        private:
+            StreamWriteCallback m_callback;
+        };
+
+        // Computes the digests of the data while the driver writes it, the file needs not be read again
+        class CHashingStream : public CForwardingStream
+        {
+        public:
+            CHashingStream(ATL::CComPtr<IStream> innerStream, const HashOptions& options);
+            virtual ~CHashingStream();
+
+            // The digests of the whole stream. If the data hasn't been written in order,
+            // e.g. a header completed at the end, they are computed by reading the inner stream again
+            HRESULT GetDigest(ContentDigest& digest);
+
+            HRESULT STDMETHODCALLTYPE SetSize(ULARGE_INTEGER libNewSize) override;
+
+        protected:
+            HRESULT OnWrite(ULONGLONG position, const void* pv, ULONG cb) override;
+
+        private:
+            HRESULT HashInnerStream(ContentDigest& digest);
+
+            CContentHasher m_hasher;
+        };
+    }
+}
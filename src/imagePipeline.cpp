@@ -0,0 +1,221 @@
+#include "stdafx.h"
+#include "imagePipeline.h"
+#include "imageResize.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace scanner
+{
+    namespace util
+    {
+        CImagePipeline::CImagePipeline(const PipelineOptions& options,
+            PageDecoder decoder,
+            PageEncoder encoder,
+            PageProcessedCallback onProcessed,
+            CThreadPool::Task threadStart,
+            CThreadPool::Task threadExit)
+            : m_options(options)
+            , m_decoder(decoder)
+            , m_encoder(encoder)
+            , m_onProcessed(onProcessed)
+        {
+            size_t threadCount = m_options.threadCount ? m_options.threadCount : std::thread::hardware_concurrency();
+            threadCount = std::max<size_t>(threadCount, 1);
+
+            // a page waiting for every thread keeps them busy without holding the whole batch in memory
+            size_t maxPendingPages = m_options.maxPendingPages ? m_options.maxPendingPages : threadCount * 2;
+
+            m_pPool.reset(new CThreadPool(threadCount, maxPendingPages, threadStart, threadExit));
+        }
+
+        CImagePipeline::~CImagePipeline()
+        {
+            m_pPool.reset();
+        }
+
+        bool CImagePipeline::SubmitPage(long index, std::shared_ptr<CMemoryBuffer> data)
+        {
+            auto page = std::make_shared<ProcessedPage>();
+            page->index = index;
+            page->data = data;
+            return Submit(page);
+        }
+
+        bool CImagePipeline::SubmitRawPage(long index, RawImage image)
+        {
+            auto page = std::make_shared<ProcessedPage>();
+            page->index = index;
+            page->image = std::move(image);
+            return Submit(page);
+        }
+
+        bool CImagePipeline::Submit(std::shared_ptr<ProcessedPage> page)
+        {
+            return m_pPool->Submit([this, page]()
+            {
+                // the wait for the pipelines of the other scans is not part of the processing time
+                if (m_options.processingLimit)
+                {
+                    m_options.processingLimit->Acquire();
+                }
+                auto start = std::chrono::steady_clock::now();
+                try
+                {
+                    ProcessPage(*page);
+                }
+                catch (const std::exception& e)
+                {
+                    page->succeeded = false;
+                    page->errorMessage = e.what();
+                }
+                page->processMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                if (m_options.processingLimit)
+                {
+                    m_options.processingLimit->Release();
+                }
+
+                if (m_onProcessed)
+                {
+                    m_onProcessed(*page);
+                }
+
+                std::lock_guard<std::mutex> g(m_lock);
+                m_stats.pages++;
+                m_stats.blankPages += page->blank ? 1 : 0;
+                m_stats.deskewedPages += page->skewAngle != 0 ? 1 : 0;
+                m_stats.encodedPages += page->encoded ? 1 : 0;
+                m_stats.failedPages += page->succeeded ? 0 : 1;
+                m_stats.thumbnails += page->thumbnails.size();
+                m_stats.totalThumbnailMs += page->thumbnailMs;
+                m_stats.totalProcessMs += page->processMs;
+                m_stats.maxProcessMs = std::max(m_stats.maxProcessMs, page->processMs);
+
+                m_pages[page->index] = std::move(*page);
+            });
+        }
+
+        void CImagePipeline::ProcessPage(ProcessedPage& page)
+        {
+            if (page.image.Empty())
+            {
+                if (!m_decoder || !page.data || !m_decoder(*page.data, page.image))
+                {
+                    // the page is kept as it is
+                    page.succeeded = false;
+                    page.errorMessage = "unable to decode the page";
+                    return;
+                }
+            }
+
+            if (m_options.removeBlankPages && IsBlankPage(page.image, m_options.blankPage, &page.inkRatio))
+            {
+                page.blank = true;
+                page.image = RawImage();
+                page.data.reset();
+                return;
+            }
+
+            bool changed = false;
+            if (m_options.deskew)
+            {
+                double angle = EstimateSkewAngle(page.image, m_options.maxSkewAngle);
+                if (std::fabs(angle) >= m_options.minSkewAngle)
+                {
+                    page.image = DeskewImage(page.image, angle);
+                    page.skewAngle = angle;
+                    changed = true;
+                }
+            }
+
+            if (!m_options.thumbnailSizes.empty())
+            {
+                MakeThumbnails(page);
+            }
+
+            if (!m_encoder)
+            {
+                return;
+            }
+
+            if (changed || m_options.recompress || !page.data)
+            {
+                auto data = std::make_shared<CMemoryBuffer>();
+                if (!m_encoder(page.image, m_options, data))
+                {
+                    page.succeeded = false;
+                    page.errorMessage = "unable to encode the page";
+                    return;
+                }
+                page.data = data;
+                page.encoded = true;
+            }
+
+            // the data is all we need from now on
+            page.image = RawImage();
+        }
+
+        void CImagePipeline::MakeThumbnails(ProcessedPage& page)
+        {
+            auto start = std::chrono::steady_clock::now();
+
+            std::vector<uint32_t> sizes = m_options.thumbnailSizes;
+            std::sort(sizes.rbegin(), sizes.rend());
+            PipelineOptions options = m_options;
+            options.imageFormat = m_options.thumbnailFormat;
+
+            // every level from the page itself, not from the one above, it is not blurred twice
+            for (uint32_t size : sizes)
+            {
+                PageThumbnail thumbnail;
+                GetThumbnailSize(page.image.width, page.image.height, size, thumbnail.width, thumbnail.height);
+                RawImage image = ResizeArea(page.image, thumbnail.width, thumbnail.height);
+                if (image.Empty())
+                {
+                    continue;
+                }
+
+                if (m_encoder)
+                {
+                    thumbnail.data = std::make_shared<CMemoryBuffer>();
+                    if (!m_encoder(image, options, thumbnail.data))
+                    {
+                        continue;
+                    }
+                }
+                else
+                {
+                    thumbnail.image = std::move(image);
+                }
+                page.thumbnails.push_back(std::move(thumbnail));
+            }
+
+            page.thumbnailMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        std::vector<ProcessedPage> CImagePipeline::Finish()
+        {
+            m_pPool->WaitIdle();
+
+            std::vector<ProcessedPage> pages;
+            std::lock_guard<std::mutex> g(m_lock);
+            pages.reserve(m_pages.size());
+            for (auto& page : m_pages)
+            {
+                pages.push_back(std::move(page.second));
+            }
+            m_pages.clear();
+
+            return pages;
+        }
+
+        PipelineStats CImagePipeline::GetStats() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            PipelineStats stats = m_stats;
+            stats.pool = m_pPool->GetStats();
+            return stats;
+        }
+    }
+}
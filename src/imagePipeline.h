@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "memoryBuffer.h"
+#include "rawImage.h"
+#include "threadPool.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        // Stages run on every page after it has been acquired
+        struct PipelineOptions
+        {
+            bool removeBlankPages = false;
+            BlankPageOptions blankPage;
+
+            bool deskew = false;
+            double maxSkewAngle = 5.0;      // degrees, larger skews are not searched for
+            double minSkewAngle = 0.2;      // smaller skews are left alone
+
+            bool recompress = false;        // encode every page again, even if it has not been changed
+            std::wstring imageFormat;       // tiff/bmp/jpeg/png, the format changed pages are encoded to
+            int quality = 85;               // JPEG quality, 1-100
+
+            // The longer side in pixels of the thumbnails made of every page, e.g. 256 and 1024, 3 at most.
+            // Downsampled from the page decoded, deskewed if it has been, and encoded in thumbnailFormat
+            std::vector<uint32_t> thumbnailSizes;
+            std::wstring thumbnailFormat = L"jpeg";
+
+            size_t threadCount = 0;         // 0 for the number of hardware threads
+            size_t maxPendingPages = 0;     // pages queued or in process at most, 0 for twice the threads
+            // Shared with the pipelines of the other scans, caps the pages processed at once by all of them.
+            // nullptr for no limit
+            std::shared_ptr<CConcurrencyLimit> processingLimit;
+
+            bool IsEnabled() const
+            {
+                return removeBlankPages || deskew || recompress || !thumbnailSizes.empty();
+            }
+        };
+
+        struct PageThumbnail
+        {
+            uint32_t width = 0;
+            uint32_t height = 0;
+            std::shared_ptr<CMemoryBuffer> data;    // encoded in PipelineOptions::thumbnailFormat
+            RawImage image;                 // kept only if there is no encoder
+        };
+
+        // a page which has gone through the pipeline
+        struct ProcessedPage
+        {
+            long index = 0;
+            bool succeeded = true;
+            std::string errorMessage;
+
+            bool blank = false;
+            double inkRatio = 0;
+            double skewAngle = 0;           // the skew corrected, in degrees
+            bool encoded = false;           // data has been encoded by the pipeline
+
+            std::shared_ptr<CMemoryBuffer> data;    // the encoded page, the original data if the page has not been changed
+            RawImage image;                 // the decoded page, kept only if there is no encoder
+            std::vector<PageThumbnail> thumbnails;  // the largest first, those failing to be encoded are left out
+            double thumbnailMs = 0;
+            double processMs = 0;
+        };
+
+        struct PipelineStats
+        {
+            uint64_t pages = 0;
+            uint64_t blankPages = 0;
+            uint64_t deskewedPages = 0;
+            uint64_t encodedPages = 0;
+            uint64_t failedPages = 0;
+            uint64_t thumbnails = 0;
+            double totalThumbnailMs = 0;
+            double totalProcessMs = 0;
+            double maxProcessMs = 0;
+            ThreadPoolStats pool;
+        };
+
+        // Decode an acquired page, returns false if the data is not understood
+        typedef std::function<bool(const CMemoryBuffer& data, RawImage& image)> PageDecoder;
+        // Encode a page in options.imageFormat, the data is written to the buffer passed in
+        typedef std::function<bool(const RawImage& image, const PipelineOptions& options, std::shared_ptr<CMemoryBuffer> data)> PageEncoder;
+        // Called on a thread of the pipeline once a page is done, e.g. to write it to a file.
+        // The page can be modified, e.g. to release the memory which is not needed anymore
+        typedef std::function<void(ProcessedPage& page)> PageProcessedCallback;
+
+        // Runs the stages on the pages in parallel while the next ones are being acquired.
+        // The codecs are passed in, so that the pipeline itself does not depend on a platform.
+        class CImagePipeline
+        {
+        public:
+            CImagePipeline(const PipelineOptions& options,
+                PageDecoder decoder,
+                PageEncoder encoder,
+                PageProcessedCallback onProcessed = nullptr,
+                CThreadPool::Task threadStart = nullptr,
+                CThreadPool::Task threadExit = nullptr);
+            ~CImagePipeline();
+
+            CImagePipeline(const CImagePipeline&) = delete;
+            CImagePipeline& operator=(const CImagePipeline&) = delete;
+
+            // Queue an encoded page. Blocks while maxPendingPages pages are waiting
+            bool SubmitPage(long index, std::shared_ptr<CMemoryBuffer> data);
+            // Queue a decoded page, nothing to decode
+            bool SubmitRawPage(long index, RawImage image);
+
+            // Wait for the pages submitted, returns them ordered by index.
+            // The pipeline can be used again afterwards
+            std::vector<ProcessedPage> Finish();
+
+            PipelineStats GetStats() const;
+
+        private:
+            bool Submit(std::shared_ptr<ProcessedPage> page);
+            void ProcessPage(ProcessedPage& page);
+            void MakeThumbnails(ProcessedPage& page);
+
+        private:
+            PipelineOptions m_options;
+            PageDecoder m_decoder;
+            PageEncoder m_encoder;
+            PageProcessedCallback m_onProcessed;
+
+            mutable std::mutex m_lock;
+            std::map<long, ProcessedPage> m_pages;
+            PipelineStats m_stats;
+
+            // the last member, the threads stop before the members above go away
+            std::unique_ptr<CThreadPool> m_pPool;
+        };
+    }
+}
@@ -0,0 +1,533 @@
+#include "stdafx.h"
+#include "imageResize.h"
+
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define IMAGE_RESIZE_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define IMAGE_RESIZE_NEON
+#include <arm_neon.h>
+#endif
+
+// as in inkCount.cpp, GCC and Clang need the instruction sets of the kernels enabled per function
+#if defined(__GNUC__)
+#define IMAGE_RESIZE_TARGET(name) __attribute__((target(name)))
+#else
+#define IMAGE_RESIZE_TARGET(name)
+#endif
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            // The weights are the parts covered exactly, in 1 / size of the result of a pixel: those of a pixel of the result
+            // add up to the size of the image. They are multiplied as signed 16 bit values by the kernels.
+            // The rows filtered vertically keep 7 fractional bits in 16 bits, so that the columns are multiplied the same way.
+            // The sums of the columns of a pixel of the result then fit in 32 bits up to MaxImageWidth
+            const uint32_t MaxKernelSize = 32767;
+            const uint32_t MaxImageWidth = 131071;
+            const int FractionBits = 7;
+
+            // the weights of every pixel of the result are followed by zeros up to a multiple of this,
+            // the kernels of the columns read them by vectors
+            const uint32_t WeightAlignment = 8;
+            // zeros after a row filtered vertically, read by the kernels of the columns along with the padding of the weights
+            const size_t RowPadding = 32;
+
+            // the pixels of the image covered by every pixel of the result along one axis
+            struct AreaFilter
+            {
+                std::vector<uint32_t> first;        // of every pixel of the result
+                std::vector<uint32_t> count;        // of the pixels covered
+                std::vector<uint32_t> offset;       // of its weights in weights
+                std::vector<uint16_t> weights;
+            };
+
+            // x * numerator / denominator rounded, as (x * multiplier + 2^(shift - 1)) >> shift,
+            // with a multiplier of 31 bits so that the kernels compute it the same way
+            struct FixedScale
+            {
+                uint32_t multiplier;
+                uint32_t shift;
+
+                uint32_t Apply(uint32_t x) const
+                {
+                    return uint32_t((uint64_t(x) * multiplier + (uint64_t(1) << (shift - 1))) >> shift);
+                }
+            };
+
+            // numerator / denominator is at most 128
+            FixedScale CreateFixedScale(uint64_t numerator, uint64_t denominator)
+            {
+                FixedScale scale;
+                scale.shift = 1;
+                while ((numerator << scale.shift) < (denominator << 30))
+                {
+                    scale.shift++;
+                }
+                scale.multiplier = uint32_t(((numerator << scale.shift) + denominator / 2) / denominator);
+                return scale;
+            }
+
+            AreaFilter CreateAreaFilter(uint32_t srcSize, uint32_t dstSize)
+            {
+                // In units of 1 / dstSize of a source pixel: the pixel d of the result covers [d * srcSize, (d + 1) * srcSize),
+                // the source pixel s covers [s * dstSize, (s + 1) * dstSize)
+                AreaFilter filter;
+                filter.first.resize(dstSize);
+                filter.count.resize(dstSize);
+                filter.offset.resize(dstSize);
+                for (uint32_t d = 0; d < dstSize; d++)
+                {
+                    uint64_t start = uint64_t(d) * srcSize;
+                    uint64_t end = start + srcSize;
+                    uint32_t first = uint32_t(start / dstSize);
+                    uint32_t last = uint32_t((end + dstSize - 1) / dstSize);
+
+                    filter.first[d] = first;
+                    filter.count[d] = last - first;
+                    filter.offset[d] = uint32_t(filter.weights.size());
+                    for (uint32_t s = first; s < last; s++)
+                    {
+                        uint64_t covered = std::min<uint64_t>(end, uint64_t(s + 1) * dstSize) - std::max<uint64_t>(start, uint64_t(s) * dstSize);
+                        filter.weights.push_back(uint16_t(covered));
+                    }
+                    filter.weights.resize((filter.weights.size() + WeightAlignment - 1) / WeightAlignment * WeightAlignment, 0);
+                }
+                return filter;
+            }
+
+            // acc[i] += row0[i] * weight0 + row1[i] * weight1
+            void AccumulateRowsScalar(const uint8_t* row0, const uint8_t* row1, uint16_t weight0, uint16_t weight1, uint32_t* acc, size_t count)
+            {
+                for (size_t i = 0; i < count; i++)
+                {
+                    acc[i] += uint32_t(row0[i]) * weight0 + uint32_t(row1[i]) * weight1;
+                }
+            }
+
+            // filtered[i] = the sum of the rows acc[i] in 16 bits with the fractional bits
+            void ScaleRowScalar(const uint32_t* acc, const FixedScale& scale, uint16_t* filtered, size_t count)
+            {
+                for (size_t i = 0; i < count; i++)
+                {
+                    filtered[i] = uint16_t(scale.Apply(acc[i]));
+                }
+            }
+
+            // every pixel of the result the sum of the pixels of the row it covers, scaled down to 8 bits
+            void FilterColumnsScalar(const uint16_t* row, size_t bpp, const AreaFilter& columns, const FixedScale& scale, uint8_t* dst, uint32_t width)
+            {
+                for (uint32_t x = 0; x < width; x++, dst += bpp)
+                {
+                    const uint16_t* src = row + size_t(columns.first[x]) * bpp;
+                    const uint16_t* weights = columns.weights.data() + columns.offset[x];
+                    for (size_t c = 0; c < bpp; c++)
+                    {
+                        uint32_t sum = 0;
+                        for (uint32_t k = 0; k < columns.count[x]; k++)
+                        {
+                            sum += uint32_t(src[k * bpp + c]) * weights[k];
+                        }
+                        dst[c] = uint8_t(scale.Apply(sum));
+                    }
+                }
+            }
+
+#if defined(IMAGE_RESIZE_X86)
+            // the pixels of both rows interleaved, multiplied by the weights and added in pairs by madd
+            IMAGE_RESIZE_TARGET("sse2")
+            void AccumulateRowsSSE2(const uint8_t* row0, const uint8_t* row1, uint16_t weight0, uint16_t weight1, uint32_t* acc, size_t count)
+            {
+                const __m128i weights = _mm_set1_epi32(int(uint32_t(weight0) | (uint32_t(weight1) << 16)));
+                const __m128i zero = _mm_setzero_si128();
+
+                size_t i = 0;
+                for (; i + 16 <= count; i += 16)
+                {
+                    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + i));
+                    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + i));
+                    __m128i lo = _mm_unpacklo_epi8(a, b);
+                    __m128i hi = _mm_unpackhi_epi8(a, b);
+
+                    __m128i* out = reinterpret_cast<__m128i*>(acc + i);
+                    _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out), _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), weights)));
+                    _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1), _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), weights)));
+                    _mm_storeu_si128(out + 2, _mm_add_epi32(_mm_loadu_si128(out + 2), _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), weights)));
+                    _mm_storeu_si128(out + 3, _mm_add_epi32(_mm_loadu_si128(out + 3), _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), weights)));
+                }
+                AccumulateRowsScalar(row0 + i, row1 + i, weight0, weight1, acc + i, count - i);
+            }
+
+            // FixedScale::Apply() of 4 values: the 32 x 32 bit products of the even and the odd values are shifted in 64 bits
+            IMAGE_RESIZE_TARGET("sse2")
+            inline __m128i ApplyScaleSSE2(__m128i x, __m128i multiplier, __m128i round, __m128i shift)
+            {
+                __m128i even = _mm_srl_epi64(_mm_add_epi64(_mm_mul_epu32(x, multiplier), round), shift);
+                __m128i odd = _mm_srl_epi64(_mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), multiplier), round), shift);
+                return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+            }
+
+            IMAGE_RESIZE_TARGET("sse2")
+            void ScaleRowSSE2(const uint32_t* acc, const FixedScale& scale, uint16_t* filtered, size_t count)
+            {
+                const __m128i multiplier = _mm_set1_epi32(int(scale.multiplier));
+                const __m128i round = _mm_set1_epi64x(int64_t(1) << (scale.shift - 1));
+                const __m128i shift = _mm_cvtsi32_si128(int(scale.shift));
+
+                size_t i = 0;
+                for (; i + 8 <= count; i += 8)
+                {
+                    // the values have 15 bits, the signed saturation does not change them
+                    __m128i lo = ApplyScaleSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i)), multiplier, round, shift);
+                    __m128i hi = ApplyScaleSSE2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i + 4)), multiplier, round, shift);
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(filtered + i), _mm_packs_epi32(lo, hi));
+                }
+                ScaleRowScalar(acc + i, scale, filtered + i, count - i);
+            }
+
+            // Gray: the values and the weights of a pixel of the result multiplied 8 at a time by madd and added up at the end.
+            // Color: the values of two pixels interleaved, madd multiplies them by their weights and adds them per channel
+            IMAGE_RESIZE_TARGET("sse2")
+            void FilterColumnsSSE2(const uint16_t* row, size_t bpp, const AreaFilter& columns, const FixedScale& scale, uint8_t* dst, uint32_t width)
+            {
+                if (bpp == 1)
+                {
+                    for (uint32_t x = 0; x < width; x++)
+                    {
+                        const uint16_t* src = row + columns.first[x];
+                        const uint16_t* weights = columns.weights.data() + columns.offset[x];
+                        __m128i sum = _mm_setzero_si128();
+                        for (uint32_t k = 0; k < columns.count[x]; k += 8)
+                        {
+                            __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + k));
+                            sum = _mm_add_epi32(sum, _mm_madd_epi16(values, _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + k))));
+                        }
+                        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+                        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+                        dst[x] = uint8_t(scale.Apply(uint32_t(_mm_cvtsi128_si32(sum))));
+                    }
+                    return;
+                }
+                if (bpp != 3)
+                {
+                    FilterColumnsScalar(row, bpp, columns, scale, dst, width);
+                    return;
+                }
+
+                const __m128i multiplier = _mm_set1_epi32(int(scale.multiplier));
+                const __m128i round = _mm_set1_epi64x(int64_t(1) << (scale.shift - 1));
+                const __m128i shift = _mm_cvtsi32_si128(int(scale.shift));
+                for (uint32_t x = 0; x < width; x++, dst += 3)
+                {
+                    const uint16_t* src = row + size_t(columns.first[x]) * 3;
+                    const uint16_t* weights = columns.weights.data() + columns.offset[x];
+                    __m128i sum = _mm_setzero_si128();
+                    for (uint32_t k = 0; k < columns.count[x]; k += 2)
+                    {
+                        // the 4th value is the first of the next pixel, its sum is not used
+                        __m128i p0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + k * 3));
+                        __m128i p1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + k * 3 + 3));
+                        __m128i w = _mm_set1_epi32(int(uint32_t(weights[k]) | (uint32_t(weights[k + 1]) << 16)));
+                        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi16(p0, p1), w));
+                    }
+                    __m128i scaled = ApplyScaleSSE2(sum, multiplier, round, shift);
+                    scaled = _mm_packus_epi16(_mm_packs_epi32(scaled, scaled), scaled);
+                    uint32_t pixel = uint32_t(_mm_cvtsi128_si32(scaled));
+                    dst[0] = uint8_t(pixel);
+                    dst[1] = uint8_t(pixel >> 8);
+                    dst[2] = uint8_t(pixel >> 16);
+                }
+            }
+
+            IMAGE_RESIZE_TARGET("avx2")
+            void AccumulateRowsAVX2(const uint8_t* row0, const uint8_t* row1, uint16_t weight0, uint16_t weight1, uint32_t* acc, size_t count)
+            {
+                const __m256i weights = _mm256_set1_epi32(int(uint32_t(weight0) | (uint32_t(weight1) << 16)));
+                const __m256i zero = _mm256_setzero_si256();
+
+                size_t i = 0;
+                for (; i + 32 <= count; i += 32)
+                {
+                    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row0 + i));
+                    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + i));
+
+                    // unpacked within the 128 bit lanes: p0 has the pixels 0-3 and 16-19, p1 4-7 and 20-23 and so on
+                    __m256i lo = _mm256_unpacklo_epi8(a, b);
+                    __m256i hi = _mm256_unpackhi_epi8(a, b);
+                    __m256i p0 = _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), weights);
+                    __m256i p1 = _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), weights);
+                    __m256i p2 = _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), weights);
+                    __m256i p3 = _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), weights);
+
+                    __m256i* out = reinterpret_cast<__m256i*>(acc + i);
+                    _mm256_storeu_si256(out, _mm256_add_epi32(_mm256_loadu_si256(out), _mm256_permute2x128_si256(p0, p1, 0x20)));
+                    _mm256_storeu_si256(out + 1, _mm256_add_epi32(_mm256_loadu_si256(out + 1), _mm256_permute2x128_si256(p2, p3, 0x20)));
+                    _mm256_storeu_si256(out + 2, _mm256_add_epi32(_mm256_loadu_si256(out + 2), _mm256_permute2x128_si256(p0, p1, 0x31)));
+                    _mm256_storeu_si256(out + 3, _mm256_add_epi32(_mm256_loadu_si256(out + 3), _mm256_permute2x128_si256(p2, p3, 0x31)));
+                }
+                AccumulateRowsScalar(row0 + i, row1 + i, weight0, weight1, acc + i, count - i);
+            }
+
+            IMAGE_RESIZE_TARGET("avx2")
+            inline __m256i ApplyScaleAVX2(__m256i x, __m256i multiplier, __m256i round, __m128i shift)
+            {
+                __m256i even = _mm256_srl_epi64(_mm256_add_epi64(_mm256_mul_epu32(x, multiplier), round), shift);
+                __m256i odd = _mm256_srl_epi64(_mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), multiplier), round), shift);
+                return _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+            }
+
+            IMAGE_RESIZE_TARGET("avx2")
+            void ScaleRowAVX2(const uint32_t* acc, const FixedScale& scale, uint16_t* filtered, size_t count)
+            {
+                const __m256i multiplier = _mm256_set1_epi32(int(scale.multiplier));
+                const __m256i round = _mm256_set1_epi64x(int64_t(1) << (scale.shift - 1));
+                const __m128i shift = _mm_cvtsi32_si128(int(scale.shift));
+
+                size_t i = 0;
+                for (; i + 16 <= count; i += 16)
+                {
+                    __m256i lo = ApplyScaleAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + i)), multiplier, round, shift);
+                    __m256i hi = ApplyScaleAVX2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + i + 8)), multiplier, round, shift);
+                    // packed within the 128 bit lanes, the quarters are put back in order
+                    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(filtered + i), packed);
+                }
+                ScaleRowScalar(acc + i, scale, filtered + i, count - i);
+            }
+#endif
+
+#if defined(IMAGE_RESIZE_NEON)
+            void AccumulateRowsNEON(const uint8_t* row0, const uint8_t* row1, uint16_t weight0, uint16_t weight1, uint32_t* acc, size_t count)
+            {
+                size_t i = 0;
+                for (; i + 16 <= count; i += 16)
+                {
+                    uint8x16_t a = vld1q_u8(row0 + i);
+                    uint8x16_t b = vld1q_u8(row1 + i);
+                    uint16x8_t aLo = vmovl_u8(vget_low_u8(a));
+                    uint16x8_t aHi = vmovl_u8(vget_high_u8(a));
+                    uint16x8_t bLo = vmovl_u8(vget_low_u8(b));
+                    uint16x8_t bHi = vmovl_u8(vget_high_u8(b));
+
+                    uint32x4_t acc0 = vmlal_n_u16(vmlal_n_u16(vld1q_u32(acc + i), vget_low_u16(aLo), weight0), vget_low_u16(bLo), weight1);
+                    uint32x4_t acc1 = vmlal_n_u16(vmlal_n_u16(vld1q_u32(acc + i + 4), vget_high_u16(aLo), weight0), vget_high_u16(bLo), weight1);
+                    uint32x4_t acc2 = vmlal_n_u16(vmlal_n_u16(vld1q_u32(acc + i + 8), vget_low_u16(aHi), weight0), vget_low_u16(bHi), weight1);
+                    uint32x4_t acc3 = vmlal_n_u16(vmlal_n_u16(vld1q_u32(acc + i + 12), vget_high_u16(aHi), weight0), vget_high_u16(bHi), weight1);
+                    vst1q_u32(acc + i, acc0);
+                    vst1q_u32(acc + i + 4, acc1);
+                    vst1q_u32(acc + i + 8, acc2);
+                    vst1q_u32(acc + i + 12, acc3);
+                }
+                AccumulateRowsScalar(row0 + i, row1 + i, weight0, weight1, acc + i, count - i);
+            }
+
+            // the rounding shift right by a negative count is the rounding of FixedScale::Apply()
+            void ScaleRowNEON(const uint32_t* acc, const FixedScale& scale, uint16_t* filtered, size_t count)
+            {
+                const int64x2_t shift = vdupq_n_s64(-int64_t(scale.shift));
+
+                size_t i = 0;
+                for (; i + 4 <= count; i += 4)
+                {
+                    uint32x4_t x = vld1q_u32(acc + i);
+                    uint64x2_t lo = vrshlq_u64(vmull_n_u32(vget_low_u32(x), scale.multiplier), shift);
+                    uint64x2_t hi = vrshlq_u64(vmull_n_u32(vget_high_u32(x), scale.multiplier), shift);
+                    vst1_u16(filtered + i, vmovn_u32(vcombine_u32(vmovn_u64(lo), vmovn_u64(hi))));
+                }
+                ScaleRowScalar(acc + i, scale, filtered + i, count - i);
+            }
+
+            void FilterColumnsNEON(const uint16_t* row, size_t bpp, const AreaFilter& columns, const FixedScale& scale, uint8_t* dst, uint32_t width)
+            {
+                if (bpp == 1)
+                {
+                    for (uint32_t x = 0; x < width; x++)
+                    {
+                        const uint16_t* src = row + columns.first[x];
+                        const uint16_t* weights = columns.weights.data() + columns.offset[x];
+                        uint32x4_t sum = vdupq_n_u32(0);
+                        for (uint32_t k = 0; k < columns.count[x]; k += 4)
+                        {
+                            sum = vmlal_u16(sum, vld1_u16(src + k), vld1_u16(weights + k));
+                        }
+                        dst[x] = uint8_t(scale.Apply(vaddvq_u32(sum)));
+                    }
+                    return;
+                }
+                if (bpp != 3)
+                {
+                    FilterColumnsScalar(row, bpp, columns, scale, dst, width);
+                    return;
+                }
+
+                for (uint32_t x = 0; x < width; x++, dst += 3)
+                {
+                    const uint16_t* src = row + size_t(columns.first[x]) * 3;
+                    const uint16_t* weights = columns.weights.data() + columns.offset[x];
+                    uint32x4_t sum = vdupq_n_u32(0);
+                    for (uint32_t k = 0; k < columns.count[x]; k++)
+                    {
+                        // the 4th value is the first of the next pixel, its sum is not used
+                        sum = vmlal_n_u16(sum, vld1_u16(src + k * 3), weights[k]);
+                    }
+                    dst[0] = uint8_t(scale.Apply(vgetq_lane_u32(sum, 0)));
+                    dst[1] = uint8_t(scale.Apply(vgetq_lane_u32(sum, 1)));
+                    dst[2] = uint8_t(scale.Apply(vgetq_lane_u32(sum, 2)));
+                }
+            }
+#endif
+
+            void AccumulateRows(SimdLevel level, const uint8_t* row0, const uint8_t* row1, uint16_t weight0, uint16_t weight1, uint32_t* acc, size_t count)
+            {
+                switch (level)
+                {
+#if defined(IMAGE_RESIZE_X86)
+                case SimdLevel::AVX2:
+                    AccumulateRowsAVX2(row0, row1, weight0, weight1, acc, count);
+                    return;
+                case SimdLevel::SSE2:
+                    AccumulateRowsSSE2(row0, row1, weight0, weight1, acc, count);
+                    return;
+#endif
+#if defined(IMAGE_RESIZE_NEON)
+                case SimdLevel::NEON:
+                    AccumulateRowsNEON(row0, row1, weight0, weight1, acc, count);
+                    return;
+#endif
+                default:
+                    AccumulateRowsScalar(row0, row1, weight0, weight1, acc, count);
+                    return;
+                }
+            }
+
+            void ScaleRow(SimdLevel level, const uint32_t* acc, const FixedScale& scale, uint16_t* filtered, size_t count)
+            {
+                switch (level)
+                {
+#if defined(IMAGE_RESIZE_X86)
+                case SimdLevel::AVX2:
+                    ScaleRowAVX2(acc, scale, filtered, count);
+                    return;
+                case SimdLevel::SSE2:
+                    ScaleRowSSE2(acc, scale, filtered, count);
+                    return;
+#endif
+#if defined(IMAGE_RESIZE_NEON)
+                case SimdLevel::NEON:
+                    ScaleRowNEON(acc, scale, filtered, count);
+                    return;
+#endif
+                default:
+                    ScaleRowScalar(acc, scale, filtered, count);
+                    return;
+                }
+            }
+
+            void FilterColumns(SimdLevel level, const uint16_t* row, size_t bpp, const AreaFilter& columns, const FixedScale& scale, uint8_t* dst, uint32_t width)
+            {
+                switch (level)
+                {
+#if defined(IMAGE_RESIZE_X86)
+                // a pixel of the result covers a few values only, the wider vectors would be mostly empty
+                case SimdLevel::AVX2:
+                case SimdLevel::SSE2:
+                    FilterColumnsSSE2(row, bpp, columns, scale, dst, width);
+                    return;
+#endif
+#if defined(IMAGE_RESIZE_NEON)
+                case SimdLevel::NEON:
+                    FilterColumnsNEON(row, bpp, columns, scale, dst, width);
+                    return;
+#endif
+                default:
+                    FilterColumnsScalar(row, bpp, columns, scale, dst, width);
+                    return;
+                }
+            }
+        }
+
+        RawImage ResizeArea(const RawImage& image, uint32_t width, uint32_t height)
+        {
+            return ResizeArea(image, width, height, GetSimdLevel());
+        }
+
+        RawImage ResizeArea(const RawImage& image, uint32_t width, uint32_t height, SimdLevel level)
+        {
+            width = std::min(width, image.width);
+            height = std::min(height, image.height);
+            if (image.Empty() || !width || !height || width > MaxKernelSize || height > MaxKernelSize || image.width > MaxImageWidth)
+            {
+                return RawImage();
+            }
+
+            RawImage result = CreateRawImage(width, height, image.format);
+            result.dpiX = image.dpiX * width / image.width;
+            result.dpiY = image.dpiY * height / image.height;
+
+            size_t bpp = GetBytesPerPixel(image.format);
+            size_t rowSize = size_t(image.width) * bpp;
+            AreaFilter rows = CreateAreaFilter(image.height, height);
+            AreaFilter columns = CreateAreaFilter(image.width, width);
+
+            // The rows covered by a row of the result are added up first, two at a time, and scaled down to 16 bits.
+            // Then the columns of that row are filtered into the pixels of the result.
+            // The sums are divided by the size of the image through fixed point reciprocals, the same at every level
+            const FixedScale rowScale = CreateFixedScale(uint64_t(1) << FractionBits, image.height);
+            const FixedScale columnScale = CreateFixedScale(1, uint64_t(image.width) << FractionBits);
+            std::vector<uint32_t> acc(rowSize);
+            std::vector<uint16_t> filtered(rowSize + RowPadding);
+            for (uint32_t y = 0; y < height; y++)
+            {
+                std::fill(acc.begin(), acc.end(), 0);
+                uint32_t first = rows.first[y];
+                uint32_t count = rows.count[y];
+                const uint16_t* weights = rows.weights.data() + rows.offset[y];
+                for (uint32_t k = 0; k < count; k += 2)
+                {
+                    const uint8_t* row0 = image.Row(first + k);
+                    if (k + 1 < count)
+                    {
+                        AccumulateRows(level, row0, image.Row(first + k + 1), weights[k], weights[k + 1], acc.data(), rowSize);
+                    }
+                    else
+                    {
+                        AccumulateRows(level, row0, row0, weights[k], 0, acc.data(), rowSize);
+                    }
+                }
+                ScaleRow(level, acc.data(), rowScale, filtered.data(), rowSize);
+                FilterColumns(level, filtered.data(), bpp, columns, columnScale, result.Row(y), width);
+            }
+            return result;
+        }
+
+        void GetThumbnailSize(uint32_t width, uint32_t height, uint32_t maxSide, uint32_t& thumbWidth, uint32_t& thumbHeight)
+        {
+            thumbWidth = width;
+            thumbHeight = height;
+            if (!width || !height || std::max(width, height) <= maxSide)
+            {
+                return;
+            }
+
+            // rounded, at least one pixel
+            if (width >= height)
+            {
+                thumbWidth = maxSide;
+                thumbHeight = std::max<uint32_t>(1, uint32_t((uint64_t(height) * maxSide + width / 2) / width));
+            }
+            else
+            {
+                thumbHeight = maxSide;
+                thumbWidth = std::max<uint32_t>(1, uint32_t((uint64_t(width) * maxSide + height / 2) / height));
+            }
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+
+#include "inkCount.h"
+#include "rawImage.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        // Downsample with an area filter: every pixel of the result is the average of the pixels of the image it covers,
+        // weighted by the part covered. Images are not enlarged, the size is limited to the one of the image.
+        // The result is the same whatever the kernel, the pixels are filtered in integers.
+        // Returns an empty image if a side of the result would be larger than 32767 or the image is wider than 131071
+        RawImage ResizeArea(const RawImage& image, uint32_t width, uint32_t height);
+        // The same with the kernel of the level, which must be supported. For tests and benchmarks
+        RawImage ResizeArea(const RawImage& image, uint32_t width, uint32_t height, SimdLevel level);
+
+        // The size of a thumbnail whose longer side is maxSide at most, with the aspect ratio of the image
+        void GetThumbnailSize(uint32_t width, uint32_t height, uint32_t maxSide, uint32_t& thumbWidth, uint32_t& thumbHeight);
+    }
+}
@@ -0,0 +1,248 @@
+#include "stdafx.h"
+#include "inkCount.h"
+
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define INK_COUNT_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define INK_COUNT_NEON
+#include <arm_neon.h>
+#endif
+
+// GCC and Clang build the kernels of the instruction sets above the baseline through target attributes,
+// MSVC allows the intrinsics anywhere
+#if defined(__GNUC__)
+#define INK_COUNT_TARGET(name) __attribute__((target(name)))
+#else
+#define INK_COUNT_TARGET(name)
+#endif
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            // The kernels count the pixels not above the limit, i.e. darker than limit + 1.
+            // The byte counters of the vector kernels are added up every 255 vectors before they overflow
+            const size_t MaxVectorsPerBlock = 255;
+
+            size_t CountDarkScalar(const uint8_t* pixels, size_t count, uint8_t limit)
+            {
+                size_t dark = 0;
+                for (size_t i = 0; i < count; i++)
+                {
+                    dark += (pixels[i] <= limit);
+                }
+                return dark;
+            }
+
+#if defined(INK_COUNT_X86)
+            INK_COUNT_TARGET("sse2")
+            size_t CountDarkSSE2(const uint8_t* pixels, size_t count, uint8_t limit)
+            {
+                const __m128i limits = _mm_set1_epi8(char(limit));
+                const __m128i zero = _mm_setzero_si128();
+                const size_t vectorEnd = count - count % 16;
+
+                __m128i total = zero;
+                size_t i = 0;
+                while (i < vectorEnd)
+                {
+                    size_t blockEnd = std::min(vectorEnd, i + MaxVectorsPerBlock * 16);
+                    __m128i counters = zero;
+                    for (; i < blockEnd; i += 16)
+                    {
+                        // min(p, limit) == p where p <= limit, the mask is -1 there
+                        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+                        counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(_mm_min_epu8(p, limits), p));
+                    }
+                    total = _mm_add_epi64(total, _mm_sad_epu8(counters, zero));
+                }
+
+                uint64_t lanes[2];
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), total);
+                return size_t(lanes[0] + lanes[1]) + CountDarkScalar(pixels + i, count - i, limit);
+            }
+
+            INK_COUNT_TARGET("avx2")
+            size_t CountDarkAVX2(const uint8_t* pixels, size_t count, uint8_t limit)
+            {
+                const __m256i limits = _mm256_set1_epi8(char(limit));
+                const __m256i zero = _mm256_setzero_si256();
+                const size_t vectorEnd = count - count % 32;
+
+                __m256i total = zero;
+                size_t i = 0;
+                while (i < vectorEnd)
+                {
+                    size_t blockEnd = std::min(vectorEnd, i + MaxVectorsPerBlock * 32);
+                    __m256i counters = zero;
+                    for (; i < blockEnd; i += 32)
+                    {
+                        __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i));
+                        counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(_mm256_min_epu8(p, limits), p));
+                    }
+                    total = _mm256_add_epi64(total, _mm256_sad_epu8(counters, zero));
+                }
+
+                uint64_t lanes[4];
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), total);
+                return size_t(lanes[0] + lanes[1] + lanes[2] + lanes[3]) + CountDarkScalar(pixels + i, count - i, limit);
+            }
+
+            bool CpuSupportsAVX2()
+            {
+#if defined(_MSC_VER)
+                int info[4] = {};
+                __cpuid(info, 0);
+                if (info[0] < 7)
+                {
+                    return false;
+                }
+
+                // the OS must save the AVX registers as well
+                __cpuid(info, 1);
+                bool osxsave = (info[2] & (1 << 27)) != 0;
+                bool avx = (info[2] & (1 << 28)) != 0;
+                if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+                {
+                    return false;
+                }
+
+                __cpuidex(info, 7, 0);
+                return (info[1] & (1 << 5)) != 0;
+#else
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx2") != 0;
+#endif
+            }
+
+            bool CpuSupportsSSE2()
+            {
+#if defined(_M_X64) || defined(__x86_64__)
+                return true;
+#elif defined(_MSC_VER)
+                int info[4] = {};
+                __cpuid(info, 1);
+                return (info[3] & (1 << 26)) != 0;
+#else
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("sse2") != 0;
+#endif
+            }
+#endif
+
+#if defined(INK_COUNT_NEON)
+            size_t CountDarkNEON(const uint8_t* pixels, size_t count, uint8_t limit)
+            {
+                const uint8x16_t limits = vdupq_n_u8(limit);
+                const size_t vectorEnd = count - count % 16;
+
+                size_t dark = 0;
+                size_t i = 0;
+                while (i < vectorEnd)
+                {
+                    size_t blockEnd = std::min(vectorEnd, i + MaxVectorsPerBlock * 16);
+                    uint8x16_t counters = vdupq_n_u8(0);
+                    for (; i < blockEnd; i += 16)
+                    {
+                        counters = vsubq_u8(counters, vcleq_u8(vld1q_u8(pixels + i), limits));
+                    }
+                    dark += vaddlvq_u8(counters);
+                }
+                return dark + CountDarkScalar(pixels + i, count - i, limit);
+            }
+#endif
+
+            SimdLevel DetectSimdLevel()
+            {
+#if defined(INK_COUNT_X86)
+                if (CpuSupportsAVX2())
+                {
+                    return SimdLevel::AVX2;
+                }
+                if (CpuSupportsSSE2())
+                {
+                    return SimdLevel::SSE2;
+                }
+#elif defined(INK_COUNT_NEON)
+                return SimdLevel::NEON;
+#endif
+                return SimdLevel::Scalar;
+            }
+        }
+
+        const char* SimdLevelToString(SimdLevel level)
+        {
+            switch (level)
+            {
+            case SimdLevel::Scalar:
+                return "scalar";
+            case SimdLevel::SSE2:
+                return "sse2";
+            case SimdLevel::AVX2:
+                return "avx2";
+            case SimdLevel::NEON:
+                return "neon";
+            }
+            return "unknown";
+        }
+
+        SimdLevel GetSimdLevel()
+        {
+            static const SimdLevel level = DetectSimdLevel();
+            return level;
+        }
+
+        bool IsSimdLevelSupported(SimdLevel level)
+        {
+            switch (level)
+            {
+            case SimdLevel::Scalar:
+                return true;
+            case SimdLevel::SSE2:
+                return GetSimdLevel() == SimdLevel::SSE2 || GetSimdLevel() == SimdLevel::AVX2;
+            case SimdLevel::AVX2:
+            case SimdLevel::NEON:
+                return GetSimdLevel() == level;
+            }
+            return false;
+        }
+
+        size_t CountDarkPixels(const uint8_t* pixels, size_t count, uint8_t darkThreshold)
+        {
+            return CountDarkPixels(pixels, count, darkThreshold, GetSimdLevel());
+        }
+
+        size_t CountDarkPixels(const uint8_t* pixels, size_t count, uint8_t darkThreshold, SimdLevel level)
+        {
+            if (!darkThreshold)
+            {
+                return 0;
+            }
+
+            uint8_t limit = uint8_t(darkThreshold - 1);
+            switch (level)
+            {
+#if defined(INK_COUNT_X86)
+            case SimdLevel::AVX2:
+                return CountDarkAVX2(pixels, count, limit);
+            case SimdLevel::SSE2:
+                return CountDarkSSE2(pixels, count, limit);
+#endif
+#if defined(INK_COUNT_NEON)
+            case SimdLevel::NEON:
+                return CountDarkNEON(pixels, count, limit);
+#endif
+            default:
+                return CountDarkScalar(pixels, count, limit);
+            }
+        }
+    }
+}
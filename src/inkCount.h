@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace scanner
+{
+    namespace util
+    {
+        // Instruction sets the pixel kernels are built for, the best one supported by the CPU is chosen at runtime
+        enum class SimdLevel
+        {
+            Scalar,
+            SSE2,
+            AVX2,
+            NEON,
+        };
+
+        const char* SimdLevelToString(SimdLevel level);
+
+        // The best level supported by the CPU, detected once
+        SimdLevel GetSimdLevel();
+        bool IsSimdLevelSupported(SimdLevel level);
+
+        // Count the 8 bit pixels darker than the threshold
+        size_t CountDarkPixels(const uint8_t* pixels, size_t count, uint8_t darkThreshold);
+        // The same with the kernel of the level, which must be supported. For tests and benchmarks
+        size_t CountDarkPixels(const uint8_t* pixels, size_t count, uint8_t darkThreshold, SimdLevel level);
+    }
+}
@@ -0,0 +1,255 @@
+#include "stdafx.h"
+#include "jobScheduler.h"
+
+#include <algorithm>
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            double ElapsedMs(CJobScheduler::Clock::time_point start, CJobScheduler::Clock::time_point end)
+            {
+                return std::chrono::duration<double, std::milli>(end - start).count();
+            }
+        }
+
+        CJobScheduler::CJobScheduler(const JobSchedulerOptions& options)
+            : m_options(options)
+            , m_nextJobId(1)
+            , m_pProcessingLimit(std::make_shared<CConcurrencyLimit>(options.maxProcessingThreads))
+        {
+        }
+
+        uint64_t CJobScheduler::Submit(const std::wstring& deviceId, int priority, JobHandler handler)
+        {
+            assert(handler);
+
+            std::vector<Job> ready;
+            uint64_t jobId = 0;
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                Job job;
+                job.metrics.id = jobId = m_nextJobId++;
+                job.metrics.deviceId = deviceId;
+                job.metrics.priority = priority;
+                job.handler = std::move(handler);
+                job.submitTime = Clock::now();
+
+                // after the jobs of the same priority or a higher one
+                auto& jobs = m_devices[deviceId].jobs;
+                auto it = std::find_if(jobs.begin(), jobs.end(), [priority](const Job& queued)
+                {
+                    return queued.metrics.priority < priority;
+                });
+                jobs.insert(it, std::move(job));
+                m_stats.submitted++;
+                m_stats.queuedCount++;
+
+                TakeReadyJobs(ready);
+            }
+            Notify(ready);
+            return jobId;
+        }
+
+        JobMetrics CJobScheduler::Finish(uint64_t jobId)
+        {
+            std::vector<Job> ready;
+            JobMetrics metrics;
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                auto it = m_activeJobs.find(jobId);
+                if (it == m_activeJobs.end())
+                {
+                    assert(false);
+                    return metrics;
+                }
+
+                metrics = std::move(it->second.metrics);
+                metrics.state = JobState::Finished;
+                metrics.runMs = ElapsedMs(it->second.startTime, Clock::now());
+                m_activeJobs.erase(it);
+
+                auto device = m_devices.find(metrics.deviceId);
+                assert(device != m_devices.end() && device->second.activeJobId == jobId);
+                device->second.activeJobId = 0;
+                if (device->second.jobs.empty())
+                {
+                    m_devices.erase(device);
+                }
+
+                m_stats.finished++;
+                m_stats.activeCount--;
+                m_stats.totalRunMs += metrics.runMs;
+                m_stats.maxRunMs = std::max(m_stats.maxRunMs, metrics.runMs);
+
+                TakeReadyJobs(ready);
+            }
+            Notify(ready);
+            return metrics;
+        }
+
+        bool CJobScheduler::Cancel(uint64_t jobId)
+        {
+            std::vector<Job> cancelled;
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                for (auto device = m_devices.begin(); device != m_devices.end() && cancelled.empty(); ++device)
+                {
+                    auto& jobs = device->second.jobs;
+                    auto it = std::find_if(jobs.begin(), jobs.end(), [jobId](const Job& queued)
+                    {
+                        return queued.metrics.id == jobId;
+                    });
+                    if (it == jobs.end())
+                    {
+                        continue;
+                    }
+
+                    cancelled.push_back(std::move(*it));
+                    jobs.erase(it);
+                    if (jobs.empty() && !device->second.activeJobId)
+                    {
+                        m_devices.erase(device);
+                        break;
+                    }
+                }
+
+                auto now = Clock::now();
+                for (auto& job : cancelled)
+                {
+                    job.metrics.state = JobState::Cancelled;
+                    job.metrics.queueMs = ElapsedMs(job.submitTime, now);
+                    m_stats.cancelled++;
+                    m_stats.queuedCount--;
+                }
+            }
+            Notify(cancelled);
+            return !cancelled.empty();
+        }
+
+        size_t CJobScheduler::CancelDevice(const std::wstring& deviceId)
+        {
+            std::vector<Job> cancelled;
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                auto device = m_devices.find(deviceId);
+                if (device == m_devices.end())
+                {
+                    return 0;
+                }
+
+                auto now = Clock::now();
+                for (auto& job : device->second.jobs)
+                {
+                    job.metrics.state = JobState::Cancelled;
+                    job.metrics.queueMs = ElapsedMs(job.submitTime, now);
+                    cancelled.push_back(std::move(job));
+                }
+                m_stats.cancelled += cancelled.size();
+                m_stats.queuedCount -= cancelled.size();
+
+                device->second.jobs.clear();
+                if (!device->second.activeJobId)
+                {
+                    m_devices.erase(device);
+                }
+            }
+            Notify(cancelled);
+            return cancelled.size();
+        }
+
+        void CJobScheduler::SetOptions(const JobSchedulerOptions& options)
+        {
+            std::vector<Job> ready;
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                m_options = options;
+                m_pProcessingLimit->SetLimit(options.maxProcessingThreads);
+                TakeReadyJobs(ready);
+            }
+            Notify(ready);
+        }
+
+        JobSchedulerOptions CJobScheduler::GetOptions() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_options;
+        }
+
+        JobSchedulerStats CJobScheduler::GetStats() const
+        {
+            JobSchedulerStats stats;
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                stats = m_stats;
+            }
+            stats.processing = m_pProcessingLimit->GetStats();
+            return stats;
+        }
+
+        std::shared_ptr<CConcurrencyLimit> CJobScheduler::GetProcessingLimit() const
+        {
+            return m_pProcessingLimit;
+        }
+
+        void CJobScheduler::TakeReadyJobs(std::vector<Job>& ready)
+        {
+            auto now = Clock::now();
+            while (!m_options.maxActiveJobs || m_activeJobs.size() < m_options.maxActiveJobs)
+            {
+                // the first job of every device idle is a candidate, few devices are attached
+                DeviceQueue* next = nullptr;
+                for (auto& device : m_devices)
+                {
+                    DeviceQueue& queue = device.second;
+                    if (queue.activeJobId || queue.jobs.empty())
+                    {
+                        continue;
+                    }
+                    if (!next ||
+                        queue.jobs.front().metrics.priority > next->jobs.front().metrics.priority ||
+                        (queue.jobs.front().metrics.priority == next->jobs.front().metrics.priority &&
+                            queue.jobs.front().metrics.id < next->jobs.front().metrics.id))
+                    {
+                        next = &queue;
+                    }
+                }
+                if (!next)
+                {
+                    break;
+                }
+
+                Job job = std::move(next->jobs.front());
+                next->jobs.pop_front();
+                next->activeJobId = job.metrics.id;
+
+                job.metrics.state = JobState::Running;
+                job.metrics.queueMs = ElapsedMs(job.submitTime, now);
+                job.startTime = now;
+
+                m_stats.started++;
+                m_stats.queuedCount--;
+                m_stats.activeCount++;
+                m_stats.maxActiveCount = std::max(m_stats.maxActiveCount, m_stats.activeCount);
+                m_stats.totalQueueMs += job.metrics.queueMs;
+                m_stats.maxQueueMs = std::max(m_stats.maxQueueMs, job.metrics.queueMs);
+
+                // the handler is kept by the job taken, the one running keeps the times only
+                Job& active = m_activeJobs[job.metrics.id];
+                active.metrics = job.metrics;
+                active.startTime = job.startTime;
+                ready.push_back(std::move(job));
+            }
+        }
+
+        void CJobScheduler::Notify(const std::vector<Job>& jobs)
+        {
+            for (const auto& job : jobs)
+            {
+                job.handler(job.metrics);
+            }
+        }
+    }
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "threadPool.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        struct JobSchedulerOptions
+        {
+            size_t maxActiveJobs = 0;           // jobs running at once on all the devices, 0 for no limit
+            size_t maxProcessingThreads = 0;    // pages processed at once by the jobs, 0 for no limit
+        };
+
+        enum class JobState
+        {
+            Queued,
+            Running,
+            Finished,
+            Cancelled,      // while queued, it has never run
+        };
+
+        struct JobMetrics
+        {
+            uint64_t id = 0;
+            std::wstring deviceId;
+            int priority = 0;
+            JobState state = JobState::Queued;
+            double queueMs = 0;     // from submitted until started or cancelled
+            double runMs = 0;       // from started until finished
+        };
+
+        struct JobSchedulerStats
+        {
+            uint64_t submitted = 0;
+            uint64_t started = 0;
+            uint64_t finished = 0;
+            uint64_t cancelled = 0;
+            size_t queuedCount = 0;
+            size_t activeCount = 0;
+            size_t maxActiveCount = 0;
+            double totalQueueMs = 0;    // of the jobs started
+            double maxQueueMs = 0;
+            double totalRunMs = 0;      // of the jobs finished
+            double maxRunMs = 0;
+            ConcurrencyLimitStats processing;
+        };
+
+        // Runs the jobs of several devices under one budget, e.g. the scans of all the scanners of a service.
+        // Every device runs one job at a time, its jobs queued in the order of their priority, the same priority first come first served.
+        // When a job finishes, the job started next is the one of the highest priority, then the oldest, among the devices idle,
+        // as long as fewer than maxActiveJobs jobs are running. Priorities are strict, a job waits as long as others of a higher one are ready.
+        // The pages of the jobs are processed under a separate limit, see GetProcessingLimit(), so that the processing
+        // of the pages acquired does not take the CPU from the transfers running.
+        // The scheduler does not run the jobs itself: a job is handed to its handler, which posts it to the thread of the device
+        class CJobScheduler
+        {
+        public:
+            typedef std::chrono::steady_clock Clock;
+            // Called once per job, outside of the lock, on the thread submitting, finishing or cancelling a job.
+            // The state is Running if the job may start: the handler must not block and Finish() must be called once the job is done.
+            // The state is Cancelled if the job has been cancelled while queued
+            typedef std::function<void(const JobMetrics& job)> JobHandler;
+
+            explicit CJobScheduler(const JobSchedulerOptions& options = JobSchedulerOptions());
+
+            CJobScheduler(const CJobScheduler&) = delete;
+            CJobScheduler& operator=(const CJobScheduler&) = delete;
+
+            // Queue a job of the device, a higher priority runs first. Returns the ID of the job, the handler may have been called already
+            uint64_t Submit(const std::wstring& deviceId, int priority, JobHandler handler);
+            // The job has run, the next ones are started. Returns its metrics
+            JobMetrics Finish(uint64_t jobId);
+
+            // Remove a job queued, false if it is not queued anymore. The jobs running are cancelled by their device
+            bool Cancel(uint64_t jobId);
+            // The jobs of the device queued, returns how many have been removed
+            size_t CancelDevice(const std::wstring& deviceId);
+
+            // Raising maxActiveJobs starts the jobs ready at once
+            void SetOptions(const JobSchedulerOptions& options);
+            JobSchedulerOptions GetOptions() const;
+            JobSchedulerStats GetStats() const;
+
+            // To be set as PipelineOptions::processingLimit of the jobs
+            std::shared_ptr<CConcurrencyLimit> GetProcessingLimit() const;
+
+        private:
+            struct Job
+            {
+                JobMetrics metrics;
+                JobHandler handler;
+                Clock::time_point submitTime;
+                Clock::time_point startTime;
+            };
+
+            struct DeviceQueue
+            {
+                std::deque<Job> jobs;       // by priority, then submitted
+                uint64_t activeJobId = 0;   // 0 if idle
+            };
+
+            // Take the jobs which may start now out of the queues, called with the lock held
+            void TakeReadyJobs(std::vector<Job>& ready);
+            // Call the handlers of the jobs taken, outside of the lock
+            static void Notify(const std::vector<Job>& jobs);
+
+        private:
+            mutable std::mutex m_lock;
+            JobSchedulerOptions m_options;
+            std::map<std::wstring, DeviceQueue> m_devices;      // the devices with jobs queued or running
+            std::map<uint64_t, Job> m_activeJobs;
+            uint64_t m_nextJobId;
+            JobSchedulerStats m_stats;      // guarded by m_lock, without the processing stats
+
+            std::shared_ptr<CConcurrencyLimit> m_pProcessingLimit;
+        };
+    }
+}
@@ -0,0 +1,520 @@
+#include "stdafx.h"
+#include "jpegEncoder.h"
+
+#include <cmath>
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            // zigzag position of each coefficient in natural order
+            const uint8_t ZigZag[64] =
+            {
+                0, 1, 5, 6, 14, 15, 27, 28,
+                2, 4, 7, 13, 16, 26, 29, 42,
+                3, 8, 12, 17, 25, 30, 41, 43,
+                9, 11, 18, 24, 31, 40, 44, 53,
+                10, 19, 23, 32, 39, 45, 52, 54,
+                20, 22, 33, 38, 46, 51, 55, 60,
+                21, 34, 37, 47, 50, 56, 59, 61,
+                35, 36, 48, 49, 57, 58, 62, 63,
+            };
+
+            // the quantization tables of the JPEG specification(Annex K), natural order
+            const uint8_t LumaQuantTable[64] =
+            {
+                16, 11, 10, 16, 24, 40, 51, 61,
+                12, 12, 14, 19, 26, 58, 60, 55,
+                14, 13, 16, 24, 40, 57, 69, 56,
+                14, 17, 22, 29, 51, 87, 80, 62,
+                18, 22, 37, 56, 68, 109, 103, 77,
+                24, 35, 55, 64, 81, 104, 113, 92,
+                49, 64, 78, 87, 103, 121, 120, 101,
+                72, 92, 95, 98, 112, 100, 103, 99,
+            };
+            const uint8_t ChromaQuantTable[64] =
+            {
+                17, 18, 24, 47, 99, 99, 99, 99,
+                18, 21, 26, 66, 99, 99, 99, 99,
+                24, 26, 56, 99, 99, 99, 99, 99,
+                47, 66, 99, 99, 99, 99, 99, 99,
+                99, 99, 99, 99, 99, 99, 99, 99,
+                99, 99, 99, 99, 99, 99, 99, 99,
+                99, 99, 99, 99, 99, 99, 99, 99,
+                99, 99, 99, 99, 99, 99, 99, 99,
+            };
+
+            // the Huffman tables of the JPEG specification(Annex K)
+            const uint8_t LumaDCBits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+            const uint8_t LumaDCValues[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+            const uint8_t ChromaDCBits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+            const uint8_t ChromaDCValues[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+            const uint8_t LumaACBits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+            const uint8_t LumaACValues[162] =
+            {
+                0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+                0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+                0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+                0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+                0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+                0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+                0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+                0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+                0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+                0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+                0xf9, 0xfa,
+            };
+            const uint8_t ChromaACBits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+            const uint8_t ChromaACValues[162] =
+            {
+                0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+                0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+                0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+                0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+                0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+                0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+                0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+                0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+                0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+                0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+                0xf9, 0xfa,
+            };
+
+            struct HuffmanTable
+            {
+                uint16_t codes[256];
+                uint8_t sizes[256];
+            };
+
+            void BuildHuffmanTable(const uint8_t* bits, const uint8_t* values, HuffmanTable& table)
+            {
+                uint16_t code = 0;
+                size_t k = 0;
+                for (int length = 1; length <= 16; length++)
+                {
+                    for (int i = 0; i < bits[length - 1]; i++, k++)
+                    {
+                        table.codes[values[k]] = code++;
+                        table.sizes[values[k]] = uint8_t(length);
+                    }
+                    code <<= 1;
+                }
+            }
+
+            // Writes the entropy coded data with the 0xff bytes stuffed, the output is flushed to the buffer in chunks
+            class CJpegWriter
+            {
+            public:
+                explicit CJpegWriter(CMemoryBuffer& data)
+                    : m_data(data)
+                    , m_bitBuffer(0)
+                    , m_bitCount(0)
+                {
+                    m_bytes.reserve(FlushSize + 16);
+                }
+                ~CJpegWriter()
+                {
+                    Flush();
+                }
+
+                void PutByte(uint8_t value)
+                {
+                    m_bytes.push_back(value);
+                }
+                void PutWord(uint16_t value)
+                {
+                    m_bytes.push_back(uint8_t(value >> 8));
+                    m_bytes.push_back(uint8_t(value));
+                }
+                void PutBytes(const uint8_t* values, size_t size)
+                {
+                    m_bytes.insert(m_bytes.end(), values, values + size);
+                }
+
+                void PutBits(uint32_t code, int size)
+                {
+                    m_bitBuffer = (m_bitBuffer << size) | code;
+                    m_bitCount += size;
+                    while (m_bitCount >= 8)
+                    {
+                        uint8_t value = uint8_t(m_bitBuffer >> (m_bitCount - 8));
+                        m_bytes.push_back(value);
+                        if (value == 0xff)
+                        {
+                            m_bytes.push_back(0);
+                        }
+                        m_bitCount -= 8;
+                    }
+                    m_bitBuffer &= (1u << m_bitCount) - 1;
+
+                    if (m_bytes.size() >= FlushSize)
+                    {
+                        Flush();
+                    }
+                }
+
+                // pad the last byte with 1 bits
+                void AlignBits()
+                {
+                    if (m_bitCount)
+                    {
+                        PutBits((1u << (8 - m_bitCount)) - 1, 8 - m_bitCount);
+                    }
+                }
+
+                void Flush()
+                {
+                    if (!m_bytes.empty())
+                    {
+                        m_data.Write(m_bytes.data(), m_bytes.size());
+                        m_bytes.clear();
+                    }
+                }
+
+            private:
+                static const size_t FlushSize = 64 * 1024;
+
+                CMemoryBuffer& m_data;
+                std::vector<uint8_t> m_bytes;
+                uint32_t m_bitBuffer;
+                int m_bitCount;
+            };
+
+            // one dimensional AAN forward DCT, the scaling is folded into the quantization
+            inline void ForwardDCT(float* d, size_t step)
+            {
+                float tmp0 = d[0] + d[7 * step];
+                float tmp7 = d[0] - d[7 * step];
+                float tmp1 = d[1 * step] + d[6 * step];
+                float tmp6 = d[1 * step] - d[6 * step];
+                float tmp2 = d[2 * step] + d[5 * step];
+                float tmp5 = d[2 * step] - d[5 * step];
+                float tmp3 = d[3 * step] + d[4 * step];
+                float tmp4 = d[3 * step] - d[4 * step];
+
+                // even part
+                float tmp10 = tmp0 + tmp3;
+                float tmp13 = tmp0 - tmp3;
+                float tmp11 = tmp1 + tmp2;
+                float tmp12 = tmp1 - tmp2;
+
+                d[0] = tmp10 + tmp11;
+                d[4 * step] = tmp10 - tmp11;
+
+                float z1 = (tmp12 + tmp13) * 0.707106781f;
+                d[2 * step] = tmp13 + z1;
+                d[6 * step] = tmp13 - z1;
+
+                // odd part
+                tmp10 = tmp4 + tmp5;
+                tmp11 = tmp5 + tmp6;
+                tmp12 = tmp6 + tmp7;
+
+                float z5 = (tmp10 - tmp12) * 0.382683433f;
+                float z2 = tmp10 * 0.541196100f + z5;
+                float z4 = tmp12 * 1.306562965f + z5;
+                float z3 = tmp11 * 0.707106781f;
+
+                float z11 = tmp7 + z3;
+                float z13 = tmp7 - z3;
+
+                d[5 * step] = z13 + z2;
+                d[3 * step] = z13 - z2;
+                d[1 * step] = z11 + z4;
+                d[7 * step] = z11 - z4;
+            }
+
+            inline void PutValue(CJpegWriter& writer, const HuffmanTable& table, int run, int value)
+            {
+                int magnitude = value < 0 ? -value : value;
+                int bitCount = 0;
+                while (magnitude)
+                {
+                    bitCount++;
+                    magnitude >>= 1;
+                }
+
+                int symbol = (run << 4) | bitCount;
+                writer.PutBits(table.codes[symbol], table.sizes[symbol]);
+                if (bitCount)
+                {
+                    // negative values are written as the ones' complement
+                    int bits = value < 0 ? value - 1 : value;
+                    writer.PutBits(uint32_t(bits) & ((1u << bitCount) - 1), bitCount);
+                }
+            }
+
+            // Transform, quantize and write a block of level shifted samples in natural order.
+            // Returns the DC coefficient
+            int EncodeBlock(CJpegWriter& writer, float* block, const float* scale, int previousDC, const HuffmanTable& dcTable, const HuffmanTable& acTable)
+            {
+                for (size_t row = 0; row < 8; row++)
+                {
+                    ForwardDCT(block + row * 8, 1);
+                }
+                for (size_t column = 0; column < 8; column++)
+                {
+                    ForwardDCT(block + column, 8);
+                }
+
+                int coefficients[64];
+                for (int i = 0; i < 64; i++)
+                {
+                    float value = block[i] * scale[i];
+                    coefficients[ZigZag[i]] = int(value < 0 ? value - 0.5f : value + 0.5f);
+                }
+
+                PutValue(writer, dcTable, 0, coefficients[0] - previousDC);
+
+                int last = 63;
+                while (last > 0 && !coefficients[last])
+                {
+                    last--;
+                }
+
+                int run = 0;
+                for (int i = 1; i <= last; i++)
+                {
+                    if (!coefficients[i])
+                    {
+                        run++;
+                        continue;
+                    }
+
+                    // ZRL for every 16 zeros
+                    while (run >= 16)
+                    {
+                        writer.PutBits(acTable.codes[0xf0], acTable.sizes[0xf0]);
+                        run -= 16;
+                    }
+                    PutValue(writer, acTable, run, coefficients[i]);
+                    run = 0;
+                }
+
+                // EOB
+                if (last != 63)
+                {
+                    writer.PutBits(acTable.codes[0], acTable.sizes[0]);
+                }
+
+                return coefficients[0];
+            }
+
+            void BuildScaleTable(const uint8_t* quantTable, int scaleFactor, uint8_t* scaledTable, float* scale)
+            {
+                static const float AANScale[8] =
+                {
+                    1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+                    1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f,
+                };
+
+                for (int i = 0; i < 64; i++)
+                {
+                    int value = (quantTable[i] * scaleFactor + 50) / 100;
+                    value = value < 1 ? 1 : (value > 255 ? 255 : value);
+
+                    // written in zigzag order
+                    scaledTable[ZigZag[i]] = uint8_t(value);
+                    scale[i] = 1.0f / (value * AANScale[i / 8] * AANScale[i % 8]);
+                }
+            }
+
+            void WriteHuffmanTable(CJpegWriter& writer, uint8_t tableClassId, const uint8_t* bits, const uint8_t* values, size_t valueCount)
+            {
+                writer.PutByte(tableClassId);
+                writer.PutBytes(bits, 16);
+                writer.PutBytes(values, valueCount);
+            }
+        }
+
+        bool EncodeJpeg(const RawImage& image, int quality, CMemoryBuffer& data)
+        {
+            if (image.Empty() || image.width > 0xffff || image.height > 0xffff)
+            {
+                return false;
+            }
+
+            bool color = (image.format == PixelFormat::BGR24);
+
+            quality = quality < 1 ? 1 : (quality > 100 ? 100 : quality);
+            int scaleFactor = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+            uint8_t lumaTable[64];
+            uint8_t chromaTable[64];
+            float lumaScale[64];
+            float chromaScale[64];
+            BuildScaleTable(LumaQuantTable, scaleFactor, lumaTable, lumaScale);
+            BuildScaleTable(ChromaQuantTable, scaleFactor, chromaTable, chromaScale);
+
+            HuffmanTable lumaDC, lumaAC, chromaDC, chromaAC;
+            BuildHuffmanTable(LumaDCBits, LumaDCValues, lumaDC);
+            BuildHuffmanTable(LumaACBits, LumaACValues, lumaAC);
+            BuildHuffmanTable(ChromaDCBits, ChromaDCValues, chromaDC);
+            BuildHuffmanTable(ChromaACBits, ChromaACValues, chromaAC);
+
+            CJpegWriter writer(data);
+
+            // SOI, APP0(JFIF with the resolution in DPI)
+            static const uint8_t JFIFHeader[] = { 0xff, 0xd8, 0xff, 0xe0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1 };
+            writer.PutBytes(JFIFHeader, sizeof(JFIFHeader));
+            bool hasDpi = image.dpiX > 0 && image.dpiY > 0;
+            writer.PutByte(hasDpi ? 1 : 0);
+            writer.PutWord(hasDpi ? uint16_t(image.dpiX + 0.5) : 1);
+            writer.PutWord(hasDpi ? uint16_t(image.dpiY + 0.5) : 1);
+            writer.PutWord(0);
+
+            // DQT
+            writer.PutWord(0xffdb);
+            writer.PutWord(uint16_t(2 + (color ? 2 : 1) * 65));
+            writer.PutByte(0);
+            writer.PutBytes(lumaTable, 64);
+            if (color)
+            {
+                writer.PutByte(1);
+                writer.PutBytes(chromaTable, 64);
+            }
+
+            // SOF0
+            writer.PutWord(0xffc0);
+            writer.PutWord(uint16_t(8 + (color ? 3 : 1) * 3));
+            writer.PutByte(8);
+            writer.PutWord(uint16_t(image.height));
+            writer.PutWord(uint16_t(image.width));
+            if (color)
+            {
+                static const uint8_t Components[] = { 3, 1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1 };
+                writer.PutBytes(Components, sizeof(Components));
+            }
+            else
+            {
+                static const uint8_t Components[] = { 1, 1, 0x11, 0 };
+                writer.PutBytes(Components, sizeof(Components));
+            }
+
+            // DHT
+            writer.PutWord(0xffc4);
+            writer.PutWord(uint16_t(2 + (color ? 2 : 1) * (17 + 12 + 17 + 162)));
+            WriteHuffmanTable(writer, 0x00, LumaDCBits, LumaDCValues, sizeof(LumaDCValues));
+            WriteHuffmanTable(writer, 0x10, LumaACBits, LumaACValues, sizeof(LumaACValues));
+            if (color)
+            {
+                WriteHuffmanTable(writer, 0x01, ChromaDCBits, ChromaDCValues, sizeof(ChromaDCValues));
+                WriteHuffmanTable(writer, 0x11, ChromaACBits, ChromaACValues, sizeof(ChromaACValues));
+            }
+
+            // SOS
+            writer.PutWord(0xffda);
+            if (color)
+            {
+                static const uint8_t Scan[] = { 0, 12, 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
+                writer.PutBytes(Scan, sizeof(Scan));
+            }
+            else
+            {
+                static const uint8_t Scan[] = { 0, 8, 1, 1, 0x00, 0, 63, 0 };
+                writer.PutBytes(Scan, sizeof(Scan));
+            }
+
+            float block[64];
+            int lumaDCValue = 0;
+            uint32_t lastX = image.width - 1;
+            uint32_t lastY = image.height - 1;
+
+            if (!color)
+            {
+                for (uint32_t blockY = 0; blockY < image.height; blockY += 8)
+                {
+                    for (uint32_t blockX = 0; blockX < image.width; blockX += 8)
+                    {
+                        // the edges are padded by repeating the last pixels
+                        for (uint32_t y = 0; y < 8; y++)
+                        {
+                            const uint8_t* row = image.Row(blockY + y < lastY ? blockY + y : lastY);
+                            for (uint32_t x = 0; x < 8; x++)
+                            {
+                                block[y * 8 + x] = float(row[blockX + x < lastX ? blockX + x : lastX]) - 128.0f;
+                            }
+                        }
+                        lumaDCValue = EncodeBlock(writer, block, lumaScale, lumaDCValue, lumaDC, lumaAC);
+                    }
+                }
+            }
+            else
+            {
+                float lumaSamples[256];
+                float cbSamples[256];
+                float crSamples[256];
+                int cbDCValue = 0;
+                int crDCValue = 0;
+
+                for (uint32_t mcuY = 0; mcuY < image.height; mcuY += 16)
+                {
+                    for (uint32_t mcuX = 0; mcuX < image.width; mcuX += 16)
+                    {
+                        for (uint32_t y = 0; y < 16; y++)
+                        {
+                            const uint8_t* row = image.Row(mcuY + y < lastY ? mcuY + y : lastY);
+                            for (uint32_t x = 0; x < 16; x++)
+                            {
+                                const uint8_t* pixel = row + (mcuX + x < lastX ? mcuX + x : lastX) * 3;
+                                float b = pixel[0];
+                                float g = pixel[1];
+                                float r = pixel[2];
+
+                                size_t i = y * 16 + x;
+                                lumaSamples[i] = 0.29900f * r + 0.58700f * g + 0.11400f * b - 128.0f;
+                                cbSamples[i] = -0.16874f * r - 0.33126f * g + 0.50000f * b;
+                                crSamples[i] = 0.50000f * r - 0.41869f * g - 0.08131f * b;
+                            }
+                        }
+
+                        // four luma blocks
+                        for (uint32_t part = 0; part < 4; part++)
+                        {
+                            uint32_t offsetX = (part & 1) * 8;
+                            uint32_t offsetY = (part >> 1) * 8;
+                            for (uint32_t y = 0; y < 8; y++)
+                            {
+                                for (uint32_t x = 0; x < 8; x++)
+                                {
+                                    block[y * 8 + x] = lumaSamples[(offsetY + y) * 16 + offsetX + x];
+                                }
+                            }
+                            lumaDCValue = EncodeBlock(writer, block, lumaScale, lumaDCValue, lumaDC, lumaAC);
+                        }
+
+                        // the chroma is averaged over 2x2 pixels
+                        for (uint32_t y = 0; y < 8; y++)
+                        {
+                            for (uint32_t x = 0; x < 8; x++)
+                            {
+                                size_t i = (y * 2) * 16 + x * 2;
+                                block[y * 8 + x] = (cbSamples[i] + cbSamples[i + 1] + cbSamples[i + 16] + cbSamples[i + 17]) * 0.25f;
+                            }
+                        }
+                        cbDCValue = EncodeBlock(writer, block, chromaScale, cbDCValue, chromaDC, chromaAC);
+
+                        for (uint32_t y = 0; y < 8; y++)
+                        {
+                            for (uint32_t x = 0; x < 8; x++)
+                            {
+                                size_t i = (y * 2) * 16 + x * 2;
+                                block[y * 8 + x] = (crSamples[i] + crSamples[i + 1] + crSamples[i + 16] + crSamples[i + 17]) * 0.25f;
+                            }
+                        }
+                        crDCValue = EncodeBlock(writer, block, chromaScale, crDCValue, chromaDC, chromaAC);
+                    }
+                }
+            }
+
+            // EOI
+            writer.AlignBits();
+            writer.PutWord(0xffd9);
+            writer.Flush();
+            return true;
+        }
+    }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "memoryBuffer.h"
+#include "rawImage.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        // Baseline JPEG encoder without platform dependencies.
+        // Grayscale images are written with one component, color ones as YCbCr 4:2:0.
+        // quality: 1-100, scaled like the IJG tables.
+        // The data is appended to the buffer
+        bool EncodeJpeg(const RawImage& image, int quality, CMemoryBuffer& data);
+    }
+}
@@ -4,7 +4,13 @@
 
 #include "WIADeviceMgr.h"
 #include "asyncEvent.h"
+#include "chunkQueue.h"
+#include "spscRing.h"
+#include "taskQueue.h"
+#include "callTimings.h"
+#include "metrics.h"
 
+#include <cstring>
 #include <experimental/filesystem>
 
 #define CHECK_VALUE_TYPE(value, type, errMsg) \
@@ -20,212 +26,1917 @@ namespace scanner
     static bool g_bInit = false;
     // global COM environment
     static std::unique_ptr<util::COMEnvironment> g_comEnvironment;
+    // COM MTA thread running the jobs of the device manager
+    static std::unique_ptr<util::CTaskQueue> g_pManagerTaskQueue;
+
+    // the devices connected and disconnected, given to on("deviceAdded") and on("deviceRemoved") on the JavaScript thread
+    static std::shared_ptr<Nan::Callback> g_pDeviceAddedCallback;
+    static std::shared_ptr<Nan::Callback> g_pDeviceRemovedCallback;
+    static std::mutex g_lockDeviceChanges;
+    static std::vector<util::DeviceChange<WIADeviceProperties>> g_deviceChanges;
+    static std::unique_ptr<uvAsyncEvent> g_pDeviceChangeEvent;
 
 
     static void cleanup();
 
 
-    // Wrap WIA device handle to JavaScript
-    class WIADeviceJSWrap
-        : public Nan::ObjectWrap
+    // Hand a page buffer over to a Node.js Buffer without copying.
+    // The memory block is owned by V8 afterwards and freed by the garbage collector.
+    static v8::Local<v8::Object> PageBufferToJS(std::shared_ptr<util::CMemoryBuffer> buffer)
     {
-    public:
-        static NAN_MODULE_INIT(Init);
+        if (!buffer || !buffer->Size())
+        {
+            return Nan::NewBuffer(0).ToLocalChecked();
+        }
 
-        std::shared_ptr<CWIADevice> GetDevice() const;
-    private:
-        explicit WIADeviceJSWrap(std::shared_ptr<CWIADevice> device);
-        ~WIADeviceJSWrap();
+        size_t size = 0;
+        char* data = buffer->Detach(size);
 
-        static NAN_METHOD(NewInstance);
+        return Nan::NewBuffer(data, (uint32_t)size,
+            [](char* data, void* hint)
+        {
+            util::CMemoryBuffer::Free(data);
+        }, nullptr).ToLocalChecked();
+    }
 
-        static NAN_METHOD(Close);
+    static const struct
+    {
+        const char* name;
+        unsigned int flag;
+    } g_scanSettingNames[] =
+    {
+        { "format", SCAN_SETTING_IMAGE_FORMAT },
+        { "paper", SCAN_SETTING_PAPER_PROFILE },
+        { "color", SCAN_SETTING_COLOR_FORMAT },
+        { "brightness", SCAN_SETTING_BRIGHTNESS },
+        { "contrast", SCAN_SETTING_CONTRAST },
+        { "dpi", SCAN_SETTING_DPI },
+        { "pageCount", SCAN_SETTING_PAGE_COUNT },
+        { "document_handling", SCAN_SETTING_DOCUMENT_HANDLING },
+    };
 
-        static NAN_METHOD(ShowDeviceDlg);
-        static NAN_METHOD(SetCallback);
-        static NAN_METHOD(GetSources);
-        static NAN_METHOD(GetProperties);
-        static NAN_METHOD(SetProperties);
-        static NAN_METHOD(GetPreview);
-        static NAN_METHOD(IsFeeder);
-        static NAN_METHOD(DoScan);
-        static NAN_METHOD(Cancel);
+    static v8::Local<v8::Object> ScanSettingsToJS(const ScanSettings& settings)
+    {
+        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
 
-    private:
-        std::shared_ptr<CWIADevice> m_device;
+        // output file format
+        retObject->Set(Nan::New("format").ToLocalChecked(), Nan::New(util::WStringToUTF8(settings.imageFormat)).ToLocalChecked());
 
-    private:
-        std::shared_ptr<Nan::Callback> m_pScanCompleteCallback;
-        std::shared_ptr<Nan::Callback> m_pScanProgressCallback;
-    private:
+        // paper profile
+        retObject->Set(Nan::New("paper").ToLocalChecked(), Nan::New(util::WStringToUTF8(settings.paperProfile)).ToLocalChecked());
 
-        static v8::Persistent<v8::Function> constructor;
-    };
-    v8::Persistent<v8::Function> WIADeviceJSWrap::constructor;
+        // color mode
+        retObject->Set(Nan::New("color").ToLocalChecked(), Nan::New(util::WStringToUTF8(settings.colorFormat)).ToLocalChecked());
 
-    NAN_MODULE_INIT(WIADeviceJSWrap::Init)
-    {
-        v8::Isolate* isolate = target->GetIsolate();
-        // Prepare constructor template
-        v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(NewInstance);
-        tpl->SetClassName(v8::String::NewFromUtf8(isolate, "WIADevice"));
-        tpl->InstanceTemplate()->SetInternalFieldCount(1);
+        // brightness range
+        v8::Local<v8::Object> brightnessRangeObject = Nan::New<v8::Object>();
+        brightnessRangeObject->Set(Nan::New("min").ToLocalChecked(), Nan::New(settings.brightnessRange.min / settings.brightnessRange.step));
+        brightnessRangeObject->Set(Nan::New("max").ToLocalChecked(), Nan::New(settings.brightnessRange.max / settings.brightnessRange.step));
+        retObject->Set(Nan::New("brightness_range").ToLocalChecked(), brightnessRangeObject);
 
-        // Prototype
+        // contrast range
+        v8::Local<v8::Object> contrastRangeObject = Nan::New<v8::Object>();
+        contrastRangeObject->Set(Nan::New("min").ToLocalChecked(), Nan::New(settings.contrastRange.min / settings.contrastRange.step));
+        contrastRangeObject->Set(Nan::New("max").ToLocalChecked(), Nan::New(settings.contrastRange.max / settings.contrastRange.step));
+        retObject->Set(Nan::New("contrast_range").ToLocalChecked(), contrastRangeObject);
 
-        Nan::SetPrototypeMethod(tpl, "close", Close);
+        // brightness
+        retObject->Set(Nan::New("brightness").ToLocalChecked(), Nan::New(settings.brightness));
 
-        Nan::SetPrototypeMethod(tpl, "showDeviceDlg", ShowDeviceDlg);
-        Nan::SetPrototypeMethod(tpl, "on", SetCallback);
-        Nan::SetPrototypeMethod(tpl, "getSources", GetSources);
-        Nan::SetPrototypeMethod(tpl, "getProperties", GetProperties);
-        Nan::SetPrototypeMethod(tpl, "setProperties", SetProperties);
-        Nan::SetPrototypeMethod(tpl, "getPreview", GetPreview);
-        Nan::SetPrototypeMethod(tpl, "isFeeder", IsFeeder);
-        Nan::SetPrototypeMethod(tpl, "doScan", DoScan);
-        Nan::SetPrototypeMethod(tpl, "cancel", Cancel);
+        // contrast
+        retObject->Set(Nan::New("contrast").ToLocalChecked(), Nan::New(settings.contrast));
 
-        constructor.Reset(isolate, tpl->GetFunction());
-        target->Set(Nan::New("WIADevice").ToLocalChecked(), tpl->GetFunction());
-    }
+        // DPI
+        retObject->Set(Nan::New("dpi").ToLocalChecked(), Nan::New(settings.dpi));
 
+        // page count
+        if (settings.pageCount)
+        {
+            retObject->Set(Nan::New("pageCount").ToLocalChecked(), Nan::New(settings.pageCount));
+        }
+        else
+        {
+            retObject->Set(Nan::New("pageCount").ToLocalChecked(), Nan::New("all").ToLocalChecked());
+        }
 
+        // document handling
+        retObject->Set(Nan::New("document_handling").ToLocalChecked(), Nan::New(util::WStringToUTF8(settings.documentHandling)).ToLocalChecked());
 
-    std::shared_ptr<CWIADevice> WIADeviceJSWrap::GetDevice() const
-    {
-        return m_device;
+        return retObject;
     }
 
-    WIADeviceJSWrap::WIADeviceJSWrap(std::shared_ptr<CWIADevice> device)
-        : m_device(device)
+    // Parse the object passed to setProperties().
+    // flags receives the settings present in the object.
+    // Returns false with a JavaScript exception thrown if a value has a wrong type
+    static bool ScanSettingsFromJS(v8::Local<v8::Object> paramObj, ScanSettings& settings, unsigned int& flags)
     {
-        assert(m_device);
+        flags = 0;
+
+        auto readString = [&paramObj](const char* name, std::wstring& value, bool& present) -> bool
+        {
+            v8::Local<v8::Value> jsValue = paramObj->Get(Nan::New(name).ToLocalChecked());
+            present = !jsValue->IsNullOrUndefined();
+            if (!present)
+            {
+                return true;
+            }
+            if (!jsValue->IsString())
+            {
+                Nan::ThrowTypeError((std::string("type \"string\" expected in value \"") + name + "\"").c_str());
+                return false;
+            }
+            value = util::WStringFromUTF8(*v8::String::Utf8Value(jsValue));
+            return true;
+        };
+
+        auto readNumber = [&paramObj](const char* name, int& value, bool& present) -> bool
+        {
+            v8::Local<v8::Value> jsValue = paramObj->Get(Nan::New(name).ToLocalChecked());
+            present = !jsValue->IsNullOrUndefined();
+            if (!present)
+            {
+                return true;
+            }
+            if (!jsValue->IsNumber())
+            {
+                Nan::ThrowTypeError((std::string("type \"number\" expected in value \"") + name + "\"").c_str());
+                return false;
+            }
+            value = (int)jsValue->IntegerValue();
+            return true;
+        };
+
+        bool present = false;
+
+        // output file format
+        if (!readString("format", settings.imageFormat, present))
+        {
+            return false;
+        }
+        if (present)
+        {
+            flags |= SCAN_SETTING_IMAGE_FORMAT;
+        }
+
+        // paper profile
+        if (!readString("paper", settings.paperProfile, present))
+        {
+            return false;
+        }
+        if (present)
+        {
+            flags |= SCAN_SETTING_PAPER_PROFILE;
+        }
+
+        // color mode
+        if (!readString("color", settings.colorFormat, present))
+        {
+            return false;
+        }
+        if (present)
+        {
+            flags |= SCAN_SETTING_COLOR_FORMAT;
+        }
+
+        // brightness
+        if (!readNumber("brightness", settings.brightness, present))
+        {
+            return false;
+        }
+        if (present)
+        {
+            flags |= SCAN_SETTING_BRIGHTNESS;
+        }
+
+        // contrast
+        if (!readNumber("contrast", settings.contrast, present))
+        {
+            return false;
+        }
+        if (present)
+        {
+            flags |= SCAN_SETTING_CONTRAST;
+        }
+
+        // DPI
+        if (!readNumber("dpi", settings.dpi, present))
+        {
+            return false;
+        }
+        if (present)
+        {
+            flags |= SCAN_SETTING_DPI;
+        }
+
+        // page count
+        {
+            v8::Local<v8::Value> pageCountValue = paramObj->Get(Nan::New("pageCount").ToLocalChecked());
+            if (!pageCountValue->IsNullOrUndefined())
+            {
+                settings.pageCount = 0;
+                if (pageCountValue->IsString())
+                {
+                    std::string count = *v8::String::Utf8Value(v8::Local<v8::String>::Cast(pageCountValue));
+                    if (count == "all")
+                    {
+                        settings.pageCount = 0;
+                    }
+                }
+                else if (pageCountValue->IsNumber())
+                {
+                    settings.pageCount = (int)pageCountValue->IntegerValue();
+                }
+                else
+                {
+                    Nan::ThrowTypeError("type \"number\" or \"string\" expected in value \"pageCount\"");
+                    return false;
+                }
+                flags |= SCAN_SETTING_PAGE_COUNT;
+            }
+        }
+
+        // document handling
+        if (!readString("document_handling", settings.documentHandling, present))
+        {
+            return false;
+        }
+        if (present)
+        {
+            flags |= SCAN_SETTING_DOCUMENT_HANDLING;
+        }
+
+        return true;
     }
-    WIADeviceJSWrap::~WIADeviceJSWrap()
+
+    // { <setting name>: <succeeded> } for every setting requested
+    static v8::Local<v8::Object> ScanSettingsResultToJS(unsigned int flags, unsigned int succeeded)
     {
+        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
 
+        for (const auto& setting : g_scanSettingNames)
+        {
+            if (flags & setting.flag)
+            {
+                retObject->Set(Nan::New(setting.name).ToLocalChecked(), Nan::New((succeeded & setting.flag) != 0));
+            }
+        }
+        return retObject;
     }
 
-    NAN_METHOD(WIADeviceJSWrap::NewInstance)
+    // Options of the page pipeline, returns false if an error has been thrown
+    static bool PipelineOptionsFromJS(v8::Local<v8::Object> pipelineObj, util::PipelineOptions& options)
     {
-        v8::Isolate* isolate = info.GetIsolate();
+        // returns false if the value has a wrong type, the values absent are left unchanged
+        auto readValue = [&pipelineObj](const char* name, bool (v8::Value::*isType)() const, const char* typeName, v8::Local<v8::Value>& value) -> bool
+        {
+            value = pipelineObj->Get(Nan::New(name).ToLocalChecked());
+            if (!value->IsNullOrUndefined() && !((*value)->*isType)())
+            {
+                Nan::ThrowTypeError((std::string("type \"") + typeName + "\" expected in value \"pipeline." + name + "\".").c_str());
+                return false;
+            }
+            return true;
+        };
 
-        if (info.IsConstructCall()) {
-            // Invoked as constructor: `new MyObject(...)`
-            CHECK_VALUE_TYPE(info[0], String, "type \"string\" expected in argument 1.");
+        v8::Local<v8::Value> value;
 
-            v8::Local<v8::String> deviceUUIDValue = v8::Local<v8::String>::Cast(info[0]);
-            std::wstring deviceUUID = util::WStringFromUTF8(*v8::String::Utf8Value(deviceUUIDValue));
+        if (!readValue("removeBlankPages", &v8::Value::IsBoolean, "boolean", value))
+        {
+            return false;
+        }
+        if (!value->IsNullOrUndefined())
+        {
+            options.removeBlankPages = value->BooleanValue();
+        }
+
+        // pages with less dark pixels than this ratio are blank
+        if (!readValue("blankInkRatio", &v8::Value::IsNumber, "number", value))
+        {
+            return false;
+        }
+        if (!value->IsNullOrUndefined())
+        {
+            options.blankPage.maxInkRatio = value->NumberValue();
+        }
+
+        // pixels darker than this are ink
+        if (!readValue("blankDarkThreshold", &v8::Value::IsNumber, "number", value))
+        {
+            return false;
+        }
+        if (!value->IsNullOrUndefined())
+        {
+            int64_t threshold = value->IntegerValue();
+            if (threshold < 0 || threshold > 255)
+            {
+                Nan::ThrowRangeError("value \"pipeline.blankDarkThreshold\" must be between 0 and 255.");
+                return false;
+            }
+            options.blankPage.darkThreshold = uint8_t(threshold);
+        }
+
+        // ratio of the borders ignored on each side
+        if (!readValue("blankMargin", &v8::Value::IsNumber, "number", value))
+        {
+            return false;
+        }
+        if (!value->IsNullOrUndefined())
+        {
+            double margin = value->NumberValue();
+            if (margin < 0 || margin >= 0.5)
+            {
+                Nan::ThrowRangeError("value \"pipeline.blankMargin\" must be at least 0 and less than 0.5.");
+                return false;
+            }
+            options.blankPage.marginRatio = margin;
+        }
+
+        if (!readValue("deskew", &v8::Value::IsBoolean, "boolean", value))
+        {
+            return false;
+        }
+        if (!value->IsNullOrUndefined())
+        {
+            options.deskew = value->BooleanValue();
+        }
+
+        if (!readValue("maxSkewAngle", &v8::Value::IsNumber, "number", value))
+        {
+            return false;
+        }
+        if (!value->IsNullOrUndefined())
+        {
+            options.maxSkewAngle = value->NumberValue();
+        }
+
+        // every page is encoded again in the format
+        if (!readValue("format", &v8::Value::IsString, "string", value))
+        {
+            return false;
+        }
+        if (!value->IsNullOrUndefined())
+        {
+            options.imageFormat = util::WStringFromUTF8(*v8::String::Utf8Value(value));
+            options.recompress = true;
+        }
+
+        if (!readValue("quality", &v8::Value::IsNumber, "number", value))
+        {
+            return false;
+        }
+        if (!value->IsNullOrUndefined())
+        {
+            options.quality = (int)value->IntegerValue();
+        }
+
+        // the longer side of the thumbnails made of every page
+        if (!readValue("thumbnails", &v8::Value::IsArray, "array", value))
+        {
+            return false;
+        }
+        if (!value->IsNullOrUndefined())
+        {
+            v8::Local<v8::Array> sizes = v8::Local<v8::Array>::Cast(value);
+            if (sizes->Length() > 3)
+            {
+                Nan::ThrowRangeError("value \"pipeline.thumbnails\" must have 3 sizes at most.");
+                return false;
+            }
+            options.thumbnailSizes.clear();
+            for (uint32_t i = 0; i < sizes->Length(); i++)
+            {
+                v8::Local<v8::Value> size = sizes->Get(i);
+                if (!size->IsNumber() || size->IntegerValue() < 16 || size->IntegerValue() > 8192)
+                {
+                    Nan::ThrowRangeError("the sizes of \"pipeline.thumbnails\" must be numbers between 16 and 8192.");
+                    return false;
+                }
+                options.thumbnailSizes.push_back(uint32_t(size->IntegerValue()));
+            }
+        }
+
+        if (!readValue("thumbnailFormat", &v8::Value::IsString, "string", value))
+        {
+            return false;
+        }
+        if (!value->IsNullOrUndefined())
+        {
+            options.thumbnailFormat = util::WStringFromUTF8(*v8::String::Utf8Value(value));
+        }
+
+        if (!readValue("threads", &v8::Value::IsNumber, "number", value))
+        {
+            return false;
+        }
+        if (!value->IsNullOrUndefined())
+        {
+            int64_t threads = value->IntegerValue();
+            if (threads < 0)
+            {
+                Nan::ThrowRangeError("value \"pipeline.threads\" must not be negative.");
+                return false;
+            }
+            options.threadCount = size_t(threads);
+        }
+
+        return true;
+    }
+
+    static v8::Local<v8::Object> PipelineStatsToJS(const util::PipelineStats& stats)
+    {
+        v8::Local<v8::Object> statsObject = Nan::New<v8::Object>();
+        statsObject->Set(Nan::New("pages").ToLocalChecked(), Nan::New(double(stats.pages)));
+        statsObject->Set(Nan::New("blankPages").ToLocalChecked(), Nan::New(double(stats.blankPages)));
+        statsObject->Set(Nan::New("deskewedPages").ToLocalChecked(), Nan::New(double(stats.deskewedPages)));
+        statsObject->Set(Nan::New("encodedPages").ToLocalChecked(), Nan::New(double(stats.encodedPages)));
+        statsObject->Set(Nan::New("failedPages").ToLocalChecked(), Nan::New(double(stats.failedPages)));
+        statsObject->Set(Nan::New("thumbnails").ToLocalChecked(), Nan::New(double(stats.thumbnails)));
+        statsObject->Set(Nan::New("totalThumbnailMs").ToLocalChecked(), Nan::New(stats.totalThumbnailMs));
+        statsObject->Set(Nan::New("totalProcessMs").ToLocalChecked(), Nan::New(stats.totalProcessMs));
+        statsObject->Set(Nan::New("maxProcessMs").ToLocalChecked(), Nan::New(stats.maxProcessMs));
+        statsObject->Set(Nan::New("stolenTasks").ToLocalChecked(), Nan::New(double(stats.pool.stolen)));
+        return statsObject;
+    }
+
+    // The thumbnails of a page, the largest first. The buffers are copied if they are delivered again later
+    static v8::Local<v8::Array> ThumbnailsToJS(const std::vector<util::PageThumbnail>& thumbnails, bool copy)
+    {
+        v8::Local<v8::Array> thumbnailsArray = Nan::New<v8::Array>();
+        for (size_t i = 0; i < thumbnails.size(); i++)
+        {
+            const util::PageThumbnail& thumbnail = thumbnails[i];
+            v8::Local<v8::Object> thumbnailObject = Nan::New<v8::Object>();
+            thumbnailObject->Set(Nan::New("width").ToLocalChecked(), Nan::New(thumbnail.width));
+            thumbnailObject->Set(Nan::New("height").ToLocalChecked(), Nan::New(thumbnail.height));
+            v8::Local<v8::Object> buffer = (copy && thumbnail.data) ?
+                Nan::CopyBuffer(thumbnail.data->Data(), uint32_t(thumbnail.data->Size())).ToLocalChecked() :
+                PageBufferToJS(thumbnail.data);
+            thumbnailObject->Set(Nan::New("data").ToLocalChecked(), buffer);
+            thumbnailsArray->Set(i, thumbnailObject);
+        }
+        return thumbnailsArray;
+    }
+
+    // the digests computed, set on the object of a page
+    static void DigestToJS(const util::ContentDigest& digest, v8::Local<v8::Object> object)
+    {
+        if (!digest.sha256.empty())
+        {
+            object->Set(Nan::New("sha256").ToLocalChecked(), Nan::New(digest.sha256).ToLocalChecked());
+        }
+        if (!digest.xxh64.empty())
+        {
+            object->Set(Nan::New("xxh64").ToLocalChecked(), Nan::New(digest.xxh64).ToLocalChecked());
+        }
+    }
+
+    static v8::Local<v8::Object> SourcesToJS(const std::vector<std::wstring>& sources)
+    {
+        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+        v8::Local<v8::Array> sourcesArray = Nan::New<v8::Array>();
+
+        for (size_t i = 0; i < sources.size(); i++)
+        {
+            sourcesArray->Set(i, Nan::New(util::WStringToUTF8(sources[i])).ToLocalChecked());
+        }
+
+        retObject->Set(Nan::New("sources").ToLocalChecked(), sourcesArray);
+        return retObject;
+    }
+
+    static v8::Local<v8::Object> DeviceToJS(const std::shared_ptr<WIADeviceProperties>& device)
+    {
+        v8::Local<v8::Object> deviceInfo = Nan::New<v8::Object>();
+
+        deviceInfo->Set(Nan::New("deviceUUID").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->deviceUUID)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("manufacturer").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->manufacturer)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("description").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->description)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("deviceType").ToLocalChecked(), Nan::New(device->type));
+        deviceInfo->Set(Nan::New("portName").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->port)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("deviceName").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->deviceName)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("serverName").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->server)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("remoteDeviceId").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->remoteDeviceId)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("uiCLSID").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->uiClassId)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("hardwareConfig").ToLocalChecked(), Nan::New(device->hardwareConfig));
+        deviceInfo->Set(Nan::New("baudrate").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->baudrate)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("STIGenericCapabilities").ToLocalChecked(), Nan::New(device->STIGenericCapabilities));
+        deviceInfo->Set(Nan::New("wiaVersion").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->WIAVersion)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("driverVersion").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->DriverVersion)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("PnPIDString").ToLocalChecked(), Nan::New(util::WStringToUTF8(device->PnPIDString)).ToLocalChecked());
+        deviceInfo->Set(Nan::New("STIDriverVersion").ToLocalChecked(), Nan::New(device->STIDriverVersion));
+
+        return deviceInfo;
+    }
+
+    static v8::Local<v8::Array> DevicesToJS(const std::vector<std::shared_ptr<WIADeviceProperties>>& devices)
+    {
+        v8::Local<v8::Array> retDevicesInfo = Nan::New<v8::Array>();
+
+        for (size_t i = 0; i < devices.size(); i++)
+        {
+            retDevicesInfo->Set(i, DeviceToJS(devices[i]));
+        }
+
+        return retDevicesInfo;
+    }
+
+    // A job run on the worker thread of a device, the counterpart of Nan::AsyncWorker.
+    // Execute() runs on the device thread, HandleOKCallback() runs on the JavaScript thread afterwards.
+    class DeviceWorker
+    {
+    public:
+        DeviceWorker()
+        {
+        }
+        virtual ~DeviceWorker()
+        {
+        }
+
+        DeviceWorker(const DeviceWorker&) = delete;
+        DeviceWorker& operator=(const DeviceWorker&) = delete;
+
+        virtual void Execute() = 0;
+        virtual void HandleOKCallback() = 0;
+        // Called instead of HandleOKCallback() if Execute() has thrown
+        virtual void HandleErrorCallback()
+        {
+        }
+
+        const std::string& ErrorMessage() const
+        {
+            return m_errorMessage;
+        }
+        void SetErrorMessage(const std::string& errorMessage)
+        {
+            m_errorMessage = errorMessage;
+        }
+
+        // the job of the worker if it has gone through the scan scheduler
+        const util::JobMetrics& GetJob() const
+        {
+            return m_job;
+        }
+        void SetJob(const util::JobMetrics& job)
+        {
+            m_job = job;
+        }
+
+    private:
+        std::string m_errorMessage;
+        util::JobMetrics m_job;
+    };
+
+    // A DeviceWorker settling a Promise with the result of the job
+    class PromiseWorker : public DeviceWorker
+    {
+    public:
+        // On the JavaScript thread, the promise is settled in the async context of the call creating it
+        PromiseWorker()
+        {
+            v8::Local<v8::Object> resource = Nan::New<v8::Object>();
+            m_resource.Reset(resource);
+            m_asyncContext = node::EmitAsyncInit(v8::Isolate::GetCurrent(), resource, "WIADevice:Promise");
+            m_resolver.Reset(v8::Promise::Resolver::New(Nan::GetCurrentContext()).ToLocalChecked());
+        }
+        virtual ~PromiseWorker()
+        {
+            node::EmitAsyncDestroy(v8::Isolate::GetCurrent(), m_asyncContext);
+            m_resolver.Reset();
+            m_resource.Reset();
+        }
+
+        v8::Local<v8::Promise> GetPromise()
+        {
+            return Nan::New(m_resolver)->GetPromise();
+        }
+
+        void HandleOKCallback() override
+        {
+            // not called from JavaScript, the nextTick queue and the continuations of the promise run when the scope
+            // closes, as after any callback
+            node::CallbackScope scope(v8::Isolate::GetCurrent(), Nan::New(m_resource), m_asyncContext);
+            Nan::New(m_resolver)->Resolve(Nan::GetCurrentContext(), GetResult()).FromJust();
+        }
+
+        void HandleErrorCallback() override
+        {
+            node::CallbackScope scope(v8::Isolate::GetCurrent(), Nan::New(m_resource), m_asyncContext);
+            Nan::New(m_resolver)->Reject(Nan::GetCurrentContext(), Nan::Error(ErrorMessage().c_str())).FromJust();
+        }
+
+    protected:
+        // Convert the result of Execute() to JavaScript, called on the JavaScript thread
+        virtual v8::Local<v8::Value> GetResult() = 0;
+
+    private:
+        Nan::Persistent<v8::Object> m_resource;
+        node::async_context m_asyncContext;
+        Nan::Persistent<v8::Promise::Resolver> m_resolver;
+    };
+
+    // Wrap WIA device handle to JavaScript
+    class WIADeviceJSWrap
+        : public Nan::ObjectWrap
+    {
+    public:
+        static NAN_MODULE_INIT(Init);
+
+        std::shared_ptr<CWIADevice> GetDevice() const;
+    private:
+        explicit WIADeviceJSWrap(std::shared_ptr<CWIADevice> device);
+        ~WIADeviceJSWrap();
+
+        static NAN_METHOD(NewInstance);
+
+        static NAN_METHOD(Close);
+
+        static NAN_METHOD(ShowDeviceDlg);
+        static NAN_METHOD(SetCallback);
+        static NAN_METHOD(GetSources);
+        static NAN_METHOD(GetProperties);
+        static NAN_METHOD(SetProperties);
+        static NAN_METHOD(GetPreview);
+        static NAN_METHOD(IsFeeder);
+        static NAN_METHOD(DoScan);
+        static NAN_METHOD(Cancel);
+        static NAN_METHOD(Refresh);
+        static NAN_METHOD(GetDeviceStats);
+        // Record the phases of the scans on a timeline, returned by getTrace() in the trace event format of Chrome
+        static NAN_METHOD(SetTracing);
+        static NAN_METHOD(GetTrace);
+
+        // Promise-returning variants running on the worker thread of the device
+        static NAN_METHOD(GetSourcesAsync);
+        static NAN_METHOD(GetPropertiesAsync);
+        static NAN_METHOD(SetPropertiesAsync);
+        static NAN_METHOD(IsFeederAsync);
+
+        // Run a job on the worker thread of the device, the object takes the ownership of the worker
+        void QueueDeviceWorker(DeviceWorker* worker);
+        // The same once the scan scheduler starts the job. The worker fails if the job is cancelled while queued
+        void QueueScheduledWorker(DeviceWorker* worker, int priority);
+
+    private:
+        std::shared_ptr<CWIADevice> m_device;
+
+        // Every device has its own COM MTA thread, so that a long scan neither occupies
+        // the libuv threadpool nor delays the jobs of other devices
+        std::unique_ptr<util::CTaskQueue> m_pTaskQueue;
+
+    private:
+        std::shared_ptr<Nan::Callback> m_pScanCompleteCallback;
+        std::shared_ptr<Nan::Callback> m_pScanProgressCallback;
+        std::shared_ptr<Nan::Callback> m_pScanDataCallback;
+        std::shared_ptr<Nan::Callback> m_pScanPageCallback;
+    private:
+
+        static v8::Persistent<v8::Function> constructor;
+    };
+    v8::Persistent<v8::Function> WIADeviceJSWrap::constructor;
+
+    NAN_MODULE_INIT(WIADeviceJSWrap::Init)
+    {
+        v8::Isolate* isolate = target->GetIsolate();
+        // Prepare constructor template
+        v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(NewInstance);
+        tpl->SetClassName(v8::String::NewFromUtf8(isolate, "WIADevice"));
+        tpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+        // Prototype
+
+        Nan::SetPrototypeMethod(tpl, "close", Close);
+
+        Nan::SetPrototypeMethod(tpl, "showDeviceDlg", ShowDeviceDlg);
+        Nan::SetPrototypeMethod(tpl, "on", SetCallback);
+        Nan::SetPrototypeMethod(tpl, "getSources", GetSources);
+        Nan::SetPrototypeMethod(tpl, "getProperties", GetProperties);
+        Nan::SetPrototypeMethod(tpl, "setProperties", SetProperties);
+        Nan::SetPrototypeMethod(tpl, "getPreview", GetPreview);
+        Nan::SetPrototypeMethod(tpl, "isFeeder", IsFeeder);
+        Nan::SetPrototypeMethod(tpl, "doScan", DoScan);
+        Nan::SetPrototypeMethod(tpl, "cancel", Cancel);
+        Nan::SetPrototypeMethod(tpl, "refresh", Refresh);
+        Nan::SetPrototypeMethod(tpl, "getDeviceStats", GetDeviceStats);
+        Nan::SetPrototypeMethod(tpl, "setTracing", SetTracing);
+        Nan::SetPrototypeMethod(tpl, "getTrace", GetTrace);
+        Nan::SetPrototypeMethod(tpl, "getSourcesAsync", GetSourcesAsync);
+        Nan::SetPrototypeMethod(tpl, "getPropertiesAsync", GetPropertiesAsync);
+        Nan::SetPrototypeMethod(tpl, "setPropertiesAsync", SetPropertiesAsync);
+        Nan::SetPrototypeMethod(tpl, "isFeederAsync", IsFeederAsync);
+
+        constructor.Reset(isolate, tpl->GetFunction());
+        target->Set(Nan::New("WIADevice").ToLocalChecked(), tpl->GetFunction());
+    }
+
+
+
+    std::shared_ptr<CWIADevice> WIADeviceJSWrap::GetDevice() const
+    {
+        return m_device;
+    }
+
+    WIADeviceJSWrap::WIADeviceJSWrap(std::shared_ptr<CWIADevice> device)
+        : m_device(device)
+    {
+        assert(m_device);
+
+        // the COM environment lives as long as the thread
+        auto comEnvironment = std::make_shared<std::unique_ptr<util::COMEnvironment>>();
+        m_pTaskQueue.reset(new util::CTaskQueue(
+            [comEnvironment]()
+        {
+            comEnvironment->reset(new util::COMEnvironment(COINIT_MULTITHREADED));
+        },
+            [comEnvironment]()
+        {
+            comEnvironment->reset();
+        }));
+    }
+    WIADeviceJSWrap::~WIADeviceJSWrap()
+    {
+        // Every job holds a reference of the object, the queue is empty here
+        m_pTaskQueue.reset();
+    }
+
+    struct WorkerJob
+    {
+        std::unique_ptr<DeviceWorker> pWorker;
+        std::unique_ptr<uvAsyncEvent> pCompleteEvent;
+        std::function<void()> onComplete;
+    };
+
+    static void WorkerCompleteCallback(uv_async_t* handle)
+    {
+        WorkerJob* job = reinterpret_cast<WorkerJob*>(handle->data);
+
+        {
+            Nan::HandleScope scope;
+            if (job->pWorker->ErrorMessage().empty())
+            {
+                job->pWorker->HandleOKCallback();
+            }
+            else
+            {
+                job->pWorker->HandleErrorCallback();
+            }
+        }
+
+        if (job->onComplete)
+        {
+            job->onComplete();
+        }
+
+        // the uv handle is closed asynchronously
+        delete job;
+    }
+
+    // Run the worker on the thread of the queue, then complete it on the JavaScript thread.
+    // onComplete is called on the JavaScript thread after the worker has completed.
+    static void QueueWorker(util::CTaskQueue* queue, DeviceWorker* worker, std::function<void()> onComplete = nullptr)
+    {
+        assert(queue);
+        assert(worker);
+
+        WorkerJob* job = new WorkerJob();
+        job->pWorker.reset(worker);
+        job->pCompleteEvent.reset(new uvAsyncEvent(job, WorkerCompleteCallback));
+        job->onComplete = onComplete;
+
+        bool ret = queue->Post([job]()
+        {
+            try
+            {
+                job->pWorker->Execute();
+            }
+            catch (const std::exception& e)
+            {
+                job->pWorker->SetErrorMessage(e.what());
+            }
+
+            job->pCompleteEvent->NotifyComplete();
+        });
+
+        if (!ret)
+        {
+            job->pWorker->SetErrorMessage("the worker thread has been stopped");
+            job->pCompleteEvent->NotifyComplete();
+        }
+    }
+
+    void WIADeviceJSWrap::QueueDeviceWorker(DeviceWorker* worker)
+    {
+        // keep the JavaScript object alive until the job completes
+        Ref();
+        QueueWorker(m_pTaskQueue.get(), worker, [this]()
+        {
+            Unref();
+        });
+    }
+
+    void WIADeviceJSWrap::QueueScheduledWorker(DeviceWorker* worker, int priority)
+    {
+        assert(worker);
+
+        // the uv handle is created on the JavaScript thread, the job is posted to the device by the scheduler
+        Ref();
+        WorkerJob* job = new WorkerJob();
+        job->pWorker.reset(worker);
+        job->pCompleteEvent.reset(new uvAsyncEvent(job, WorkerCompleteCallback));
+        job->onComplete = [this]()
+        {
+            Unref();
+        };
+
+        util::CTaskQueue* queue = m_pTaskQueue.get();
+        util::CJobScheduler& scheduler = CWIADeviceMgr::GetInstance()->GetScanScheduler();
+        scheduler.Submit(m_device->GetDeviceUUID(), priority, [job, queue, &scheduler](const util::JobMetrics& metrics)
+        {
+            job->pWorker->SetJob(metrics);
+            if (metrics.state == util::JobState::Cancelled)
+            {
+                job->pWorker->SetErrorMessage("the scan has been cancelled before it started");
+                job->pCompleteEvent->NotifyComplete();
+                return;
+            }
+
+            // the next job starts as soon as this one is done, not once JavaScript has handled it
+            uint64_t jobId = metrics.id;
+            bool ret = queue->Post([job, jobId, &scheduler]()
+            {
+                try
+                {
+                    job->pWorker->Execute();
+                }
+                catch (const std::exception& e)
+                {
+                    job->pWorker->SetErrorMessage(e.what());
+                }
+
+                job->pWorker->SetJob(scheduler.Finish(jobId));
+                job->pCompleteEvent->NotifyComplete();
+            });
+
+            if (!ret)
+            {
+                job->pWorker->SetErrorMessage("the worker thread has been stopped");
+                job->pWorker->SetJob(scheduler.Finish(jobId));
+                job->pCompleteEvent->NotifyComplete();
+            }
+        });
+    }
+
+    NAN_METHOD(WIADeviceJSWrap::NewInstance)
+    {
+        v8::Isolate* isolate = info.GetIsolate();
+
+        if (info.IsConstructCall()) {
+            // Invoked as constructor: `new MyObject(...)`
+            CHECK_VALUE_TYPE(info[0], String, "type \"string\" expected in argument 1.");
+
+            v8::Local<v8::String> deviceUUIDValue = v8::Local<v8::String>::Cast(info[0]);
+            std::wstring deviceUUID = util::WStringFromUTF8(*v8::String::Utf8Value(deviceUUIDValue));
+
+            try
+            {
+                auto device = CWIADeviceMgr::GetInstance()->OpenWIADevice(deviceUUID);
+
+                if (!device)
+                {
+                    throw std::runtime_error("unable to open WIA device");
+                }
+
+                WIADeviceJSWrap* obj = new WIADeviceJSWrap(device);
+                obj->Wrap(info.This());
+                info.GetReturnValue().Set(info.This());
+            }
+            catch (const std::exception&)
+            {
+                char errBuf[500] = { 0 };
+                sprintf_s(errBuf, "Unable to open device \"%s\".", util::WStringToUTF8(deviceUUID).c_str());
+                Nan::ThrowError(errBuf);
+                return;
+            }
+        }
+        else {
+            // Invoked as plain function `MyObject(...)`, turn into construct call.
+            const int argc = 1;
+            v8::Local<v8::Value> argv[argc] = { info[0] };
+            v8::Local<v8::Context> context = isolate->GetCurrentContext();
+            v8::Local<v8::Function> cons = v8::Local<v8::Function>::New(isolate, constructor);
+            v8::Local<v8::Object> result =
+                cons->NewInstance(context, argc, argv).ToLocalChecked();
+            info.GetReturnValue().Set(result);
+        }
+    }
+
+    NAN_METHOD(WIADeviceJSWrap::Close)
+    {
+        v8::Isolate* isolate = info.GetIsolate();
+        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+        assert(obj);
+
+        if (!obj->GetDevice())
+        {
+            assert(false);
+            Nan::ThrowError("Object has been destroyed");
+            return;
+        }
+
+        // the jobs running keep the device until they complete, then it goes back to the pool
+        obj->m_device.reset();
+    }
+
+    NAN_METHOD(WIADeviceJSWrap::SetCallback)
+    {
+        v8::Isolate* isolate = info.GetIsolate();
+        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+
+        assert(obj);
+
+        CHECK_VALUE_TYPE(info[0], String, "type \"string\" expected in argument 1.");
+
+        v8::Local<v8::String> callbackTypeValue = v8::Local<v8::String>::Cast(info[0]);
+        std::string callbackType = *v8::String::Utf8Value(callbackTypeValue);
+
+        std::shared_ptr<Nan::Callback> callbk;
+
+        if (!info[1]->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(info[1], Function, "type \"function\" expected in argument 2.");
+            callbk = std::shared_ptr<Nan::Callback>(new Nan::Callback(Nan::To<v8::Function>(info[1]).ToLocalChecked()));
+        }
+
+        if (!obj->GetDevice())
+        {
+            assert(false);
+            Nan::ThrowError("Object has been destroyed");
+            return;
+        }
+
+        if (callbackType == "progress")
+        {
+            obj->m_pScanProgressCallback = callbk;
+        }
+        else if (callbackType == "complete")
+        {
+            obj->m_pScanCompleteCallback = callbk;
+        }
+        else if (callbackType == "data")
+        {
+            obj->m_pScanDataCallback = callbk;
+        }
+        else if (callbackType == "page")
+        {
+            obj->m_pScanPageCallback = callbk;
+        }
+
+    }
+
+    NAN_METHOD(WIADeviceJSWrap::ShowDeviceDlg)
+    {
+        v8::Isolate* isolate = info.GetIsolate();
+        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+        assert(obj);
+
+        HWND parentHWND = 0;
+
+        // HWND handle
+        if (!info[0]->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(info[0], Object, "type \"Object\" expected in argument 1.");
+            parentHWND = *(HWND*)node::Buffer::Data(info[1]);
+        }
+        CHECK_VALUE_TYPE(info[1], String, "type \"string\" expected in argument 2.");
+        CHECK_VALUE_TYPE(info[2], String, "type \"string\" expected in argument 3.");
+
+        v8::Local<v8::String> recvFolderValue = v8::Local<v8::String>::Cast(info[1]);
+        v8::Local<v8::String> filenameTemplateValue = v8::Local<v8::String>::Cast(info[2]);
+
+        std::wstring recvFolder = util::WStringFromUTF8(*v8::String::Utf8Value(recvFolderValue));
+        std::wstring filenameTemplate = util::WStringFromUTF8(*v8::String::Utf8Value(filenameTemplateValue));
+
+        if (!obj->GetDevice())
+        {
+            assert(false);
+            Nan::ThrowError("Object has been destroyed");
+            return;
+        }
+
+        // Open the scan dialog provided by Windows. Do modal loop here
+        std::vector<std::wstring> outFilepaths;
+        HRESULT hr = obj->GetDevice()->ShowDeviceDlg(parentHWND, recvFolder, filenameTemplate, outFilepaths);
+
+        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+        v8::Local<v8::Array> filesArray = Nan::New<v8::Array>();
+
+        for (size_t i = 0; i < outFilepaths.size(); i++)
+        {
+            filesArray->Set(i, Nan::New(util::WStringToUTF8(outFilepaths[i])).ToLocalChecked());
+        }
+
+        retObject->Set(Nan::New("files").ToLocalChecked(), filesArray);
+        retObject->Set(Nan::New("retCode").ToLocalChecked(), Nan::New(hr));
+        retObject->Set(Nan::New("errorMsg").ToLocalChecked(), Nan::New(util::WStringToUTF8(util::GetWIAErrorStr(hr))).ToLocalChecked());
+
+        info.GetReturnValue().Set(retObject);
+    }
+
+    NAN_METHOD(WIADeviceJSWrap::GetSources)
+    {
+        v8::Isolate* isolate = info.GetIsolate();
+        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+        assert(obj);
+
+        if (!obj->GetDevice())
+        {
+            assert(false);
+            Nan::ThrowError("Object has been destroyed");
+            return;
+        }
+
+        auto sources = obj->GetDevice()->GetImageSources();
+
+        info.GetReturnValue().Set(SourcesToJS(sources));
+    }
+
+    NAN_METHOD(WIADeviceJSWrap::GetProperties)
+    {
+        v8::Isolate* isolate = info.GetIsolate();
+        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+
+        assert(obj);
+
+        if (!obj->GetDevice())
+        {
+            assert(false);
+            Nan::ThrowError("Object has been destroyed");
+            return;
+        }
+
+        // all settings are read from the device in one round trip
+        ScanSettings settings = obj->GetDevice()->GetScanSettings();
+
+        info.GetReturnValue().Set(ScanSettingsToJS(settings));
+    }
+    NAN_METHOD(WIADeviceJSWrap::SetProperties)
+    {
+        v8::Isolate* isolate = info.GetIsolate();
+        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+        assert(obj);
+
+        if (!obj->GetDevice())
+        {
+            assert(false);
+            Nan::ThrowError("Object has been destroyed");
+            return;
+        }
+
+        CHECK_VALUE_TYPE(info[0], Object, "type \"object\" expected in argument 1.");
+
+        v8::Local<v8::Object> paramObj = v8::Local<v8::Object>::Cast(info[0]);
+
+        ScanSettings settings;
+        unsigned int flags = 0;
+        if (!ScanSettingsFromJS(paramObj, settings, flags))
+        {
+            return;
+        }
+
+        // all settings are written to the device in one round trip
+        unsigned int succeeded = obj->GetDevice()->SetScanSettings(settings, flags);
+
+        info.GetReturnValue().Set(ScanSettingsResultToJS(flags, succeeded));
+    }
+
+    NAN_METHOD(WIADeviceJSWrap::GetPreview)
+    {
+        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+        assert(obj);
+
+        if (!obj->GetDevice())
+        {
+            assert(false);
+            Nan::ThrowError("Object has been destroyed");
+            return;
+        }
+
+        int dpi = 75;
+        if (!info[0]->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(info[0], Object, "type \"object\" expected in argument 1.");
+            v8::Local<v8::Value> dpiValue = v8::Local<v8::Object>::Cast(info[0])->Get(Nan::New("dpi").ToLocalChecked());
+            if (!dpiValue->IsNullOrUndefined())
+            {
+                CHECK_VALUE_TYPE(dpiValue, Number, "type \"number\" expected in value \"dpi\".");
+                int64_t value = dpiValue->IntegerValue();
+                if (value <= 0 || value > INT_MAX)
+                {
+                    Nan::ThrowRangeError("value \"dpi\" is out of range.");
+                    return;
+                }
+                dpi = int(value);
+            }
+        }
+
+        std::shared_ptr<Nan::Callback> rowCallback;
+        if (!info[1]->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(info[1], Function, "type \"function\" expected in argument 2.");
+            rowCallback.reset(new Nan::Callback(Nan::To<v8::Function>(info[1]).ToLocalChecked()));
+        }
+
+        class GetPreviewWorker : public PromiseWorker
+        {
+        public:
+            GetPreviewWorker(std::shared_ptr<CWIADevice> device, int dpi, std::shared_ptr<Nan::Callback> rowCallback)
+                : m_device(device)
+                , m_dpi(dpi)
+                , m_rowCallback(rowCallback)
+                , m_hrResult(S_OK)
+                , m_rowWidth(0)
+            {
+                if (m_rowCallback)
+                {
+                    m_pRowEvent.reset(new uvAsyncEvent(this, rowsCallback));
+                }
+            }
+
+            void Execute() override
+            {
+                util::RawScanRowCallback onRow = nullptr;
+                if (m_pRowEvent)
+                {
+                    // on the thread of the transfer, the rows wait for the JavaScript thread in a batch
+                    onRow = [this](uint32_t y, const uint8_t* row, uint32_t width)
+                    {
+                        {
+                            std::lock_guard<std::mutex> g(m_lockRows);
+                            m_rowWidth = width;
+                            m_rowYs.push_back(y);
+                            m_rowData.insert(m_rowData.end(), row, row + width);
+                        }
+                        m_pRowEvent->NotifyComplete();
+                    };
+                }
+
+                m_hrResult = m_device->GetPreview(m_dpi, onRow, m_result);
+                if (m_hrResult == E_INVALIDARG)
+                {
+                    SetErrorMessage("value \"dpi\" is not supported");
+                }
+                else if (FAILED(m_hrResult))
+                {
+                    std::string errorMsg = util::WStringToUTF8(util::GetWIAErrorStr(m_hrResult));
+                    SetErrorMessage(errorMsg.empty() ? "the preview has failed" : errorMsg);
+                }
+            }
+
+            void HandleOKCallback() override
+            {
+                // the rows left are given before the promise is settled
+                EmitRows();
+                PromiseWorker::HandleOKCallback();
+            }
+
+            void HandleErrorCallback() override
+            {
+                EmitRows();
+                PromiseWorker::HandleErrorCallback();
+            }
+
+        protected:
+            v8::Local<v8::Value> GetResult() override
+            {
+                const util::RawImage& image = m_result.image;
+
+                v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+                retObject->Set(Nan::New("width").ToLocalChecked(), Nan::New(image.width));
+                retObject->Set(Nan::New("height").ToLocalChecked(), Nan::New(image.height));
+                retObject->Set(Nan::New("dpi").ToLocalChecked(), Nan::New(m_dpi));
+                retObject->Set(Nan::New("data").ToLocalChecked(), image.pixels.empty() ?
+                    Nan::NewBuffer(0).ToLocalChecked() :
+                    Nan::CopyBuffer(reinterpret_cast<const char*>(image.pixels.data()), uint32_t(image.pixels.size())).ToLocalChecked());
+                retObject->Set(Nan::New("firstRowMs").ToLocalChecked(), Nan::New(m_result.firstRowMs));
+                retObject->Set(Nan::New("totalMs").ToLocalChecked(), Nan::New(m_result.totalMs));
+                return retObject;
+            }
+
+        private:
+            static void rowsCallback(uv_async_t* handle)
+            {
+                auto* pThis = reinterpret_cast<GetPreviewWorker*>(handle->data);
+                pThis->EmitRows();
+            }
+
+            void EmitRows()
+            {
+                if (!m_pRowEvent)
+                {
+                    return;
+                }
+
+                std::vector<uint32_t> rowYs;
+                std::vector<uint8_t> rowData;
+                uint32_t width = 0;
+                {
+                    std::lock_guard<std::mutex> g(m_lockRows);
+                    rowYs.swap(m_rowYs);
+                    rowData.swap(m_rowData);
+                    width = m_rowWidth;
+                }
+
+                // Consecutive rows go in one call, top-down.
+                // Bottom-up data gives the rows from the last one up
+                for (size_t i = 0; i < rowYs.size();)
+                {
+                    size_t j = i + 1;
+                    int step = (j < rowYs.size() && rowYs[j] + 1 == rowYs[i]) ? -1 : 1;
+                    while (j < rowYs.size() && int64_t(rowYs[j]) == int64_t(rowYs[j - 1]) + step)
+                    {
+                        j++;
+                    }
+
+                    Nan::HandleScope scope;
+                    uint32_t count = uint32_t(j - i);
+                    v8::Local<v8::Object> buffer = Nan::NewBuffer(count * width).ToLocalChecked();
+                    char* dst = node::Buffer::Data(buffer);
+                    for (size_t r = 0; r < count; r++)
+                    {
+                        size_t src = (step > 0 ? i + r : j - 1 - r) * width;
+                        std::memcpy(dst + r * width, rowData.data() + src, width);
+                    }
+
+                    v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+                    retObject->Set(Nan::New("y").ToLocalChecked(), Nan::New(step > 0 ? rowYs[i] : rowYs[j - 1]));
+                    retObject->Set(Nan::New("count").ToLocalChecked(), Nan::New(count));
+                    retObject->Set(Nan::New("width").ToLocalChecked(), Nan::New(width));
+                    retObject->Set(Nan::New("data").ToLocalChecked(), buffer);
+
+                    int argc = 1;
+                    std::unique_ptr<v8::Local<v8::Value>[]> argv(new v8::Local<v8::Value>[argc]());
+                    argv[0] = retObject;
+                    Nan::Call(*m_rowCallback, argc, argv.get());
+                    i = j;
+                }
+            }
+
+        private:
+            std::shared_ptr<CWIADevice> m_device;
+            int m_dpi;
+            std::shared_ptr<Nan::Callback> m_rowCallback;
+            HRESULT m_hrResult;
+            PreviewResult m_result;
+
+            // members for the rows given as they come
+            std::unique_ptr<uvAsyncEvent> m_pRowEvent;
+            std::mutex m_lockRows;
+            std::vector<uint32_t> m_rowYs;
+            std::vector<uint8_t> m_rowData;     // the rows of m_rowYs one after another
+            uint32_t m_rowWidth;
+        };
+
+        auto* worker = new GetPreviewWorker(obj->GetDevice(), dpi, rowCallback);
+        info.GetReturnValue().Set(worker->GetPromise());
+        obj->QueueDeviceWorker(worker);
+    }
+
+    NAN_METHOD(WIADeviceJSWrap::IsFeeder)
+    {
+        v8::Isolate* isolate = info.GetIsolate();
+        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+        assert(obj);
+
+        if (!obj->GetDevice())
+        {
+            assert(false);
+            Nan::ThrowError("Object has been destroyed");
+            return;
+        }
+
+        info.GetReturnValue().Set(Nan::New(obj->GetDevice()->IsFeeder()));
+    }
+
+    NAN_METHOD(WIADeviceJSWrap::DoScan)
+    {
+        v8::Isolate* isolate = info.GetIsolate();
+        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+        assert(obj);
+
+        if (!obj->GetDevice())
+        {
+            assert(false);
+            Nan::ThrowError("Object has been destroyed");
+            return;
+        }
+
+        CHECK_VALUE_TYPE(info[0], Object, "type \"object\" expected in argument 1.");
+
+        if (!info[1]->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(info[1], Function, "type \"function\" expected in argument 2.");
+            std::shared_ptr<Nan::Callback> callbk(new Nan::Callback(Nan::To<v8::Function>(info[1]).ToLocalChecked()));
+            obj->m_pScanCompleteCallback = callbk;
+        }
+
+        v8::Local<v8::Object> paramObj = v8::Local<v8::Object>::Cast(info[0]);
+
+        ScanOptions options;
+
+        // output type(file/buffer)
+        v8::Local<v8::Value> outputValue = paramObj->Get(Nan::New("output").ToLocalChecked());
+        if (!outputValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(outputValue, String, "type \"string\" expected in value \"output\".");
+            std::string output = *v8::String::Utf8Value(v8::Local<v8::String>::Cast(outputValue));
+            if (output == "file")
+            {
+                options.output = ScanOutput::File;
+            }
+            else if (output == "buffer")
+            {
+                options.output = ScanOutput::Buffer;
+            }
+            else
+            {
+                Nan::ThrowTypeError("value \"output\" must be \"file\" or \"buffer\".");
+                return;
+            }
+        }
+
+        if (options.output == ScanOutput::File)
+        {
+            v8::Local<v8::String> saveDirValue = v8::Local<v8::String>::Cast(paramObj->Get(Nan::New("saveDir").ToLocalChecked()));
+            v8::Local<v8::String> saveFilenameValue = v8::Local<v8::String>::Cast(paramObj->Get(Nan::New("saveFilename").ToLocalChecked()));
+
+            CHECK_VALUE_TYPE(saveDirValue, String, "type \"string\" expected in value \"saveDir\".");
+            CHECK_VALUE_TYPE(saveFilenameValue, String, "type \"string\" expected in value \"saveFilename\".");
+
+            options.saveDirectory = util::WStringFromUTF8(*v8::String::Utf8Value(saveDirValue));
+            options.saveFilename = util::WStringFromUTF8(*v8::String::Utf8Value(saveFilenameValue));
+        }
+
+        // all pages in one multi-page file
+        v8::Local<v8::Value> documentValue = paramObj->Get(Nan::New("document").ToLocalChecked());
+        if (!documentValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(documentValue, String, "type \"string\" expected in value \"document\".");
+            std::string document = *v8::String::Utf8Value(v8::Local<v8::String>::Cast(documentValue));
+            if (document == "pdf")
+            {
+                options.document = util::DocumentFormat::Pdf;
+            }
+            else if (document == "tiff")
+            {
+                options.document = util::DocumentFormat::Tiff;
+            }
+            else
+            {
+                Nan::ThrowTypeError("value \"document\" must be \"pdf\" or \"tiff\".");
+                return;
+            }
+        }
+
+        // digests of the files or buffers, one algorithm or an array of them
+        v8::Local<v8::Value> hashValue = paramObj->Get(Nan::New("hash").ToLocalChecked());
+        if (!hashValue->IsNullOrUndefined())
+        {
+            v8::Local<v8::Array> hashArray;
+            if (hashValue->IsArray())
+            {
+                hashArray = v8::Local<v8::Array>::Cast(hashValue);
+            }
+            else
+            {
+                hashArray = Nan::New<v8::Array>();
+                hashArray->Set(0, hashValue);
+            }
+
+            for (uint32_t i = 0; i < hashArray->Length(); i++)
+            {
+                v8::Local<v8::Value> algorithmValue = hashArray->Get(i);
+                CHECK_VALUE_TYPE(algorithmValue, String, "type \"string\" expected in value \"hash\".");
+                std::string algorithm = *v8::String::Utf8Value(v8::Local<v8::String>::Cast(algorithmValue));
+                if (algorithm == "sha256")
+                {
+                    options.hash.sha256 = true;
+                }
+                else if (algorithm == "xxh64")
+                {
+                    options.hash.xxh64 = true;
+                }
+                else
+                {
+                    Nan::ThrowTypeError("value \"hash\" must be \"sha256\" or \"xxh64\".");
+                    return;
+                }
+            }
+        }
+
+        // when the files written behind the transfer are flushed to the disk
+        v8::Local<v8::Value> durabilityValue = paramObj->Get(Nan::New("durability").ToLocalChecked());
+        if (!durabilityValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(durabilityValue, String, "type \"string\" expected in value \"durability\".");
+            std::string durability = *v8::String::Utf8Value(v8::Local<v8::String>::Cast(durabilityValue));
+            if (durability == "none")
+            {
+                options.fileSink.durability = util::FileDurability::None;
+            }
+            else if (durability == "end")
+            {
+                options.fileSink.durability = util::FileDurability::FlushAtEnd;
+            }
+            else if (durability == "page")
+            {
+                options.fileSink.durability = util::FileDurability::FlushEachFile;
+            }
+            else
+            {
+                Nan::ThrowTypeError("value \"durability\" must be \"none\", \"end\" or \"page\".");
+                return;
+            }
+        }
+
+        // the transfer is recorded to be replayed without the scanner
+        v8::Local<v8::Value> traceValue = paramObj->Get(Nan::New("trace").ToLocalChecked());
+        if (!traceValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(traceValue, String, "type \"string\" expected in value \"trace\".");
+            options.traceFile = util::WStringFromUTF8(*v8::String::Utf8Value(v8::Local<v8::String>::Cast(traceValue)));
+        }
+        v8::Local<v8::Value> traceDataValue = paramObj->Get(Nan::New("traceData").ToLocalChecked());
+        if (!traceDataValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(traceDataValue, Boolean, "type \"boolean\" expected in value \"traceData\".");
+            options.traceData = traceDataValue->BooleanValue();
+        }
+
+        // how many bytes of page data can be queued for the event "data"
+        size_t dataQueueSize = 4 * 1024 * 1024;
+        v8::Local<v8::Value> dataQueueSizeValue = paramObj->Get(Nan::New("dataQueueSize").ToLocalChecked());
+        if (!dataQueueSizeValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(dataQueueSizeValue, Number, "type \"number\" expected in value \"dataQueueSize\".");
+            int64_t size = dataQueueSizeValue->IntegerValue();
+            if (size <= 0)
+            {
+                Nan::ThrowRangeError("value \"dataQueueSize\" must be greater than 0.");
+                return;
+            }
+            dataQueueSize = size_t(size);
+        }
+
+        // the scans of all the devices are queued by the scheduler, the higher priorities first
+        int priority = 0;
+        v8::Local<v8::Value> priorityValue = paramObj->Get(Nan::New("priority").ToLocalChecked());
+        if (!priorityValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(priorityValue, Number, "type \"number\" expected in value \"priority\".");
+            int64_t value = priorityValue->IntegerValue();
+            if (value < INT_MIN || value > INT_MAX)
+            {
+                Nan::ThrowRangeError("value \"priority\" is out of range.");
+                return;
+            }
+            priority = int(value);
+        }
+
+        // the scan is cancelled once it has run this long, ms
+        v8::Local<v8::Value> timeoutValue = paramObj->Get(Nan::New("timeout").ToLocalChecked());
+        if (!timeoutValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(timeoutValue, Number, "type \"number\" expected in value \"timeout\".");
+            int64_t timeout = timeoutValue->IntegerValue();
+            if (timeout < 0 || timeout > INT_MAX)
+            {
+                Nan::ThrowRangeError("value \"timeout\" is out of range.");
+                return;
+            }
+            options.timeoutMs = int(timeout);
+        }
+
+        // the transfer is aborted if the driver hasn't stopped this long after a cancel, ms
+        v8::Local<v8::Value> cancelTimeoutValue = paramObj->Get(Nan::New("cancelTimeout").ToLocalChecked());
+        if (!cancelTimeoutValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(cancelTimeoutValue, Number, "type \"number\" expected in value \"cancelTimeout\".");
+            int64_t timeout = cancelTimeoutValue->IntegerValue();
+            if (timeout < 0 || timeout > INT_MAX)
+            {
+                Nan::ThrowRangeError("value \"cancelTimeout\" is out of range.");
+                return;
+            }
+            options.cancelTimeoutMs = int(timeout);
+        }
+
+        // post-processing of the pages
+        v8::Local<v8::Value> pipelineValue = paramObj->Get(Nan::New("pipeline").ToLocalChecked());
+        if (!pipelineValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(pipelineValue, Object, "type \"object\" expected in value \"pipeline\".");
+            if (!PipelineOptionsFromJS(v8::Local<v8::Object>::Cast(pipelineValue), options.pipeline))
+            {
+                return;
+            }
+        }
+
+        class ScanWorker : public DeviceWorker
+        {
+        public:
+            ScanWorker(WIADeviceJSWrap* obj, const ScanOptions& options, size_t dataQueueSize)
+                : m_pObj(obj)
+                , m_device(obj->GetDevice())
+                , m_options(options)
+                , m_pProgressEvent(new uvAsyncEvent(this, progressCallback))
+                , m_progressRing(4096)
+                , m_hrScanResult(S_OK)
+            {
+                // page data is streamed only if someone is listening
+                if (m_pObj->m_pScanDataCallback)
+                {
+                    m_pDataQueue.reset(new util::CChunkQueue(dataQueueSize));
+                    m_pDataEvent.reset(new uvAsyncEvent(this, dataCallback));
+                }
+                if (m_pObj->m_pScanPageCallback)
+                {
+                    m_pPageEvent.reset(new uvAsyncEvent(this, pageCallback));
+                }
+            }
+
+            void Execute() override
+            {
+                // runs on the COM MTA thread of the device
+                // firstly, create directory if needed
+                if (m_options.output == ScanOutput::File)
+                {
+                    std::experimental::filesystem::create_directories(m_options.saveDirectory);
+                }
+
+                ScanDataCallback onData = nullptr;
+                if (m_pDataQueue)
+                {
+                    onData = [this](long page, uint64_t offset, const void* data, size_t size) -> bool
+                    {
+                        // blocks while the JavaScript side is behind
+                        bool ret = m_pDataQueue->Push(page, offset, data, size);
+                        m_pDataEvent->NotifyComplete();
+                        return ret;
+                    };
+                }
+
+                ScanPageCallback onPage = nullptr;
+                if (m_pPageEvent)
+                {
+                    // called on the threads of the page pipeline as well
+                    onPage = [this](const ScanPageInfo& page)
+                    {
+                        {
+                            std::lock_guard<std::mutex> g(m_lockPages);
+                            m_pages.push_back(std::make_pair(page, std::chrono::steady_clock::now()));
+                        }
+                        m_pPageEvent->NotifyComplete();
+                    };
+                }
+
+                m_hrScanResult = m_device->Scan(m_options, m_scannedPages,
+                    [this](const ScanProgressInfo& info)
+                {
+                    // Every record is kept, uv_async_send() might merge several wakeups into one
+                    m_progressRing.Push(info);
+                    m_pProgressEvent->NotifyComplete();
+                }, onData, onPage, &m_pipelineStats, &m_cancelInfo);
+            }
+
+            void HandleErrorCallback() override
+            {
+                if (GetJob().state == util::JobState::Cancelled)
+                {
+                    // cancelled while queued by the scheduler, the scan has not started
+                    m_hrScanResult = E_ABORT;
+                    m_cancelInfo.cancelled = true;
+                    m_cancelInfo.cancelTime = std::chrono::steady_clock::now();
+                }
+                else
+                {
+                    // Execute() has thrown, the scan is reported as failed
+                    m_hrScanResult = E_FAIL;
+                }
+                HandleOKCallback();
+            }
+
+            void HandleOKCallback() override
+            {
+                Nan::HandleScope scope;
+
+                // deliver the progress and the data left before the scan completes
+                EmitProgress();
+                if (m_pDataQueue)
+                {
+                    m_pDataQueue->Close();
+                    EmitData();
+                }
+                if (m_pPageEvent)
+                {
+                    EmitPages();
+                }
+
+                if (m_pObj->m_pScanCompleteCallback)
+                {
+                    Nan::HandleScope scope;
+                    util::CTimelineSpan span(m_device->GetTimeline(), "EmitComplete", "js");
+
+                    v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+
+                    retObject->Set(Nan::New("retCode").ToLocalChecked(), Nan::New(m_hrScanResult));
+                    std::wstring errorMsg = util::GetWIAErrorStr(m_hrScanResult);
+                    retObject->Set(Nan::New("errMsg").ToLocalChecked(), Nan::New(util::WStringToUTF8(errorMsg)).ToLocalChecked());
+
+                    v8::Local<v8::Array> filesArray = Nan::New<v8::Array>();
+                    v8::Local<v8::Array> buffersArray = Nan::New<v8::Array>();
+                    for (size_t i = 0; i < m_scannedPages.size(); i++)
+                    {
+                        if (m_options.output == ScanOutput::Buffer)
+                        {
+                            buffersArray->Set(i, PageBufferToJS(m_scannedPages[i].buffer));
+                        }
+                        else
+                        {
+                            filesArray->Set(i, Nan::New(util::WStringToUTF8(m_scannedPages[i].filePath)).ToLocalChecked());
+                        }
+                    }
+                    retObject->Set(Nan::New("files").ToLocalChecked(), filesArray);
+                    if (m_options.output == ScanOutput::Buffer)
+                    {
+                        retObject->Set(Nan::New("buffers").ToLocalChecked(), buffersArray);
+                    }
+                    if (m_options.hash.IsEnabled())
+                    {
+                        // in the order of the files or the buffers
+                        v8::Local<v8::Array> hashesArray = Nan::New<v8::Array>();
+                        for (size_t i = 0; i < m_scannedPages.size(); i++)
+                        {
+                            v8::Local<v8::Object> hashObject = Nan::New<v8::Object>();
+                            DigestToJS(m_scannedPages[i].digest, hashObject);
+                            hashesArray->Set(i, hashObject);
+                        }
+                        retObject->Set(Nan::New("hashes").ToLocalChecked(), hashesArray);
+                    }
+                    if (!m_options.pipeline.thumbnailSizes.empty() && m_options.document == util::DocumentFormat::None)
+                    {
+                        // in the order of the files or the buffers
+                        v8::Local<v8::Array> thumbnailsArray = Nan::New<v8::Array>();
+                        for (size_t i = 0; i < m_scannedPages.size(); i++)
+                        {
+                            thumbnailsArray->Set(i, ThumbnailsToJS(m_scannedPages[i].thumbnails, false));
+                        }
+                        retObject->Set(Nan::New("thumbnails").ToLocalChecked(), thumbnailsArray);
+                    }
+                    if (m_options.pipeline.IsEnabled())
+                    {
+                        retObject->Set(Nan::New("pipeline").ToLocalChecked(), PipelineStatsToJS(m_pipelineStats));
+                    }
+                    if (m_cancelInfo.cancelled)
+                    {
+                        // toCompleteMs includes the delivery of the data left
+                        double toCompleteMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_cancelInfo.cancelTime).count();
+
+                        v8::Local<v8::Object> cancelObject = Nan::New<v8::Object>();
+                        cancelObject->Set(Nan::New("timedOut").ToLocalChecked(), Nan::New(m_cancelInfo.timedOut));
+                        cancelObject->Set(Nan::New("forced").ToLocalChecked(), Nan::New(m_cancelInfo.forced));
+                        cancelObject->Set(Nan::New("toIdleMs").ToLocalChecked(), Nan::New(m_cancelInfo.cancelToIdleMs));
+                        cancelObject->Set(Nan::New("toCompleteMs").ToLocalChecked(), Nan::New(toCompleteMs));
+                        retObject->Set(Nan::New("cancel").ToLocalChecked(), cancelObject);
+                    }
+
+                    const util::JobMetrics& job = GetJob();
+                    v8::Local<v8::Object> jobObject = Nan::New<v8::Object>();
+                    jobObject->Set(Nan::New("id").ToLocalChecked(), Nan::New(double(job.id)));
+                    jobObject->Set(Nan::New("priority").ToLocalChecked(), Nan::New(job.priority));
+                    jobObject->Set(Nan::New("queueMs").ToLocalChecked(), Nan::New(job.queueMs));
+                    jobObject->Set(Nan::New("runMs").ToLocalChecked(), Nan::New(job.runMs));
+                    retObject->Set(Nan::New("job").ToLocalChecked(), jobObject);
+
+                    int argc = 1;
+                    std::unique_ptr<v8::Local<v8::Value>[]> argv(new v8::Local<v8::Value>[argc]());
+                    argv[0] = retObject;
+                    Nan::Call(*m_pObj->m_pScanCompleteCallback, argc, argv.get());
+                }
+            }
+
+        private:
+            static void dataCallback(uv_async_t* handle)
+            {
+                auto* pThis = reinterpret_cast<ScanWorker*>(handle->data);
+                pThis->EmitData();
+            }
+
+            void EmitData()
+            {
+                util::CTimelineSpan span(m_device->GetTimeline(), "EmitData", "js");
+
+                // The queue is always drained to unblock the transfer thread, even if the callback has been removed
+                std::deque<util::DataChunk> chunks;
+                m_pDataQueue->PopAll(chunks);
+
+                if (!m_pObj->m_pScanDataCallback)
+                {
+                    return;
+                }
+
+                for (auto& chunk : chunks)
+                {
+                    Nan::HandleScope scope;
+
+                    v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+
+                    retObject->Set(Nan::New("page").ToLocalChecked(), Nan::New(int32_t(chunk.page)));
+                    retObject->Set(Nan::New("offset").ToLocalChecked(), Nan::New(double(chunk.offset)));
+                    retObject->Set(Nan::New("data").ToLocalChecked(), PageBufferToJS(chunk.data));
+
+                    int argc = 1;
+                    std::unique_ptr<v8::Local<v8::Value>[]> argv(new v8::Local<v8::Value>[argc]());
+                    argv[0] = retObject;
+                    Nan::Call(*m_pObj->m_pScanDataCallback, argc, argv.get());
+                }
+            }
+
+            static void pageCallback(uv_async_t* handle)
+            {
+                auto* pThis = reinterpret_cast<ScanWorker*>(handle->data);
+                pThis->EmitPages();
+            }
+
+            void EmitPages()
+            {
+                util::CTimeline& timeline = m_device->GetTimeline();
+                util::CTimelineSpan span(timeline, "EmitPages", "js");
+
+                std::deque<std::pair<ScanPageInfo, std::chrono::steady_clock::time_point>> pages;
+                {
+                    std::lock_guard<std::mutex> g(m_lockPages);
+                    pages.swap(m_pages);
+                }
+
+                if (!m_pObj->m_pScanPageCallback)
+                {
+                    return;
+                }
+
+                for (auto& queuedPage : pages)
+                {
+                    Nan::HandleScope scope;
+
+                    const ScanPageInfo& page = queuedPage.first;
+                    v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+
+                    retObject->Set(Nan::New("page").ToLocalChecked(), Nan::New(int32_t(page.index)));
+                    retObject->Set(Nan::New("side").ToLocalChecked(), Nan::New(page.side == ScanPageSide::Back ? "back" : "front").ToLocalChecked());
+                    retObject->Set(Nan::New("size").ToLocalChecked(), Nan::New(double(page.size)));
+                    retObject->Set(Nan::New("transferMs").ToLocalChecked(), Nan::New(page.transferMs));
+                    DigestToJS(page.digest, retObject);
+                    if (!m_options.pipeline.thumbnailSizes.empty())
+                    {
+                        // copies, the thumbnails are delivered again by the event 'complete' unless the pages make a document
+                        retObject->Set(Nan::New("thumbnails").ToLocalChecked(),
+                            ThumbnailsToJS(page.thumbnails, m_options.document == util::DocumentFormat::None));
+                    }
+                    if (m_options.output == ScanOutput::Buffer)
+                    {
+                        // a copy, the buffer is delivered again by the event 'complete'
+                        v8::Local<v8::Object> buffer = page.buffer ?
+                            Nan::CopyBuffer(page.buffer->Data(), uint32_t(page.buffer->Size())).ToLocalChecked() :
+                            Nan::NewBuffer(0).ToLocalChecked();
+                        retObject->Set(Nan::New("buffer").ToLocalChecked(), buffer);
+                    }
+                    else
+                    {
+                        retObject->Set(Nan::New("file").ToLocalChecked(), Nan::New(util::WStringToUTF8(page.filePath)).ToLocalChecked());
+                    }
+
+                    int argc = 1;
+                    std::unique_ptr<v8::Local<v8::Value>[]> argv(new v8::Local<v8::Value>[argc]());
+                    argv[0] = retObject;
+                    Nan::Call(*m_pObj->m_pScanPageCallback, argc, argv.get());
+
+                    // from the page complete until JavaScript has handled it
+                    if (timeline.IsEnabled())
+                    {
+                        timeline.AddSpan("DeliverPage", "js", queuedPage.second, std::chrono::steady_clock::now(), "page", page.index);
+                    }
+                }
+            }
+
+            static void progressCallback(uv_async_t* handle)
+            {
+                auto* pThis = reinterpret_cast<ScanWorker*>(handle->data);
+                pThis->EmitProgress();
+            }
 
-            try
+            void EmitProgress()
             {
-                auto device = CWIADeviceMgr::GetInstance()->OpenWIADevice(deviceUUID);
+                util::CTimelineSpan span(m_device->GetTimeline(), "EmitProgress", "js");
 
-                if (!device)
+                // Drain the ring in one batch.
+                // Consecutive status updates of a page are merged into the latest one,
+                // page starts and ends are always delivered.
+                std::vector<ScanProgressInfo> records;
+                m_progressRing.PopAll([&records](const ScanProgressInfo& info)
                 {
-                    throw std::runtime_error("unable to open WIA device");
-                }
+                    if (info.type == ScanProgressType::Status &&
+                        !records.empty() &&
+                        records.back().type == ScanProgressType::Status &&
+                        records.back().pageCount == info.pageCount)
+                    {
+                        ULONG coalesced = records.back().coalesced + 1;
+                        records.back() = info;
+                        records.back().coalesced = coalesced;
+                    }
+                    else
+                    {
+                        records.push_back(info);
+                    }
+                });
 
-                WIADeviceJSWrap* obj = new WIADeviceJSWrap(device);
-                obj->Wrap(info.This());
-                info.GetReturnValue().Set(info.This());
-            }
-            catch (const std::exception&)
-            {
-                char errBuf[500] = { 0 };
-                sprintf_s(errBuf, "Unable to open device \"%s\".", util::WStringToUTF8(deviceUUID).c_str());
-                Nan::ThrowError(errBuf);
-                return;
-            }
-        }
-        else {
-            // Invoked as plain function `MyObject(...)`, turn into construct call.
-            const int argc = 1;
-            v8::Local<v8::Value> argv[argc] = { info[0] };
-            v8::Local<v8::Context> context = isolate->GetCurrentContext();
-            v8::Local<v8::Function> cons = v8::Local<v8::Function>::New(isolate, constructor);
-            v8::Local<v8::Object> result =
-                cons->NewInstance(context, argc, argv).ToLocalChecked();
-            info.GetReturnValue().Set(result);
-        }
-    }
+                if (!m_pObj->m_pScanProgressCallback)
+                {
+                    return;
+                }
 
-    NAN_METHOD(WIADeviceJSWrap::Close)
-    {
-        v8::Isolate* isolate = info.GetIsolate();
-        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
-        assert(obj);
+                util::DeviceMetrics& metrics = m_device->GetMetrics();
+                metrics.progressDelivered.Add(records.size());
+                for (const auto& record : records)
+                {
+                    metrics.progressCoalesced.Add(record.coalesced);
+                }
 
-        if (!obj->GetDevice())
-        {
-            assert(false);
-            Nan::ThrowError("Object has been destroyed");
-            return;
-        }
+                for (auto& record : records)
+                {
+                    Nan::HandleScope scope;
 
-        obj->GetDevice().reset();
-    }
+                    v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
 
-    NAN_METHOD(WIADeviceJSWrap::SetCallback)
-    {
-        v8::Isolate* isolate = info.GetIsolate();
-        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+                    const char* type = "status";
+                    if (record.type == ScanProgressType::PageStart)
+                    {
+                        type = "pageStart";
+                    }
+                    else if (record.type == ScanProgressType::PageEnd)
+                    {
+                        type = "pageEnd";
+                    }
 
-        assert(obj);
+                    retObject->Set(Nan::New("type").ToLocalChecked(), Nan::New(type).ToLocalChecked());
+                    retObject->Set(Nan::New("page").ToLocalChecked(), Nan::New(record.pageCount));
+                    retObject->Set(Nan::New("percent").ToLocalChecked(), Nan::New(record.percentComplete));
+                    retObject->Set(Nan::New("bytesTransferred").ToLocalChecked(), Nan::New(double(record.bytesTransferred)));
+                    retObject->Set(Nan::New("error").ToLocalChecked(), Nan::New(record.error));
+                    retObject->Set(Nan::New("errMsg").ToLocalChecked(), Nan::New(util::WStringToUTF8(util::GetWIAErrorStr(record.error))).ToLocalChecked());
+                    retObject->Set(Nan::New("coalesced").ToLocalChecked(), Nan::New(record.coalesced));
 
-        CHECK_VALUE_TYPE(info[0], String, "type \"string\" expected in argument 1.");
+                    int argc = 1;
+                    std::unique_ptr<v8::Local<v8::Value>[]> argv(new v8::Local<v8::Value>[argc]());
+                    argv[0] = retObject;
+                    Nan::Call(*m_pObj->m_pScanProgressCallback, argc, argv.get());
+                }
+            }
 
-        v8::Local<v8::String> callbackTypeValue = v8::Local<v8::String>::Cast(info[0]);
-        std::string callbackType = *v8::String::Utf8Value(callbackTypeValue);
+        private:
+            WIADeviceJSWrap* m_pObj;
+            std::shared_ptr<CWIADevice> m_device;
+            ScanOptions m_options;
 
-        std::shared_ptr<Nan::Callback> callbk;
+            // members for progress info
+            std::unique_ptr<uvAsyncEvent> m_pProgressEvent;
+            util::CSPSCRing<ScanProgressInfo> m_progressRing;
 
-        if (!info[1]->IsNullOrUndefined())
-        {
-            CHECK_VALUE_TYPE(info[1], Function, "type \"function\" expected in argument 2.");
-            callbk = std::shared_ptr<Nan::Callback>(new Nan::Callback(Nan::To<v8::Function>(info[1]).ToLocalChecked()));
-        }
+            // members for streaming page data
+            std::unique_ptr<util::CChunkQueue> m_pDataQueue;
+            std::unique_ptr<uvAsyncEvent> m_pDataEvent;
 
-        if (!obj->GetDevice())
-        {
-            assert(false);
-            Nan::ThrowError("Object has been destroyed");
-            return;
-        }
+            // members for the pages completed, filled by the threads of the pipeline as well
+            std::unique_ptr<uvAsyncEvent> m_pPageEvent;
+            std::mutex m_lockPages;
+            std::deque<std::pair<ScanPageInfo, std::chrono::steady_clock::time_point>> m_pages;     // with the time they were queued
 
-        if (callbackType == "progress")
-        {
-            obj->m_pScanProgressCallback = callbk;
-        }
-        else if (callbackType == "complete")
-        {
-            obj->m_pScanCompleteCallback = callbk;
-        }
+            HRESULT m_hrScanResult;
+            // the acquired images
+            std::vector<ScannedPage> m_scannedPages;
+            util::PipelineStats m_pipelineStats;
+            ScanCancelInfo m_cancelInfo;
+        };
+        // the pages are processed under the budget of all the scans
+        options.pipeline.processingLimit = CWIADeviceMgr::GetInstance()->GetScanScheduler().GetProcessingLimit();
 
+        ScanWorker* worker = new ScanWorker(obj, options, dataQueueSize);
+        obj->QueueScheduledWorker(worker, priority);
     }
 
-    NAN_METHOD(WIADeviceJSWrap::ShowDeviceDlg)
+    NAN_METHOD(WIADeviceJSWrap::Cancel)
     {
         v8::Isolate* isolate = info.GetIsolate();
         WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
-        assert(obj);
-
-        HWND parentHWND = 0;
-
-        // HWND handle
-        if (!info[0]->IsNullOrUndefined())
-        {
-            CHECK_VALUE_TYPE(info[0], Object, "type \"Object\" expected in argument 1.");
-            parentHWND = *(HWND*)node::Buffer::Data(info[1]);
-        }
-        CHECK_VALUE_TYPE(info[1], String, "type \"string\" expected in argument 2.");
-        CHECK_VALUE_TYPE(info[2], String, "type \"string\" expected in argument 3.");
-
-        v8::Local<v8::String> recvFolderValue = v8::Local<v8::String>::Cast(info[1]);
-        v8::Local<v8::String> filenameTemplateValue = v8::Local<v8::String>::Cast(info[2]);
 
-        std::wstring recvFolder = util::WStringFromUTF8(*v8::String::Utf8Value(recvFolderValue));
-        std::wstring filenameTemplate = util::WStringFromUTF8(*v8::String::Utf8Value(filenameTemplateValue));
+        assert(obj);
 
         if (!obj->GetDevice())
         {
@@ -234,29 +1945,17 @@ namespace scanner
             return;
         }
 
-        // Open the scan dialog provided by Windows. Do modal loop here
-        std::vector<std::wstring> outFilepaths;
-        HRESULT hr = obj->GetDevice()->ShowDeviceDlg(parentHWND, recvFolder, filenameTemplate, outFilepaths);
-
-        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
-        v8::Local<v8::Array> filesArray = Nan::New<v8::Array>();
-
-        for (size_t i = 0; i < outFilepaths.size(); i++)
-        {
-            filesArray->Set(i, Nan::New(util::WStringToUTF8(outFilepaths[i])).ToLocalChecked());
-        }
-
-        retObject->Set(Nan::New("files").ToLocalChecked(), filesArray);
-        retObject->Set(Nan::New("retCode").ToLocalChecked(), Nan::New(hr));
-        retObject->Set(Nan::New("errorMsg").ToLocalChecked(), Nan::New(util::WStringToUTF8(util::GetWIAErrorStr(hr))).ToLocalChecked());
-
-        info.GetReturnValue().Set(retObject);
+        // false if no scan is running or queued. The scans queued first, none of them starts meanwhile
+        bool ret = CWIADeviceMgr::GetInstance()->GetScanScheduler().CancelDevice(obj->GetDevice()->GetDeviceUUID()) > 0;
+        ret = obj->GetDevice()->CancelScan() || ret;
+        info.GetReturnValue().Set(Nan::New(ret));
     }
 
-    NAN_METHOD(WIADeviceJSWrap::GetSources)
+    NAN_METHOD(WIADeviceJSWrap::Refresh)
     {
         v8::Isolate* isolate = info.GetIsolate();
         WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+
         assert(obj);
 
         if (!obj->GetDevice())
@@ -266,22 +1965,11 @@ namespace scanner
             return;
         }
 
-        auto sources = obj->GetDevice()->GetImageSources();
-
-        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
-        v8::Local<v8::Array> sourcesArray = Nan::New<v8::Array>();
-
-        for (size_t i = 0; i < sources.size(); i++)
-        {
-            sourcesArray->Set(i, Nan::New(util::WStringToUTF8(sources[i])).ToLocalChecked());
-        }
-
-        retObject->Set(Nan::New("sources").ToLocalChecked(), sourcesArray);
-
-        info.GetReturnValue().Set(retObject);
+        obj->GetDevice()->RefreshProperties();
+        obj->GetDevice()->InvalidateItemTree();
     }
 
-    NAN_METHOD(WIADeviceJSWrap::GetProperties)
+    NAN_METHOD(WIADeviceJSWrap::GetDeviceStats)
     {
         v8::Isolate* isolate = info.GetIsolate();
         WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
@@ -296,66 +1984,41 @@ namespace scanner
         }
 
         v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
-        
-        // output file format
-        std::wstring imageFormat = obj->GetDevice()->GetImageFormat();
-        retObject->Set(Nan::New("format").ToLocalChecked(), Nan::New(util::WStringToUTF8(imageFormat)).ToLocalChecked());
-
-        // paper profile
-        std::wstring paperProfile = obj->GetDevice()->GetPaperProfile();
-        retObject->Set(Nan::New("paper").ToLocalChecked(), Nan::New(util::WStringToUTF8(paperProfile)).ToLocalChecked());
-
-        // color mode
-        std::wstring color = obj->GetDevice()->GetColorFormat();
-        retObject->Set(Nan::New("color").ToLocalChecked(), Nan::New(util::WStringToUTF8(color)).ToLocalChecked());
-
-        // brightness range
-        int min, max, normal, step;
-        obj->GetDevice()->GetScanBrightnessRange(min, max, normal, step);
-        v8::Local<v8::Object> brightnessRangeObject = Nan::New<v8::Object>();
-        brightnessRangeObject->Set(Nan::New("min").ToLocalChecked(), Nan::New(min/step));
-        brightnessRangeObject->Set(Nan::New("max").ToLocalChecked(), Nan::New(max/step));
-        retObject->Set(Nan::New("brightness_range").ToLocalChecked(), brightnessRangeObject);
-
-        // contrast range
-        obj->GetDevice()->GetScanContrastRange(min, max, normal, step);
-        v8::Local<v8::Object> contrastRangeObject = Nan::New<v8::Object>();
-        contrastRangeObject->Set(Nan::New("min").ToLocalChecked(), Nan::New(min / step));
-        contrastRangeObject->Set(Nan::New("max").ToLocalChecked(), Nan::New(max / step));
-        retObject->Set(Nan::New("contrast_range").ToLocalChecked(), contrastRangeObject);
-
-        // brightness
-        int brightness = obj->GetDevice()->GetScanBrightness();
-        retObject->Set(Nan::New("brightness").ToLocalChecked(), Nan::New(brightness));
-
-        // contrast
-        int contrast = obj->GetDevice()->GetScanContrast();
-        retObject->Set(Nan::New("contrast").ToLocalChecked(), Nan::New(contrast));
-
-        // DPI
-        int dpi = obj->GetDevice()->GetScanDPI();
-        retObject->Set(Nan::New("dpi").ToLocalChecked(), Nan::New(dpi));
-
-        // page count
-        int pageCount = obj->GetDevice()->GetScanPageCount();
-        if (pageCount)
-        {
-            retObject->Set(Nan::New("pageCount").ToLocalChecked(), Nan::New(pageCount));
-        }
-        else
-        {
-            retObject->Set(Nan::New("pageCount").ToLocalChecked(), Nan::New("all").ToLocalChecked());
-        }
 
-        // document handling
-        std::wstring handling = obj->GetDevice()->GetDocumentHandling();
-        retObject->Set(Nan::New("document_handling").ToLocalChecked(), Nan::New(util::WStringToUTF8(handling)).ToLocalChecked());
+        // property cache
+        util::PropertyCacheStats cacheStats = obj->GetDevice()->GetPropertyCacheStats();
+        v8::Local<v8::Object> cacheObject = Nan::New<v8::Object>();
+        cacheObject->Set(Nan::New("hits").ToLocalChecked(), Nan::New((double)cacheStats.hits));
+        cacheObject->Set(Nan::New("misses").ToLocalChecked(), Nan::New((double)cacheStats.misses));
+        cacheObject->Set(Nan::New("invalidations").ToLocalChecked(), Nan::New((double)cacheStats.invalidations));
+        retObject->Set(Nan::New("propertyCache").ToLocalChecked(), cacheObject);
+
+        // WIA item tree
+        WIAItemTreeStats treeStats = obj->GetDevice()->GetItemTreeStats();
+        v8::Local<v8::Object> treeObject = Nan::New<v8::Object>();
+        treeObject->Set(Nan::New("builds").ToLocalChecked(), Nan::New((double)treeStats.builds));
+        treeObject->Set(Nan::New("cacheHits").ToLocalChecked(), Nan::New((double)treeStats.cacheHits));
+        treeObject->Set(Nan::New("lastBuildMs").ToLocalChecked(), Nan::New(treeStats.lastBuildMs));
+        treeObject->Set(Nan::New("totalBuildMs").ToLocalChecked(), Nan::New(treeStats.totalBuildMs));
+        retObject->Set(Nan::New("itemTree").ToLocalChecked(), treeObject);
+
+        // scan state and lock contention, answered without waiting for a running scan
+        util::DeviceLockStats lockStats = obj->GetDevice()->GetLockStats();
+        v8::Local<v8::Object> lockObject = Nan::New<v8::Object>();
+        lockObject->Set(Nan::New("scanState").ToLocalChecked(), Nan::New(util::ScanStateToString(obj->GetDevice()->GetScanState())).ToLocalChecked());
+        lockObject->Set(Nan::New("reads").ToLocalChecked(), Nan::New((double)lockStats.reads));
+        lockObject->Set(Nan::New("writes").ToLocalChecked(), Nan::New((double)lockStats.writes));
+        lockObject->Set(Nan::New("refusedWrites").ToLocalChecked(), Nan::New((double)lockStats.refusedWrites));
+        lockObject->Set(Nan::New("refusedScans").ToLocalChecked(), Nan::New((double)lockStats.refusedScans));
+        lockObject->Set(Nan::New("maxReadWaitMs").ToLocalChecked(), Nan::New(lockStats.maxReadWaitMs));
+        lockObject->Set(Nan::New("maxWriteWaitMs").ToLocalChecked(), Nan::New(lockStats.maxWriteWaitMs));
+        retObject->Set(Nan::New("lock").ToLocalChecked(), lockObject);
 
         info.GetReturnValue().Set(retObject);
     }
-    NAN_METHOD(WIADeviceJSWrap::SetProperties)
+
+    NAN_METHOD(WIADeviceJSWrap::SetTracing)
     {
-        v8::Isolate* isolate = info.GetIsolate();
         WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
         assert(obj);
 
@@ -366,142 +2029,31 @@ namespace scanner
             return;
         }
 
-        CHECK_VALUE_TYPE(info[0], Object, "type \"object\" expected in argument 1.");
-
-        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
-
-        v8::Local<v8::Object> paramObj = v8::Local<v8::Object>::Cast(info[0]);
-
-        // output file format
-        {
-            v8::Local<v8::String> imageFormatValue = v8::Local<v8::String>::Cast(paramObj->Get(Nan::New("format").ToLocalChecked()));
-            if (!imageFormatValue->IsNullOrUndefined())
-            {
-                CHECK_VALUE_TYPE(imageFormatValue, String, "type \"string\" expected in value \"format\"");
-                std::wstring imgFormat = util::WStringFromUTF8(*v8::String::Utf8Value(imageFormatValue));
-                bool ret = obj->GetDevice()->SetImageFormat(imgFormat);
-
-                retObject->Set(Nan::New("format").ToLocalChecked(), Nan::New(ret));
-            }
-        }
-
-        // paper profile
-        {
-            v8::Local<v8::String> paperSizeValue = v8::Local<v8::String>::Cast(paramObj->Get(Nan::New("paper").ToLocalChecked()));
-            if (!paperSizeValue->IsNullOrUndefined())
-            {
-                CHECK_VALUE_TYPE(paperSizeValue, String, "type \"string\" expected in value \"paper\"");
-
-                std::wstring paperProfile = util::WStringFromUTF8(*v8::String::Utf8Value(paperSizeValue));
-                obj->GetDevice()->GetPaperProfile();
-                bool ret = obj->GetDevice()->SetPaperProfile(paperProfile);
-
-                retObject->Set(Nan::New("paper").ToLocalChecked(), Nan::New(ret));
-            }
-        }
-
-        // color mode
-        {
-            v8::Local<v8::String> colorValue = v8::Local<v8::String>::Cast(paramObj->Get(Nan::New("color").ToLocalChecked()));
-            if (!colorValue->IsNullOrUndefined())
-            {
-                CHECK_VALUE_TYPE(colorValue, String, "type \"string\" expected in value \"color\"");
-                std::wstring imgFormat = util::WStringFromUTF8(*v8::String::Utf8Value(colorValue));
-                bool ret = obj->GetDevice()->SetColorFormat(imgFormat);
-
-                retObject->Set(Nan::New("color").ToLocalChecked(), Nan::New(ret));
-            }
-        }
-
-        // brightness
-        {
-            v8::Local<v8::Integer> brightnessValue = v8::Local<v8::Integer>::Cast(paramObj->Get(Nan::New("brightness").ToLocalChecked()));
-            if (!brightnessValue->IsNullOrUndefined())
-            {
-                CHECK_VALUE_TYPE(brightnessValue, Number, "type \"number\" expected in value \"brightness\"");
-                int brightness = brightnessValue->IntegerValue();
-
-                bool ret = obj->GetDevice()->SetScanBrightness(brightness);
-
-                retObject->Set(Nan::New("brightness").ToLocalChecked(), Nan::New(ret));
-            }
-        }
-
-        // contrast
-        {
-            v8::Local<v8::Integer> contrastValue = v8::Local<v8::Integer>::Cast(paramObj->Get(Nan::New("contrast").ToLocalChecked()));
-            if (!contrastValue->IsNullOrUndefined())
-            {
-                CHECK_VALUE_TYPE(contrastValue, Number, "type \"number\" expected in value \"contrast\"");
-                int contrast = contrastValue->IntegerValue();
-                bool ret = obj->GetDevice()->SetScanContrast(contrast);
-
-                retObject->Set(Nan::New("contrast").ToLocalChecked(), Nan::New(ret));
-            }
-        }
-
-        // DPI
-        {
-            v8::Local<v8::Integer> dpiValue = v8::Local<v8::Integer>::Cast(paramObj->Get(Nan::New("dpi").ToLocalChecked()));
-            if (!dpiValue->IsNullOrUndefined())
-            {
-                CHECK_VALUE_TYPE(dpiValue, Number, "type \"number\" expected in value \"dpi\"");
-                int dpi = dpiValue->IntegerValue();
-                bool ret = obj->GetDevice()->SetScanDPI(dpi);
-
-                retObject->Set(Nan::New("dpi").ToLocalChecked(), Nan::New(ret));
-            }
-        }
-
-        // page count
-        {
-            v8::Local<v8::Value> pageCountValue = paramObj->Get(Nan::New("pageCount").ToLocalChecked());
-            if (!pageCountValue->IsNullOrUndefined())
-            {
-                int pageCount = 0;
-                if (pageCountValue->IsString())
-                {
-                    std::string count = *v8::String::Utf8Value(v8::Local<v8::String>::Cast(pageCountValue));
-                    if (count == "all")
-                    {
-                        pageCount = 0;
-                    }
-                }
-                else if (pageCountValue->IsNumber())
-                {
-                    pageCount = pageCountValue->IntegerValue();
-                }
-                else
-                {
-                    Nan::ThrowTypeError("type \"number\" or \"string\" expected in value \"pageCount\"");
-                    return;
-                }
+        CHECK_VALUE_TYPE(info[0], Boolean, "type \"boolean\" expected in argument 1.");
 
-                bool ret = obj->GetDevice()->SetScanPageCount(pageCount);
+        // a new timeline starts once enabled
+        obj->GetDevice()->GetTimeline().Enable(info[0]->BooleanValue());
+    }
 
-                retObject->Set(Nan::New("pageCount").ToLocalChecked(), Nan::New(ret));
-            }
-        }
+    NAN_METHOD(WIADeviceJSWrap::GetTrace)
+    {
+        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+        assert(obj);
 
-        // document handling
+        if (!obj->GetDevice())
         {
-            v8::Local<v8::String> docHandlingValue = v8::Local<v8::String>::Cast(paramObj->Get(Nan::New("document_handling").ToLocalChecked()));
-            if (!docHandlingValue->IsNullOrUndefined())
-            {
-                CHECK_VALUE_TYPE(docHandlingValue, String, "type \"string\" expected in value \"format\"");
-                std::wstring handling = util::WStringFromUTF8(*v8::String::Utf8Value(docHandlingValue));
-                bool ret = obj->GetDevice()->SetDocumentHandling(handling);
-
-                retObject->Set(Nan::New("document_handling").ToLocalChecked(), Nan::New(ret));
-            }
+            assert(false);
+            Nan::ThrowError("Object has been destroyed");
+            return;
         }
 
-        info.GetReturnValue().Set(retObject);
+        // JSON to be saved and loaded in about://tracing
+        std::string trace = obj->GetDevice()->GetTimeline().ToChromeTrace();
+        info.GetReturnValue().Set(Nan::New(trace).ToLocalChecked());
     }
 
-    NAN_METHOD(WIADeviceJSWrap::GetPreview)
+    NAN_METHOD(WIADeviceJSWrap::GetSourcesAsync)
     {
-        v8::Isolate* isolate = info.GetIsolate();
         WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
         assert(obj);
 
@@ -512,11 +2064,37 @@ namespace scanner
             return;
         }
 
+        class GetSourcesWorker : public PromiseWorker
+        {
+        public:
+            explicit GetSourcesWorker(std::shared_ptr<CWIADevice> device)
+                : m_device(device)
+            {
+            }
+
+            void Execute() override
+            {
+                m_sources = m_device->GetImageSources();
+            }
+
+        protected:
+            v8::Local<v8::Value> GetResult() override
+            {
+                return SourcesToJS(m_sources);
+            }
+
+        private:
+            std::shared_ptr<CWIADevice> m_device;
+            std::vector<std::wstring> m_sources;
+        };
+
+        auto* worker = new GetSourcesWorker(obj->GetDevice());
+        info.GetReturnValue().Set(worker->GetPromise());
+        obj->QueueDeviceWorker(worker);
     }
 
-    NAN_METHOD(WIADeviceJSWrap::IsFeeder)
+    NAN_METHOD(WIADeviceJSWrap::GetPropertiesAsync)
     {
-        v8::Isolate* isolate = info.GetIsolate();
         WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
         assert(obj);
 
@@ -527,12 +2105,37 @@ namespace scanner
             return;
         }
 
-        info.GetReturnValue().Set(Nan::New(obj->GetDevice()->IsFeeder()));
+        class GetPropertiesWorker : public PromiseWorker
+        {
+        public:
+            explicit GetPropertiesWorker(std::shared_ptr<CWIADevice> device)
+                : m_device(device)
+            {
+            }
+
+            void Execute() override
+            {
+                m_settings = m_device->GetScanSettings();
+            }
+
+        protected:
+            v8::Local<v8::Value> GetResult() override
+            {
+                return ScanSettingsToJS(m_settings);
+            }
+
+        private:
+            std::shared_ptr<CWIADevice> m_device;
+            ScanSettings m_settings;
+        };
+
+        auto* worker = new GetPropertiesWorker(obj->GetDevice());
+        info.GetReturnValue().Set(worker->GetPromise());
+        obj->QueueDeviceWorker(worker);
     }
 
-    NAN_METHOD(WIADeviceJSWrap::DoScan)
+    NAN_METHOD(WIADeviceJSWrap::SetPropertiesAsync)
     {
-        v8::Isolate* isolate = info.GetIsolate();
         WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
         assert(obj);
 
@@ -545,174 +2148,398 @@ namespace scanner
 
         CHECK_VALUE_TYPE(info[0], Object, "type \"object\" expected in argument 1.");
 
-        if (!info[1]->IsNullOrUndefined())
+        // the arguments are parsed on the JavaScript thread
+        ScanSettings settings;
+        unsigned int flags = 0;
+        if (!ScanSettingsFromJS(v8::Local<v8::Object>::Cast(info[0]), settings, flags))
         {
-            CHECK_VALUE_TYPE(info[1], Function, "type \"function\" expected in argument 2.");
-            std::shared_ptr<Nan::Callback> callbk(new Nan::Callback(Nan::To<v8::Function>(info[1]).ToLocalChecked()));
-            obj->m_pScanCompleteCallback = callbk;
+            return;
         }
 
-        v8::Local<v8::Object> paramObj = v8::Local<v8::Object>::Cast(info[0]);
+        class SetPropertiesWorker : public PromiseWorker
+        {
+        public:
+            SetPropertiesWorker(std::shared_ptr<CWIADevice> device, const ScanSettings& settings, unsigned int flags)
+                : m_device(device)
+                , m_settings(settings)
+                , m_flags(flags)
+                , m_succeeded(0)
+            {
+            }
+
+            void Execute() override
+            {
+                m_succeeded = m_device->SetScanSettings(m_settings, m_flags);
+            }
+
+        protected:
+            v8::Local<v8::Value> GetResult() override
+            {
+                return ScanSettingsResultToJS(m_flags, m_succeeded);
+            }
 
-        v8::Local<v8::String> saveDirValue = v8::Local<v8::String>::Cast(paramObj->Get(Nan::New("saveDir").ToLocalChecked()));
-        v8::Local<v8::String> saveFilenameValue = v8::Local<v8::String>::Cast(paramObj->Get(Nan::New("saveFilename").ToLocalChecked()));
+        private:
+            std::shared_ptr<CWIADevice> m_device;
+            ScanSettings m_settings;
+            unsigned int m_flags;
+            unsigned int m_succeeded;
+        };
+
+        auto* worker = new SetPropertiesWorker(obj->GetDevice(), settings, flags);
+        info.GetReturnValue().Set(worker->GetPromise());
+        obj->QueueDeviceWorker(worker);
+    }
 
-        CHECK_VALUE_TYPE(saveDirValue, String, "type \"string\" expected in value \"saveDir\".");
-        CHECK_VALUE_TYPE(saveFilenameValue, String, "type \"string\" expected in value \"saveFilename\".");
+    NAN_METHOD(WIADeviceJSWrap::IsFeederAsync)
+    {
+        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+        assert(obj);
 
-        std::wstring saveDir = util::WStringFromUTF8(*v8::String::Utf8Value(saveDirValue));
-        std::wstring saveFilename = util::WStringFromUTF8(*v8::String::Utf8Value(saveFilenameValue));
+        if (!obj->GetDevice())
+        {
+            assert(false);
+            Nan::ThrowError("Object has been destroyed");
+            return;
+        }
 
-        class ScanWorker : public Nan::AsyncWorker
+        class IsFeederWorker : public PromiseWorker
         {
         public:
-            ScanWorker(WIADeviceJSWrap* obj, const std::wstring& saveDir, const std::wstring& saveFilename)
-                : Nan::AsyncWorker(NULL)
-                , m_pObj(obj)
-                , m_saveDir(saveDir)
-                , m_saveFilename(saveFilename)
-                , m_pProgressEvent(new uvAsyncEvent(this, progressCallback))
-                , m_hrScanResult(S_OK)
+            explicit IsFeederWorker(std::shared_ptr<CWIADevice> device)
+                : m_device(device)
+                , m_bFeeder(false)
             {
             }
 
             void Execute() override
             {
-                util::COMEnvironment env;
-                // firstly, create directory if needed
-                std::experimental::filesystem::create_directories(m_saveDir);
-
-                m_hrScanResult = m_pObj->GetDevice()->Scan(m_saveDir, m_saveFilename, m_saveFilePaths,
-                    [this](const ScanProgressInfo& info)
-                {
-                    std::lock_guard<std::recursive_mutex> g(m_lockProgress);
-                    m_progressInfo = info;
-                    
-                    m_pProgressEvent->NotifyComplete();
-                });
+                m_bFeeder = m_device->IsFeeder();
             }
 
-            void HandleOKCallback() override
+        protected:
+            v8::Local<v8::Value> GetResult() override
             {
-                Nan::HandleScope scope;
+                return Nan::New(m_bFeeder);
+            }
 
-                if (m_pObj->m_pScanCompleteCallback)
-                {
-                    Nan::HandleScope scope;
+        private:
+            std::shared_ptr<CWIADevice> m_device;
+            bool m_bFeeder;
+        };
 
-                    v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+        auto* worker = new IsFeederWorker(obj->GetDevice());
+        info.GetReturnValue().Set(worker->GetPromise());
+        obj->QueueDeviceWorker(worker);
+    }
 
-                    retObject->Set(Nan::New("retCode").ToLocalChecked(), Nan::New(m_hrScanResult));
-                    std::wstring errorMsg = util::GetWIAErrorStr(m_hrScanResult);
-                    retObject->Set(Nan::New("errMsg").ToLocalChecked(), Nan::New(util::WStringToUTF8(errorMsg)).ToLocalChecked());
 
-                    v8::Local<v8::Array> filesArray = Nan::New<v8::Array>();
-                    for (int i = 0; i < m_saveFilePaths.size(); i++)
-                    {
-                        filesArray->Set(i, Nan::New(util::WStringToUTF8(m_saveFilePaths[i])).ToLocalChecked());
-                    }
-                    retObject->Set(Nan::New("files").ToLocalChecked(), filesArray);
+    static NAN_METHOD(ListAllDevices)
+    {
+        auto devices = CWIADeviceMgr::GetInstance()->ListAllDevices();
 
-                    int argc = 1;
-                    std::unique_ptr<v8::Local<v8::Value>[]> argv(new v8::Local<v8::Value>[argc]());
-                    argv[0] = retObject;
-                    Nan::Call(*m_pObj->m_pScanCompleteCallback, argc, argv.get());
-                }
+        info.GetReturnValue().Set(DevicesToJS(devices));
+    }
+
+    static NAN_METHOD(ListAllDevicesAsync)
+    {
+        if (!g_pManagerTaskQueue)
+        {
+            Nan::ThrowError("the module has been cleaned up");
+            return;
+        }
+
+        class ListAllDevicesWorker : public PromiseWorker
+        {
+        public:
+            void Execute() override
+            {
+                m_devices = CWIADeviceMgr::GetInstance()->ListAllDevices();
+            }
+
+        protected:
+            v8::Local<v8::Value> GetResult() override
+            {
+                return DevicesToJS(m_devices);
             }
 
         private:
-            static void progressCallback(uv_async_t* handle)
+            std::vector<std::shared_ptr<WIADeviceProperties>> m_devices;
+        };
+
+        auto* worker = new ListAllDevicesWorker();
+        info.GetReturnValue().Set(worker->GetPromise());
+        QueueWorker(g_pManagerTaskQueue.get(), worker);
+    }
+
+    static void DeviceChangeCallback(uv_async_t* handle)
+    {
+        std::vector<util::DeviceChange<WIADeviceProperties>> changes;
+        {
+            std::lock_guard<std::mutex> g(g_lockDeviceChanges);
+            changes.swap(g_deviceChanges);
+        }
+
+        for (const auto& change : changes)
+        {
+            auto pCallback = change.type == util::DeviceChangeType::Added ? g_pDeviceAddedCallback : g_pDeviceRemovedCallback;
+            if (!pCallback)
             {
-                auto* pThis = reinterpret_cast<ScanWorker*>(handle->data);
+                continue;
+            }
 
-                std::lock_guard<std::recursive_mutex> g(pThis->m_lockProgress);
-                if (pThis->m_pObj->m_pScanProgressCallback)
-                {
-                    Nan::HandleScope scope;
+            Nan::HandleScope scope;
+            int argc = 1;
+            std::unique_ptr<v8::Local<v8::Value>[]> argv(new v8::Local<v8::Value>[argc]());
+            argv[0] = DeviceToJS(change.device);
+            Nan::Call(*pCallback, argc, argv.get());
+        }
+    }
 
-                    v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+    // on("deviceAdded" | "deviceRemoved", callback), null to stop listening
+    static NAN_METHOD(On)
+    {
+        CHECK_VALUE_TYPE(info[0], String, "type \"string\" expected in argument 1.");
+        std::string eventType = *v8::String::Utf8Value(info[0]);
 
-                    retObject->Set(Nan::New("page").ToLocalChecked(), Nan::New(pThis->m_progressInfo.pageCount));
-                    retObject->Set(Nan::New("percent").ToLocalChecked(), Nan::New(pThis->m_progressInfo.percentComplete));
-                    retObject->Set(Nan::New("bytesTransferred").ToLocalChecked(), Nan::New(double(pThis->m_progressInfo.bytesTransferred)));
-                    retObject->Set(Nan::New("error").ToLocalChecked(), Nan::New(pThis->m_progressInfo.error));
-                    retObject->Set(Nan::New("errMsg").ToLocalChecked(), Nan::New(util::WStringToUTF8(util::GetWIAErrorStr(pThis->m_progressInfo.error))).ToLocalChecked());
+        std::shared_ptr<Nan::Callback> callbk;
+        if (!info[1]->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(info[1], Function, "type \"function\" expected in argument 2.");
+            callbk = std::shared_ptr<Nan::Callback>(new Nan::Callback(Nan::To<v8::Function>(info[1]).ToLocalChecked()));
+        }
 
-                    int argc = 1;
-                    std::unique_ptr<v8::Local<v8::Value>[]> argv(new v8::Local<v8::Value>[argc]());
-                    argv[0] = retObject;
-                    Nan::Call(*pThis->m_pObj->m_pScanProgressCallback, argc, argv.get());
-                }
+        if (!g_pManagerTaskQueue)
+        {
+            Nan::ThrowError("the module has been cleaned up");
+            return;
+        }
+
+        if (eventType == "deviceAdded")
+        {
+            g_pDeviceAddedCallback = callbk;
+        }
+        else if (eventType == "deviceRemoved")
+        {
+            g_pDeviceRemovedCallback = callbk;
+        }
+        else
+        {
+            Nan::ThrowError(("unknown event \"" + eventType + "\"").c_str());
+            return;
+        }
+
+        if (!callbk || g_pDeviceChangeEvent)
+        {
+            return;
+        }
+
+        // the listeners alone don't keep the process running
+        g_pDeviceChangeEvent.reset(new uvAsyncEvent(nullptr, DeviceChangeCallback));
+        g_pDeviceChangeEvent->Unref();
+        CWIADeviceMgr::GetInstance()->SetDeviceChangeHandler([](const util::DeviceChange<WIADeviceProperties>& change)
+        {
+            {
+                std::lock_guard<std::mutex> g(g_lockDeviceChanges);
+                g_deviceChanges.push_back(change);
             }
+            g_pDeviceChangeEvent->NotifyComplete();
+        });
 
-        private:
-            WIADeviceJSWrap* m_pObj;
-            std::wstring m_saveDir;
-            std::wstring m_saveFilename;
+        // the changes are reported once the devices have been listed, off the JavaScript thread
+        g_pManagerTaskQueue->Post([]()
+        {
+            CWIADeviceMgr::GetInstance()->ListAllDevices();
+        });
+    }
 
-            // members for progress info
-            std::unique_ptr<uvAsyncEvent> m_pProgressEvent;
-            std::recursive_mutex m_lockProgress;
-            ScanProgressInfo m_progressInfo;
+    static NAN_METHOD(GetCallTimings)
+    {
+        auto timings = util::CCallTimings::GetInstance().GetTimings();
 
-            HRESULT m_hrScanResult;
-            // paths of the acquired image files
-            std::vector<std::wstring> m_saveFilePaths;
-        };
-        ScanWorker* worker = new ScanWorker(obj, saveDir, saveFilename);
-        Nan::AsyncQueueWorker(worker);
+        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+        for (const auto& timing : timings)
+        {
+            v8::Local<v8::Object> timingObject = Nan::New<v8::Object>();
+            timingObject->Set(Nan::New("count").ToLocalChecked(), Nan::New((double)timing.second.count));
+            timingObject->Set(Nan::New("totalMs").ToLocalChecked(), Nan::New(timing.second.totalMs));
+            timingObject->Set(Nan::New("maxMs").ToLocalChecked(), Nan::New(timing.second.maxMs));
+            timingObject->Set(Nan::New("lastMs").ToLocalChecked(), Nan::New(timing.second.lastMs));
+            retObject->Set(Nan::New(timing.first).ToLocalChecked(), timingObject);
+        }
+
+        info.GetReturnValue().Set(retObject);
     }
 
-    NAN_METHOD(WIADeviceJSWrap::Cancel)
+    static v8::Local<v8::Object> HistogramToJS(const util::HistogramSnapshot& histogram)
     {
-        v8::Isolate* isolate = info.GetIsolate();
-        WIADeviceJSWrap* obj = Nan::ObjectWrap::Unwrap<WIADeviceJSWrap>(info.Holder());
+        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+        retObject->Set(Nan::New("count").ToLocalChecked(), Nan::New((double)histogram.count));
+        retObject->Set(Nan::New("meanMs").ToLocalChecked(), Nan::New(histogram.MeanUs() / 1000.0));
+        retObject->Set(Nan::New("minMs").ToLocalChecked(), Nan::New(histogram.minUs / 1000.0));
+        retObject->Set(Nan::New("p50Ms").ToLocalChecked(), Nan::New(histogram.PercentileUs(50) / 1000.0));
+        retObject->Set(Nan::New("p90Ms").ToLocalChecked(), Nan::New(histogram.PercentileUs(90) / 1000.0));
+        retObject->Set(Nan::New("p99Ms").ToLocalChecked(), Nan::New(histogram.PercentileUs(99) / 1000.0));
+        retObject->Set(Nan::New("p999Ms").ToLocalChecked(), Nan::New(histogram.PercentileUs(99.9) / 1000.0));
+        retObject->Set(Nan::New("maxMs").ToLocalChecked(), Nan::New(histogram.maxUs / 1000.0));
+        return retObject;
+    }
 
-        assert(obj);
+    static NAN_METHOD(GetStats)
+    {
+        auto devices = util::CMetricsRegistry::GetInstance().GetSnapshot();
 
-        if (!obj->GetDevice())
+        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+        for (const auto& device : devices)
         {
-            assert(false);
-            Nan::ThrowError("Object has been destroyed");
-            return;
+            const util::DeviceMetricsSnapshot& metrics = device.second;
+            v8::Local<v8::Object> deviceObject = Nan::New<v8::Object>();
+            deviceObject->Set(Nan::New("readMultiple").ToLocalChecked(), HistogramToJS(metrics.readMultiple));
+            deviceObject->Set(Nan::New("writeMultiple").ToLocalChecked(), HistogramToJS(metrics.writeMultiple));
+            deviceObject->Set(Nan::New("createDevice").ToLocalChecked(), HistogramToJS(metrics.createDevice));
+            deviceObject->Set(Nan::New("enumChildItems").ToLocalChecked(), HistogramToJS(metrics.enumChildItems));
+            deviceObject->Set(Nan::New("download").ToLocalChecked(), HistogramToJS(metrics.download));
+            deviceObject->Set(Nan::New("pageTransfer").ToLocalChecked(), HistogramToJS(metrics.pageTransfer));
+            deviceObject->Set(Nan::New("scans").ToLocalChecked(), Nan::New((double)metrics.scans));
+            deviceObject->Set(Nan::New("failedScans").ToLocalChecked(), Nan::New((double)metrics.failedScans));
+            deviceObject->Set(Nan::New("pages").ToLocalChecked(), Nan::New((double)metrics.pages));
+            deviceObject->Set(Nan::New("bytes").ToLocalChecked(), Nan::New((double)metrics.bytes));
+            deviceObject->Set(Nan::New("bytesPerSec").ToLocalChecked(), Nan::New(metrics.BytesPerSecond()));
+            deviceObject->Set(Nan::New("progressDelivered").ToLocalChecked(), Nan::New((double)metrics.progressDelivered));
+            deviceObject->Set(Nan::New("progressCoalesced").ToLocalChecked(), Nan::New((double)metrics.progressCoalesced));
+            retObject->Set(Nan::New(util::WStringToUTF8(device.first)).ToLocalChecked(), deviceObject);
         }
 
-        obj->GetDevice()->CancelScan();
-
+        info.GetReturnValue().Set(retObject);
     }
 
+    static NAN_METHOD(ResetStats)
+    {
+        util::CMetricsRegistry::GetInstance().Reset();
+    }
 
-    static NAN_METHOD(ListAllDevices)
+    // setDevicePool({ idleTtl, maxIdle }), the values absent are left unchanged
+    static NAN_METHOD(SetDevicePool)
     {
-        auto devices = CWIADeviceMgr::GetInstance()->ListAllDevices();
+        CHECK_VALUE_TYPE(info[0], Object, "type \"object\" expected in argument 1.");
+        v8::Local<v8::Object> paramObj = Nan::To<v8::Object>(info[0]).ToLocalChecked();
 
-        v8::Local<v8::Array> retDevicesInfo = Nan::New<v8::Array>();
+        util::WarmPoolOptions options = CWIADeviceMgr::GetInstance()->GetDevicePoolOptions();
 
-        for (size_t i = 0; i < devices.size(); i++)
+        // how long a device closed is kept open, ms. 0 closes the devices at once
+        v8::Local<v8::Value> idleTtlValue = paramObj->Get(Nan::New("idleTtl").ToLocalChecked());
+        if (!idleTtlValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(idleTtlValue, Number, "type \"number\" expected in value \"idleTtl\".");
+            int64_t idleTtl = idleTtlValue->IntegerValue();
+            if (idleTtl < 0)
+            {
+                Nan::ThrowRangeError("value \"idleTtl\" must not be negative.");
+                return;
+            }
+            options.idleTtl = std::chrono::milliseconds(idleTtl);
+        }
+
+        // how many devices closed are kept open at most, of all UUIDs
+        v8::Local<v8::Value> maxIdleValue = paramObj->Get(Nan::New("maxIdle").ToLocalChecked());
+        if (!maxIdleValue->IsNullOrUndefined())
         {
-            v8::Local<v8::Object> deviceInfo = Nan::New<v8::Object>();
+            CHECK_VALUE_TYPE(maxIdleValue, Number, "type \"number\" expected in value \"maxIdle\".");
+            int64_t maxIdle = maxIdleValue->IntegerValue();
+            if (maxIdle < 0)
+            {
+                Nan::ThrowRangeError("value \"maxIdle\" must not be negative.");
+                return;
+            }
+            options.maxIdle = size_t(maxIdle);
+        }
+
+        CWIADeviceMgr::GetInstance()->SetDevicePoolOptions(options);
+    }
+
+    static NAN_METHOD(GetDevicePoolStats)
+    {
+        util::WarmPoolStats stats = CWIADeviceMgr::GetInstance()->GetDevicePoolStats();
+        uint64_t opened = stats.hits + stats.misses;
+
+        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+        retObject->Set(Nan::New("hits").ToLocalChecked(), Nan::New((double)stats.hits));
+        retObject->Set(Nan::New("misses").ToLocalChecked(), Nan::New((double)stats.misses));
+        retObject->Set(Nan::New("hitRate").ToLocalChecked(), Nan::New(opened ? double(stats.hits) / double(opened) : 0.0));
+        retObject->Set(Nan::New("expired").ToLocalChecked(), Nan::New((double)stats.expired));
+        retObject->Set(Nan::New("evicted").ToLocalChecked(), Nan::New((double)stats.evicted));
+        retObject->Set(Nan::New("overCapacity").ToLocalChecked(), Nan::New((double)stats.overCapacity));
+        retObject->Set(Nan::New("idle").ToLocalChecked(), Nan::New((double)stats.idleCount));
+        retObject->Set(Nan::New("inUse").ToLocalChecked(), Nan::New((double)stats.inUseCount));
+
+        info.GetReturnValue().Set(retObject);
+    }
+
+    // setScanScheduler({ maxActiveScans, maxProcessingThreads }), the values absent are left unchanged
+    static NAN_METHOD(SetScanScheduler)
+    {
+        CHECK_VALUE_TYPE(info[0], Object, "type \"object\" expected in argument 1.");
+        v8::Local<v8::Object> paramObj = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+
+        util::CJobScheduler& scheduler = CWIADeviceMgr::GetInstance()->GetScanScheduler();
+        util::JobSchedulerOptions options = scheduler.GetOptions();
 
-            deviceInfo->Set(Nan::New("deviceUUID").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->deviceUUID)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("manufacturer").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->manufacturer)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("description").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->description)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("deviceType").ToLocalChecked(), Nan::New(devices[i]->type));
-            deviceInfo->Set(Nan::New("portName").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->port)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("deviceName").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->deviceName)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("serverName").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->server)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("remoteDeviceId").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->remoteDeviceId)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("uiCLSID").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->uiClassId)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("hardwareConfig").ToLocalChecked(), Nan::New(devices[i]->hardwareConfig));
-            deviceInfo->Set(Nan::New("baudrate").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->baudrate)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("STIGenericCapabilities").ToLocalChecked(), Nan::New(devices[i]->STIGenericCapabilities));
-            deviceInfo->Set(Nan::New("wiaVersion").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->WIAVersion)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("driverVersion").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->DriverVersion)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("PnPIDString").ToLocalChecked(), Nan::New(util::WStringToUTF8(devices[i]->PnPIDString)).ToLocalChecked());
-            deviceInfo->Set(Nan::New("STIDriverVersion").ToLocalChecked(), Nan::New(devices[i]->STIDriverVersion));
+        // scans running at once on all the devices, 0 for no limit
+        v8::Local<v8::Value> maxActiveScansValue = paramObj->Get(Nan::New("maxActiveScans").ToLocalChecked());
+        if (!maxActiveScansValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(maxActiveScansValue, Number, "type \"number\" expected in value \"maxActiveScans\".");
+            int64_t maxActiveScans = maxActiveScansValue->IntegerValue();
+            if (maxActiveScans < 0)
+            {
+                Nan::ThrowRangeError("value \"maxActiveScans\" must not be negative.");
+                return;
+            }
+            options.maxActiveJobs = size_t(maxActiveScans);
+        }
 
-            retDevicesInfo->Set(i, deviceInfo);
+        // pages processed at once by the pipelines of all the scans, 0 for no limit
+        v8::Local<v8::Value> maxProcessingThreadsValue = paramObj->Get(Nan::New("maxProcessingThreads").ToLocalChecked());
+        if (!maxProcessingThreadsValue->IsNullOrUndefined())
+        {
+            CHECK_VALUE_TYPE(maxProcessingThreadsValue, Number, "type \"number\" expected in value \"maxProcessingThreads\".");
+            int64_t maxProcessingThreads = maxProcessingThreadsValue->IntegerValue();
+            if (maxProcessingThreads < 0)
+            {
+                Nan::ThrowRangeError("value \"maxProcessingThreads\" must not be negative.");
+                return;
+            }
+            options.maxProcessingThreads = size_t(maxProcessingThreads);
         }
 
-        info.GetReturnValue().Set(retDevicesInfo);
+        scheduler.SetOptions(options);
+    }
+
+    static NAN_METHOD(GetScanSchedulerStats)
+    {
+        util::JobSchedulerStats stats = CWIADeviceMgr::GetInstance()->GetScanScheduler().GetStats();
+
+        v8::Local<v8::Object> retObject = Nan::New<v8::Object>();
+        retObject->Set(Nan::New("submitted").ToLocalChecked(), Nan::New((double)stats.submitted));
+        retObject->Set(Nan::New("started").ToLocalChecked(), Nan::New((double)stats.started));
+        retObject->Set(Nan::New("finished").ToLocalChecked(), Nan::New((double)stats.finished));
+        retObject->Set(Nan::New("cancelled").ToLocalChecked(), Nan::New((double)stats.cancelled));
+        retObject->Set(Nan::New("queued").ToLocalChecked(), Nan::New((double)stats.queuedCount));
+        retObject->Set(Nan::New("active").ToLocalChecked(), Nan::New((double)stats.activeCount));
+        retObject->Set(Nan::New("maxActive").ToLocalChecked(), Nan::New((double)stats.maxActiveCount));
+        retObject->Set(Nan::New("avgQueueMs").ToLocalChecked(), Nan::New(stats.started ? stats.totalQueueMs / stats.started : 0.0));
+        retObject->Set(Nan::New("maxQueueMs").ToLocalChecked(), Nan::New(stats.maxQueueMs));
+        retObject->Set(Nan::New("avgRunMs").ToLocalChecked(), Nan::New(stats.finished ? stats.totalRunMs / stats.finished : 0.0));
+        retObject->Set(Nan::New("maxRunMs").ToLocalChecked(), Nan::New(stats.maxRunMs));
+
+        v8::Local<v8::Object> processingObject = Nan::New<v8::Object>();
+        processingObject->Set(Nan::New("pages").ToLocalChecked(), Nan::New((double)stats.processing.acquired));
+        processingObject->Set(Nan::New("waited").ToLocalChecked(), Nan::New((double)stats.processing.waited));
+        processingObject->Set(Nan::New("totalWaitMs").ToLocalChecked(), Nan::New(stats.processing.totalWaitMs));
+        processingObject->Set(Nan::New("active").ToLocalChecked(), Nan::New((double)stats.processing.activeCount));
+        processingObject->Set(Nan::New("maxActive").ToLocalChecked(), Nan::New((double)stats.processing.maxActiveCount));
+        retObject->Set(Nan::New("processing").ToLocalChecked(), processingObject);
+
+        info.GetReturnValue().Set(retObject);
     }
 
     static NAN_METHOD(OpenDevice)
@@ -759,6 +2586,18 @@ namespace scanner
 
     static void cleanup()
     {
+        // waits for a change being reported, the handler is not called again
+        if (g_pDeviceChangeEvent)
+        {
+            CWIADeviceMgr::GetInstance()->SetDeviceChangeHandler(nullptr);
+            g_pDeviceChangeEvent.reset();
+        }
+        g_deviceChanges.clear();
+        g_pDeviceAddedCallback.reset();
+        g_pDeviceRemovedCallback.reset();
+
+        // the jobs queued still use the device manager
+        g_pManagerTaskQueue.reset();
         CWIADeviceMgr::GetInstance().reset();
 
         ShutdownComEnvironment();
@@ -793,9 +2632,30 @@ NAN_MODULE_INIT(init)
         return;
     }
 
+    // the thread running listAllDevicesAsync()
+    auto comEnvironment = std::make_shared<std::unique_ptr<util::COMEnvironment>>();
+    g_pManagerTaskQueue.reset(new util::CTaskQueue(
+        [comEnvironment]()
+    {
+        comEnvironment->reset(new util::COMEnvironment(COINIT_MULTITHREADED));
+    },
+        [comEnvironment]()
+    {
+        comEnvironment->reset();
+    }));
+
     scanner::WIADeviceJSWrap::Init(target);
 
     Nan::SetMethod(target, "listAllDevices", ListAllDevices);
+    Nan::SetMethod(target, "listAllDevicesAsync", ListAllDevicesAsync);
+    Nan::SetMethod(target, "on", On);
+    Nan::SetMethod(target, "getCallTimings", GetCallTimings);
+    Nan::SetMethod(target, "getStats", GetStats);
+    Nan::SetMethod(target, "resetStats", ResetStats);
+    Nan::SetMethod(target, "setDevicePool", SetDevicePool);
+    Nan::SetMethod(target, "getDevicePoolStats", GetDevicePoolStats);
+    Nan::SetMethod(target, "setScanScheduler", SetScanScheduler);
+    Nan::SetMethod(target, "getScanSchedulerStats", GetScanSchedulerStats);
     Nan::SetMethod(target, "openDevice", OpenDevice);
     Nan::SetMethod(target, "cleanup", Cleanup);
 
@@ -0,0 +1,211 @@
+#include "stdafx.h"
+#include "memoryBuffer.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+namespace scanner
+{
+    namespace util
+    {
+        // the buffer grows at least by this size, most pages are far bigger than this
+        static const size_t MinimumGrowSize = 64 * 1024;
+
+        CMemoryBuffer::CMemoryBuffer(size_t initialCapacity)
+            : m_pData(nullptr)
+            , m_size(0)
+            , m_capacity(0)
+            , m_position(0)
+        {
+            if (initialCapacity)
+            {
+                Reserve(initialCapacity);
+            }
+        }
+
+        CMemoryBuffer::~CMemoryBuffer()
+        {
+            Free(m_pData);
+        }
+
+        size_t CMemoryBuffer::Write(const void* data, size_t size)
+        {
+            if (!size)
+            {
+                return 0;
+            }
+            if (!data)
+            {
+                return 0;
+            }
+
+            size_t writeEnd = m_position + size;
+            if (writeEnd < m_position)
+            {
+                // overflow
+                return 0;
+            }
+
+            if (writeEnd > m_capacity)
+            {
+                // grow geometrically so that a page written in small pieces is not copied over and over
+                size_t newCapacity = (std::max)(writeEnd, (std::max)(m_capacity * 2, MinimumGrowSize));
+                if (!Reserve(newCapacity))
+                {
+                    return 0;
+                }
+            }
+
+            // the cursor might be moved beyond the end of the data
+            if (m_position > m_size)
+            {
+                memset(m_pData + m_size, 0, m_position - m_size);
+            }
+
+            memcpy(m_pData + m_position, data, size);
+            m_position = writeEnd;
+            m_size = (std::max)(m_size, writeEnd);
+
+            return size;
+        }
+
+        size_t CMemoryBuffer::Read(void* data, size_t size)
+        {
+            if (!data || m_position >= m_size)
+            {
+                return 0;
+            }
+
+            size_t readSize = (std::min)(size, m_size - m_position);
+            memcpy(data, m_pData + m_position, readSize);
+            m_position += readSize;
+
+            return readSize;
+        }
+
+        bool CMemoryBuffer::Seek(int64_t offset, SeekOrigin origin, uint64_t* newPosition)
+        {
+            int64_t base = 0;
+            switch (origin)
+            {
+            case SeekOrigin::Begin:
+                base = 0;
+                break;
+            case SeekOrigin::Current:
+                base = int64_t(m_position);
+                break;
+            case SeekOrigin::End:
+                base = int64_t(m_size);
+                break;
+            default:
+                return false;
+            }
+
+            int64_t position = base + offset;
+            if (position < 0)
+            {
+                return false;
+            }
+
+            m_position = size_t(position);
+            if (newPosition)
+            {
+                *newPosition = m_position;
+            }
+            return true;
+        }
+
+        bool CMemoryBuffer::Resize(size_t size)
+        {
+            if (size > m_capacity && !Reserve(size))
+            {
+                return false;
+            }
+            if (size > m_size)
+            {
+                memset(m_pData + m_size, 0, size - m_size);
+            }
+            m_size = size;
+            return true;
+        }
+
+        bool CMemoryBuffer::Reserve(size_t capacity)
+        {
+            if (capacity <= m_capacity)
+            {
+                return true;
+            }
+
+            // realloc() is able to extend the block in place in most cases
+            char* pNewData = (char*)realloc(m_pData, capacity);
+            if (!pNewData)
+            {
+                return false;
+            }
+
+            m_pData = pNewData;
+            m_capacity = capacity;
+            return true;
+        }
+
+        void CMemoryBuffer::Clear()
+        {
+            m_size = 0;
+            m_position = 0;
+        }
+
+        char* CMemoryBuffer::Data()
+        {
+            return m_pData;
+        }
+
+        const char* CMemoryBuffer::Data() const
+        {
+            return m_pData;
+        }
+
+        size_t CMemoryBuffer::Size() const
+        {
+            return m_size;
+        }
+
+        size_t CMemoryBuffer::Capacity() const
+        {
+            return m_capacity;
+        }
+
+        size_t CMemoryBuffer::Position() const
+        {
+            return m_position;
+        }
+
+        char* CMemoryBuffer::Detach(size_t& size)
+        {
+            char* pData = m_pData;
+            size = m_size;
+
+            // Give back the unused tail of the block. Shrinking is done in place by the allocator.
+            if (pData && m_size && m_size < m_capacity)
+            {
+                char* pShrunk = (char*)realloc(pData, m_size);
+                if (pShrunk)
+                {
+                    pData = pShrunk;
+                }
+            }
+
+            m_pData = nullptr;
+            m_size = 0;
+            m_capacity = 0;
+            m_position = 0;
+
+            return pData;
+        }
+
+        void CMemoryBuffer::Free(char* data)
+        {
+            free(data);
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace scanner
+{
+    namespace util
+    {
+        enum class SeekOrigin
+        {
+            Begin,
+            Current,
+            End
+        };
+
+        // A growable in-memory byte buffer with a file-like cursor.
+        // It has no dependency on Windows, the COM stream adapter lives in memoryStream.h
+        class CMemoryBuffer
+        {
+        public:
+            explicit CMemoryBuffer(size_t initialCapacity = 0);
+            ~CMemoryBuffer();
+
+            CMemoryBuffer(const CMemoryBuffer&) = delete;
+            CMemoryBuffer& operator=(const CMemoryBuffer&) = delete;
+
+            // Write data at the current position, the buffer grows if needed.
+            // Returns how many bytes have been written
+            size_t Write(const void* data, size_t size);
+            // Read data from the current position.
+            // Returns how many bytes have been read
+            size_t Read(void* data, size_t size);
+            bool Seek(int64_t offset, SeekOrigin origin, uint64_t* newPosition = nullptr);
+
+            // Change the logical size of the buffer. New bytes are zero filled
+            bool Resize(size_t size);
+            bool Reserve(size_t capacity);
+            void Clear();
+
+            char* Data();
+            const char* Data() const;
+            size_t Size() const;
+            size_t Capacity() const;
+            size_t Position() const;
+
+            // Give up the ownership of the memory block, the buffer becomes empty afterwards.
+            // The block returned must be released with CMemoryBuffer::Free()
+            char* Detach(size_t& size);
+            static void Free(char* data);
+
+        private:
+            char* m_pData;
+            size_t m_size;
+            size_t m_capacity;
+            size_t m_position;
+        };
+    }
+}
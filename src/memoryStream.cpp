@@ -0,0 +1,210 @@
+#include "stdafx.h"
+#include "memoryStream.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        CMemoryStream::CMemoryStream(std::shared_ptr<CMemoryBuffer> buffer)
+            : m_cRef(1)
+            , m_pBuffer(buffer)
+        {
+            assert(m_pBuffer);
+        }
+
+        CMemoryStream::~CMemoryStream()
+        {
+        }
+
+        std::shared_ptr<CMemoryBuffer> CMemoryStream::GetBuffer() const
+        {
+            return m_pBuffer;
+        }
+
+        // IUnknown
+        HRESULT CMemoryStream::QueryInterface(REFIID riid, void **ppvObject)
+        {
+            if (NULL == ppvObject)
+            {
+                return E_INVALIDARG;
+            }
+
+            if (IsEqualIID(riid, IID_IUnknown))
+            {
+                *ppvObject = static_cast<IUnknown*>(this);
+            }
+            else if (IsEqualIID(riid, IID_ISequentialStream))
+            {
+                *ppvObject = static_cast<ISequentialStream*>(this);
+            }
+            else if (IsEqualIID(riid, IID_IStream))
+            {
+                *ppvObject = static_cast<IStream*>(this);
+            }
+            else
+            {
+                *ppvObject = NULL;
+                return (E_NOINTERFACE);
+            }
+
+            reinterpret_cast<IUnknown*>(*ppvObject)->AddRef();
+            return S_OK;
+        }
+
+        ULONG CMemoryStream::AddRef()
+        {
+            return InterlockedIncrement((long*)&m_cRef);
+        }
+
+        ULONG CMemoryStream::Release()
+        {
+            LONG cRef = InterlockedDecrement((long*)&m_cRef);
+            if (0 == cRef)
+            {
+                delete this;
+            }
+            return cRef;
+        }
+
+        // ISequentialStream
+        HRESULT CMemoryStream::Read(void* pv, ULONG cb, ULONG* pcbRead)
+        {
+            if (!pv)
+            {
+                return STG_E_INVALIDPOINTER;
+            }
+
+            ULONG readSize = (ULONG)m_pBuffer->Read(pv, cb);
+            if (pcbRead)
+            {
+                *pcbRead = readSize;
+            }
+            return readSize < cb ? S_FALSE : S_OK;
+        }
+
+        HRESULT CMemoryStream::Write(const void* pv, ULONG cb, ULONG* pcbWritten)
+        {
+            if (!pv)
+            {
+                return STG_E_INVALIDPOINTER;
+            }
+
+            ULONG writtenSize = (ULONG)m_pBuffer->Write(pv, cb);
+            if (pcbWritten)
+            {
+                *pcbWritten = writtenSize;
+            }
+            return writtenSize < cb ? STG_E_MEDIUMFULL : S_OK;
+        }
+
+        // IStream
+        HRESULT CMemoryStream::Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition)
+        {
+            SeekOrigin origin = SeekOrigin::Begin;
+            switch (dwOrigin)
+            {
+            case STREAM_SEEK_SET:
+                origin = SeekOrigin::Begin;
+                break;
+            case STREAM_SEEK_CUR:
+                origin = SeekOrigin::Current;
+                break;
+            case STREAM_SEEK_END:
+                origin = SeekOrigin::End;
+                break;
+            default:
+                return STG_E_INVALIDFUNCTION;
+            }
+
+            uint64_t newPosition = 0;
+            if (!m_pBuffer->Seek(dlibMove.QuadPart, origin, &newPosition))
+            {
+                return STG_E_INVALIDFUNCTION;
+            }
+
+            if (plibNewPosition)
+            {
+                plibNewPosition->QuadPart = newPosition;
+            }
+            return S_OK;
+        }
+
+        HRESULT CMemoryStream::SetSize(ULARGE_INTEGER libNewSize)
+        {
+            if (libNewSize.QuadPart > SIZE_MAX)
+            {
+                return STG_E_MEDIUMFULL;
+            }
+            return m_pBuffer->Resize((size_t)libNewSize.QuadPart) ? S_OK : STG_E_MEDIUMFULL;
+        }
+
+        HRESULT CMemoryStream::CopyTo(IStream* pstm, ULARGE_INTEGER cb, ULARGE_INTEGER* pcbRead, ULARGE_INTEGER* pcbWritten)
+        {
+            if (!pstm)
+            {
+                return STG_E_INVALIDPOINTER;
+            }
+
+            size_t position = m_pBuffer->Position();
+            size_t available = position < m_pBuffer->Size() ? m_pBuffer->Size() - position : 0;
+            ULONG copySize = (ULONG)(std::min)(cb.QuadPart, (ULONGLONG)available);
+
+            ULONG written = 0;
+            HRESULT hr = S_OK;
+            if (copySize)
+            {
+                hr = pstm->Write(m_pBuffer->Data() + position, copySize, &written);
+            }
+            m_pBuffer->Seek(copySize, SeekOrigin::Current);
+
+            if (pcbRead)
+            {
+                pcbRead->QuadPart = copySize;
+            }
+            if (pcbWritten)
+            {
+                pcbWritten->QuadPart = written;
+            }
+            return hr;
+        }
+
+        HRESULT CMemoryStream::Commit(DWORD grfCommitFlags)
+        {
+            return S_OK;
+        }
+
+        HRESULT CMemoryStream::Revert()
+        {
+            return S_OK;
+        }
+
+        HRESULT CMemoryStream::LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+        {
+            return STG_E_INVALIDFUNCTION;
+        }
+
+        HRESULT CMemoryStream::UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType)
+        {
+            return STG_E_INVALIDFUNCTION;
+        }
+
+        HRESULT CMemoryStream::Stat(STATSTG* pstatstg, DWORD grfStatFlag)
+        {
+            if (!pstatstg)
+            {
+                return STG_E_INVALIDPOINTER;
+            }
+
+            memset(pstatstg, 0, sizeof(STATSTG));
+            pstatstg->type = STGTY_STREAM;
+            pstatstg->cbSize.QuadPart = m_pBuffer->Size();
+            pstatstg->grfMode = STGM_READWRITE;
+            return S_OK;
+        }
+
+        HRESULT CMemoryStream::Clone(IStream** ppstm)
+        {
+            return E_NOTIMPL;
+        }
+    }
+}
@@ -0,0 +1,260 @@
+#include "stdafx.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            const size_t SubBucketCount = size_t(1) << CLatencyHistogram::SubBucketBits;
+
+            // the index of the highest bit set, 0 for 0 and 1
+            int HighestBit(uint64_t value)
+            {
+                int bit = 0;
+                for (int step = 32; step; step >>= 1)
+                {
+                    if (value >> step)
+                    {
+                        value >>= step;
+                        bit += step;
+                    }
+                }
+                return bit;
+            }
+
+            thread_local DeviceMetrics* t_pCurrentMetrics = nullptr;
+        }
+
+        double HistogramSnapshot::MeanUs() const
+        {
+            return count ? double(sumUs) / double(count) : 0;
+        }
+
+        uint64_t HistogramSnapshot::PercentileUs(double percentile) const
+        {
+            uint64_t total = 0;
+            for (uint64_t bucket : buckets)
+            {
+                total += bucket;
+            }
+            if (!total)
+            {
+                return 0;
+            }
+
+            // the rank of the value, 1 for the smallest one
+            double fraction = (std::min)((std::max)(percentile, 0.0), 100.0) / 100.0;
+            uint64_t rank = (std::max)(uint64_t(std::ceil(fraction * double(total))), uint64_t(1));
+
+            uint64_t seen = 0;
+            for (size_t i = 0; i < buckets.size(); i++)
+            {
+                seen += buckets[i];
+                if (seen >= rank)
+                {
+                    return (std::min)((std::max)(CLatencyHistogram::BucketUpperBound(i), minUs), maxUs);
+                }
+            }
+            return maxUs;
+        }
+
+        CLatencyHistogram::CLatencyHistogram()
+        {
+            Reset();
+        }
+
+        void CLatencyHistogram::Record(uint64_t valueUs)
+        {
+            m_sumUs.fetch_add(valueUs, std::memory_order_relaxed);
+
+            uint64_t minUs = m_minUs.load(std::memory_order_relaxed);
+            while (valueUs < minUs && !m_minUs.compare_exchange_weak(minUs, valueUs, std::memory_order_relaxed))
+            {
+            }
+            uint64_t maxUs = m_maxUs.load(std::memory_order_relaxed);
+            while (valueUs > maxUs && !m_maxUs.compare_exchange_weak(maxUs, valueUs, std::memory_order_relaxed))
+            {
+            }
+
+            // counted last, a snapshot seeing the value sees it in the sum and the extremes too
+            m_buckets[BucketIndex(valueUs)].fetch_add(1, std::memory_order_release);
+        }
+
+        void CLatencyHistogram::Record(std::chrono::steady_clock::duration elapsed)
+        {
+            auto elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+            Record(uint64_t((std::max)(elapsedUs, decltype(elapsedUs)(0))));
+        }
+
+        HistogramSnapshot CLatencyHistogram::GetSnapshot() const
+        {
+            HistogramSnapshot snapshot;
+            snapshot.buckets.resize(BucketCount);
+            for (size_t i = 0; i < BucketCount; i++)
+            {
+                snapshot.buckets[i] = m_buckets[i].load(std::memory_order_acquire);
+                snapshot.count += snapshot.buckets[i];
+            }
+            snapshot.sumUs = m_sumUs.load(std::memory_order_relaxed);
+            if (snapshot.count)
+            {
+                snapshot.minUs = m_minUs.load(std::memory_order_relaxed);
+                snapshot.maxUs = m_maxUs.load(std::memory_order_relaxed);
+            }
+            return snapshot;
+        }
+
+        void CLatencyHistogram::Reset()
+        {
+            for (auto& bucket : m_buckets)
+            {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+            m_sumUs.store(0, std::memory_order_relaxed);
+            m_minUs.store(UINT64_MAX, std::memory_order_relaxed);
+            m_maxUs.store(0, std::memory_order_relaxed);
+        }
+
+        size_t CLatencyHistogram::BucketIndex(uint64_t valueUs)
+        {
+            // the first two powers of two are exact, then every power of two is split in 32 buckets
+            if (valueUs < 2 * SubBucketCount)
+            {
+                return size_t(valueUs);
+            }
+            int shift = HighestBit(valueUs) - SubBucketBits;
+            if (shift > MaxValueBits - SubBucketBits - 1)
+            {
+                return BucketCount - 1;
+            }
+            return (size_t(shift) << SubBucketBits) + size_t(valueUs >> shift);
+        }
+
+        uint64_t CLatencyHistogram::BucketLowerBound(size_t index)
+        {
+            if (index < 2 * SubBucketCount)
+            {
+                return uint64_t(index);
+            }
+            int shift = int(index >> SubBucketBits) - 1;
+            return uint64_t(index - (size_t(shift) << SubBucketBits)) << shift;
+        }
+
+        uint64_t CLatencyHistogram::BucketUpperBound(size_t index)
+        {
+            if (index < 2 * SubBucketCount)
+            {
+                return uint64_t(index);
+            }
+            if (index >= BucketCount - 1)
+            {
+                return UINT64_MAX;
+            }
+            return BucketLowerBound(index + 1) - 1;
+        }
+
+        void DeviceMetrics::Reset()
+        {
+            readMultiple.Reset();
+            writeMultiple.Reset();
+            createDevice.Reset();
+            enumChildItems.Reset();
+            download.Reset();
+            pageTransfer.Reset();
+
+            scans.Reset();
+            failedScans.Reset();
+            pages.Reset();
+            bytes.Reset();
+            progressDelivered.Reset();
+            progressCoalesced.Reset();
+        }
+
+        double DeviceMetricsSnapshot::BytesPerSecond() const
+        {
+            return pageTransfer.sumUs ? double(bytes) * 1000000.0 / double(pageTransfer.sumUs) : 0;
+        }
+
+        CMetricsRegistry::CMetricsRegistry()
+        {
+        }
+
+        CMetricsRegistry& CMetricsRegistry::GetInstance()
+        {
+            static CMetricsRegistry instance;
+            return instance;
+        }
+
+        std::shared_ptr<DeviceMetrics> CMetricsRegistry::GetDeviceMetrics(const std::wstring& deviceUUID)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            auto& pMetrics = m_devices[deviceUUID];
+            if (!pMetrics)
+            {
+                pMetrics = std::make_shared<DeviceMetrics>();
+            }
+            return pMetrics;
+        }
+
+        std::map<std::wstring, DeviceMetricsSnapshot> CMetricsRegistry::GetSnapshot() const
+        {
+            std::map<std::wstring, std::shared_ptr<DeviceMetrics>> devices;
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                devices = m_devices;
+            }
+
+            std::map<std::wstring, DeviceMetricsSnapshot> snapshot;
+            for (const auto& device : devices)
+            {
+                const DeviceMetrics& metrics = *device.second;
+                DeviceMetricsSnapshot& deviceSnapshot = snapshot[device.first];
+                deviceSnapshot.readMultiple = metrics.readMultiple.GetSnapshot();
+                deviceSnapshot.writeMultiple = metrics.writeMultiple.GetSnapshot();
+                deviceSnapshot.createDevice = metrics.createDevice.GetSnapshot();
+                deviceSnapshot.enumChildItems = metrics.enumChildItems.GetSnapshot();
+                deviceSnapshot.download = metrics.download.GetSnapshot();
+                deviceSnapshot.pageTransfer = metrics.pageTransfer.GetSnapshot();
+
+                deviceSnapshot.scans = metrics.scans.Get();
+                deviceSnapshot.failedScans = metrics.failedScans.Get();
+                deviceSnapshot.pages = metrics.pages.Get();
+                deviceSnapshot.bytes = metrics.bytes.Get();
+                deviceSnapshot.progressDelivered = metrics.progressDelivered.Get();
+                deviceSnapshot.progressCoalesced = metrics.progressCoalesced.Get();
+            }
+            return snapshot;
+        }
+
+        void CMetricsRegistry::Reset()
+        {
+            // the devices open keep their metrics, they are cleared only
+            std::lock_guard<std::mutex> g(m_lock);
+            for (auto& device : m_devices)
+            {
+                device.second->Reset();
+            }
+        }
+
+        CMetricsScope::CMetricsScope(DeviceMetrics* pMetrics)
+            : m_pPrevious(t_pCurrentMetrics)
+        {
+            t_pCurrentMetrics = pMetrics;
+        }
+
+        CMetricsScope::~CMetricsScope()
+        {
+            t_pCurrentMetrics = m_pPrevious;
+        }
+
+        DeviceMetrics* CMetricsScope::Current()
+        {
+            return t_pCurrentMetrics;
+        }
+    }
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace scanner
+{
+    namespace util
+    {
+        struct HistogramSnapshot
+        {
+            uint64_t count = 0;
+            uint64_t sumUs = 0;
+            uint64_t minUs = 0;
+            uint64_t maxUs = 0;
+            std::vector<uint64_t> buckets;
+
+            double MeanUs() const;
+            // the upper bound of the bucket the percentile falls in, e.g. 99.9; at most 1/32 above the value recorded
+            uint64_t PercentileUs(double percentile) const;
+        };
+
+        // Latencies in microseconds in log-linear buckets as HdrHistogram does: 32 buckets for every power of two,
+        // exact up to 64 us, then within 1/32. Values above 2^40 us (12 days) are counted in the last bucket.
+        // Recording is lock-free, any thread may record while another one reads a snapshot
+        class CLatencyHistogram
+        {
+        public:
+            static const int SubBucketBits = 5;
+            static const int MaxValueBits = 40;
+            static const size_t BucketCount = size_t(MaxValueBits - SubBucketBits + 1) << SubBucketBits;
+
+            CLatencyHistogram();
+
+            CLatencyHistogram(const CLatencyHistogram&) = delete;
+            CLatencyHistogram& operator=(const CLatencyHistogram&) = delete;
+
+            void Record(uint64_t valueUs);
+            void Record(std::chrono::steady_clock::duration elapsed);
+            // taken while values are recorded, the sum and the extremes may include values not counted yet
+            HistogramSnapshot GetSnapshot() const;
+            void Reset();
+
+            static size_t BucketIndex(uint64_t valueUs);
+            // the values counted in the bucket
+            static uint64_t BucketLowerBound(size_t index);
+            static uint64_t BucketUpperBound(size_t index);
+
+        private:
+            std::atomic<uint64_t> m_buckets[BucketCount];     // the count is their sum
+            std::atomic<uint64_t> m_sumUs;
+            std::atomic<uint64_t> m_minUs;
+            std::atomic<uint64_t> m_maxUs;
+        };
+
+        class CCounter
+        {
+        public:
+            CCounter() : m_value(0) {}
+
+            void Add(uint64_t value = 1)
+            {
+                m_value.fetch_add(value, std::memory_order_relaxed);
+            }
+            uint64_t Get() const
+            {
+                return m_value.load(std::memory_order_relaxed);
+            }
+            void Reset()
+            {
+                m_value.store(0, std::memory_order_relaxed);
+            }
+
+        private:
+            std::atomic<uint64_t> m_value;
+        };
+
+        // What a device has cost since the module has been loaded, kept when the device is closed and opened again
+        struct DeviceMetrics
+        {
+            // the calls to the driver
+            CLatencyHistogram readMultiple;
+            CLatencyHistogram writeMultiple;
+            CLatencyHistogram createDevice;
+            CLatencyHistogram enumChildItems;
+            CLatencyHistogram download;
+            // from the first byte of a page to its end
+            CLatencyHistogram pageTransfer;
+
+            CCounter scans;
+            CCounter failedScans;
+            CCounter pages;
+            CCounter bytes;
+            // the progress events given to JS, and the ones merged into them as JS didn't keep up
+            CCounter progressDelivered;
+            CCounter progressCoalesced;
+
+            void Reset();
+        };
+
+        struct DeviceMetricsSnapshot
+        {
+            HistogramSnapshot readMultiple;
+            HistogramSnapshot writeMultiple;
+            HistogramSnapshot createDevice;
+            HistogramSnapshot enumChildItems;
+            HistogramSnapshot download;
+            HistogramSnapshot pageTransfer;
+
+            uint64_t scans = 0;
+            uint64_t failedScans = 0;
+            uint64_t pages = 0;
+            uint64_t bytes = 0;
+            uint64_t progressDelivered = 0;
+            uint64_t progressCoalesced = 0;
+
+            // over the time the pages have been transferred
+            double BytesPerSecond() const;
+        };
+
+        // The metrics of all devices by UUID. The lock is taken when a device is looked up and for the snapshots only,
+        // the devices keep their metrics to record into
+        class CMetricsRegistry
+        {
+        public:
+            static CMetricsRegistry& GetInstance();
+
+            std::shared_ptr<DeviceMetrics> GetDeviceMetrics(const std::wstring& deviceUUID);
+            std::map<std::wstring, DeviceMetricsSnapshot> GetSnapshot() const;
+            void Reset();
+
+        private:
+            CMetricsRegistry();
+
+            CMetricsRegistry(const CMetricsRegistry&) = delete;
+            CMetricsRegistry& operator=(const CMetricsRegistry&) = delete;
+
+        private:
+            mutable std::mutex m_lock;
+            std::map<std::wstring, std::shared_ptr<DeviceMetrics>> m_devices;
+        };
+
+        // The device the calls of the thread are recorded for until destruction, so that helpers
+        // not knowing the device (e.g. the ones reading the properties) can record them
+        class CMetricsScope
+        {
+        public:
+            explicit CMetricsScope(DeviceMetrics* pMetrics);
+            ~CMetricsScope();
+
+            CMetricsScope(const CMetricsScope&) = delete;
+            CMetricsScope& operator=(const CMetricsScope&) = delete;
+
+            // nullptr outside of a scope
+            static DeviceMetrics* Current();
+
+        private:
+            DeviceMetrics* m_pPrevious;
+        };
+
+        // Records the time elapsed between construction and destruction to a histogram of the metrics, if any
+        class CScopedLatency
+        {
+        public:
+            CScopedLatency(DeviceMetrics* pMetrics, CLatencyHistogram DeviceMetrics::* histogram)
+                : m_pHistogram(pMetrics ? &(pMetrics->*histogram) : nullptr)
+            {
+                if (m_pHistogram)
+                {
+                    m_startTime = std::chrono::steady_clock::now();
+                }
+            }
+
+            ~CScopedLatency()
+            {
+                if (m_pHistogram)
+                {
+                    m_pHistogram->Record(std::chrono::steady_clock::now() - m_startTime);
+                }
+            }
+
+            CScopedLatency(const CScopedLatency&) = delete;
+            CScopedLatency& operator=(const CScopedLatency&) = delete;
+
+        private:
+            CLatencyHistogram* m_pHistogram;
+            std::chrono::steady_clock::time_point m_startTime;
+        };
+    }
+}
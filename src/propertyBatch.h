@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace scanner
+{
+    namespace util
+    {
+        // The packing of the batched property calls, without WIA types.
+        // Spec is PROPSPEC and Variant is PROPVARIANT in the module; anything with the same members will do.
+
+        // One spec per ID, in the order of the IDs
+        template <typename Spec, typename Id, typename Kind>
+        std::unique_ptr<Spec[]> PackPropertySpecs(const std::vector<Id>& ids, Kind kind)
+        {
+            std::unique_ptr<Spec[]> specs(new Spec[ids.size()]());
+            for (size_t i = 0; i < ids.size(); i++)
+            {
+                specs[i].ulKind = kind;
+                specs[i].propid = ids[i];
+            }
+            return specs;
+        }
+
+        // values[i] into variants[i] as a 32-bit integer of the type given, e.g. VT_I4
+        template <typename Variant, typename Value, typename Type>
+        void PackLongValues(const std::vector<Value>& values, Variant* variants, Type type)
+        {
+            for (size_t i = 0; i < values.size(); i++)
+            {
+                variants[i].vt = type;
+                variants[i].lVal = values[i];
+            }
+        }
+
+        // Write properties owned by settings, e.g. the X and Y resolutions by the DPI, in one batch.
+        // The batch is rejected as a whole if a single property is, in that case the properties are written one by one
+        // to find out which settings are not accepted.
+        // writeBatch() writes all the properties and writeOne(i) the property i, both return false if rejected.
+        // Returns the owners whose properties have all been written
+        template <typename WriteBatch, typename WriteOne>
+        unsigned int WritePropertyBatch(const std::vector<unsigned int>& owners, WriteBatch&& writeBatch, WriteOne&& writeOne)
+        {
+            unsigned int written = 0;
+            for (auto owner : owners)
+            {
+                written |= owner;
+            }
+            if (owners.empty() || writeBatch())
+            {
+                return written;
+            }
+
+            unsigned int failed = 0;
+            for (size_t i = 0; i < owners.size(); i++)
+            {
+                if (!writeOne(i))
+                {
+                    failed |= owners[i];
+                }
+            }
+            return written & ~failed;
+        }
+    }
+}
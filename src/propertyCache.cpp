@@ -0,0 +1,86 @@
+#include "stdafx.h"
+#include "propertyCache.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        CPropertyCache::CPropertyCache()
+        {
+        }
+
+        CPropertyCache::~CPropertyCache()
+        {
+        }
+
+        bool CPropertyCache::GetValues(const std::vector<PROPID>& propids, std::map<PROPID, LONG>& values, std::vector<PROPID>& missing)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+
+            missing.clear();
+            for (auto propid : propids)
+            {
+                auto iter = m_values.find(propid);
+                if (iter != m_values.end())
+                {
+                    values[propid] = iter->second;
+                    m_stats.hits++;
+                }
+                else
+                {
+                    missing.push_back(propid);
+                    m_stats.misses++;
+                }
+            }
+            return missing.empty();
+        }
+
+        void CPropertyCache::SetValue(PROPID propid, LONG value)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            m_values[propid] = value;
+        }
+
+        void CPropertyCache::RemoveValue(PROPID propid)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            m_values.erase(propid);
+        }
+
+        bool CPropertyCache::GetRange(PROPID propid, PropertyRange& range)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+
+            auto iter = m_ranges.find(propid);
+            if (iter == m_ranges.end())
+            {
+                m_stats.misses++;
+                return false;
+            }
+
+            range = iter->second;
+            m_stats.hits++;
+            return true;
+        }
+
+        void CPropertyCache::SetRange(PROPID propid, const PropertyRange& range)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            m_ranges[propid] = range;
+        }
+
+        void CPropertyCache::Invalidate()
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            m_values.clear();
+            m_ranges.clear();
+            m_stats.invalidations++;
+        }
+
+        PropertyCacheStats CPropertyCache::GetStats() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_stats;
+        }
+    }
+}
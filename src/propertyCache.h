@@ -0,0 +1,66 @@
+#pragma once
+
+#include <wtypes.h>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace scanner
+{
+    // valid values of a property with a WIA_PROP_RANGE attribute
+    struct PropertyRange
+    {
+        int min = 0;
+        int max = 0;
+        int normal = 0;
+        int step = 1;
+    };
+
+    namespace util
+    {
+        struct PropertyCacheStats
+        {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t invalidations = 0;
+        };
+
+        // The last values and ranges read from (or written to) the properties of a WIA item.
+        // Lookups of cached properties don't go to the driver.
+        // Thread safe, the cache can be invalidated from the thread receiving WIA events.
+        class CPropertyCache
+        {
+        public:
+            CPropertyCache();
+            ~CPropertyCache();
+
+            CPropertyCache(const CPropertyCache&) = delete;
+            CPropertyCache& operator=(const CPropertyCache&) = delete;
+
+            // Look up the values of propids. values receives the ones cached,
+            // missing receives the ones which have to be read from the device.
+            // Returns true if all of them are cached
+            bool GetValues(const std::vector<PROPID>& propids, std::map<PROPID, LONG>& values, std::vector<PROPID>& missing);
+            void SetValue(PROPID propid, LONG value);
+            void RemoveValue(PROPID propid);
+
+            bool GetRange(PROPID propid, PropertyRange& range);
+            void SetRange(PROPID propid, const PropertyRange& range);
+
+            // Drop everything cached, the next lookups go to the device
+            void Invalidate();
+
+            PropertyCacheStats GetStats() const;
+
+        private:
+            mutable std::mutex m_lock;
+
+            std::map<PROPID, LONG> m_values;
+            std::map<PROPID, PropertyRange> m_ranges;
+
+            PropertyCacheStats m_stats;
+        };
+    }
+}
@@ -0,0 +1,271 @@
+#include "stdafx.h"
+#include "rawImage.h"
+#include "inkCount.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            const double PI = 3.14159265358979323846;
+
+            inline uint8_t Luma(uint8_t b, uint8_t g, uint8_t r)
+            {
+                return uint8_t((29 * b + 150 * g + 77 * r) >> 8);
+            }
+
+            inline uint8_t GetLuma(const RawImage& image, uint32_t x, uint32_t y)
+            {
+                const uint8_t* row = image.Row(y);
+                if (image.format == PixelFormat::Gray8)
+                {
+                    return row[x];
+                }
+                const uint8_t* pixel = row + x * 3;
+                return Luma(pixel[0], pixel[1], pixel[2]);
+            }
+
+            struct Point
+            {
+                int32_t x;
+                int32_t y;
+            };
+
+            // sharpness of the projection profile of the points sheared by tan(angle)
+            double ProfileScore(const std::vector<Point>& points, int32_t width, int32_t height, double angle, std::vector<uint32_t>& bins)
+            {
+                double slope = std::tan(angle * PI / 180.0);
+                int32_t offset = int32_t(std::ceil(std::fabs(slope) * width)) + 1;
+
+                bins.assign(size_t(height + 2 * offset), 0);
+                for (const auto& point : points)
+                {
+                    int32_t bin = int32_t(std::lround(point.y - point.x * slope)) + offset;
+                    bins[bin]++;
+                }
+
+                double score = 0;
+                for (auto count : bins)
+                {
+                    score += double(count) * count;
+                }
+                return score;
+            }
+        }
+
+        size_t GetBytesPerPixel(PixelFormat format)
+        {
+            return format == PixelFormat::BGR24 ? 3 : 1;
+        }
+
+        RawImage CreateRawImage(uint32_t width, uint32_t height, PixelFormat format, uint8_t fill)
+        {
+            RawImage image;
+            image.width = width;
+            image.height = height;
+            image.format = format;
+            image.stride = width * GetBytesPerPixel(format);
+            image.pixels.assign(image.stride * height, fill);
+            return image;
+        }
+
+        RawImage ToGray8(const RawImage& image)
+        {
+            if (image.format == PixelFormat::Gray8)
+            {
+                return image;
+            }
+
+            RawImage gray = CreateRawImage(image.width, image.height, PixelFormat::Gray8);
+            gray.dpiX = image.dpiX;
+            gray.dpiY = image.dpiY;
+
+            for (uint32_t y = 0; y < image.height; y++)
+            {
+                const uint8_t* src = image.Row(y);
+                uint8_t* dst = gray.Row(y);
+                for (uint32_t x = 0; x < image.width; x++, src += 3)
+                {
+                    dst[x] = Luma(src[0], src[1], src[2]);
+                }
+            }
+            return gray;
+        }
+
+        double MeasureInkRatio(const RawImage& image, uint8_t darkThreshold, double marginRatio)
+        {
+            uint32_t marginX = uint32_t(image.width * marginRatio);
+            uint32_t marginY = uint32_t(image.height * marginRatio);
+            if (image.Empty() || marginX * 2 >= image.width || marginY * 2 >= image.height)
+            {
+                return 0;
+            }
+
+            // rows are counted by the SIMD kernel, color rows are converted to luma first
+            uint32_t rowWidth = image.width - marginX * 2;
+            std::vector<uint8_t> lumaRow(image.format == PixelFormat::Gray8 ? 0 : rowWidth);
+
+            uint64_t inkCount = 0;
+            for (uint32_t y = marginY; y < image.height - marginY; y++)
+            {
+                const uint8_t* row = image.Row(y) + marginX * GetBytesPerPixel(image.format);
+                if (image.format != PixelFormat::Gray8)
+                {
+                    for (uint32_t x = 0; x < rowWidth; x++, row += 3)
+                    {
+                        lumaRow[x] = Luma(row[0], row[1], row[2]);
+                    }
+                    row = lumaRow.data();
+                }
+                inkCount += CountDarkPixels(row, rowWidth, darkThreshold);
+            }
+
+            uint64_t total = uint64_t(rowWidth) * (image.height - marginY * 2);
+            return double(inkCount) / total;
+        }
+
+        bool IsBlankPage(const RawImage& image, const BlankPageOptions& options, double* inkRatio)
+        {
+            double ratio = MeasureInkRatio(image, options.darkThreshold, options.marginRatio);
+            if (inkRatio)
+            {
+                *inkRatio = ratio;
+            }
+            return ratio < options.maxInkRatio;
+        }
+
+        double EstimateSkewAngle(const RawImage& image, double maxAngle, double angleStep)
+        {
+            if (image.Empty() || maxAngle <= 0 || angleStep <= 0)
+            {
+                return 0;
+            }
+
+            // Sample the page on a grid, a few hundred thousand points are enough to find the lines
+            const size_t maxPoints = 256 * 1024;
+            const uint8_t darkThreshold = 128;
+            uint32_t step = std::max<uint32_t>(1, image.width / 1024);
+            uint32_t marginX = image.width / 20;
+            uint32_t marginY = image.height / 20;
+
+            std::vector<Point> points;
+            while (true)
+            {
+                points.clear();
+                for (uint32_t y = marginY; y + marginY < image.height && points.size() <= maxPoints; y += step)
+                {
+                    for (uint32_t x = marginX; x + marginX < image.width; x += step)
+                    {
+                        if (GetLuma(image, x, y) < darkThreshold)
+                        {
+                            points.push_back({ int32_t(x / step), int32_t(y / step) });
+                        }
+                    }
+                }
+
+                if (points.size() <= maxPoints)
+                {
+                    break;
+                }
+                step *= 2;
+            }
+
+            // too little ink to tell
+            if (points.size() < 64)
+            {
+                return 0;
+            }
+
+            int32_t width = int32_t(image.width / step + 1);
+            int32_t height = int32_t(image.height / step + 1);
+            std::vector<uint32_t> bins;
+
+            // coarse search over the whole range, then a fine one around the best angle
+            double coarseStep = std::max(angleStep, 0.5);
+            double bestAngle = 0;
+            double bestScore = ProfileScore(points, width, height, 0, bins);
+            for (double angle = -maxAngle; angle <= maxAngle; angle += coarseStep)
+            {
+                double score = ProfileScore(points, width, height, angle, bins);
+                if (score > bestScore)
+                {
+                    bestScore = score;
+                    bestAngle = angle;
+                }
+            }
+
+            double center = bestAngle;
+            for (double angle = center - coarseStep; angle <= center + coarseStep; angle += angleStep)
+            {
+                if (std::fabs(angle) > maxAngle)
+                {
+                    continue;
+                }
+
+                double score = ProfileScore(points, width, height, angle, bins);
+                if (score > bestScore)
+                {
+                    bestScore = score;
+                    bestAngle = angle;
+                }
+            }
+
+            return bestAngle;
+        }
+
+        RawImage DeskewImage(const RawImage& image, double angle)
+        {
+            RawImage result = CreateRawImage(image.width, image.height, image.format);
+            result.dpiX = image.dpiX;
+            result.dpiY = image.dpiY;
+
+            size_t bpp = GetBytesPerPixel(image.format);
+            double sinA = std::sin(angle * PI / 180.0);
+            double cosA = std::cos(angle * PI / 180.0);
+            double cx = image.width / 2.0;
+            double cy = image.height / 2.0;
+
+            for (uint32_t y = 0; y < image.height; y++)
+            {
+                uint8_t* dst = result.Row(y);
+                double dy = y - cy;
+
+                for (uint32_t x = 0; x < image.width; x++, dst += bpp)
+                {
+                    // the source position of the output pixel, bilinear interpolated
+                    double dx = x - cx;
+                    double sx = cx + dx * cosA - dy * sinA;
+                    double sy = cy + dx * sinA + dy * cosA;
+
+                    if (sx < 0 || sy < 0 || sx >= image.width - 1 || sy >= image.height - 1)
+                    {
+                        continue;
+                    }
+
+                    uint32_t x0 = uint32_t(sx);
+                    uint32_t y0 = uint32_t(sy);
+                    double fx = sx - x0;
+                    double fy = sy - y0;
+
+                    const uint8_t* p00 = image.Row(y0) + x0 * bpp;
+                    const uint8_t* p10 = p00 + bpp;
+                    const uint8_t* p01 = p00 + image.stride;
+                    const uint8_t* p11 = p01 + bpp;
+
+                    for (size_t c = 0; c < bpp; c++)
+                    {
+                        double top = p00[c] + (p10[c] - p00[c]) * fx;
+                        double bottom = p01[c] + (p11[c] - p01[c]) * fx;
+                        dst[c] = uint8_t(top + (bottom - top) * fy + 0.5);
+                    }
+                }
+            }
+
+            return result;
+        }
+    }
+}
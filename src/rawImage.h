@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace scanner
+{
+    namespace util
+    {
+        enum class PixelFormat
+        {
+            Gray8,      // 1 byte per pixel
+            BGR24,      // 3 bytes per pixel, blue first as in Windows bitmaps
+        };
+
+        // An uncompressed image, rows top-down
+        struct RawImage
+        {
+            uint32_t width = 0;
+            uint32_t height = 0;
+            PixelFormat format = PixelFormat::Gray8;
+            size_t stride = 0;          // bytes per row
+            double dpiX = 0;
+            double dpiY = 0;
+            std::vector<uint8_t> pixels;
+
+            bool Empty() const
+            {
+                return pixels.empty();
+            }
+            uint8_t* Row(uint32_t y)
+            {
+                return pixels.data() + y * stride;
+            }
+            const uint8_t* Row(uint32_t y) const
+            {
+                return pixels.data() + y * stride;
+            }
+        };
+
+        size_t GetBytesPerPixel(PixelFormat format);
+
+        // Allocate an image filled with the value
+        RawImage CreateRawImage(uint32_t width, uint32_t height, PixelFormat format, uint8_t fill = 0xff);
+        // Convert to 8 bit grayscale, the image is copied if it is grayscale already
+        RawImage ToGray8(const RawImage& image);
+
+        struct BlankPageOptions
+        {
+            uint8_t darkThreshold = 160;    // pixels darker than this are ink
+            double maxInkRatio = 0.002;     // a page with less ink than this ratio is blank
+            double marginRatio = 0.05;      // borders ignored on each side, scanners often leave shadows there
+        };
+
+        // Ratio of the dark pixels to all pixels inside the margins
+        double MeasureInkRatio(const RawImage& image, uint8_t darkThreshold, double marginRatio);
+        bool IsBlankPage(const RawImage& image, const BlankPageOptions& options, double* inkRatio = nullptr);
+
+        // Estimate the skew of the text lines in degrees, positive if the lines go down to the right.
+        // The projection profile of the dark pixels is the sharpest at the angle of the lines
+        double EstimateSkewAngle(const RawImage& image, double maxAngle, double angleStep = 0.1);
+        // Rotate the image so that lines of the angle become horizontal, the uncovered corners are filled white.
+        // The size of the image is kept
+        RawImage DeskewImage(const RawImage& image, double angle);
+    }
+}
@@ -0,0 +1,404 @@
+#include "stdafx.h"
+#include "rawScan.h"
+
+#include <cstring>
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            // little-endian fields, the data may not be aligned
+            inline uint32_t ReadUInt32(const uint8_t* p)
+            {
+                return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+            }
+            inline int32_t ReadInt32(const uint8_t* p)
+            {
+                return int32_t(ReadUInt32(p));
+            }
+            inline uint16_t ReadUInt16(const uint8_t* p)
+            {
+                return uint16_t(p[0] | (p[1] << 8));
+            }
+
+            inline uint8_t Luma(uint8_t b, uint8_t g, uint8_t r)
+            {
+                return uint8_t((29 * b + 150 * g + 77 * r) >> 8);
+            }
+
+            // layout of WIA_RAW_HEADER, see wia_lh.h
+            const size_t RawHeaderSize = 76;
+            const uint32_t RawDataTypeRawBGR = 7;       // WIA_DATA_RAW_BGR
+            const uint32_t RawPhotoWhite0 = 1;          // WIA_PHOTO_WHITE_0, 0 bits are white
+            const uint32_t RawLineOrderBottomToTop = 2; // WIA_LINE_ORDER_BOTTOM_TO_TOP
+
+            bool ParseWiaRaw(const uint8_t* data, size_t size, RawScanLayout& layout)
+            {
+                if (size < RawHeaderSize || std::memcmp(data, "WRAW", 4) != 0)
+                {
+                    return false;
+                }
+
+                uint32_t headerSize = ReadUInt32(data + 8);
+                layout.dpiX = ReadUInt32(data + 12);
+                layout.dpiY = ReadUInt32(data + 16);
+                layout.width = ReadUInt32(data + 20);
+                layout.height = ReadUInt32(data + 24);
+                layout.stride = ReadUInt32(data + 28);
+                layout.bitsPerPixel = ReadUInt32(data + 32);
+                uint32_t dataType = ReadUInt32(data + 40);
+                uint32_t compression = ReadUInt32(data + 52);
+                uint32_t photometric = ReadUInt32(data + 56);
+                uint32_t lineOrder = ReadUInt32(data + 60);
+                uint32_t dataOffset = ReadUInt32(data + 64);
+
+                if (compression != 0 || (layout.bitsPerPixel != 1 && layout.bitsPerPixel != 8 && layout.bitsPerPixel != 24))
+                {
+                    return false;
+                }
+
+                if (!dataOffset)
+                {
+                    dataOffset = headerSize ? headerSize : uint32_t(RawHeaderSize);
+                }
+
+                layout.pixelOffset = dataOffset;
+                layout.bottomUp = (lineOrder == RawLineOrderBottomToTop);
+                layout.rgbOrder = (dataType != RawDataTypeRawBGR);
+
+                // bilevel pixels follow the photometric interpretation, gray levels are taken as they are
+                for (int i = 0; i < 256; i++)
+                {
+                    layout.palette[i] = uint8_t(i);
+                }
+                if (layout.bitsPerPixel == 1)
+                {
+                    bool zeroIsWhite = (photometric == RawPhotoWhite0);
+                    layout.palette[0] = zeroIsWhite ? 0xff : 0;
+                    layout.palette[1] = zeroIsWhite ? 0 : 0xff;
+                }
+                return true;
+            }
+
+            bool ParseDIB(const uint8_t* data, size_t size, RawScanLayout& layout)
+            {
+                // a BMP file, WiaImgFmt_MEMORYBMP comes without the file header
+                size_t dibOffset = 0;
+                size_t filePixelOffset = 0;
+                if (size >= 14 && data[0] == 'B' && data[1] == 'M')
+                {
+                    filePixelOffset = ReadUInt32(data + 10);
+                    dibOffset = 14;
+                }
+                const uint8_t* dib = data + dibOffset;
+                size_t dibSize = size - dibOffset;
+
+                if (dibSize < 40)
+                {
+                    return false;
+                }
+
+                uint32_t headerSize = ReadUInt32(dib);
+                if (headerSize < 40 || headerSize > dibSize)
+                {
+                    return false;
+                }
+
+                int32_t width = ReadInt32(dib + 4);
+                int32_t height = ReadInt32(dib + 8);
+                layout.bitsPerPixel = ReadUInt16(dib + 14);
+                uint32_t compression = ReadUInt32(dib + 16);
+                int32_t pelsPerMeterX = ReadInt32(dib + 24);
+                int32_t pelsPerMeterY = ReadInt32(dib + 28);
+                uint32_t colorsUsed = ReadUInt32(dib + 32);
+
+                const uint32_t BI_RGB_VALUE = 0;
+                const uint32_t BI_BITFIELDS_VALUE = 3;
+                bool bitfields = (compression == BI_BITFIELDS_VALUE && layout.bitsPerPixel == 32);
+                if ((compression != BI_RGB_VALUE && !bitfields) || width <= 0)
+                {
+                    return false;
+                }
+                if (layout.bitsPerPixel != 1 && layout.bitsPerPixel != 4 && layout.bitsPerPixel != 8 &&
+                    layout.bitsPerPixel != 24 && layout.bitsPerPixel != 32)
+                {
+                    return false;
+                }
+
+                layout.width = uint32_t(width);
+                // The height is 0 if the length of a feeder page was unknown when the header was written,
+                // the rows are top-down then
+                layout.bottomUp = (height > 0);
+                layout.height = uint32_t(height < 0 ? -height : height);
+                layout.stride = ((size_t(layout.width) * layout.bitsPerPixel + 31) / 32) * 4;
+                layout.dpiX = pelsPerMeterX > 0 ? pelsPerMeterX * 0.0254 : 0;
+                layout.dpiY = pelsPerMeterY > 0 ? pelsPerMeterY * 0.0254 : 0;
+
+                size_t paletteOffset = headerSize + ((bitfields && headerSize == 40) ? 12 : 0);
+                size_t paletteCount = 0;
+                if (layout.bitsPerPixel <= 8)
+                {
+                    paletteCount = colorsUsed ? colorsUsed : (size_t(1) << layout.bitsPerPixel);
+                    paletteCount = paletteCount > 256 ? 256 : paletteCount;
+                }
+                if (paletteOffset + paletteCount * 4 > dibSize)
+                {
+                    return false;
+                }
+
+                for (int i = 0; i < 256; i++)
+                {
+                    layout.palette[i] = uint8_t(i);
+                }
+                for (size_t i = 0; i < paletteCount; i++)
+                {
+                    const uint8_t* entry = dib + paletteOffset + i * 4;
+                    layout.palette[i] = Luma(entry[0], entry[1], entry[2]);
+                }
+
+                layout.pixelOffset = (filePixelOffset > dibOffset) ? filePixelOffset : dibOffset + paletteOffset + paletteCount * 4;
+                layout.rgbOrder = false;
+                return true;
+            }
+
+            bool ConvertRows(RawScanLayout& layout, const uint8_t* data, size_t size, RawImage& image)
+            {
+                if (!layout.width || !layout.stride || layout.pixelOffset >= size)
+                {
+                    return false;
+                }
+
+                // A transfer ended early, or a feeder page of unknown length.
+                // The rows available are taken
+                uint32_t availableRows = uint32_t((size - layout.pixelOffset) / layout.stride);
+                if (!layout.height || layout.height > availableRows)
+                {
+                    layout.height = availableRows;
+                }
+                if (!layout.height)
+                {
+                    return false;
+                }
+
+                RawImage result = CreateRawImage(layout.width, layout.height, layout.GetPixelFormat());
+                result.dpiX = layout.dpiX;
+                result.dpiY = layout.dpiY;
+
+                const uint8_t* pixels = data + layout.pixelOffset;
+                for (uint32_t y = 0; y < layout.height; y++)
+                {
+                    const uint8_t* src = pixels + size_t(layout.bottomUp ? layout.height - 1 - y : y) * layout.stride;
+                    if (!ConvertRawScanRow(layout, src, result.Row(y)))
+                    {
+                        return false;
+                    }
+                }
+
+                image = std::move(result);
+                return true;
+            }
+        }
+
+        PixelFormat RawScanLayout::GetPixelFormat() const
+        {
+            return bitsPerPixel >= 24 ? PixelFormat::BGR24 : PixelFormat::Gray8;
+        }
+
+        bool ParseRawScanHeader(const void* data, size_t size, RawScanLayout& layout)
+        {
+            if (!data || !size)
+            {
+                return false;
+            }
+
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+            return ParseWiaRaw(bytes, size, layout) || ParseDIB(bytes, size, layout);
+        }
+
+        bool ConvertRawScanRow(const RawScanLayout& layout, const uint8_t* src, uint8_t* dst)
+        {
+            switch (layout.bitsPerPixel)
+            {
+            case 1:
+                for (uint32_t x = 0; x < layout.width; x++)
+                {
+                    dst[x] = layout.palette[(src[x >> 3] >> (7 - (x & 7))) & 1];
+                }
+                return true;
+            case 4:
+                for (uint32_t x = 0; x < layout.width; x++)
+                {
+                    dst[x] = layout.palette[(src[x >> 1] >> ((x & 1) ? 0 : 4)) & 0x0f];
+                }
+                return true;
+            case 8:
+                for (uint32_t x = 0; x < layout.width; x++)
+                {
+                    dst[x] = layout.palette[src[x]];
+                }
+                return true;
+            case 24:
+                if (layout.rgbOrder)
+                {
+                    for (uint32_t x = 0; x < layout.width; x++, src += 3, dst += 3)
+                    {
+                        dst[0] = src[2];
+                        dst[1] = src[1];
+                        dst[2] = src[0];
+                    }
+                }
+                else
+                {
+                    std::memcpy(dst, src, size_t(layout.width) * 3);
+                }
+                return true;
+            case 32:
+                for (uint32_t x = 0; x < layout.width; x++, src += 4, dst += 3)
+                {
+                    dst[0] = src[0];
+                    dst[1] = src[1];
+                    dst[2] = src[2];
+                }
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        bool DecodeRawScan(const void* data, size_t size, RawImage& image)
+        {
+            if (!data || !size)
+            {
+                return false;
+            }
+
+            RawScanLayout layout;
+            return ParseRawScanHeader(data, size, layout) &&
+                ConvertRows(layout, reinterpret_cast<const uint8_t*>(data), size, image);
+        }
+
+        CRawScanRowDecoder::CRawScanRowDecoder(RawScanRowCallback callback)
+            : m_callback(callback)
+            , m_contiguousSize(0)
+            , m_writtenSize(0)
+            , m_bHeaderKnown(false)
+            , m_rowCount(0)
+        {
+        }
+
+        void CRawScanRowDecoder::Write(uint64_t offset, const void* data, size_t size)
+        {
+            if (!data || !size)
+            {
+                return;
+            }
+
+            size_t end = size_t(offset) + size;
+            if (end > m_data.size())
+            {
+                m_data.resize(end);
+            }
+            std::memcpy(m_data.data() + offset, data, size);
+
+            // the driver writes in order, but may go back to rewrite the header
+            if (offset <= m_contiguousSize && end > m_contiguousSize)
+            {
+                m_contiguousSize = end;
+            }
+            if (end > m_writtenSize)
+            {
+                m_writtenSize = end;
+            }
+            DecodeRows(m_contiguousSize);
+        }
+
+        void CRawScanRowDecoder::Finish()
+        {
+            DecodeRows(m_writtenSize);
+        }
+
+        bool CRawScanRowDecoder::IsHeaderKnown() const
+        {
+            return m_bHeaderKnown;
+        }
+
+        uint32_t CRawScanRowDecoder::GetRowCount() const
+        {
+            return m_rowCount;
+        }
+
+        const RawImage& CRawScanRowDecoder::GetImage() const
+        {
+            return m_image;
+        }
+
+        void CRawScanRowDecoder::DecodeRows(size_t availableSize)
+        {
+            if (!m_bHeaderKnown)
+            {
+                if (!ParseRawScanHeader(m_data.data(), availableSize, m_layout) || !m_layout.width || !m_layout.stride)
+                {
+                    return;
+                }
+                m_bHeaderKnown = true;
+
+                // the rows of a page of unknown length are appended as they come
+                if (!m_layout.height)
+                {
+                    m_layout.bottomUp = false;
+                }
+                m_image = CreateRawImage(m_layout.width, m_layout.height, PixelFormat::Gray8);
+                m_image.stride = m_layout.width;
+                m_image.dpiX = m_layout.dpiX;
+                m_image.dpiY = m_layout.dpiY;
+                if (m_layout.GetPixelFormat() == PixelFormat::BGR24)
+                {
+                    m_colorRow.resize(size_t(m_layout.width) * 3);
+                }
+            }
+
+            if (availableSize <= m_layout.pixelOffset)
+            {
+                return;
+            }
+            size_t availableRows = (availableSize - m_layout.pixelOffset) / m_layout.stride;
+            if (m_layout.height && availableRows > m_layout.height)
+            {
+                availableRows = m_layout.height;
+            }
+
+            for (; m_rowCount < availableRows; m_rowCount++)
+            {
+                const uint8_t* src = m_data.data() + m_layout.pixelOffset + size_t(m_rowCount) * m_layout.stride;
+                uint32_t y = m_layout.bottomUp ? m_layout.height - 1 - m_rowCount : m_rowCount;
+                if (!m_layout.height)
+                {
+                    m_image.height++;
+                    m_image.pixels.resize(size_t(m_image.height) * m_image.stride, 0xff);
+                }
+                uint8_t* dst = m_image.Row(y);
+
+                if (m_colorRow.empty())
+                {
+                    ConvertRawScanRow(m_layout, src, dst);
+                }
+                else
+                {
+                    ConvertRawScanRow(m_layout, src, m_colorRow.data());
+                    const uint8_t* bgr = m_colorRow.data();
+                    for (uint32_t x = 0; x < m_layout.width; x++, bgr += 3)
+                    {
+                        dst[x] = Luma(bgr[0], bgr[1], bgr[2]);
+                    }
+                }
+
+                if (m_callback)
+                {
+                    m_callback(y, dst, m_layout.width);
+                }
+            }
+        }
+    }
+}
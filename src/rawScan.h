@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "rawImage.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        // Uncompressed scanlines handed over by the driver: WiaImgFmt_RAW(WIA_RAW_HEADER followed by the data)
+        // or WiaImgFmt_MEMORYBMP(BITMAPINFOHEADER, the color table and the rows, no file header).
+        // A BMP file with BITMAPFILEHEADER is accepted as well.
+        // Bilevel and palette images are expanded to PixelFormat::Gray8, color ones to PixelFormat::BGR24.
+        // Returns false if the data is in neither format
+        bool DecodeRawScan(const void* data, size_t size, RawImage& image);
+
+        // where the rows are in the data and how the pixels are laid out, read from the header
+        struct RawScanLayout
+        {
+            size_t pixelOffset = 0;     // of the first row of the data
+            uint32_t width = 0;
+            uint32_t height = 0;        // 0 if unknown, taken from the size of the data
+            size_t stride = 0;
+            uint32_t bitsPerPixel = 0;
+            bool bottomUp = false;
+            bool rgbOrder = false;      // 24 bit pixels are RGB instead of BGR
+            uint8_t palette[256];       // gray level of each palette entry for 1/4/8 bit pixels
+            double dpiX = 0;
+            double dpiY = 0;
+
+            // of the rows converted, PixelFormat::BGR24 for 24 and 32 bit pixels
+            PixelFormat GetPixelFormat() const;
+        };
+
+        // Returns false until the header, and the color table if any, are complete, or if the data is in neither format
+        bool ParseRawScanHeader(const void* data, size_t size, RawScanLayout& layout);
+        // A row of the data into the pixel format of the layout
+        bool ConvertRawScanRow(const RawScanLayout& layout, const uint8_t* src, uint8_t* dst);
+
+        // a row decoded, y from the top
+        typedef std::function<void(uint32_t y, const uint8_t* row, uint32_t width)> RawScanRowCallback;
+
+        // Decodes the rows of a page while the driver writes it, e.g. for a preview painted as it comes.
+        // Every row is given once, converted to PixelFormat::Gray8, as soon as the data up to its end has been written.
+        // Bottom-up data gives the last row first. The rows written after a gap wait for the gap to be filled or Finish()
+        class CRawScanRowDecoder
+        {
+        public:
+            explicit CRawScanRowDecoder(RawScanRowCallback callback);
+
+            CRawScanRowDecoder(const CRawScanRowDecoder&) = delete;
+            CRawScanRowDecoder& operator=(const CRawScanRowDecoder&) = delete;
+
+            // the data as ScanDataCallback hands it over
+            void Write(uint64_t offset, const void* data, size_t size);
+            // The rows written but not given yet, at the end of the page
+            void Finish();
+
+            bool IsHeaderKnown() const;
+            uint32_t GetRowCount() const;
+            // The rows given so far, white where missing
+            const RawImage& GetImage() const;
+
+        private:
+            void DecodeRows(size_t availableSize);
+
+        private:
+            RawScanRowCallback m_callback;
+            std::vector<uint8_t> m_data;
+            size_t m_contiguousSize;    // written without a gap from the start
+            size_t m_writtenSize;
+
+            bool m_bHeaderKnown;
+            RawScanLayout m_layout;
+            uint32_t m_rowCount;        // of the data, in the order written
+            std::vector<uint8_t> m_colorRow;
+            RawImage m_image;
+        };
+    }
+}
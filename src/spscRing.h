@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+namespace scanner
+{
+    namespace util
+    {
+        // Lock-free ring buffer with a single producer thread and a single consumer thread.
+        // The capacity is rounded up to a power of 2.
+        template <typename T>
+        class CSPSCRing
+        {
+        public:
+            explicit CSPSCRing(size_t capacity)
+                : m_capacity(RoundUpPowerOf2(capacity))
+                , m_mask(m_capacity - 1)
+                , m_pItems(new T[m_capacity]())
+                , m_head(0)
+                , m_tail(0)
+            {
+            }
+
+            CSPSCRing(const CSPSCRing&) = delete;
+            CSPSCRing& operator=(const CSPSCRing&) = delete;
+
+            // Producer side. Returns false if the ring is full
+            bool TryPush(const T& item)
+            {
+                size_t tail = m_tail.load(std::memory_order_relaxed);
+                if (tail - m_head.load(std::memory_order_acquire) == m_capacity)
+                {
+                    return false;
+                }
+
+                m_pItems[tail & m_mask] = item;
+                m_tail.store(tail + 1, std::memory_order_release);
+                return true;
+            }
+
+            // Producer side. Waits for the consumer if the ring is full, nothing is dropped
+            void Push(const T& item)
+            {
+                while (!TryPush(item))
+                {
+                    std::this_thread::yield();
+                }
+            }
+
+            // Consumer side. Returns false if the ring is empty
+            bool TryPop(T& item)
+            {
+                size_t head = m_head.load(std::memory_order_relaxed);
+                if (head == m_tail.load(std::memory_order_acquire))
+                {
+                    return false;
+                }
+
+                item = m_pItems[head & m_mask];
+                m_head.store(head + 1, std::memory_order_release);
+                return true;
+            }
+
+            // Consumer side. Pops everything available at the moment in one go
+            template <typename Func>
+            size_t PopAll(Func&& func)
+            {
+                size_t head = m_head.load(std::memory_order_relaxed);
+                size_t tail = m_tail.load(std::memory_order_acquire);
+
+                for (size_t i = head; i != tail; i++)
+                {
+                    func(m_pItems[i & m_mask]);
+                }
+                m_head.store(tail, std::memory_order_release);
+
+                return tail - head;
+            }
+
+            size_t Capacity() const
+            {
+                return m_capacity;
+            }
+
+            size_t Size() const
+            {
+                return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+            }
+
+        private:
+            static size_t RoundUpPowerOf2(size_t value)
+            {
+                size_t result = 1;
+                while (result < value)
+                {
+                    result <<= 1;
+                }
+                return result;
+            }
+
+        private:
+            const size_t m_capacity;
+            const size_t m_mask;
+            std::unique_ptr<T[]> m_pItems;
+
+            // keep the indices on separate cache lines, the producer and the consumer write them respectively
+            char m_padding0[64];
+            std::atomic<size_t> m_head;     // next slot to read, written by the consumer
+            char m_padding1[64];
+            std::atomic<size_t> m_tail;     // next slot to write, written by the producer
+            char m_padding2[64];
+        };
+    }
+}
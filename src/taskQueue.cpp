@@ -0,0 +1,110 @@
+#include "stdafx.h"
+#include "taskQueue.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        CTaskQueue::CTaskQueue(Task threadStart, Task threadExit)
+            : m_threadStart(threadStart)
+            , m_threadExit(threadExit)
+            , m_bStopping(false)
+            , m_bRunning(false)
+            , m_completedCount(0)
+        {
+            m_thread = std::thread(&CTaskQueue::ThreadProc, this);
+        }
+
+        CTaskQueue::~CTaskQueue()
+        {
+            Stop();
+        }
+
+        bool CTaskQueue::Post(Task task)
+        {
+            assert(task);
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                if (m_bStopping)
+                {
+                    return false;
+                }
+                m_tasks.push_back(std::move(task));
+            }
+            m_cvTask.notify_one();
+            return true;
+        }
+
+        void CTaskQueue::Stop()
+        {
+            assert(!IsWorkerThread());
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                m_bStopping = true;
+            }
+            m_cvTask.notify_one();
+
+            if (m_thread.joinable())
+            {
+                m_thread.join();
+            }
+        }
+
+        bool CTaskQueue::IsWorkerThread() const
+        {
+            return std::this_thread::get_id() == m_thread.get_id();
+        }
+
+        size_t CTaskQueue::GetPendingCount() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_tasks.size() + (m_bRunning ? 1 : 0);
+        }
+
+        uint64_t CTaskQueue::GetCompletedCount() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_completedCount;
+        }
+
+        void CTaskQueue::ThreadProc()
+        {
+            if (m_threadStart)
+            {
+                m_threadStart();
+            }
+
+            while (true)
+            {
+                Task task;
+                {
+                    std::unique_lock<std::mutex> g(m_lock);
+                    m_cvTask.wait(g, [this]() { return m_bStopping || !m_tasks.empty(); });
+
+                    // the tasks queued before Stop() are still run
+                    if (m_tasks.empty())
+                    {
+                        break;
+                    }
+
+                    task = std::move(m_tasks.front());
+                    m_tasks.pop_front();
+                    m_bRunning = true;
+                }
+
+                task();
+
+                {
+                    std::lock_guard<std::mutex> g(m_lock);
+                    m_bRunning = false;
+                    m_completedCount++;
+                }
+            }
+
+            if (m_threadExit)
+            {
+                m_threadExit();
+            }
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace scanner
+{
+    namespace util
+    {
+        // A dedicated thread running tasks one by one in the order they are posted.
+        // threadStart/threadExit run on the thread before the first task and after the last one,
+        // e.g. to enter and leave a COM apartment.
+        class CTaskQueue
+        {
+        public:
+            typedef std::function<void()> Task;
+
+            CTaskQueue(Task threadStart = nullptr, Task threadExit = nullptr);
+            // Runs the tasks still queued, then joins the thread
+            ~CTaskQueue();
+
+            CTaskQueue(const CTaskQueue&) = delete;
+            CTaskQueue& operator=(const CTaskQueue&) = delete;
+
+            // Returns false if the queue has been stopped
+            bool Post(Task task);
+
+            // Reject further tasks, run the tasks queued and wait for the thread to exit.
+            // Must not be called from the thread of the queue
+            void Stop();
+
+            bool IsWorkerThread() const;
+
+            // tasks posted but not finished yet, including the one running
+            size_t GetPendingCount() const;
+            uint64_t GetCompletedCount() const;
+
+        private:
+            void ThreadProc();
+
+        private:
+            Task m_threadStart;
+            Task m_threadExit;
+
+            mutable std::mutex m_lock;
+            std::condition_variable m_cvTask;
+            std::deque<Task> m_tasks;
+            bool m_bStopping;
+            bool m_bRunning;            // a task is running
+            uint64_t m_completedCount;
+
+            // started after the members above are ready
+            std::thread m_thread;
+        };
+    }
+}
@@ -0,0 +1,288 @@
+#include "stdafx.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            // the pool and the deque of the current thread, if it belongs to a pool
+            thread_local CThreadPool* t_pCurrentPool = nullptr;
+            thread_local size_t t_currentWorker = 0;
+        }
+
+        CThreadPool::CThreadPool(size_t threadCount, size_t maxPendingTasks, Task threadStart, Task threadExit)
+            : m_maxPendingTasks(maxPendingTasks ? maxPendingTasks : 1)
+            , m_threadStart(threadStart)
+            , m_threadExit(threadExit)
+            , m_queuedCount(0)
+            , m_pendingCount(0)
+            , m_bStopping(false)
+            , m_nextWorker(0)
+        {
+            if (!threadCount)
+            {
+                threadCount = std::thread::hardware_concurrency();
+            }
+            if (!threadCount)
+            {
+                threadCount = 1;
+            }
+
+            for (size_t i = 0; i < threadCount; i++)
+            {
+                m_workers.emplace_back(new Worker());
+            }
+            // the threads start after every deque is ready, they steal from each other
+            for (size_t i = 0; i < threadCount; i++)
+            {
+                m_workers[i]->thread = std::thread(&CThreadPool::WorkerProc, this, i);
+            }
+        }
+
+        CThreadPool::~CThreadPool()
+        {
+            Stop();
+        }
+
+        bool CThreadPool::Submit(Task task)
+        {
+            assert(task);
+
+            bool isPoolThread = (t_pCurrentPool == this);
+            size_t index = 0;
+            {
+                std::unique_lock<std::mutex> g(m_lock);
+                if (m_bStopping)
+                {
+                    return false;
+                }
+
+                // a thread of the pool waiting for itself would never wake up
+                if (!isPoolThread && m_pendingCount >= m_maxPendingTasks)
+                {
+                    m_stats.blocked++;
+                    m_cvNotFull.wait(g, [this]() { return m_bStopping || m_pendingCount < m_maxPendingTasks; });
+                    if (m_bStopping)
+                    {
+                        return false;
+                    }
+                }
+
+                // counted as queued under the same lock as the check of m_bStopping,
+                // Stop() lets the threads exit only once the tasks accepted have run
+                m_pendingCount++;
+                m_queuedCount++;
+                m_stats.submitted++;
+            }
+
+            index = isPoolThread ? t_currentWorker : (m_nextWorker++ % m_workers.size());
+            {
+                std::lock_guard<std::mutex> g(m_workers[index]->lock);
+                m_workers[index]->tasks.push_back(std::move(task));
+            }
+            m_cvTask.notify_one();
+            return true;
+        }
+
+        void CThreadPool::WaitIdle()
+        {
+            assert(t_pCurrentPool != this);
+
+            std::unique_lock<std::mutex> g(m_lock);
+            m_cvIdle.wait(g, [this]() { return m_pendingCount == 0; });
+        }
+
+        void CThreadPool::Stop()
+        {
+            assert(t_pCurrentPool != this);
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                m_bStopping = true;
+            }
+            m_cvTask.notify_all();
+            m_cvNotFull.notify_all();
+
+            for (auto& worker : m_workers)
+            {
+                if (worker->thread.joinable())
+                {
+                    worker->thread.join();
+                }
+            }
+        }
+
+        size_t CThreadPool::GetThreadCount() const
+        {
+            return m_workers.size();
+        }
+
+        ThreadPoolStats CThreadPool::GetStats() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_stats;
+        }
+
+        void CThreadPool::WorkerProc(size_t index)
+        {
+            t_pCurrentPool = this;
+            t_currentWorker = index;
+
+            if (m_threadStart)
+            {
+                m_threadStart();
+            }
+
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> g(m_lock);
+                    m_cvTask.wait(g, [this]() { return m_bStopping || m_queuedCount > 0; });
+
+                    // the tasks queued before Stop() are still run
+                    if (!m_queuedCount)
+                    {
+                        break;
+                    }
+
+                    // claim a task, it is in one of the deques or about to be
+                    m_queuedCount--;
+                }
+
+                // The deques are searched one by one, a task pushed meanwhile might be missed,
+                // and the task claimed may not be pushed yet by Submit(). Search again until found
+                bool stolen = false;
+                Task task;
+                while (!(task = TakeTask(index, stolen)))
+                {
+                    std::this_thread::yield();
+                }
+
+                try
+                {
+                    task();
+                }
+                catch (...)
+                {
+                    // a task must not take the thread down, it reports its errors by itself
+                    assert(false);
+                }
+
+                {
+                    std::lock_guard<std::mutex> g(m_lock);
+                    m_pendingCount--;
+                    m_stats.completed++;
+                    if (stolen)
+                    {
+                        m_stats.stolen++;
+                    }
+
+                    if (!m_pendingCount)
+                    {
+                        m_cvIdle.notify_all();
+                    }
+                }
+                m_cvNotFull.notify_one();
+            }
+
+            if (m_threadExit)
+            {
+                m_threadExit();
+            }
+
+            t_pCurrentPool = nullptr;
+        }
+
+        CThreadPool::Task CThreadPool::TakeTask(size_t index, bool& stolen)
+        {
+            stolen = false;
+
+            // the newest task of the own deque is the warmest in the cache
+            {
+                Worker& worker = *m_workers[index];
+                std::lock_guard<std::mutex> g(worker.lock);
+                if (!worker.tasks.empty())
+                {
+                    Task task = std::move(worker.tasks.back());
+                    worker.tasks.pop_back();
+                    return task;
+                }
+            }
+
+            // steal the oldest task of another deque
+            for (size_t i = 1; i < m_workers.size(); i++)
+            {
+                size_t victim = (index + i) % m_workers.size();
+                Worker& worker = *m_workers[victim];
+                std::lock_guard<std::mutex> g(worker.lock);
+                if (!worker.tasks.empty())
+                {
+                    Task task = std::move(worker.tasks.front());
+                    worker.tasks.pop_front();
+                    stolen = true;
+                    return task;
+                }
+            }
+
+            return nullptr;
+        }
+
+        CConcurrencyLimit::CConcurrencyLimit(size_t limit)
+            : m_limit(limit)
+        {
+        }
+
+        void CConcurrencyLimit::Acquire()
+        {
+            std::unique_lock<std::mutex> g(m_lock);
+            if (m_limit && m_stats.activeCount >= m_limit)
+            {
+                auto start = std::chrono::steady_clock::now();
+                m_cvRelease.wait(g, [this]()
+                {
+                    return !m_limit || m_stats.activeCount < m_limit;
+                });
+                m_stats.waited++;
+                m_stats.totalWaitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            }
+            m_stats.acquired++;
+            m_stats.activeCount++;
+            m_stats.maxActiveCount = std::max(m_stats.maxActiveCount, m_stats.activeCount);
+        }
+
+        void CConcurrencyLimit::Release()
+        {
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                assert(m_stats.activeCount > 0);
+                m_stats.activeCount--;
+            }
+            m_cvRelease.notify_one();
+        }
+
+        void CConcurrencyLimit::SetLimit(size_t limit)
+        {
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                m_limit = limit;
+            }
+            m_cvRelease.notify_all();
+        }
+
+        size_t CConcurrencyLimit::GetLimit() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_limit;
+        }
+
+        ConcurrencyLimitStats CConcurrencyLimit::GetStats() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_stats;
+        }
+    }
+}
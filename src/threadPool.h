@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+namespace scanner
+{
+    namespace util
+    {
+        struct ThreadPoolStats
+        {
+            uint64_t submitted = 0;     // tasks accepted by Submit()
+            uint64_t completed = 0;
+            uint64_t stolen = 0;        // tasks run by a thread other than the one they were queued to
+            uint64_t blocked = 0;       // how many times Submit() has waited because the pool was full
+        };
+
+        // A fixed set of threads, each with its own task deque.
+        // Tasks are spread over the deques, an idle thread steals from the others before going to sleep.
+        // At most maxPendingTasks tasks are queued or running, Submit() blocks the caller beyond that,
+        // so that a fast producer is slowed down instead of piling up work.
+        class CThreadPool
+        {
+        public:
+            typedef std::function<void()> Task;
+
+            // threadCount: 0 for the number of hardware threads
+            // threadStart/threadExit run on every thread of the pool, e.g. to enter and leave a COM apartment
+            CThreadPool(size_t threadCount, size_t maxPendingTasks, Task threadStart = nullptr, Task threadExit = nullptr);
+            // Runs the tasks still queued, then joins the threads
+            ~CThreadPool();
+
+            CThreadPool(const CThreadPool&) = delete;
+            CThreadPool& operator=(const CThreadPool&) = delete;
+
+            // Returns false if the pool has been stopped.
+            // A task submitted from a thread of the pool goes to the deque of that thread and never blocks
+            bool Submit(Task task);
+
+            // Wait until every task submitted has completed
+            void WaitIdle();
+
+            // Reject further tasks, run the tasks queued and join the threads.
+            // Must not be called from a thread of the pool
+            void Stop();
+
+            size_t GetThreadCount() const;
+            ThreadPoolStats GetStats() const;
+
+        private:
+            struct Worker
+            {
+                std::mutex lock;
+                std::deque<Task> tasks;
+                std::thread thread;
+            };
+
+            void WorkerProc(size_t index);
+            // Take a task claimed already, the own deque first, then steal from the others
+            Task TakeTask(size_t index, bool& stolen);
+
+        private:
+            const size_t m_maxPendingTasks;
+            Task m_threadStart;
+            Task m_threadExit;
+
+            std::vector<std::unique_ptr<Worker>> m_workers;
+
+            mutable std::mutex m_lock;
+            std::condition_variable m_cvTask;
+            std::condition_variable m_cvNotFull;
+            std::condition_variable m_cvIdle;
+            size_t m_queuedCount;       // tasks in the deques not claimed by a thread yet
+            size_t m_pendingCount;      // tasks submitted and not completed yet
+            bool m_bStopping;
+
+            std::atomic<size_t> m_nextWorker;
+            ThreadPoolStats m_stats;    // guarded by m_lock
+        };
+
+        struct ConcurrencyLimitStats
+        {
+            uint64_t acquired = 0;
+            uint64_t waited = 0;        // acquisitions which had to wait for a slot
+            double totalWaitMs = 0;
+            size_t activeCount = 0;
+            size_t maxActiveCount = 0;
+        };
+
+        // Caps how many threads, of any number of pools, run a kind of work at once,
+        // e.g. the pages processed by the pipelines of all the scans. A limit of 0 lets every thread through
+        class CConcurrencyLimit
+        {
+        public:
+            explicit CConcurrencyLimit(size_t limit = 0);
+
+            CConcurrencyLimit(const CConcurrencyLimit&) = delete;
+            CConcurrencyLimit& operator=(const CConcurrencyLimit&) = delete;
+
+            // Blocks while the limit is reached
+            void Acquire();
+            void Release();
+
+            // Raising the limit wakes the threads waiting, lowering it lets the ones running finish
+            void SetLimit(size_t limit);
+            size_t GetLimit() const;
+            ConcurrencyLimitStats GetStats() const;
+
+        private:
+            mutable std::mutex m_lock;
+            std::condition_variable m_cvRelease;
+            size_t m_limit;
+            ConcurrencyLimitStats m_stats;  // guarded by m_lock
+        };
+    }
+}
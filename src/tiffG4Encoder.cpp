@@ -0,0 +1,319 @@
+#include "stdafx.h"
+#include "tiffG4Encoder.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            struct FaxCode
+            {
+                uint16_t code;
+                uint8_t length;
+            };
+
+            // the run length codes of ITU-T T.4: terminating codes for 0-63, then make-up codes for 64-1728
+            const FaxCode WhiteCodes[91] =
+            {
+                { 0x35, 8 }, { 0x07, 6 }, { 0x07, 4 }, { 0x08, 4 }, { 0x0b, 4 }, { 0x0c, 4 }, { 0x0e, 4 }, { 0x0f, 4 },
+                { 0x13, 5 }, { 0x14, 5 }, { 0x07, 5 }, { 0x08, 5 }, { 0x08, 6 }, { 0x03, 6 }, { 0x34, 6 }, { 0x35, 6 },
+                { 0x2a, 6 }, { 0x2b, 6 }, { 0x27, 7 }, { 0x0c, 7 }, { 0x08, 7 }, { 0x17, 7 }, { 0x03, 7 }, { 0x04, 7 },
+                { 0x28, 7 }, { 0x2b, 7 }, { 0x13, 7 }, { 0x24, 7 }, { 0x18, 7 }, { 0x02, 8 }, { 0x03, 8 }, { 0x1a, 8 },
+                { 0x1b, 8 }, { 0x12, 8 }, { 0x13, 8 }, { 0x14, 8 }, { 0x15, 8 }, { 0x16, 8 }, { 0x17, 8 }, { 0x28, 8 },
+                { 0x29, 8 }, { 0x2a, 8 }, { 0x2b, 8 }, { 0x2c, 8 }, { 0x2d, 8 }, { 0x04, 8 }, { 0x05, 8 }, { 0x0a, 8 },
+                { 0x0b, 8 }, { 0x52, 8 }, { 0x53, 8 }, { 0x54, 8 }, { 0x55, 8 }, { 0x24, 8 }, { 0x25, 8 }, { 0x58, 8 },
+                { 0x59, 8 }, { 0x5a, 8 }, { 0x5b, 8 }, { 0x4a, 8 }, { 0x4b, 8 }, { 0x32, 8 }, { 0x33, 8 }, { 0x34, 8 },
+
+                { 0x1b, 5 }, { 0x12, 5 }, { 0x17, 6 }, { 0x37, 7 }, { 0x36, 8 }, { 0x37, 8 }, { 0x64, 8 }, { 0x65, 8 },
+                { 0x68, 8 }, { 0x67, 8 }, { 0xcc, 9 }, { 0xcd, 9 }, { 0xd2, 9 }, { 0xd3, 9 }, { 0xd4, 9 }, { 0xd5, 9 },
+                { 0xd6, 9 }, { 0xd7, 9 }, { 0xd8, 9 }, { 0xd9, 9 }, { 0xda, 9 }, { 0xdb, 9 }, { 0x98, 9 }, { 0x99, 9 },
+                { 0x9a, 9 }, { 0x18, 6 }, { 0x9b, 9 },
+            };
+            const FaxCode BlackCodes[91] =
+            {
+                { 0x37, 10 }, { 0x02, 3 }, { 0x03, 2 }, { 0x02, 2 }, { 0x03, 3 }, { 0x03, 4 }, { 0x02, 4 }, { 0x03, 5 },
+                { 0x05, 6 }, { 0x04, 6 }, { 0x04, 7 }, { 0x05, 7 }, { 0x07, 7 }, { 0x04, 8 }, { 0x07, 8 }, { 0x18, 9 },
+                { 0x17, 10 }, { 0x18, 10 }, { 0x08, 10 }, { 0x67, 11 }, { 0x68, 11 }, { 0x6c, 11 }, { 0x37, 11 }, { 0x28, 11 },
+                { 0x17, 11 }, { 0x18, 11 }, { 0xca, 12 }, { 0xcb, 12 }, { 0xcc, 12 }, { 0xcd, 12 }, { 0x68, 12 }, { 0x69, 12 },
+                { 0x6a, 12 }, { 0x6b, 12 }, { 0xd2, 12 }, { 0xd3, 12 }, { 0xd4, 12 }, { 0xd5, 12 }, { 0xd6, 12 }, { 0xd7, 12 },
+                { 0x6c, 12 }, { 0x6d, 12 }, { 0xda, 12 }, { 0xdb, 12 }, { 0x54, 12 }, { 0x55, 12 }, { 0x56, 12 }, { 0x57, 12 },
+                { 0x64, 12 }, { 0x65, 12 }, { 0x52, 12 }, { 0x53, 12 }, { 0x24, 12 }, { 0x37, 12 }, { 0x38, 12 }, { 0x27, 12 },
+                { 0x28, 12 }, { 0x58, 12 }, { 0x59, 12 }, { 0x2b, 12 }, { 0x2c, 12 }, { 0x5a, 12 }, { 0x66, 12 }, { 0x67, 12 },
+
+                { 0x0f, 10 }, { 0xc8, 12 }, { 0xc9, 12 }, { 0x5b, 12 }, { 0x33, 12 }, { 0x34, 12 }, { 0x35, 12 }, { 0x6c, 13 },
+                { 0x6d, 13 }, { 0x4a, 13 }, { 0x4b, 13 }, { 0x4c, 13 }, { 0x4d, 13 }, { 0x72, 13 }, { 0x73, 13 }, { 0x74, 13 },
+                { 0x75, 13 }, { 0x76, 13 }, { 0x77, 13 }, { 0x52, 13 }, { 0x53, 13 }, { 0x54, 13 }, { 0x55, 13 }, { 0x5a, 13 },
+                { 0x5b, 13 }, { 0x64, 13 }, { 0x65, 13 },
+            };
+            // make-up codes for 1792-2560, the same for both colors
+            const FaxCode ExtendedMakeUpCodes[13] =
+            {
+                { 0x08, 11 }, { 0x0c, 11 }, { 0x0d, 11 }, { 0x12, 12 }, { 0x13, 12 }, { 0x14, 12 }, { 0x15, 12 },
+                { 0x16, 12 }, { 0x17, 12 }, { 0x1c, 12 }, { 0x1d, 12 }, { 0x1e, 12 }, { 0x1f, 12 },
+            };
+
+            const FaxCode PassCode = { 0x1, 4 };
+            const FaxCode HorizontalCode = { 0x1, 3 };
+            // by b1 - a1, from -3 to 3
+            const FaxCode VerticalCodes[7] =
+            {
+                { 0x03, 7 }, { 0x03, 6 }, { 0x03, 3 }, { 0x1, 1 }, { 0x2, 3 }, { 0x02, 6 }, { 0x02, 7 },
+            };
+
+            class CBitWriter
+            {
+            public:
+                explicit CBitWriter(std::vector<uint8_t>& data)
+                    : m_data(data)
+                    , m_bitBuffer(0)
+                    , m_bitCount(0)
+                {
+                }
+
+                void Put(const FaxCode& code)
+                {
+                    m_bitBuffer = (m_bitBuffer << code.length) | code.code;
+                    m_bitCount += code.length;
+                    while (m_bitCount >= 8)
+                    {
+                        m_bitCount -= 8;
+                        m_data.push_back(uint8_t(m_bitBuffer >> m_bitCount));
+                    }
+                    m_bitBuffer &= (1u << m_bitCount) - 1;
+                }
+
+                void PutRun(uint32_t run, const FaxCode* codes)
+                {
+                    while (run >= 2560 + 64)
+                    {
+                        Put(ExtendedMakeUpCodes[12]);
+                        run -= 2560;
+                    }
+                    if (run >= 64)
+                    {
+                        uint32_t makeUp = run >> 6;
+                        Put(makeUp <= 27 ? codes[63 + makeUp] : ExtendedMakeUpCodes[makeUp - 28]);
+                        run &= 63;
+                    }
+                    Put(codes[run]);
+                }
+
+                // pad the last byte with 0 bits
+                void Align()
+                {
+                    if (m_bitCount)
+                    {
+                        m_data.push_back(uint8_t(m_bitBuffer << (8 - m_bitCount)));
+                        m_bitBuffer = 0;
+                        m_bitCount = 0;
+                    }
+                }
+
+            private:
+                std::vector<uint8_t>& m_data;
+                uint32_t m_bitBuffer;
+                int m_bitCount;
+            };
+
+            // position of the first pixel from start which is not of the color, end if there is none
+            inline uint32_t FindChange(const uint8_t* line, uint32_t start, uint32_t end, uint8_t color)
+            {
+                while (start < end && line[start] == color)
+                {
+                    start++;
+                }
+                return start;
+            }
+
+            // 1 for black pixels
+            void ThresholdRow(const RawImage& image, uint32_t y, uint8_t threshold, uint8_t* line)
+            {
+                const uint8_t* row = image.Row(y);
+                if (image.format == PixelFormat::Gray8)
+                {
+                    for (uint32_t x = 0; x < image.width; x++)
+                    {
+                        line[x] = row[x] < threshold ? 1 : 0;
+                    }
+                }
+                else
+                {
+                    for (uint32_t x = 0; x < image.width; x++, row += 3)
+                    {
+                        uint32_t luma = (29 * row[0] + 150 * row[1] + 77 * row[2]) >> 8;
+                        line[x] = luma < threshold ? 1 : 0;
+                    }
+                }
+            }
+
+            // two dimensional coding of a row against the reference row, see T.4 4.2
+            void EncodeRow(CBitWriter& writer, const uint8_t* line, const uint8_t* reference, uint32_t width)
+            {
+                uint32_t a0 = 0;
+                uint32_t a1 = line[0] ? 0 : FindChange(line, 0, width, 0);
+                uint32_t b1 = reference[0] ? 0 : FindChange(reference, 0, width, 0);
+
+                for (;;)
+                {
+                    uint32_t b2 = b1 < width ? FindChange(reference, b1, width, reference[b1]) : width;
+                    if (b2 >= a1)
+                    {
+                        int32_t distance = int32_t(b1) - int32_t(a1);
+                        if (distance >= -3 && distance <= 3)
+                        {
+                            writer.Put(VerticalCodes[distance + 3]);
+                            a0 = a1;
+                        }
+                        else
+                        {
+                            uint32_t a2 = a1 < width ? FindChange(line, a1, width, line[a1]) : width;
+                            writer.Put(HorizontalCode);
+
+                            // the imaginary pixel before the row is white
+                            if (a0 + a1 == 0 || !line[a0])
+                            {
+                                writer.PutRun(a1 - a0, WhiteCodes);
+                                writer.PutRun(a2 - a1, BlackCodes);
+                            }
+                            else
+                            {
+                                writer.PutRun(a1 - a0, BlackCodes);
+                                writer.PutRun(a2 - a1, WhiteCodes);
+                            }
+                            a0 = a2;
+                        }
+                    }
+                    else
+                    {
+                        writer.Put(PassCode);
+                        a0 = b2;
+                    }
+
+                    if (a0 >= width)
+                    {
+                        break;
+                    }
+
+                    uint8_t color = line[a0];
+                    a1 = FindChange(line, a0, width, color);
+                    b1 = FindChange(reference, a0, width, color ^ 1);
+                    b1 = FindChange(reference, b1, width, color);
+                }
+            }
+
+            void PutUInt16(std::vector<uint8_t>& data, uint16_t value)
+            {
+                data.push_back(uint8_t(value));
+                data.push_back(uint8_t(value >> 8));
+            }
+            void PutUInt32(std::vector<uint8_t>& data, uint32_t value)
+            {
+                PutUInt16(data, uint16_t(value));
+                PutUInt16(data, uint16_t(value >> 16));
+            }
+
+            const uint16_t TiffTypeShort = 3;
+            const uint16_t TiffTypeLong = 4;
+            const uint16_t TiffTypeRational = 5;
+
+            void PutEntry(std::vector<uint8_t>& data, uint16_t tag, uint16_t type, uint32_t value)
+            {
+                PutUInt16(data, tag);
+                PutUInt16(data, type);
+                PutUInt32(data, 1);
+                if (type == TiffTypeShort)
+                {
+                    PutUInt16(data, uint16_t(value));
+                    PutUInt16(data, 0);
+                }
+                else
+                {
+                    PutUInt32(data, value);
+                }
+            }
+        }
+
+        void EncodeG4(const RawImage& image, uint8_t threshold, std::vector<uint8_t>& data)
+        {
+            if (image.Empty())
+            {
+                return;
+            }
+
+            // the reference of the first row is all white
+            std::vector<uint8_t> line(image.width, 0);
+            std::vector<uint8_t> reference(image.width, 0);
+
+            CBitWriter writer(data);
+            for (uint32_t y = 0; y < image.height; y++)
+            {
+                ThresholdRow(image, y, threshold, line.data());
+                EncodeRow(writer, line.data(), reference.data(), image.width);
+                line.swap(reference);
+            }
+
+            // EOFB
+            const FaxCode EndOfLine = { 0x001, 12 };
+            writer.Put(EndOfLine);
+            writer.Put(EndOfLine);
+            writer.Align();
+        }
+
+        bool EncodeTiffG4(const RawImage& image, uint8_t threshold, CMemoryBuffer& data)
+        {
+            if (image.Empty())
+            {
+                return false;
+            }
+
+            // header, the strip, then the IFD
+            std::vector<uint8_t> file = { 'I', 'I', 42, 0, 0, 0, 0, 0 };
+            EncodeG4(image, threshold, file);
+
+            uint32_t stripSize = uint32_t(file.size() - 8);
+            if (file.size() & 1)
+            {
+                file.push_back(0);
+            }
+
+            bool hasDpi = image.dpiX > 0 && image.dpiY > 0;
+            uint16_t entryCount = hasDpi ? 12 : 9;
+            uint32_t ifdOffset = uint32_t(file.size());
+            uint32_t resolutionOffset = ifdOffset + 2 + entryCount * 12 + 4;
+            file[4] = uint8_t(ifdOffset);
+            file[5] = uint8_t(ifdOffset >> 8);
+            file[6] = uint8_t(ifdOffset >> 16);
+            file[7] = uint8_t(ifdOffset >> 24);
+
+            // the entries are sorted by tag
+            PutUInt16(file, entryCount);
+            PutEntry(file, 256, TiffTypeLong, image.width);         // ImageWidth
+            PutEntry(file, 257, TiffTypeLong, image.height);        // ImageLength
+            PutEntry(file, 258, TiffTypeShort, 1);                  // BitsPerSample
+            PutEntry(file, 259, TiffTypeShort, 4);                  // Compression: CCITT T.6
+            PutEntry(file, 262, TiffTypeShort, 0);                  // PhotometricInterpretation: WhiteIsZero
+            PutEntry(file, 273, TiffTypeLong, 8);                   // StripOffsets
+            PutEntry(file, 277, TiffTypeShort, 1);                  // SamplesPerPixel
+            PutEntry(file, 278, TiffTypeLong, image.height);        // RowsPerStrip
+            PutEntry(file, 279, TiffTypeLong, stripSize);           // StripByteCounts
+            if (hasDpi)
+            {
+                PutEntry(file, 282, TiffTypeRational, resolutionOffset);        // XResolution
+                PutEntry(file, 283, TiffTypeRational, resolutionOffset + 8);    // YResolution
+                PutEntry(file, 296, TiffTypeShort, 2);                          // ResolutionUnit: inch
+            }
+            PutUInt32(file, 0);
+
+            if (hasDpi)
+            {
+                PutUInt32(file, uint32_t(image.dpiX * 100 + 0.5));
+                PutUInt32(file, 100);
+                PutUInt32(file, uint32_t(image.dpiY * 100 + 0.5));
+                PutUInt32(file, 100);
+            }
+
+            return data.Write(file.data(), file.size()) == file.size();
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "memoryBuffer.h"
+#include "rawImage.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        // Bilevel compression of CCITT T.6(Group 4 fax) without platform dependencies.
+        // Pixels darker than the threshold are black.
+        // The data is appended, bits are filled from the most significant one(FillOrder 1)
+        void EncodeG4(const RawImage& image, uint8_t threshold, std::vector<uint8_t>& data);
+
+        // A single page TIFF with a G4 compressed strip.
+        // The data is appended to the buffer
+        bool EncodeTiffG4(const RawImage& image, uint8_t threshold, CMemoryBuffer& data);
+    }
+}
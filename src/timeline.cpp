@@ -0,0 +1,152 @@
+#include "stdafx.h"
+#include "timeline.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <thread>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            void AppendJsonString(std::string& out, const char* value)
+            {
+                out += '"';
+                for (const char* c = value ? value : ""; *c; c++)
+                {
+                    if (*c == '"' || *c == '\\')
+                    {
+                        out += '\\';
+                    }
+                    if (uint8_t(*c) >= 0x20)
+                    {
+                        out += *c;
+                    }
+                }
+                out += '"';
+            }
+        }
+
+        CTimeline::CTimeline(size_t capacity)
+            : m_bEnabled(false)
+            , m_origin(Clock::now())
+            , m_capacity((std::max)(capacity, size_t(1)))
+            , m_next(0)
+            , m_droppedCount(0)
+        {
+        }
+
+        void CTimeline::Enable(bool enabled)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            if (enabled && !m_bEnabled.load(std::memory_order_relaxed))
+            {
+                m_origin = Clock::now();
+                m_spans.clear();
+                m_next = 0;
+                m_droppedCount = 0;
+            }
+            m_bEnabled.store(enabled, std::memory_order_relaxed);
+        }
+
+        void CTimeline::AddSpan(const char* name, const char* category, Clock::time_point startTime, Clock::time_point endTime,
+            const char* argName, int64_t arg)
+        {
+            TimelineSpan span;
+            span.name = name;
+            span.category = category;
+            span.threadId = CurrentThreadId();
+            span.argName = argName;
+            span.arg = arg;
+
+            std::lock_guard<std::mutex> g(m_lock);
+            span.startUs = std::chrono::duration<double, std::micro>(startTime - m_origin).count();
+            span.durationUs = std::chrono::duration<double, std::micro>(endTime - startTime).count();
+
+            if (m_spans.size() < m_capacity)
+            {
+                m_spans.push_back(span);
+                return;
+            }
+            m_spans[m_next] = span;
+            m_next = (m_next + 1) % m_capacity;
+            m_droppedCount++;
+        }
+
+        std::vector<TimelineSpan> CTimeline::GetSpans() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            std::vector<TimelineSpan> spans;
+            spans.reserve(m_spans.size());
+            spans.insert(spans.end(), m_spans.begin() + m_next, m_spans.end());
+            spans.insert(spans.end(), m_spans.begin(), m_spans.begin() + m_next);
+            return spans;
+        }
+
+        uint64_t CTimeline::GetDroppedCount() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_droppedCount;
+        }
+
+        std::string CTimeline::ToChromeTrace() const
+        {
+            std::vector<TimelineSpan> spans = GetSpans();
+            uint64_t droppedCount = GetDroppedCount();
+
+            std::string out;
+            out.reserve(64 + spans.size() * 128);
+            out += "{\"traceEvents\":[";
+
+            char number[64];
+            for (size_t i = 0; i < spans.size(); i++)
+            {
+                const TimelineSpan& span = spans[i];
+                out += i ? ",\n{\"name\":" : "\n{\"name\":";
+                AppendJsonString(out, span.name);
+                out += ",\"cat\":";
+                AppendJsonString(out, span.category);
+                std::snprintf(number, sizeof(number), ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                    span.threadId, span.startUs, span.durationUs);
+                out += number;
+                if (span.argName)
+                {
+                    out += ",\"args\":{";
+                    AppendJsonString(out, span.argName);
+                    std::snprintf(number, sizeof(number), ":%lld}", (long long)span.arg);
+                    out += number;
+                }
+                out += '}';
+            }
+
+            std::snprintf(number, sizeof(number), "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedSpans\":%llu}}",
+                (unsigned long long)droppedCount);
+            out += number;
+            return out;
+        }
+
+        uint32_t CTimeline::CurrentThreadId()
+        {
+            static thread_local uint32_t threadId = 0;
+            if (!threadId)
+            {
+#if defined(_WIN32)
+                threadId = uint32_t(::GetCurrentThreadId());
+#elif defined(__linux__)
+                threadId = uint32_t(::syscall(SYS_gettid));
+#else
+                threadId = uint32_t(std::hash<std::thread::id>()(std::this_thread::get_id()));
+#endif
+            }
+            return threadId;
+        }
+    }
+}
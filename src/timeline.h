@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace scanner
+{
+    namespace util
+    {
+        struct TimelineSpan
+        {
+            const char* name = nullptr;         // literals, not copied
+            const char* category = nullptr;
+            uint32_t threadId = 0;
+            double startUs = 0;                 // since the timeline has been enabled
+            double durationUs = 0;
+            const char* argName = nullptr;      // a number shown with the span if given, e.g. the page
+            int64_t arg = 0;
+        };
+
+        // The phases of the scans of a device on a timeline, exported in the trace event format of Chrome (about://tracing).
+        // Disabled by default, a span costs a single branch then.
+        // The last spans are kept only, the oldest ones are dropped once the capacity is reached
+        class CTimeline
+        {
+        public:
+            typedef std::chrono::steady_clock Clock;
+
+            explicit CTimeline(size_t capacity = 65536);
+
+            CTimeline(const CTimeline&) = delete;
+            CTimeline& operator=(const CTimeline&) = delete;
+
+            bool IsEnabled() const
+            {
+                return m_bEnabled.load(std::memory_order_relaxed);
+            }
+
+            // Enabling starts a new timeline, the spans recorded before are cleared
+            void Enable(bool enabled);
+
+            // Called on any thread
+            void AddSpan(const char* name, const char* category, Clock::time_point startTime, Clock::time_point endTime,
+                const char* argName = nullptr, int64_t arg = 0);
+
+            // in the order they have ended
+            std::vector<TimelineSpan> GetSpans() const;
+            uint64_t GetDroppedCount() const;
+
+            // {"traceEvents":[...]}, complete events ("ph":"X") with the times in microseconds
+            std::string ToChromeTrace() const;
+
+            // the id of the calling thread in the system
+            static uint32_t CurrentThreadId();
+
+        private:
+            std::atomic<bool> m_bEnabled;
+
+            mutable std::mutex m_lock;
+            Clock::time_point m_origin;
+            std::vector<TimelineSpan> m_spans;      // a ring once full
+            size_t m_capacity;
+            size_t m_next;                          // where the next span goes once the ring is full
+            uint64_t m_droppedCount;
+        };
+
+        // Records a span from the construction to the destruction if the timeline is enabled
+        class CTimelineSpan
+        {
+        public:
+            CTimelineSpan(CTimeline& timeline, const char* name, const char* category, const char* argName = nullptr, int64_t arg = 0)
+                : m_pTimeline(timeline.IsEnabled() ? &timeline : nullptr)
+                , m_name(name)
+                , m_category(category)
+                , m_argName(argName)
+                , m_arg(arg)
+            {
+                if (m_pTimeline)
+                {
+                    m_startTime = CTimeline::Clock::now();
+                }
+            }
+
+            ~CTimelineSpan()
+            {
+                if (m_pTimeline)
+                {
+                    m_pTimeline->AddSpan(m_name, m_category, m_startTime, CTimeline::Clock::now(), m_argName, m_arg);
+                }
+            }
+
+            CTimelineSpan(const CTimelineSpan&) = delete;
+            CTimelineSpan& operator=(const CTimelineSpan&) = delete;
+
+        private:
+            CTimeline* m_pTimeline;
+            const char* m_name;
+            const char* m_category;
+            const char* m_argName;
+            int64_t m_arg;
+            CTimeline::Clock::time_point m_startTime;
+        };
+    }
+}
@@ -0,0 +1,297 @@
+#include "stdafx.h"
+#include "transferTrace.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace scanner
+{
+    namespace util
+    {
+        namespace
+        {
+            const char TraceMagic[8] = { 'W', 'I', 'A', 'T', 'R', 'A', 'C', 'E' };
+            const uint8_t TraceVersion = 1;
+            const uint8_t TraceFlagData = 0x01;
+
+            // LEB128, at most 10 bytes
+            size_t PutVarint(uint8_t* out, uint64_t value)
+            {
+                size_t size = 0;
+                while (value >= 0x80)
+                {
+                    out[size++] = uint8_t(value | 0x80);
+                    value >>= 7;
+                }
+                out[size++] = uint8_t(value);
+                return size;
+            }
+        }
+
+        CTransferTraceRecorder::CTransferTraceRecorder()
+            : m_bWithData(false)
+            , m_lastTimeUs(0)
+        {
+        }
+
+        CTransferTraceRecorder::~CTransferTraceRecorder()
+        {
+            Close();
+        }
+
+        bool CTransferTraceRecorder::Open(const FilePath& path, bool withData)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            if (m_pFile)
+            {
+                return false;
+            }
+
+            // a few events fit in a buffer, small buffers keep the memory of a long trace low
+            FileSinkOptions options;
+            options.bufferSize = 256 * 1024;
+            m_pWriter = std::make_shared<CFileWriter>(options);
+            m_pFile = m_pWriter->Create(path);
+            if (!m_pFile)
+            {
+                m_pWriter.reset();
+                return false;
+            }
+
+            uint8_t header[sizeof(TraceMagic) + 2];
+            std::memcpy(header, TraceMagic, sizeof(TraceMagic));
+            header[sizeof(TraceMagic)] = TraceVersion;
+            header[sizeof(TraceMagic) + 1] = withData ? TraceFlagData : 0;
+            m_pFile->Write(header, sizeof(header));
+
+            m_bWithData = withData;
+            m_startTime = std::chrono::steady_clock::now();
+            m_lastTimeUs = 0;
+            return true;
+        }
+
+        bool CTransferTraceRecorder::IsOpen() const
+        {
+            return m_pFile != nullptr;
+        }
+
+        void CTransferTraceRecorder::RecordMessage(const TransferParams& params)
+        {
+            uint64_t fields[] =
+            {
+                uint64_t(uint32_t(params.message)),
+                uint64_t(uint32_t(params.percentComplete)),
+                params.transferredBytes,
+                uint64_t(uint32_t(params.errorStatus)),
+            };
+            Append(TraceEventType::Message, fields, 4, nullptr, 0);
+        }
+
+        void CTransferTraceRecorder::RecordNextStream()
+        {
+            Append(TraceEventType::NextStream, nullptr, 0, nullptr, 0);
+        }
+
+        void CTransferTraceRecorder::RecordWrite(uint64_t offset, const void* data, size_t size)
+        {
+            uint64_t fields[] = { offset, uint64_t(size) };
+            Append(TraceEventType::Write, fields, 2, data, size);
+        }
+
+        bool CTransferTraceRecorder::Close()
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            if (!m_pFile)
+            {
+                return true;
+            }
+
+            uint8_t end = uint8_t(TraceEventType::End);
+            m_pFile->Write(&end, 1);
+            bool succeeded = m_pFile->Close();
+            succeeded = m_pWriter->Finish() && succeeded;
+
+            m_pFile.reset();
+            m_pWriter.reset();
+            return succeeded;
+        }
+
+        void CTransferTraceRecorder::Append(TraceEventType type, const uint64_t* fields, size_t fieldCount, const void* data, size_t size)
+        {
+            uint64_t timeUs = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - m_startTime).count());
+
+            std::lock_guard<std::mutex> g(m_lock);
+            if (!m_pFile)
+            {
+                return;
+            }
+
+            // the type, the time since the previous event and the fields
+            uint8_t record[1 + 10 * 5];
+            size_t recordSize = 0;
+            record[recordSize++] = uint8_t(type);
+            recordSize += PutVarint(record + recordSize, timeUs > m_lastTimeUs ? timeUs - m_lastTimeUs : 0);
+            for (size_t i = 0; i < fieldCount; i++)
+            {
+                recordSize += PutVarint(record + recordSize, fields[i]);
+            }
+            m_lastTimeUs = (std::max)(m_lastTimeUs, timeUs);
+
+            m_pFile->Write(record, recordSize);
+            if (m_bWithData && size)
+            {
+                m_pFile->Write(data, size);
+            }
+        }
+
+        CTransferTraceReader::CTransferTraceReader()
+            : m_file(nullptr)
+            , m_bWithData(false)
+            , m_bComplete(false)
+            , m_timeUs(0)
+        {
+        }
+
+        CTransferTraceReader::~CTransferTraceReader()
+        {
+            if (m_file)
+            {
+                std::fclose(m_file);
+            }
+        }
+
+        bool CTransferTraceReader::Open(const FilePath& path)
+        {
+            if (m_file)
+            {
+                return false;
+            }
+
+#if defined(_WIN32)
+            m_file = _wfopen(path.c_str(), L"rb");
+#else
+            m_file = std::fopen(path.c_str(), "rb");
+#endif
+            if (!m_file)
+            {
+                return false;
+            }
+
+            uint8_t header[sizeof(TraceMagic) + 2];
+            if (std::fread(header, 1, sizeof(header), m_file) != sizeof(header) ||
+                std::memcmp(header, TraceMagic, sizeof(TraceMagic)) != 0 || header[sizeof(TraceMagic)] != TraceVersion)
+            {
+                std::fclose(m_file);
+                m_file = nullptr;
+                return false;
+            }
+
+            m_bWithData = (header[sizeof(TraceMagic) + 1] & TraceFlagData) != 0;
+            m_bComplete = false;
+            m_timeUs = 0;
+            return true;
+        }
+
+        bool CTransferTraceReader::HasData() const
+        {
+            return m_bWithData;
+        }
+
+        bool CTransferTraceReader::Next(TraceEvent& event)
+        {
+            if (!m_file || m_bComplete)
+            {
+                return false;
+            }
+
+            int type = std::fgetc(m_file);
+            if (type == EOF)
+            {
+                return false;
+            }
+            if (type == int(TraceEventType::End))
+            {
+                m_bComplete = true;
+                return false;
+            }
+
+            uint64_t delta = 0;
+            if (!ReadVarint(delta))
+            {
+                return false;
+            }
+            m_timeUs += delta;
+
+            event = TraceEvent();
+            event.type = TraceEventType(type);
+            event.timeUs = m_timeUs;
+
+            switch (event.type)
+            {
+            case TraceEventType::Message:
+            {
+                uint64_t message = 0;
+                uint64_t percentComplete = 0;
+                uint64_t errorStatus = 0;
+                if (!ReadVarint(message) || !ReadVarint(percentComplete) ||
+                    !ReadVarint(event.params.transferredBytes) || !ReadVarint(errorStatus))
+                {
+                    return false;
+                }
+                event.params.message = TransferMessage(int32_t(uint32_t(message)));
+                event.params.percentComplete = int32_t(uint32_t(percentComplete));
+                event.params.errorStatus = int32_t(uint32_t(errorStatus));
+                return true;
+            }
+            case TraceEventType::NextStream:
+                return true;
+            case TraceEventType::Write:
+            {
+                uint64_t size = 0;
+                if (!ReadVarint(event.offset) || !ReadVarint(size) || size > UINT32_MAX)
+                {
+                    return false;
+                }
+                event.size = uint32_t(size);
+                if (m_bWithData && size)
+                {
+                    event.data.resize(size_t(size));
+                    if (std::fread(event.data.data(), 1, event.data.size(), m_file) != event.data.size())
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            default:
+                // damaged, or written by a later version
+                return false;
+            }
+        }
+
+        bool CTransferTraceReader::IsComplete() const
+        {
+            return m_bComplete;
+        }
+
+        bool CTransferTraceReader::ReadVarint(uint64_t& value)
+        {
+            value = 0;
+            for (int shift = 0; shift < 64; shift += 7)
+            {
+                int byte = std::fgetc(m_file);
+                if (byte == EOF)
+                {
+                    return false;
+                }
+                value |= uint64_t(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+}
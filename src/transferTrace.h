@@ -0,0 +1,115 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "fileSink.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        // the messages of IWiaTransferCallback::TransferCallback, the values of WIA_TRANSFER_MSG_*
+        enum class TransferMessage : int32_t
+        {
+            Status = 1,
+            EndOfStream = 2,
+            EndOfTransfer = 3,
+            DeviceStatus = 5,
+            NewPage = 6,
+        };
+
+        // stand-in of WiaTransferParams
+        struct TransferParams
+        {
+            TransferMessage message = TransferMessage::Status;
+            int32_t percentComplete = 0;
+            uint64_t transferredBytes = 0;
+            int32_t errorStatus = 0;        // an HRESULT
+        };
+
+        enum class TraceEventType : uint8_t
+        {
+            End = 0,            // the trace is complete
+            Message = 1,        // TransferCallback()
+            NextStream = 2,     // GetNextStream(), a page starts
+            Write = 3,          // the driver writes to the stream of the page
+        };
+
+        struct TraceEvent
+        {
+            TraceEventType type = TraceEventType::End;
+            uint64_t timeUs = 0;            // since the recording started
+            TransferParams params;          // Message
+            uint64_t offset = 0;            // Write: where the data goes in the page
+            uint32_t size = 0;              // Write
+            std::vector<uint8_t> data;      // Write, empty if the trace is recorded without the data
+        };
+
+        // Records what the driver does during a transfer into a trace file, to be replayed without the scanner.
+        // The events are varint encoded and written behind the transfer.
+        // Only the sizes of the writes are kept unless the data is asked for
+        class CTransferTraceRecorder
+        {
+        public:
+            CTransferTraceRecorder();
+            // Close()
+            ~CTransferTraceRecorder();
+
+            CTransferTraceRecorder(const CTransferTraceRecorder&) = delete;
+            CTransferTraceRecorder& operator=(const CTransferTraceRecorder&) = delete;
+
+            bool Open(const FilePath& path, bool withData);
+            bool IsOpen() const;
+
+            void RecordMessage(const TransferParams& params);
+            void RecordNextStream();
+            void RecordWrite(uint64_t offset, const void* data, size_t size);
+
+            // Complete the trace and wait until it is written. Returns false if it could not be
+            bool Close();
+
+        private:
+            void Append(TraceEventType type, const uint64_t* fields, size_t fieldCount, const void* data, size_t size);
+
+            std::mutex m_lock;
+            std::shared_ptr<CFileWriter> m_pWriter;
+            std::shared_ptr<CFileSink> m_pFile;
+            bool m_bWithData;
+            std::chrono::steady_clock::time_point m_startTime;
+            uint64_t m_lastTimeUs;          // the times are stored as deltas
+        };
+
+        // Reads the events of a trace file one by one
+        class CTransferTraceReader
+        {
+        public:
+            CTransferTraceReader();
+            ~CTransferTraceReader();
+
+            CTransferTraceReader(const CTransferTraceReader&) = delete;
+            CTransferTraceReader& operator=(const CTransferTraceReader&) = delete;
+
+            // Returns false if the file is not a trace
+            bool Open(const FilePath& path);
+            // the writes carry their data
+            bool HasData() const;
+
+            // Returns false once the trace ends or if it is damaged, IsComplete() tells which
+            bool Next(TraceEvent& event);
+            bool IsComplete() const;
+
+        private:
+            bool ReadVarint(uint64_t& value);
+
+            FILE* m_file;
+            bool m_bWithData;
+            bool m_bComplete;
+            uint64_t m_timeUs;
+        };
+    }
+}
@@ -1,5 +1,7 @@
 ﻿#include "stdafx.h"
 #include "utils.h"
+#include "metrics.h"
+#include "propertyBatch.h"
 #include <comdef.h>
 
 namespace scanner
@@ -46,12 +48,16 @@ namespace scanner
 
         CPropVariant::CPropVariant(int propCount)
             : m_pPropValues(new PROPVARIANT[propCount]())
+            , m_propCount(propCount)
         {
-            PropVariantInit(m_pPropValues.get());
+            for (int i = 0; i < m_propCount; i++)
+            {
+                PropVariantInit(&m_pPropValues[i]);
+            }
         }
         CPropVariant::~CPropVariant()
         {
-            PropVariantClear(m_pPropValues.get());
+            FreePropVariantArray(m_propCount, m_pPropValues.get());
         }
         const PROPVARIANT& CPropVariant::operator[](int index) const
         {
@@ -67,6 +73,29 @@ namespace scanner
             return m_pPropValues.get();
         }
 
+        int CPropVariant::count() const
+        {
+            return m_propCount;
+        }
+
+        static std::unique_ptr<PROPSPEC[]> MakePropSpecs(const std::vector<PROPID>& propids)
+        {
+            return PackPropertySpecs<PROPSPEC>(propids, ULONG(PRSPEC_PROPID));
+        }
+
+        // The calls to the driver, timed for the device of the thread if any
+        static HRESULT ReadMultiple(IWiaPropertyStorage* pWiaPropertyStorage, ULONG count, const PROPSPEC* propSpecs, PROPVARIANT* values)
+        {
+            CScopedLatency latency(CMetricsScope::Current(), &DeviceMetrics::readMultiple);
+            return pWiaPropertyStorage->ReadMultiple(count, propSpecs, values);
+        }
+
+        static HRESULT WriteMultiple(IWiaPropertyStorage* pWiaPropertyStorage, ULONG count, const PROPSPEC* propSpecs, const PROPVARIANT* values, PROPID propidNameFirst)
+        {
+            CScopedLatency latency(CMetricsScope::Current(), &DeviceMetrics::writeMultiple);
+            return pWiaPropertyStorage->WriteMultiple(count, propSpecs, values, propidNameFirst);
+        }
+
         // WIA properties
         // This function reads item property which returns BSTR like WIA_DIP_DEV_ID, WIA_DIP_DEV_NAME etc.
         std::wstring ReadPropertyString(ATL::CComPtr<IWiaPropertyStorage> pWiaPropertyStorage, PROPID propid)
@@ -86,7 +115,7 @@ namespace scanner
             PropSpec[0].ulKind = PRSPEC_PROPID;
             PropSpec[0].propid = propid;
 
-            HRESULT hr = pWiaPropertyStorage->ReadMultiple(1, PropSpec, PropVar.get());
+            HRESULT hr = ReadMultiple(pWiaPropertyStorage, 1, PropSpec, PropVar.get());
             if (S_OK == hr)
             {
                 if (PropVar[0].vt == VT_BSTR)
@@ -122,7 +151,7 @@ namespace scanner
 
             PropSpec[0].ulKind = PRSPEC_PROPID;
             PropSpec[0].propid = propid;
-            HRESULT hr = pWiaPropertyStorage->ReadMultiple(1, PropSpec, PropVar.get());
+            HRESULT hr = ReadMultiple(pWiaPropertyStorage, 1, PropSpec, PropVar.get());
             if (S_OK == hr)
             {
                 if (PropVar[0].vt == VT_I4)
@@ -159,7 +188,7 @@ namespace scanner
 
                 PropSpec[0].ulKind = PRSPEC_PROPID;
                 PropSpec[0].propid = propid;
-                HRESULT hr = pWiaPropertyStorage->ReadMultiple(1, PropSpec, PropVar.get());
+                HRESULT hr = ReadMultiple(pWiaPropertyStorage, 1, PropSpec, PropVar.get());
                 if (S_OK == hr)
                 {
                     if (PropVar[0].vt == VT_CLSID)
@@ -202,7 +231,7 @@ namespace scanner
             PropVar[0].vt = VT_BSTR;
             PropVar[0].bstrVal = valueBstr;
 
-            HRESULT hr = pWiaPropertyStorage->WriteMultiple(1, PropSpec, PropVar, WIA_DIP_FIRST);
+            HRESULT hr = WriteMultiple(pWiaPropertyStorage, 1, PropSpec, PropVar, WIA_DIP_FIRST);
 
             if (FAILED(hr))
             {
@@ -230,7 +259,7 @@ namespace scanner
             PropVar[0].vt = VT_I4;
             PropVar[0].lVal = lVal;
 
-            HRESULT hr = pWiaPropertyStorage->WriteMultiple(1, PropSpec, PropVar, WIA_DIP_FIRST);
+            HRESULT hr = WriteMultiple(pWiaPropertyStorage, 1, PropSpec, PropVar, WIA_DIP_FIRST);
 
             if (FAILED(hr))
             {
@@ -259,7 +288,7 @@ namespace scanner
             PropVar[0].vt = VT_CLSID;
             PropVar[0].puuid = &guid;
 
-            HRESULT hr = pWiaPropertyStorage->WriteMultiple(1, PropSpec, PropVar, WIA_DIP_FIRST);
+            HRESULT hr = WriteMultiple(pWiaPropertyStorage, 1, PropSpec, PropVar, WIA_DIP_FIRST);
 
             if (FAILED(hr))
             {
@@ -267,6 +296,77 @@ namespace scanner
             }
         }
 
+        // This function reads several properties with one IWiaPropertyStorage::ReadMultiple() call
+        void ReadProperties(ATL::CComPtr<IWiaPropertyStorage> pWiaPropertyStorage, const std::vector<PROPID>& propids, CPropVariant& values)
+        {
+            assert(pWiaPropertyStorage);
+            if ((!pWiaPropertyStorage))
+            {
+                throw PropertyStorageException("invalid IWiaPropertyStorage pointer", E_INVALIDARG);
+            }
+            assert(values.count() >= (int)propids.size());
+            if (propids.empty())
+            {
+                return;
+            }
+
+            auto propSpecs = MakePropSpecs(propids);
+
+            // S_FALSE is returned if none of the properties exists
+            HRESULT hr = ReadMultiple(pWiaPropertyStorage, (ULONG)propids.size(), propSpecs.get(), values.get());
+            if (FAILED(hr))
+            {
+                throw PropertyStorageException("Error calling IWiaPropertyStorage::ReadMultiple().", hr);
+            }
+        }
+
+        // This function writes several properties with one IWiaPropertyStorage::WriteMultiple() call
+        void WriteProperties(ATL::CComPtr<IWiaPropertyStorage> pWiaPropertyStorage, const std::vector<PROPID>& propids, const CPropVariant& values)
+        {
+            assert(pWiaPropertyStorage);
+            if ((!pWiaPropertyStorage))
+            {
+                throw PropertyStorageException("invalid IWiaPropertyStorage pointer", E_INVALIDARG);
+            }
+            assert(values.count() >= (int)propids.size());
+            if (propids.empty())
+            {
+                return;
+            }
+
+            auto propSpecs = MakePropSpecs(propids);
+
+            HRESULT hr = WriteMultiple(pWiaPropertyStorage, (ULONG)propids.size(), propSpecs.get(), values.get(), WIA_DIP_FIRST);
+            if (FAILED(hr))
+            {
+                throw PropertyStorageException("Error calling IWiaPropertyStorage::WriteMultiple().", hr);
+            }
+        }
+
+        // This function reads attributes of several properties with one IWiaPropertyStorage::GetPropertyAttributes() call
+        void ReadPropertyAttributes(ATL::CComPtr<IWiaPropertyStorage> pWiaPropertyStorage, const std::vector<PROPID>& propids, std::vector<ULONG>& accessFlags, CPropVariant& attributes)
+        {
+            assert(pWiaPropertyStorage);
+            if ((!pWiaPropertyStorage))
+            {
+                throw PropertyStorageException("invalid IWiaPropertyStorage pointer", E_INVALIDARG);
+            }
+            assert(attributes.count() >= (int)propids.size());
+            accessFlags.assign(propids.size(), 0);
+            if (propids.empty())
+            {
+                return;
+            }
+
+            auto propSpecs = MakePropSpecs(propids);
+
+            HRESULT hr = pWiaPropertyStorage->GetPropertyAttributes((ULONG)propids.size(), propSpecs.get(), accessFlags.data(), attributes.get());
+            if (FAILED(hr))
+            {
+                throw PropertyStorageException("Error calling IWiaPropertyStorage::GetPropertyAttributes().", hr);
+            }
+        }
+
         std::wstring GetWIAErrorStr(HRESULT ret)
         {
             _com_error err(ret);
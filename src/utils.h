@@ -58,12 +58,21 @@ namespace scanner
             PROPVARIANT& operator[](int index);
 
             PROPVARIANT* get() const;
+            int count() const;
 
         private:
             std::unique_ptr<PROPVARIANT[]> m_pPropValues;
+            int m_propCount;
 
         };
 
+        // Read/write several properties with a single IWiaPropertyStorage call.
+        // values[i] corresponds to propids[i]. Properties not supported by the item are left as VT_EMPTY.
+        void ReadProperties(ATL::CComPtr<IWiaPropertyStorage> pWiaPropertyStorage, const std::vector<PROPID>& propids, CPropVariant& values);
+        void WriteProperties(ATL::CComPtr<IWiaPropertyStorage> pWiaPropertyStorage, const std::vector<PROPID>& propids, const CPropVariant& values);
+        // Read the valid values(range/list/flag) of several properties with a single call
+        void ReadPropertyAttributes(ATL::CComPtr<IWiaPropertyStorage> pWiaPropertyStorage, const std::vector<PROPID>& propids, std::vector<ULONG>& accessFlags, CPropVariant& attributes);
+
         // get error message string from the WIA error code
         std::wstring GetWIAErrorStr(HRESULT ret);
     }
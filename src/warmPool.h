@@ -0,0 +1,345 @@
+#pragma once
+
+#include "watchdog.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace scanner
+{
+    namespace util
+    {
+        struct WarmPoolOptions
+        {
+            std::chrono::milliseconds idleTtl = std::chrono::milliseconds(0);      // 0 disables the pool
+            size_t maxIdle = 4;                 // of all keys, the objects idle the longest are dropped first
+        };
+
+        struct WarmPoolStats
+        {
+            uint64_t hits = 0;                  // handed out again
+            uint64_t misses = 0;                // created, or failed to
+            uint64_t expired = 0;               // dropped after the idle TTL
+            uint64_t evicted = 0;               // dropped as their key has been evicted, e.g. the device has been disconnected
+            uint64_t overCapacity = 0;          // dropped as more than maxIdle were idle
+            size_t idleCount = 0;
+            size_t inUseCount = 0;
+        };
+
+        // Keeps the objects released idle for a while and hands them out again for the same key,
+        // e.g. the devices, as opening a device again takes seconds with some drivers.
+        // An object is handed out to one user at a time. The handle may be copied,
+        // the object returns to the pool once the last copy is gone.
+        // The objects are dropped on the thread of the pool, started by the first one released
+        template <typename T>
+        class CWarmPool
+        {
+        public:
+            typedef std::function<std::shared_ptr<T>()> Factory;
+            typedef CWatchdog::Clock Clock;
+
+            // threadStart/threadExit run on the thread dropping the objects, e.g. to initialize COM there
+            explicit CWarmPool(CWatchdog::Action threadStart = nullptr, CWatchdog::Action threadExit = nullptr)
+                : m_pState(std::make_shared<State>())
+            {
+                m_pState->pWatchdog.reset(new CWatchdog(threadStart, threadExit));
+            }
+
+            ~CWarmPool()
+            {
+                Shutdown();
+            }
+
+            CWarmPool(const CWarmPool&) = delete;
+            CWarmPool& operator=(const CWarmPool&) = delete;
+
+            // An object idle for the key if any, one made by the factory otherwise, outside of the lock.
+            // nullptr if the factory fails
+            std::shared_ptr<T> Acquire(const std::wstring& key, const Factory& factory, bool* pReused = nullptr)
+            {
+                State& state = *m_pState;
+                std::shared_ptr<T> object;
+                uint64_t generation = 0;
+                {
+                    std::lock_guard<std::mutex> g(state.lock);
+                    auto it = state.idle.find(key);
+                    if (!state.bShutdown && it != state.idle.end())
+                    {
+                        // the one released last, its driver connection is the least likely to have gone stale
+                        object = std::move(it->second.back().object);
+                        it->second.pop_back();
+                        if (it->second.empty())
+                        {
+                            state.idle.erase(it);
+                        }
+                        state.stats.idleCount--;
+                        state.stats.inUseCount++;
+                        state.stats.hits++;
+                        generation = state.generations[key];
+                        Schedule(state);
+                    }
+                    else
+                    {
+                        state.stats.misses++;
+                    }
+                }
+                if (pReused)
+                {
+                    *pReused = object != nullptr;
+                }
+
+                if (!object)
+                {
+                    object = factory ? factory() : nullptr;
+                    if (!object)
+                    {
+                        return nullptr;
+                    }
+
+                    std::lock_guard<std::mutex> g(state.lock);
+                    state.stats.inUseCount++;
+                    generation = state.generations[key];
+                }
+
+                std::weak_ptr<State> weakState = m_pState;
+                T* pObject = object.get();
+                return std::shared_ptr<T>(pObject, [weakState, object, key, generation](T*) mutable
+                {
+                    Release(weakState, std::move(object), key, generation);
+                });
+            }
+
+            // The objects of the key are not handed out again, e.g. the device has been disconnected.
+            // The idle ones are dropped at once, the ones in use when released
+            void Evict(const std::wstring& key)
+            {
+                State& state = *m_pState;
+                std::lock_guard<std::mutex> g(state.lock);
+                state.generations[key]++;
+
+                auto it = state.idle.find(key);
+                if (it == state.idle.end())
+                {
+                    return;
+                }
+                for (auto& idle : it->second)
+                {
+                    state.dropped.push_back(std::move(idle.object));
+                }
+                state.stats.evicted += it->second.size();
+                state.stats.idleCount -= it->second.size();
+                state.idle.erase(it);
+                Schedule(state);
+            }
+
+            // Options changed apply to the objects released from now on, the objects idle are dropped if disabled
+            void SetOptions(const WarmPoolOptions& options)
+            {
+                State& state = *m_pState;
+                std::lock_guard<std::mutex> g(state.lock);
+                state.options = options;
+                if (!IsEnabled(state))
+                {
+                    DropIdle(state);
+                }
+                Schedule(state);
+            }
+
+            WarmPoolOptions GetOptions() const
+            {
+                std::lock_guard<std::mutex> g(m_pState->lock);
+                return m_pState->options;
+            }
+
+            WarmPoolStats GetStats() const
+            {
+                std::lock_guard<std::mutex> g(m_pState->lock);
+                return m_pState->stats;
+            }
+
+            // Drops the objects idle and stops the thread of the pool, on the calling thread.
+            // The objects in use are dropped when released
+            void Shutdown()
+            {
+                std::unique_ptr<CWatchdog> pWatchdog;
+                std::vector<std::shared_ptr<T>> dropped;
+                {
+                    State& state = *m_pState;
+                    std::lock_guard<std::mutex> g(state.lock);
+                    state.bShutdown = true;
+                    DropIdle(state);
+                    dropped.swap(state.dropped);
+                    pWatchdog.swap(state.pWatchdog);
+                }
+
+                // waits for the objects being dropped on the thread of the pool
+                pWatchdog.reset();
+                dropped.clear();
+            }
+
+        private:
+            struct IdleObject
+            {
+                std::shared_ptr<T> object;
+                Clock::time_point expiry;
+            };
+
+            struct State
+            {
+                std::mutex lock;
+                WarmPoolOptions options;
+                std::map<std::wstring, std::deque<IdleObject>> idle;   // by the time released, the latest last
+                std::map<std::wstring, uint64_t> generations;           // the objects acquired before an eviction are dropped
+                std::vector<std::shared_ptr<T>> dropped;                // to be dropped on the thread of the pool
+                WarmPoolStats stats;
+                bool bShutdown = false;
+                std::unique_ptr<CWatchdog> pWatchdog;
+            };
+
+            static bool IsEnabled(const State& state)
+            {
+                return !state.bShutdown && state.options.idleTtl.count() > 0 && state.options.maxIdle > 0;
+            }
+
+            static void Release(const std::weak_ptr<State>& weakState, std::shared_ptr<T> object, const std::wstring& key, uint64_t generation)
+            {
+                auto pState = weakState.lock();
+                if (!pState)
+                {
+                    return;
+                }
+
+                // dropped after the lock unless kept
+                std::shared_ptr<T> dropped;
+                State& state = *pState;
+                std::lock_guard<std::mutex> g(state.lock);
+                state.stats.inUseCount--;
+                if (state.generations[key] != generation && state.pWatchdog)
+                {
+                    state.stats.evicted++;
+                    state.dropped.push_back(std::move(object));
+                    Schedule(state);
+                    return;
+                }
+                if (!IsEnabled(state))
+                {
+                    // as if there were no pool
+                    dropped = std::move(object);
+                    return;
+                }
+
+                IdleObject idle;
+                idle.object = std::move(object);
+                idle.expiry = Clock::now() + state.options.idleTtl;
+                state.idle[key].push_back(std::move(idle));
+                state.stats.idleCount++;
+
+                while (state.stats.idleCount > state.options.maxIdle)
+                {
+                    // the object idle the longest of all keys
+                    auto oldest = state.idle.begin();
+                    for (auto it = state.idle.begin(); it != state.idle.end(); ++it)
+                    {
+                        if (it->second.front().expiry < oldest->second.front().expiry)
+                        {
+                            oldest = it;
+                        }
+                    }
+                    state.dropped.push_back(std::move(oldest->second.front().object));
+                    oldest->second.pop_front();
+                    if (oldest->second.empty())
+                    {
+                        state.idle.erase(oldest);
+                    }
+                    state.stats.idleCount--;
+                    state.stats.overCapacity++;
+                }
+                Schedule(state);
+            }
+
+            // all the idle objects to be dropped, under the lock
+            static void DropIdle(State& state)
+            {
+                for (auto& key : state.idle)
+                {
+                    for (auto& idle : key.second)
+                    {
+                        state.dropped.push_back(std::move(idle.object));
+                    }
+                }
+                state.idle.clear();
+                state.stats.idleCount = 0;
+            }
+
+            // Arms the thread of the pool for the next object to be dropped, under the lock
+            static void Schedule(State& state)
+            {
+                if (!state.pWatchdog)
+                {
+                    return;
+                }
+
+                Clock::time_point deadline = Clock::now();
+                if (state.dropped.empty())
+                {
+                    if (state.idle.empty())
+                    {
+                        state.pWatchdog->Disarm();
+                        return;
+                    }
+                    deadline = Clock::time_point::max();
+                    for (const auto& key : state.idle)
+                    {
+                        deadline = (std::min)(deadline, key.second.front().expiry);
+                    }
+                }
+
+                // the pool stops the watchdog before the state goes away
+                State* pState = &state;
+                state.pWatchdog->Arm(deadline, [pState]()
+                {
+                    Collect(*pState);
+                });
+            }
+
+            // on the thread of the pool
+            static void Collect(State& state)
+            {
+                std::vector<std::shared_ptr<T>> dropped;
+                {
+                    std::lock_guard<std::mutex> g(state.lock);
+                    dropped.swap(state.dropped);
+
+                    auto now = Clock::now();
+                    for (auto it = state.idle.begin(); it != state.idle.end();)
+                    {
+                        auto& objects = it->second;
+                        while (!objects.empty() && objects.front().expiry <= now)
+                        {
+                            dropped.push_back(std::move(objects.front().object));
+                            objects.pop_front();
+                            state.stats.idleCount--;
+                            state.stats.expired++;
+                        }
+                        it = objects.empty() ? state.idle.erase(it) : std::next(it);
+                    }
+                    Schedule(state);
+                }
+                dropped.clear();
+            }
+
+        private:
+            std::shared_ptr<State> m_pState;
+        };
+    }
+}
@@ -0,0 +1,110 @@
+#include "stdafx.h"
+#include "watchdog.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        CWatchdog::CWatchdog(Action threadStart, Action threadExit)
+            : m_threadStart(threadStart)
+            , m_threadExit(threadExit)
+            , m_bArmed(false)
+            , m_bStop(false)
+            , m_firedCount(0)
+        {
+        }
+
+        CWatchdog::~CWatchdog()
+        {
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                m_bStop = true;
+                m_bArmed = false;
+            }
+            m_condition.notify_all();
+
+            if (m_thread.joinable())
+            {
+                m_thread.join();
+            }
+        }
+
+        void CWatchdog::Arm(Clock::time_point deadline, Action action)
+        {
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                if (m_bStop)
+                {
+                    return;
+                }
+
+                m_deadline = deadline;
+                m_action = action;
+                m_bArmed = true;
+
+                if (!m_thread.joinable())
+                {
+                    m_thread = std::thread(&CWatchdog::ThreadProc, this);
+                }
+            }
+            m_condition.notify_all();
+        }
+
+        void CWatchdog::Disarm()
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            m_bArmed = false;
+            m_action = nullptr;
+        }
+
+        uint64_t CWatchdog::GetFiredCount() const
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            return m_firedCount;
+        }
+
+        void CWatchdog::ThreadProc()
+        {
+            if (m_threadStart)
+            {
+                m_threadStart();
+            }
+
+            std::unique_lock<std::mutex> g(m_lock);
+            while (!m_bStop)
+            {
+                if (!m_bArmed)
+                {
+                    m_condition.wait(g);
+                    continue;
+                }
+
+                // woken up early if armed again or stopped
+                if (Clock::now() < m_deadline)
+                {
+                    m_condition.wait_until(g, m_deadline);
+                    continue;
+                }
+
+                Action action = std::move(m_action);
+                m_action = nullptr;
+                m_bArmed = false;
+                m_firedCount++;
+
+                // the action may arm the watchdog again
+                g.unlock();
+                if (action)
+                {
+                    action();
+                }
+                g.lock();
+            }
+            g.unlock();
+
+            if (m_threadExit)
+            {
+                m_threadExit();
+            }
+        }
+    }
+}
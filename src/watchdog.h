@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace scanner
+{
+    namespace util
+    {
+        // Runs an action on its own thread once a deadline passes, e.g. to abort a transfer the driver doesn't stop.
+        // The thread is started by the first Arm() and stopped when the object is destroyed,
+        // an action running at that time is waited for
+        class CWatchdog
+        {
+        public:
+            typedef std::function<void()> Action;
+            typedef std::chrono::steady_clock Clock;
+
+            // threadStart/threadExit run on the thread of the watchdog, e.g. to initialize COM there
+            explicit CWatchdog(Action threadStart = nullptr, Action threadExit = nullptr);
+            ~CWatchdog();
+
+            CWatchdog(const CWatchdog&) = delete;
+            CWatchdog& operator=(const CWatchdog&) = delete;
+
+            // The action runs once when the deadline passes, unless disarmed or armed again before.
+            // Can be called from an action
+            void Arm(Clock::time_point deadline, Action action);
+            void Disarm();
+
+            // how many actions have run
+            uint64_t GetFiredCount() const;
+
+        private:
+            void ThreadProc();
+
+            Action m_threadStart;
+            Action m_threadExit;
+
+            mutable std::mutex m_lock;
+            std::condition_variable m_condition;
+            bool m_bArmed;
+            bool m_bStop;
+            Clock::time_point m_deadline;
+            Action m_action;
+            uint64_t m_firedCount;
+
+            std::thread m_thread;
+        };
+    }
+}
@@ -0,0 +1,87 @@
+#include "stdafx.h"
+#include "wiaEventCallback.h"
+
+namespace scanner
+{
+    CWIAEventCallback::CWIAEventCallback(WIAEventHandler handler)
+        : m_cRef(1)
+        , m_handler(handler)
+    {
+    }
+
+    CWIAEventCallback::~CWIAEventCallback()
+    {
+    }
+
+    void CWIAEventCallback::Disconnect()
+    {
+        // waits for the handler running at the moment
+        std::lock_guard<std::mutex> g(m_lockHandler);
+        m_handler = nullptr;
+    }
+
+    // IUnknown
+    HRESULT CWIAEventCallback::QueryInterface(REFIID riid, void **ppvObject)
+    {
+        if (NULL == ppvObject)
+        {
+            return E_INVALIDARG;
+        }
+
+        if (IsEqualIID(riid, IID_IUnknown))
+        {
+            *ppvObject = static_cast<IUnknown*>(this);
+        }
+        else if (IsEqualIID(riid, IID_IWiaEventCallback))
+        {
+            *ppvObject = static_cast<IWiaEventCallback*>(this);
+        }
+        else
+        {
+            *ppvObject = NULL;
+            return (E_NOINTERFACE);
+        }
+
+        reinterpret_cast<IUnknown*>(*ppvObject)->AddRef();
+        return S_OK;
+    }
+
+    ULONG CWIAEventCallback::AddRef()
+    {
+        return InterlockedIncrement((long*)&m_cRef);
+    }
+
+    ULONG CWIAEventCallback::Release()
+    {
+        LONG cRef = InterlockedDecrement((long*)&m_cRef);
+        if (0 == cRef)
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    // IWiaEventCallback
+    HRESULT CWIAEventCallback::ImageEventCallback(
+        const GUID* pEventGUID,
+        BSTR bstrEventDescription,
+        BSTR bstrDeviceID,
+        BSTR bstrDeviceDescription,
+        DWORD dwDeviceType,
+        BSTR bstrFullItemName,
+        ULONG* pulEventType,
+        ULONG ulReserved)
+    {
+        if (!pEventGUID)
+        {
+            return E_INVALIDARG;
+        }
+
+        std::lock_guard<std::mutex> g(m_lockHandler);
+        if (m_handler)
+        {
+            m_handler(*pEventGUID, bstrDeviceID ? std::wstring(bstrDeviceID) : std::wstring());
+        }
+        return S_OK;
+    }
+}
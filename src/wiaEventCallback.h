@@ -0,0 +1,50 @@
+#pragma once
+
+#include <wia.h>
+
+#include <functional>
+#include <mutex>
+
+namespace scanner
+{
+    // Receives an event fired by the WIA service, called on a thread of the COM runtime
+    typedef std::function<void(const GUID& eventId, const std::wstring& deviceId)> WIAEventHandler;
+
+    // IWiaEventCallback implementation forwarding WIA events to a handler.
+    // The events keep arriving until every registration object returned by
+    // IWiaDevMgr2::RegisterEventCallbackInterface() is released, so the owner calls Disconnect()
+    // before it goes away to make sure the handler is not running and will never be called again.
+    class CWIAEventCallback : public IWiaEventCallback
+    {
+    public:
+        explicit CWIAEventCallback(WIAEventHandler handler);
+        virtual ~CWIAEventCallback();
+
+        CWIAEventCallback(const CWIAEventCallback&) = delete;
+        CWIAEventCallback& operator=(const CWIAEventCallback&) = delete;
+
+        void Disconnect();
+
+        // IUnknown
+        HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override;
+        ULONG STDMETHODCALLTYPE AddRef() override;
+        ULONG STDMETHODCALLTYPE Release() override;
+
+        // IWiaEventCallback
+        HRESULT STDMETHODCALLTYPE ImageEventCallback(
+            const GUID* pEventGUID,
+            BSTR bstrEventDescription,
+            BSTR bstrDeviceID,
+            BSTR bstrDeviceDescription,
+            DWORD dwDeviceType,
+            BSTR bstrFullItemName,
+            ULONG* pulEventType,
+            ULONG ulReserved) override;
+
+    private:
+        ULONG m_cRef;
+
+        std::mutex m_lockHandler;
+        WIAEventHandler m_handler;
+    };
+}
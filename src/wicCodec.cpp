@@ -0,0 +1,234 @@
+#include "stdafx.h"
+#include "wicCodec.h"
+#include "memoryStream.h"
+
+#include <wincodec.h>
+
+namespace scanner
+{
+    namespace util
+    {
+        static HRESULT CreateImagingFactory(ATL::CComPtr<IWICImagingFactory>& pFactory)
+        {
+            // the factory is free-threaded, every thread of the pipeline creates its own anyway
+            return pFactory.CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER);
+        }
+
+        static bool IsGrayPixelFormat(const WICPixelFormatGUID& format)
+        {
+            return IsEqualGUID(format, GUID_WICPixelFormatBlackWhite) ||
+                IsEqualGUID(format, GUID_WICPixelFormat2bppGray) ||
+                IsEqualGUID(format, GUID_WICPixelFormat4bppGray) ||
+                IsEqualGUID(format, GUID_WICPixelFormat8bppGray) ||
+                IsEqualGUID(format, GUID_WICPixelFormat16bppGray);
+        }
+
+        static bool ContainerFormatFromName(const std::wstring& format, GUID& containerFormat)
+        {
+            if (format == L"jpeg" || format == L"jpg")
+            {
+                containerFormat = GUID_ContainerFormatJpeg;
+            }
+            else if (format == L"png")
+            {
+                containerFormat = GUID_ContainerFormatPng;
+            }
+            else if (format == L"tiff" || format == L"tif")
+            {
+                containerFormat = GUID_ContainerFormatTiff;
+            }
+            else if (format == L"bmp")
+            {
+                containerFormat = GUID_ContainerFormatBmp;
+            }
+            else
+            {
+                return false;
+            }
+            return true;
+        }
+
+        HRESULT DecodeImage(const void* data, size_t size, RawImage& image)
+        {
+            if (!data || !size || size > MAXDWORD)
+            {
+                return E_INVALIDARG;
+            }
+
+            ATL::CComPtr<IWICImagingFactory> pFactory;
+            HRESULT hr = CreateImagingFactory(pFactory);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+
+            // the stream reads the data in place
+            ATL::CComPtr<IWICStream> pStream;
+            hr = pFactory->CreateStream(&pStream);
+            if (SUCCEEDED(hr))
+            {
+                hr = pStream->InitializeFromMemory((BYTE*)data, DWORD(size));
+            }
+
+            ATL::CComPtr<IWICBitmapDecoder> pDecoder;
+            if (SUCCEEDED(hr))
+            {
+                hr = pFactory->CreateDecoderFromStream(pStream, NULL, WICDecodeMetadataCacheOnDemand, &pDecoder);
+            }
+
+            ATL::CComPtr<IWICBitmapFrameDecode> pFrame;
+            if (SUCCEEDED(hr))
+            {
+                hr = pDecoder->GetFrame(0, &pFrame);
+            }
+
+            WICPixelFormatGUID sourceFormat = { 0 };
+            UINT width = 0;
+            UINT height = 0;
+            double dpiX = 0;
+            double dpiY = 0;
+            if (SUCCEEDED(hr))
+            {
+                hr = pFrame->GetPixelFormat(&sourceFormat);
+            }
+            if (SUCCEEDED(hr))
+            {
+                hr = pFrame->GetSize(&width, &height);
+            }
+            if (SUCCEEDED(hr))
+            {
+                pFrame->GetResolution(&dpiX, &dpiY);
+            }
+
+            PixelFormat targetFormat = IsGrayPixelFormat(sourceFormat) ? PixelFormat::Gray8 : PixelFormat::BGR24;
+            const WICPixelFormatGUID& wicTargetFormat = (targetFormat == PixelFormat::Gray8) ? GUID_WICPixelFormat8bppGray : GUID_WICPixelFormat24bppBGR;
+
+            ATL::CComPtr<IWICFormatConverter> pConverter;
+            if (SUCCEEDED(hr))
+            {
+                hr = pFactory->CreateFormatConverter(&pConverter);
+            }
+            if (SUCCEEDED(hr))
+            {
+                hr = pConverter->Initialize(pFrame, wicTargetFormat, WICBitmapDitherTypeNone, NULL, 0.0, WICBitmapPaletteTypeCustom);
+            }
+
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+
+            RawImage decoded = CreateRawImage(width, height, targetFormat);
+            decoded.dpiX = dpiX;
+            decoded.dpiY = dpiY;
+
+            // WIC rows are DWORD aligned only if asked to, the stride of RawImage is taken as it is
+            hr = pConverter->CopyPixels(NULL, UINT(decoded.stride), UINT(decoded.pixels.size()), decoded.pixels.data());
+            if (SUCCEEDED(hr))
+            {
+                image = std::move(decoded);
+            }
+            return hr;
+        }
+
+        HRESULT EncodeImage(const RawImage& image, const std::wstring& format, int quality, std::shared_ptr<CMemoryBuffer> data)
+        {
+            assert(data);
+
+            GUID containerFormat = { 0 };
+            if (image.Empty() || !ContainerFormatFromName(format, containerFormat))
+            {
+                return E_INVALIDARG;
+            }
+
+            ATL::CComPtr<IWICImagingFactory> pFactory;
+            HRESULT hr = CreateImagingFactory(pFactory);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+
+            ATL::CComPtr<IStream> pStream;
+            pStream.Attach(new CMemoryStream(data));
+
+            ATL::CComPtr<IWICBitmapEncoder> pEncoder;
+            hr = pFactory->CreateEncoder(containerFormat, NULL, &pEncoder);
+            if (SUCCEEDED(hr))
+            {
+                hr = pEncoder->Initialize(pStream, WICBitmapEncoderNoCache);
+            }
+
+            ATL::CComPtr<IWICBitmapFrameEncode> pFrame;
+            ATL::CComPtr<IPropertyBag2> pProperties;
+            if (SUCCEEDED(hr))
+            {
+                hr = pEncoder->CreateNewFrame(&pFrame, &pProperties);
+            }
+
+            if (SUCCEEDED(hr) && IsEqualGUID(containerFormat, GUID_ContainerFormatJpeg))
+            {
+                PROPBAG2 option = { 0 };
+                option.pstrName = L"ImageQuality";
+
+                quality = quality < 1 ? 1 : (quality > 100 ? 100 : quality);
+                ATL::CComVariant value(float(quality) / 100.0f);
+                hr = pProperties->Write(1, &option, &value);
+            }
+
+            if (SUCCEEDED(hr))
+            {
+                hr = pFrame->Initialize(pProperties);
+            }
+            if (SUCCEEDED(hr))
+            {
+                hr = pFrame->SetSize(image.width, image.height);
+            }
+            if (SUCCEEDED(hr) && image.dpiX > 0 && image.dpiY > 0)
+            {
+                hr = pFrame->SetResolution(image.dpiX, image.dpiY);
+            }
+
+            const WICPixelFormatGUID& sourceFormat = (image.format == PixelFormat::Gray8) ? GUID_WICPixelFormat8bppGray : GUID_WICPixelFormat24bppBGR;
+            WICPixelFormatGUID pixelFormat = sourceFormat;
+            if (SUCCEEDED(hr))
+            {
+                hr = pFrame->SetPixelFormat(&pixelFormat);
+            }
+
+            // The encoder might not support the format of the image, e.g. 8 bit grayscale BMP.
+            // Fall back to 24 bit color, which every encoder takes
+            if (SUCCEEDED(hr) && !IsEqualGUID(pixelFormat, sourceFormat))
+            {
+                pixelFormat = GUID_WICPixelFormat24bppBGR;
+                hr = pFrame->SetPixelFormat(&pixelFormat);
+            }
+
+            ATL::CComPtr<IWICBitmap> pBitmap;
+            if (SUCCEEDED(hr))
+            {
+                hr = pFactory->CreateBitmapFromMemory(image.width, image.height, sourceFormat,
+                    UINT(image.stride), UINT(image.pixels.size()), (BYTE*)image.pixels.data(), &pBitmap);
+            }
+
+            ATL::CComPtr<IWICBitmapSource> pSource;
+            if (SUCCEEDED(hr))
+            {
+                hr = WICConvertBitmapSource(pixelFormat, pBitmap, &pSource);
+            }
+            if (SUCCEEDED(hr))
+            {
+                hr = pFrame->WriteSource(pSource, NULL);
+            }
+            if (SUCCEEDED(hr))
+            {
+                hr = pFrame->Commit();
+            }
+            if (SUCCEEDED(hr))
+            {
+                hr = pEncoder->Commit();
+            }
+
+            return hr;
+        }
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+#include "memoryBuffer.h"
+#include "rawImage.h"
+
+namespace scanner
+{
+    namespace util
+    {
+        // Decode the first frame of an image file in memory with WIC(Windows Imaging Component).
+        // Grayscale and black/white images are decoded to PixelFormat::Gray8, the others to PixelFormat::BGR24
+        HRESULT DecodeImage(const void* data, size_t size, RawImage& image);
+
+        // Encode an image to a file format(tiff/bmp/jpeg/png) with WIC.
+        // quality is used by JPEG only, 1-100
+        HRESULT EncodeImage(const RawImage& image, const std::wstring& format, int quality, std::shared_ptr<CMemoryBuffer> data);
+    }
+}
@@ -1,10 +1,11 @@
 ﻿/**
  * Test script and library usage examples are provided here. 
  */
-const { listAllDevices, WIADevice } = require('wia-scanner-js');
+const { listAllDevices, listAllDevicesAsync, on, getCallTimings, getStats, resetStats, setDevicePool, getDevicePoolStats, setScanScheduler, getScanSchedulerStats, WIADevice } = require('wia-scanner-js');
 
 /**
  * listAllDevices - List all WIA devices available on the current computer.
+ * The devices are listed once, then the list is kept up to date by the WIA device events instead of being read again.
  * returns = 
  * [
  *   {
@@ -30,6 +31,135 @@ const { listAllDevices, WIADevice } = require('wia-scanner-js');
  */
 let devices = listAllDevices();
 
+/**
+ * listAllDevicesAsync() - Same as listAllDevices, runs on a background thread and returns a Promise of the device list.
+ */
+listAllDevicesAsync().then(function (devices) {
+
+});
+
+/**
+ * on(event, callback) - Be told of the devices connected and disconnected, instead of polling listAllDevices().
+ *   event: "deviceAdded" or "deviceRemoved"
+ *   callback: function(device), device as listed by listAllDevices(), the last one known once removed.
+ *             null to stop listening
+ * The listeners don't keep the process running.
+ */
+on('deviceAdded', function (device) {
+
+});
+on('deviceRemoved', function (device) {
+
+});
+
+/**
+ * getCallTimings() - How long the calls to the WIA driver took, accumulated since the module was loaded.
+ * returns = {
+ *   "CWIADevice::Scan": {
+ *     count: 2,          // number of calls
+ *     totalMs: 15321.5,  // time spent in all calls
+ *     maxMs: 8012.3,     // the slowest call
+ *     lastMs: 7309.2,    // the latest call
+ *   },
+ *   "CWIADevice::GetScanSettings": { ... },
+ *   ...
+ * }
+ */
+let callTimings = getCallTimings();
+
+/**
+ * getStats() - What every device opened has cost since the module was loaded, by device UUID.
+ * The latencies are kept in histograms, the percentiles are at most 1/32 above the times measured.
+ * returns = {
+ *   "{6BDD1FC6-810F-11D0-BEC7-08002BE2092F}\\0000": {
+ *     readMultiple: {          // IWiaPropertyStorage::ReadMultiple
+ *       count: 412,
+ *       meanMs: 1.8,
+ *       minMs: 0.4,
+ *       p50Ms: 1.2,
+ *       p90Ms: 3.1,
+ *       p99Ms: 12.6,
+ *       p999Ms: 40.9,
+ *       maxMs: 41.2,
+ *     },
+ *     writeMultiple: { ... },  // IWiaPropertyStorage::WriteMultiple
+ *     createDevice: { ... },   // IWiaDevMgr2::CreateDevice, when the device is opened
+ *     enumChildItems: { ... }, // IWiaItem2::EnumChildItems, when the item tree is built
+ *     download: { ... },       // IWiaTransfer::Download, a whole scan
+ *     pageTransfer: { ... },   // from the first byte of a page to its end
+ *     scans: 3,
+ *     failedScans: 0,
+ *     pages: 24,
+ *     bytes: 201326592,
+ *     bytesPerSec: 8912345.6,  // while the pages were transferred
+ *     progressDelivered: 310,  // progress events given to the callback
+ *     progressCoalesced: 1254, // status updates merged into them as JS didn't keep up
+ *   },
+ *   ...
+ * }
+ *
+ * resetStats() - Clear the stats of all devices.
+ */
+let stats = getStats();
+
+/**
+ * setDevicePool(options) - Keep the devices closed open for a while, and hand them out again to the next WIADevice of the same UUID.
+ * Opening a device takes seconds with some drivers. The item tree and the cached properties are kept,
+ * the settings of doScan and the tracing are reset. A device disconnected is closed at once.
+ * options = {
+ *   idleTtl: 60000,    // ms a device closed is kept open, 0 by default: the devices are closed at once
+ *   maxIdle: 4,        // devices kept open at most, of all UUIDs. The ones closed the longest ago are closed first
+ * }
+ *
+ * getDevicePoolStats() returns = {
+ *   hits: 41,          // devices handed out again
+ *   misses: 3,         // devices opened
+ *   hitRate: 0.93,
+ *   expired: 2,        // closed after idleTtl
+ *   evicted: 0,        // closed as disconnected
+ *   overCapacity: 0,   // closed as more than maxIdle were kept
+ *   idle: 1,           // kept open at the moment
+ *   inUse: 1,
+ * }
+ */
+setDevicePool({ idleTtl: 60000, maxIdle: 4 });
+let poolStats = getDevicePoolStats();
+
+/**
+ * setScanScheduler(options) - Share the machine between the scans of all the devices.
+ * Every device runs one scan at a time, the others wait in its queue by params.priority of doScan, then in the order of the calls.
+ * When a scan completes, the next one started is the one of the highest priority, then the oldest, among the devices idle.
+ * The values absent are left unchanged, there is no limit by default.
+ * options = {
+ *   maxActiveScans: 2,         // Scans running at once on all the devices, 0 for no limit
+ *   maxProcessingThreads: 3,   // Pages processed at once by params.pipeline of all the scans, 0 for no limit.
+ *                              // Keeps the post-processing from taking the CPU from the transfers running
+ * }
+ *
+ * getScanSchedulerStats() returns = {
+ *   submitted: 12,     // scans queued by doScan
+ *   started: 10,
+ *   finished: 9,
+ *   cancelled: 1,      // cancelled while queued
+ *   queued: 1,         // at the moment
+ *   active: 1,
+ *   maxActive: 2,
+ *   avgQueueMs: 850,   // from doScan until the scan started
+ *   maxQueueMs: 4100,
+ *   avgRunMs: 30500,
+ *   maxRunMs: 61000,
+ *   processing: {
+ *     pages: 240,        // pages processed
+ *     waited: 35,        // pages which waited for maxProcessingThreads
+ *     totalWaitMs: 2300,
+ *     active: 3,
+ *     maxActive: 3,
+ *   },
+ * }
+ */
+setScanScheduler({ maxActiveScans: 0, maxProcessingThreads: 0 });
+let schedulerStats = getScanSchedulerStats();
+
 /**
  * WIADevice(deviceUUID) - Open a WIA device.
  *   deviceUUID: UUID of the device acquired from the method listAllDevices.
@@ -40,6 +170,11 @@ let devices = listAllDevices();
  */
 let wiaDevice = new WIADevice(devices[0].deviceUUID);
 
+/**
+ * wiaDevice.close() - Release the device, kept open by the pool if enabled. The jobs running keep it until they complete.
+ * The object can't be used any more.
+ */
+
 /**
  * wiaDevice.showDeviceDlg - Open the scan dialog provided by Microsoft Windows. Then enter the modal loop which quits as the dialog closes.
  * 
@@ -83,7 +218,9 @@ let imageSourcesArray = wiaDevice.getSources();
  * wiaDevice.getProperties() - get properties of the WIA device currently opened.
  * 
  * returns = {
- *   format: "tiff",                        // Output image format(tiff/bmp/jpeg/png)
+ *   format: "tiff",                        // Output image format(tiff/bmp/jpeg/png/raw).
+ *                                          // raw acquires uncompressed scanlines and encodes them natively:
+ *                                          // blackwhite pages as TIFF G4, the others as JPEG unless pipeline.format says otherwise
  *   paper: "auto",                         // Paper type(auto/letter/businesscard/uslegal/usstatement/a0~a10/b0~b10)
  *   color: "blackwhite",                   // Color mode(blackwhite/greyscale/fullcolor)
  *   brightness_range: {min: -50, max: 50}, // Brightness value range available for this scanner
@@ -96,9 +233,59 @@ let imageSourcesArray = wiaDevice.getSources();
  *                                          // The scanner will keep running until no paper available if the value is set to "all"
  *   document_handling: "front"             // Which side of the paper will be scanned（front: front side only/duplex: both sides）
  * }
+ * 
+ * Values read from the device are cached. Later calls don't go to the driver until the device fires an event
+ * (connected/disconnected/item tree updated) or wiaDevice.refresh() is called.
  */
 let properties = wiaDevice.getProperties();
 
+/**
+ * wiaDevice.refresh() - Drop the property values cached, the next getProperties() reads them from the device again.
+ * The item tree of the device(image sources) is rebuilt before it is used next time as well.
+ */
+wiaDevice.refresh();
+
+/**
+ * wiaDevice.getDeviceStats() - Counters of the device object.
+ * 
+ * returns = {
+ *   propertyCache: {
+ *     hits: 12,          // Properties found in the cache
+ *     misses: 7,         // Properties read from the device
+ *     invalidations: 1   // How many times the cache has been dropped
+ *   },
+ *   itemTree: {          // The item tree is built when the device opens, and rebuilt only if the device reports a change or after refresh()
+ *     builds: 1,         // How many times the tree has been built
+ *     cacheHits: 25,     // How many times the tree built before has been used
+ *     lastBuildMs: 180,  // How long the last build took
+ *     totalBuildMs: 180
+ *   },
+ *   lock: {              // A scan holds the device lock only while it applies its settings, not during the transfer
+ *     scanState: 'idle', // idle/starting/transferring/cancelling
+ *     reads: 40,         // Property reads, they don't wait for a running scan
+ *     writes: 3,
+ *     refusedWrites: 0,  // Property writes refused because a scan was running. The format, document handling and
+ *                        // page count are always accepted, the next scan takes them
+ *     refusedScans: 0,   // doScan() calls refused because another scan was running(WIA_ERROR_BUSY)
+ *     maxReadWaitMs: 0.2,
+ *     maxWriteWaitMs: 1.5
+ *   }
+ * }
+ */
+let deviceStats = wiaDevice.getDeviceStats();
+
+/**
+ * wiaDevice.setTracing(enabled) - Record the phases of the scans of the device on a timeline, off by default.
+ * Enabling starts a new timeline. The spans: Scan, GetImageSource, FindImageSourcesFromDevice, WriteSettings,
+ * Download, WaitForFirstByte, TransferPage, CreateFile, FinishPipeline, FinishDocument, FinishFiles,
+ * and on the JavaScript thread EmitProgress, EmitData, EmitPages, DeliverPage(from the page complete until handled), EmitComplete.
+ *
+ * wiaDevice.getTrace() - The spans recorded, JSON in the trace event format of Chrome.
+ * Save it to a file and load it in about://tracing or https://ui.perfetto.dev
+ */
+wiaDevice.setTracing(true);
+// fs.writeFileSync('scan-trace.json', wiaDevice.getTrace());
+
 /**
  * wiaDevice.setProperties(params) - set properties of the WIA device currently opened.
  * 
@@ -137,12 +324,17 @@ let setPropsRet = wiaDevice.setProperties({
 /**
  * event 'progress' - Indicates the progress of the current scan operation.
  * 
+ * No update is lost. Every update reported by the driver is queued natively and delivered in order.
+ * Consecutive "status" updates of the same page that arrive together are merged into the latest one.
+ * 
  * progressInfo = {
+ *   type: "status",      // Type of the update("pageStart"/"status"/"pageEnd"). "pageStart" and "pageEnd" are never merged
  *   page: 0,             // Current page index
  *   percent: 100,        // Scan progress of current page
  *   bytesTrnasferred: 0, // how many bytes has been transferred
  *   error: 0,            // Error code
- *   errMsg: ""           // Error msg
+ *   errMsg: "",          // Error msg
+ *   coalesced: 0         // How many "status" updates have been merged into this one
  * }
  * 
  */
@@ -150,6 +342,50 @@ wiaDevice.on('progress', (progressInfo) => {
     console.log(`page=${progressInfo.page}  percent=${progressInfo.percent}`);
 });
 
+/**
+ * event 'data' - Delivers the image data while the page is still being transferred.
+ * 
+ * Chunks are queued natively with a bounded size(see params.dataQueueSize of doScan).
+ * The transfer slows down instead of using more memory if chunks are not taken away fast enough.
+ * 
+ * chunk = {
+ *   page: 1,             // Index of the page the data belongs to
+ *   offset: 0,           // Where the data locates in the image. Drivers might rewrite the image header at the end of a page
+ *   data: <Buffer ...>   // Image data
+ * }
+ * 
+ */
+wiaDevice.on('data', (chunk) => {
+    console.log(`page=${chunk.page}  offset=${chunk.offset}  length=${chunk.data.length}`);
+});
+
+/**
+ * event 'page' - Triggered as soon as a page is complete, while the next pages are still being scanned.
+ * 
+ * If params.output is "file", the page is reported once its file is written.
+ * If params.pipeline of doScan is given, the page is reported once processed, pages may arrive out of order
+ * and the blank pages removed are not reported.
+ * 
+ * pageInfo = {
+ *   page: 0,             // Index of the page, the same as in the event 'data'
+ *   side: "front",       // "front"/"back", the odd pages of a duplex scan are back sides
+ *   file: "C:\\Users\\example\\Pictures\\scanner-test\\scan111_1.jpeg",   // Path of the image, if params.output is "file"
+ *   buffer: <Buffer ...>,    // A copy of the image, if params.output is "buffer". Empty if params.document is given
+ *   size: 1048576,       // Bytes of the image
+ *   transferMs: 1530,    // How long the transfer of the page took
+ *   sha256: "9f86d0...", // Digests of the image if params.hash is given, not reported for the pages of a document
+ *   xxh64: "44bc2c...",
+ *   thumbnails: [        // Available only if params.pipeline.thumbnails is given, the largest first
+ *     { width: 724, height: 1024, data: <Buffer ff d8 ff e0 ...> },
+ *     { width: 181, height: 256, data: <Buffer ff d8 ff e0 ...> },
+ *   ],
+ * }
+ * 
+ */
+wiaDevice.on('page', (pageInfo) => {
+    console.log(`page=${pageInfo.page}  side=${pageInfo.side}  size=${pageInfo.size}`);
+});
+
 /**
  * event 'complete' - Triggered after the scan operation has completed
  * 
@@ -161,7 +397,43 @@ wiaDevice.on('progress', (progressInfo) => {
  *     "C:\\Users\\example\\Pictures\\scanner-test\\scan111_2.jpeg",
  *     "C:\\Users\\example\\Pictures\\scanner-test\\scan111_3.jpeg",
  *     ...
- *   ]
+ *   ],
+ *   buffers: [           // Available only if params.output is "buffer". An array of Buffer objects holding the acquired images
+ *     <Buffer ff d8 ff e0 ...>,
+ *     ...
+ *   ],
+ *   hashes: [            // Available only if params.hash is given. The digests of the files or the buffers, in the same order
+ *     { sha256: "9f86d0...", xxh64: "44bc2c..." },
+ *     ...
+ *   ],
+ *   thumbnails: [        // Available only if params.pipeline.thumbnails is given and not params.document. The thumbnails of every page, in the same order
+ *     [ { width: 724, height: 1024, data: <Buffer ff d8 ff e0 ...> }, { width: 181, height: 256, data: <Buffer ...> } ],
+ *     ...
+ *   ],
+ *   pipeline: {          // Available only if params.pipeline is given
+ *     pages: 100,            // Pages processed
+ *     blankPages: 3,         // Pages removed as blank
+ *     deskewedPages: 41,
+ *     encodedPages: 41,      // Pages encoded again, the others are delivered as acquired
+ *     failedPages: 0,        // Pages which could not be processed, delivered as acquired
+ *     totalProcessMs: 8400,  // Time spent on the pages, summed over the threads
+ *     maxProcessMs: 160,
+ *     stolenTasks: 12,       // Pages taken over by an idle thread of the pipeline
+ *     thumbnails: 200,       // Thumbnails made
+ *     totalThumbnailMs: 900, // Time spent downsampling and encoding them
+ *   },
+ *   cancel: {            // Available only if the scan has been cancelled
+ *     timedOut: false,       // Cancelled because params.timeout passed
+ *     forced: false,         // The driver didn't stop within params.cancelTimeout, the transfer was aborted
+ *     toIdleMs: 35,          // From the cancel until the device was idle again
+ *     toCompleteMs: 37,      // From the cancel until this event
+ *   },
+ *   job: {               // The scan as queued by the scheduler, see setScanScheduler
+ *     id: 7,
+ *     priority: 0,
+ *     queueMs: 850,          // From doScan until the scan started
+ *     runMs: 30500,          // From the start until the scan was done, before this event
+ *   }
  * }
  * 
  */
@@ -170,26 +442,90 @@ wiaDevice.on('complete', (imageData) => {
 });
 
 /**
- * wiaDevice.getPreview(callback) - Get a preview image from the scanner
+ * wiaDevice.getPreview([options][, rowCallback]) - Get a preview image from the scanner
  * 
- * Currently not implemented yet.
+ * Scans one page at a low DPI in greyscale, the rows are given to rowCallback as soon as they are transferred,
+ * so that the preview can be painted as it comes. The resolution and the color mode are written back afterwards,
+ * the settings of the next scan are not changed. Runs on the scan thread of the device, returns a Promise.
  * 
- * imageData = {
- *   data: <dataURL>     // dataURL of the picture
+ * options = {
+ *   dpi: 75,            // one of the DPI values of setProperties, 75 by default
+ * }
+ * 
+ * rows = {
+ *   y: 0,               // the first row, from the top
+ *   count: 16,          // rows, one after another top-down
+ *   width: 638,
+ *   data: <Buffer>      // 8 bit grey levels, width bytes per row
+ * }
+ * 
+ * preview = {
+ *   width: 638,
+ *   height: 825,
+ *   dpi: 75,
+ *   data: <Buffer>      // 8 bit grey levels, width bytes per row, white where no row has come
+ *   firstRowMs: 412.5,  // from the start until the first row came
+ *   totalMs: 2390.1
  * }
  */
-wiaDevice.getPreview(function (imageData) {
+wiaDevice.getPreview({ dpi: 75 }, function (rows) {
 
-});
+}).then(function (preview) { });
 
 let isFeeder = wiaDevice.isFeeder();
 
+/**
+ * Promise-returning variants of getSources/getProperties/setProperties/isFeeder.
+ * They run on the scan thread of the device, so the JavaScript thread is not blocked by the driver.
+ * The results are the same as the synchronous methods.
+ * A job queued after a running scan starts when the scan finishes.
+ */
+wiaDevice.getSourcesAsync().then(function (sources) { });
+wiaDevice.getPropertiesAsync().then(function (properties) { });
+wiaDevice.setPropertiesAsync({ dpi: 300 }).then(function (setPropsRet) { });
+wiaDevice.isFeederAsync().then(function (isFeeder) { });
+
 /**
  * wiaDevice.doScan(params[, callback]) - Run the scan operation.
  * 
+ * Every opened device runs its scans on a dedicated thread, devices scan concurrently without occupying the libuv threadpool.
+ * 
  * params = {
- *   saveDir: "C:\\Users\\example\\Pictures\\scanner-test", // Where to save images acquired from the scanner
- *   saveFilename: "test111"                                // Filename template of image files.
+ *   output: "file",                                        // Where the acquired images go("file"/"buffer"), "file" by default.
+ *                                                          // If the value is "buffer", images are kept in memory and returned as Buffer objects without being written to disk.
+ *   saveDir: "C:\\Users\\example\\Pictures\\scanner-test", // Where to save images acquired from the scanner. Not needed if output is "buffer"
+ *   saveFilename: "test111",                               // Filename template of image files. Not needed if output is "buffer"
+ *   document: "pdf",                                       // Optional. Append every page to one multi-page file("pdf"/"tiff") as it comes,
+ *                                                          // <saveDir>\<saveFilename>.pdf, or a single Buffer if output is "buffer".
+ *                                                          // JPEG and bilevel pages are taken as they are, the other ones are compressed again.
+ *                                                          // The event 'page' reports the file of the document and the bytes added by the page
+ *   hash: ["sha256", "xxh64"],                             // Optional. Digests of every file or buffer("sha256"/"xxh64"), computed while the data
+ *                                                          // is written instead of reading the files again. xxh64 is fast, to find duplicates
+ *   durability: "none",                                    // Optional. The files are written behind the transfer, when they reach the disk:
+ *                                                          // "none" left to the system, "end" all flushed before 'complete', "page" each one before its 'page'
+ *   trace: "C:\\scans\\scan.wiatrace",                     // Optional. Record the messages and the writes of the driver, to be replayed by bench/replayBench
+ *   traceData: false,                                      // The trace keeps the data written, not only the sizes
+ *   dataQueueSize: 4194304,                                // How many bytes can be queued for the event 'data', 4MB by default.
+ *   priority: 0,                                           // Optional. The scans queued with a higher priority start first, see setScanScheduler
+ *   timeout: 0,                                            // Cancel the scan once it has run this many ms, 0 for no limit
+ *   cancelTimeout: 0,                                      // Abort the transfer if the driver hasn't stopped this many ms after a cancel, 0 to wait for the driver
+ *   pipeline: {                                            // Optional. Process every page natively while the next one is being transferred.
+ *                                                          // The pages are kept in memory until processed, the files are written afterwards.
+ *                                                          // The event 'data' still delivers the data as acquired.
+ *     removeBlankPages: false,                             // Drop the pages without content
+ *     blankInkRatio: 0.002,                                // Pages with less dark pixels than this ratio are blank
+ *     blankDarkThreshold: 160,                             // Pixels darker than this(0-255) are ink
+ *     blankMargin: 0.05,                                   // Ratio of the borders ignored on each side, scanners often leave shadows there
+ *     deskew: false,                                       // Straighten the pages scanned askew
+ *     maxSkewAngle: 5,                                     // The largest skew corrected, in degrees
+ *     format: "jpeg",                                      // Encode every page again in this format(tiff/tiff-g4/bmp/jpeg/png).
+ *                                                          // Changed pages are encoded in the acquired format if absent
+ *     quality: 85,                                         // JPEG quality, 1-100
+ *     thumbnails: [1024, 256],                             // The longer side of the thumbnails made of every page, 3 sizes at most(16-8192).
+ *                                                          // Downsampled from the processed page, never enlarged
+ *     thumbnailFormat: "jpeg",                             // Format of the thumbnails(jpeg/png/bmp/tiff)
+ *     threads: 0,                                          // Threads processing the pages, 0 for the number of CPU cores
+ *   }
  * }
  * 
  * callback = function(imageData) {  // callback here will override the callback handling the event 'complete'!
@@ -203,7 +539,11 @@ wiaDevice.doScan({
 });
 
 /**
- * wiaDevice.cancel() - Abort the scan operation currently running.
+ * wiaDevice.cancel() - Abort the scan operation currently running, and the scans of the device queued by the scheduler.
+ * The scans queued complete with retCode E_ABORT(-2147467260) without starting.
+ * 
+ * Returns false if no scan is running or queued. The transfer stops at the next callback of the driver,
+ * params.cancelTimeout of doScan bounds the wait. The event 'complete' reports the latency in imageData.cancel.
  * 
  */
 //setTimeout(() => {